@@ -3,44 +3,56 @@
 #include <math.h>
 
 #include "app_main.h"
+#include "asrc.h"
 #include "pdm2pcm.h"
 #include "i2s.h"
 
 uint16_t PDM_Buffer[AUDIO_IN_PDM_BUFFER_SIZE];
 
-uint16_t PCM_Buffer[AUDIO_IN_PCM_BUFFER_SIZE];
+static uint16_t PCM_Buffer[AUDIO_IN_PCM_BUFFER_SIZE];
 
-int16_t Sine_Wave[48];
+PCM_Ring_t PCM_In_Ring;
 
-volatile uint32_t PCM_Read_Index_USB = 0;;
-volatile uint32_t PCM_Read_Index_SPKR = 0;
-volatile uint32_t PCM_Write_Index = 0;
-volatile uint32_t PCM_Full_Flag_USB = 0;
-volatile uint32_t PCM_Full_Flag_SPKR = 0;
+#if AUDIO_IN_ASRC
+static uint16_t PCM_Usb_Buffer[AUDIO_IN_USB_BUFFER_SIZE];
 
-#define PCM_SPKR_SIZE (AUDIO_IN_PCM_SAMPLES_IN_MS * 2) // sterio speaker
-uint16_t SPKR_Samples[PCM_SPKR_SIZE];
+PCM_Ring_t PCM_Usb_Ring;
 
-uint32_t PCM_Get_Count_USB(void)
-{
-    if (PCM_Full_Flag_USB)
-        return AUDIO_IN_PCM_BUFFER_SIZE;
-    if (PCM_Write_Index >= PCM_Read_Index_USB)
-        return PCM_Write_Index - PCM_Read_Index_USB;
-    return AUDIO_IN_PCM_BUFFER_SIZE - (PCM_Read_Index_USB - PCM_Write_Index);
-}
+static ASRC_t PCM_ASRC;
+#endif
+
+/* filter output when it would wrap the ring */
+static uint16_t PCM_Chunk[AUDIO_IN_PCM_SAMPLES_IN_MS / 2];
 
-uint32_t PCM_Get_Count_SPKR(void)
+int16_t Sine_Wave[48];
+
+/* filter one half of the pdm buffer into the ring */
+static void PCM_Filter_Half(uint16_t *pdm)
 {
-    if (PCM_Full_Flag_SPKR)
-        return AUDIO_IN_PCM_BUFFER_SIZE;
-    if (PCM_Write_Index >= PCM_Read_Index_SPKR)
-        return PCM_Write_Index - PCM_Read_Index_SPKR;
-    return AUDIO_IN_PCM_BUFFER_SIZE - (PCM_Read_Index_SPKR - PCM_Write_Index);
+    uint32_t count;
+    uint16_t *dest = PCM_Ring_Write_Ptr(&PCM_In_Ring, &count);
+
+    if (count >= AUDIO_IN_PCM_SAMPLES_IN_MS / 2)
+    {
+        PDM_Filter(pdm, dest, &PDM1_filter_handler);
+        PCM_Ring_Commit(&PCM_In_Ring, AUDIO_IN_PCM_SAMPLES_IN_MS / 2);
+    }
+    else
+    {
+        /* filter state must advance even when the ring is full */
+        PDM_Filter(pdm, PCM_Chunk, &PDM1_filter_handler);
+        PCM_Ring_Write(&PCM_In_Ring, PCM_Chunk, AUDIO_IN_PCM_SAMPLES_IN_MS / 2);
+    }
 }
 
 void App_Main(void)
 {
+    PCM_Ring_Init(&PCM_In_Ring, PCM_Buffer, AUDIO_IN_PCM_BUFFER_SIZE);
+#if AUDIO_IN_ASRC
+    PCM_Ring_Init(&PCM_Usb_Ring, PCM_Usb_Buffer, AUDIO_IN_USB_BUFFER_SIZE);
+    ASRC_Init(&PCM_ASRC, AUDIO_IN_CHANNELS);
+#endif
+
     for (uint16_t i = 0; i < 48; i++)
     {
         Sine_Wave[i] = 0xFFFF * sinf(i * 2 * 3.1416f * 1000.0f / 48000.0f) / 2;
@@ -48,6 +60,20 @@ void App_Main(void)
 
     while (1)
     {
+#if AUDIO_IN_ASRC
+        /* about once per usb packet, keeps the loop gain independent of the main loop */
+        uint32_t level = PCM_Ring_Count(&PCM_Usb_Ring);
+
+        if (level + AUDIO_IN_PCM_SAMPLES_IN_MS <= AUDIO_IN_USB_LEVEL)
+        {
+            /* pdm ring fuller than the target means the microphone clock runs fast */
+            ASRC_Track(&PCM_ASRC, PCM_Ring_Count(&PCM_In_Ring) / AUDIO_IN_CHANNELS,
+                       AUDIO_IN_PCM_TARGET / AUDIO_IN_CHANNELS);
+
+            ASRC_Ring(&PCM_ASRC, &PCM_In_Ring, &PCM_Usb_Ring,
+                      (AUDIO_IN_USB_LEVEL - level) / AUDIO_IN_CHANNELS);
+        }
+#endif
     }
 }
 
@@ -55,39 +81,13 @@ void HAL_I2S_RxHalfCpltCallback(I2S_HandleTypeDef *hi2s)
 {
     if (hi2s == &hi2s2)
     {
-        PDM_Filter(PDM_Buffer, &PCM_Buffer[PCM_Write_Index], &PDM1_filter_handler);
-        PCM_Write_Index += AUDIO_IN_PCM_SAMPLES_IN_MS / 2;
-        if (PCM_Write_Index >= AUDIO_IN_PCM_BUFFER_SIZE)
-        {
-            PCM_Write_Index = 0;
-        }
-        if (PCM_Write_Index == PCM_Read_Index_USB)
-        {
-            PCM_Full_Flag_USB = 1;
-        }
-        if (PCM_Write_Index == PCM_Read_Index_SPKR)
-        {
-            PCM_Full_Flag_SPKR = 1;
-        }
+        PCM_Filter_Half(PDM_Buffer);
     }
 }
 void HAL_I2S_RxCpltCallback(I2S_HandleTypeDef *hi2s)
 {
     if (hi2s == &hi2s2)
     {
-        PDM_Filter(PDM_Buffer + AUDIO_IN_PDM_BUFFER_SIZE / 2, &PCM_Buffer[PCM_Write_Index], &PDM1_filter_handler);
-        PCM_Write_Index += AUDIO_IN_PCM_SAMPLES_IN_MS / 2;
-        if (PCM_Write_Index >= AUDIO_IN_PCM_BUFFER_SIZE)
-        {
-            PCM_Write_Index = 0;
-        }
-        if (PCM_Write_Index == PCM_Read_Index_USB)
-        {
-            PCM_Full_Flag_USB = 1;
-        }
-        if (PCM_Write_Index == PCM_Read_Index_SPKR)
-        {
-            PCM_Full_Flag_SPKR = 1;
-        }
+        PCM_Filter_Half(PDM_Buffer + AUDIO_IN_PDM_BUFFER_SIZE / 2);
     }
 }
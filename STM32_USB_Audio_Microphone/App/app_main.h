@@ -1,24 +1,41 @@
 #ifndef AUDIO_IN_H_
 #define AUDIO_IN_H_
 
+#include "pcm_ring.h"
+
 #define AUDIO_IN_SAMPLING_FREQ 48000
 #define AUDIO_IN_PDM_DECIMATION_FACTOR 64
 #define AUDIO_IN_CHANNELS 1
 #define AUDIO_IN_PCM_SAMPLES_IN_MS (AUDIO_IN_SAMPLING_FREQ / 1000)
 #define AUDIO_IN_PDM_FREQ (AUDIO_IN_SAMPLING_FREQ * AUDIO_IN_PDM_DECIMATION_FACTOR * AUDIO_IN_CHANNELS)
 
-#define AUDIO_IN_PCM_BUFFER_SIZE (AUDIO_IN_PCM_SAMPLES_IN_MS * 20)
+/* pdm filter to usb ring, power of two samples, about 21 ms */
+#define AUDIO_IN_PCM_BUFFER_SIZE 1024
 #define AUDIO_IN_PDM_BUFFER_SIZE (AUDIO_IN_PCM_SAMPLES_IN_MS * AUDIO_IN_PDM_DECIMATION_FACTOR / 16)
 
 extern uint16_t PDM_Buffer[];
 
-extern uint16_t PCM_Buffer[];
+/* 1 to resample the pdm clock to the usb clock, 0 repeats a sample when running low */
+#ifndef AUDIO_IN_ASRC
+#define AUDIO_IN_ASRC 1
+#endif
+
+/* asrc to usb ring, power of two samples, topped up to AUDIO_IN_USB_LEVEL */
+#define AUDIO_IN_USB_BUFFER_SIZE 256
+#define AUDIO_IN_USB_LEVEL (3 * AUDIO_IN_PCM_SAMPLES_IN_MS)
+
+/* pdm ring fill level the asrc steers to */
+#define AUDIO_IN_PCM_TARGET (4 * AUDIO_IN_PCM_SAMPLES_IN_MS)
 
-extern volatile uint32_t PCM_Read_Index_USB;
-extern volatile uint32_t PCM_Write_Index;
+/* i2s dma interrupt produces, asrc or usb in endpoint consumes */
+extern PCM_Ring_t PCM_In_Ring;
 
-uint32_t PCM_Get_Count_USB(void);
-uint32_t PCM_Get_Count_SPKR(void);
+#if AUDIO_IN_ASRC
+/* asrc produces, usb in endpoint consumes */
+extern PCM_Ring_t PCM_Usb_Ring;
+#else
+#define PCM_Usb_Ring PCM_In_Ring
+#endif
 
 
 #endif /* AUDIO_IN_H_ */
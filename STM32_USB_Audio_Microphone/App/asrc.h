@@ -0,0 +1,48 @@
+#ifndef ASRC_H_
+#define ASRC_H_
+
+#include <stdint.h>
+
+#include "pcm_ring.h"
+
+/**
+ * fixed point polyphase asynchronous sample rate converter
+ * for clock drift, the ratio stays within ASRC_MAX_PPM of 1
+ */
+
+/** taps per phase, even so they pair up for smlad */
+#define ASRC_TAPS                      16
+
+/** filter phases, 2^n, outputs between two phases are interpolated */
+#define ASRC_PHASES_LOG2               6
+#define ASRC_PHASES                    (1 << ASRC_PHASES_LOG2)
+
+#define ASRC_MAX_CHANNELS              2
+
+/** ratio limit, well beyond crystal tolerances */
+#define ASRC_MAX_PPM                   1000
+
+/** fill level loop, proportional 2^n / 2^32 ratio per frame of error, integral the same per call */
+#define ASRC_KP_SHIFT                  12
+#define ASRC_KI_SHIFT                  4
+
+#define ASRC_UNITY                     (1ULL << 32)
+
+typedef struct
+{
+	uint8_t channels;
+	uint8_t index;          /* history write position */
+	uint64_t pos;           /* 32.32, input frames to take before the next output */
+	uint64_t step;          /* 32.32, input frames per output frame */
+	int32_t integral;
+	int16_t history[ASRC_MAX_CHANNELS][2 * ASRC_TAPS];
+} ASRC_t;
+
+void ASRC_Init(ASRC_t *asrc, uint8_t channels);
+void ASRC_Reset(ASRC_t *asrc);
+void ASRC_Set_Ratio(ASRC_t *asrc, uint64_t step);
+void ASRC_Track(ASRC_t *asrc, uint32_t level, uint32_t target);
+uint32_t ASRC_Process(ASRC_t *asrc, const int16_t *in, uint32_t *in_frames, int16_t *out, uint32_t out_frames);
+uint32_t ASRC_Ring(ASRC_t *asrc, PCM_Ring_t *in, PCM_Ring_t *out, uint32_t out_frames);
+
+#endif /* ASRC_H_ */
@@ -0,0 +1,41 @@
+#ifndef PCM_RING_H_
+#define PCM_RING_H_
+
+#include <stdint.h>
+
+/**
+ * lock free single producer single consumer ring of pcm samples
+ * one interrupt or thread writes, one other reads, no locks needed
+ * head and tail run freely and wrap at 2^32, size is a power of two
+ */
+typedef struct
+{
+	uint16_t *buffer;
+	uint32_t mask;          /* size - 1 */
+	uint32_t head;          /* written by the producer only */
+	uint32_t tail;          /* written by the consumer only */
+	uint32_t overruns;      /* writes dropped, ring full, producer side */
+	uint32_t underruns;     /* reads refused, ring empty, consumer side */
+} PCM_Ring_t;
+
+#define PCM_RING_IS_POW2(n)            ((n) && !((n) & ((n) - 1)))
+
+uint8_t PCM_Ring_Init(PCM_Ring_t *ring, uint16_t *buffer, uint32_t size);
+void PCM_Ring_Reset(PCM_Ring_t *ring);
+
+uint32_t PCM_Ring_Size(const PCM_Ring_t *ring);
+uint32_t PCM_Ring_Count(const PCM_Ring_t *ring);
+uint32_t PCM_Ring_Free(const PCM_Ring_t *ring);
+
+/** producer */
+uint32_t PCM_Ring_Write(PCM_Ring_t *ring, const uint16_t *data, uint32_t count);
+uint16_t *PCM_Ring_Write_Ptr(PCM_Ring_t *ring, uint32_t *count);
+void PCM_Ring_Commit(PCM_Ring_t *ring, uint32_t count);
+
+/** consumer */
+uint32_t PCM_Ring_Read(PCM_Ring_t *ring, uint16_t *data, uint32_t count);
+uint16_t *PCM_Ring_Read_Ptr(PCM_Ring_t *ring, uint32_t *count);
+uint16_t *PCM_Ring_Peek(PCM_Ring_t *ring, uint32_t offset, uint32_t *count);
+void PCM_Ring_Release(PCM_Ring_t *ring, uint32_t count);
+
+#endif /* PCM_RING_H_ */
@@ -370,16 +370,19 @@ static uint8_t USBD_AUDIO_DataIn(USBD_HandleTypeDef *pdev,
       ((USBD_AUDIO_ItfTypeDef *)pdev->pUserData)->Record();
     }
 
-    if (PCM_Get_Count_USB() > AUDIO_IN_PCM_SAMPLES_IN_MS)
+    uint32_t count = AUDIO_IN_PCM_SAMPLES_IN_MS;
+
+#if !AUDIO_IN_ASRC
+    /* Running low, stretch the packet by repeating its last sample */
+    if (PCM_Ring_Count(&PCM_Usb_Ring) < (AUDIO_IN_PCM_SAMPLES_IN_MS * 5U / 2U))
     {
-      for (uint32_t i = 0; i < AUDIO_IN_PCM_SAMPLES_IN_MS; i++)
-      {
-        samples[i] = PCM_Buffer[PCM_Read_Index_USB++];
-        if (PCM_Read_Index_USB >= AUDIO_IN_PCM_BUFFER_SIZE)
-        {
-          PCM_Read_Index_USB = 0;
-        }
-      }
+      count--;
+    }
+#endif
+
+    if (PCM_Ring_Read(&PCM_Usb_Ring, samples, count) != 0U)
+    {
+      samples[AUDIO_IN_PCM_SAMPLES_IN_MS - 1U] = samples[count - 1U];
 
       USBD_LL_Transmit(pdev, AUDIO_IN_EP,
                        (uint8_t *)samples,
@@ -391,19 +394,6 @@ static uint8_t USBD_AUDIO_DataIn(USBD_HandleTypeDef *pdev,
                        (uint8_t *)Sine_Wave,
                        AUDIO_IN_PCM_SAMPLES_IN_MS * 2);
     }
-
-//    if (PCM_Get_Count_USB() > (AUDIO_IN_PCM_BUFFER_SIZE * 0.9))
-//    {
-//      PCM_Read_Index_USB++;
-//    }
-
-    if (PCM_Get_Count_USB() < (AUDIO_IN_PCM_SAMPLES_IN_MS * 1.5))
-    {
-      if (PCM_Read_Index_USB > 0)
-      {
-        PCM_Read_Index_USB--;
-      }
-    }
   }
 
   return USBD_OK;
@@ -0,0 +1,20 @@
+#ifndef INC_AUDIO_FEEDBACK_H_
+#define INC_AUDIO_FEEDBACK_H_
+
+#include <stdint.h>
+
+/** full speed feedback is 10.14 samples per frame, sent in 3 bytes */
+#define AUDIO_FB_FRACTION_BITS         14
+#define AUDIO_FB_NOMINAL(freq)         ((uint32_t)((freq) / 1000) << AUDIO_FB_FRACTION_BITS)
+
+/** sof frames per rate measurement, 2^n */
+#define AUDIO_FB_WINDOW_LOG2           8
+
+/** fill level correction, 2^-n sample per frame for each frame off target */
+#define AUDIO_FB_LEVEL_SHIFT           8
+
+void Audio_Feedback_Init(uint32_t freq);
+void Audio_Feedback_I2S_Played(uint16_t frames);
+uint32_t Audio_Feedback_SOF(int32_t level_error);
+
+#endif /* INC_AUDIO_FEEDBACK_H_ */
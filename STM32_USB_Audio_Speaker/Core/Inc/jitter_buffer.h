@@ -0,0 +1,45 @@
+#ifndef INC_JITTER_BUFFER_H_
+#define INC_JITTER_BUFFER_H_
+
+#include <stdint.h>
+
+#include "pcm_ring.h"
+
+/** latency target limits, the target moves between them with the measured jitter */
+#ifndef JB_MIN_MS
+#define JB_MIN_MS                      2
+#endif
+#ifndef JB_MAX_MS
+#define JB_MAX_MS                      10
+#endif
+
+/** worst arrival deviation decays by 2^-n per packet, about 4 s at 1 packet per ms */
+#define JB_DECAY_SHIFT                 12
+
+/** an underrun adds this much to the worst deviation */
+#define JB_UNDERRUN_US                 1000
+
+/** a gap this long means the host stopped streaming */
+#define JB_RESTART_US                  20000
+
+typedef struct
+{
+	uint32_t target;        /* fill level the feedback steers to, samples */
+	uint32_t level;         /* fill level at the last packet, samples */
+	uint32_t level_min;     /* since JB_Reset_Stats */
+	uint32_t level_max;
+	uint32_t jitter_us;     /* mean deviation of packet spacing from 1 ms */
+	uint32_t peak_us;       /* worst deviation, decaying */
+	uint32_t packets;
+	uint32_t underruns;
+	uint32_t overruns;
+} JB_Stats_t;
+
+void JB_Init(const PCM_Ring_t *ring, uint32_t samples_per_ms);
+void JB_Set_Limits(uint8_t min_ms, uint8_t max_ms);
+void JB_Packet();
+uint32_t JB_Target();
+const JB_Stats_t *JB_Get_Stats();
+void JB_Reset_Stats();
+
+#endif /* INC_JITTER_BUFFER_H_ */
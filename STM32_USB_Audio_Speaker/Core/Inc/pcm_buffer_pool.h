@@ -4,16 +4,45 @@
 #include <stdint.h>
 #include <stddef.h>
 
+#include "pcm_ring.h"
+
 #define AUDIO_OUT_SAMPLING_FREQ        48000
 #define AUDIO_OUT_BIT_RESOLUTION       16
 #define AUDIO_OUT_CHANNELS             2
 #define AUDIO_OUT_PCM_SAMPLES          (AUDIO_OUT_CHANNELS*AUDIO_OUT_SAMPLING_FREQ/1000)
 
-void App_Loop();
-uint8_t PCM_Pool_Is_Full();
-uint8_t PCM_Pool_Is_Empty();
-uint8_t PCM_Pool_Get_Count();
-uint16_t *PCM_Pool_Next_Filled();
-uint16_t *PCM_Pool_Next_Empty();
+/** feedback paced packets carry up to one frame more than nominal */
+#define AUDIO_OUT_PCM_MAX_SAMPLES      (AUDIO_OUT_PCM_SAMPLES+AUDIO_OUT_CHANNELS)
+
+/** usb to i2s ring, power of two samples, room for the largest jitter buffer target and a burst */
+#define PCM_POOL_SAMPLES               2048
+
+/** samples per i2s dma buffer, played in place from the ring */
+#define PCM_POOL_PERIOD                64
+
+/**
+ * 1 to resample usb to the i2s clock, only for hosts that ignore the
+ * feedback endpoint, feedback and asrc would both steer the usb ring
+ * level and fight each other
+ */
+#ifndef PCM_POOL_ASRC
+#define PCM_POOL_ASRC                  0
+#endif
+
+/** asrc to i2s ring, the latency the asrc adds */
+#define PCM_POOL_PLAY_SAMPLES          (4*PCM_POOL_PERIOD)
+
+#if PCM_POOL_SAMPLES % PCM_POOL_PERIOD || PCM_POOL_PLAY_SAMPLES % PCM_POOL_PERIOD
+#error "PCM_POOL_SAMPLES and PCM_POOL_PLAY_SAMPLES must hold a whole number of periods"
+#endif
+
+void PCM_Pool_Init();
+void PCM_Pool_Start();
+void PCM_Pool_Process();
+uint16_t *PCM_Pool_Rx_Buffer();
+void PCM_Pool_Received(uint16_t samples);
+uint32_t PCM_Pool_Get_Level();
+int32_t PCM_Pool_Level_Error();
+const PCM_Ring_t *PCM_Pool_Get_Ring();
 
 #endif /* INC_PCM_BUFFER_POOL_H_ */
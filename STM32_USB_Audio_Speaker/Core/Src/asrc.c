@@ -0,0 +1,261 @@
+#include <string.h>
+#include <math.h>
+
+#include "asrc.h"
+
+#if defined(__ARM_FEATURE_DSP) && __ARM_FEATURE_DSP
+#include "main.h"
+#define ASRC_DSP 1
+#else
+#define ASRC_DSP 0
+#endif
+
+/**
+ * input frames go through a history of ASRC_TAPS frames, an output is
+ * the dot product of the history with the filter phase for its
+ * fractional position, interpolated between the two nearest phases
+ * the position advances by step input frames per output frame, so the
+ * input rate over the output rate is step / 2^32
+ */
+
+/** prototype cutoff as a fraction of nyquist */
+#define ASRC_CUTOFF                    0.9f
+
+/** phase p is the filter delayed by p / ASRC_PHASES frame, the extra phase is a whole frame */
+static int16_t ASRC_Coef[ASRC_PHASES + 1][ASRC_TAPS] __attribute__((aligned(4)));
+static uint8_t ASRC_Coef_Ready;
+
+/** windowed sinc, each phase normalised to unity gain */
+static void ASRC_Design()
+{
+	float h[ASRC_TAPS];
+
+	for (uint32_t p = 0; p <= ASRC_PHASES; p++)
+	{
+		float mu = (float)p / ASRC_PHASES;
+		float sum = 0;
+
+		for (uint32_t k = 0; k < ASRC_TAPS; k++)
+		{
+			/** distance from the output to tap k, the newest frame is the last tap */
+			float u = (float)(ASRC_TAPS - 1 - k) - ASRC_TAPS / 2 + mu;
+			float x = (float)M_PI * ASRC_CUTOFF * u;
+			float sinc = (fabsf(x) < 1e-6f) ? 1.0f : sinf(x) / x;
+			float w = 0.42f + 0.5f * cosf(2.0f * (float)M_PI * u / ASRC_TAPS)
+					+ 0.08f * cosf(4.0f * (float)M_PI * u / ASRC_TAPS);
+
+			h[k] = sinc * w;
+			sum += h[k];
+		}
+
+		for (uint32_t k = 0; k < ASRC_TAPS; k++)
+		{
+			ASRC_Coef[p][k] = (int16_t)lrintf(h[k] / sum * 32767.0f);
+		}
+	}
+
+	ASRC_Coef_Ready = 1;
+}
+
+/** two q15 values as one word, the history is not always word aligned */
+static inline uint32_t ASRC_Read2(const int16_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/** q30 dot product of one phase with the history */
+static inline int32_t ASRC_Dot(const int16_t *coef, const int16_t *x)
+{
+	int32_t acc = 0;
+
+#if ASRC_DSP
+	for (uint32_t k = 0; k < ASRC_TAPS; k += 2)
+	{
+		acc = (int32_t)__SMLAD(ASRC_Read2(&coef[k]), ASRC_Read2(&x[k]), (uint32_t)acc);
+	}
+#else
+	for (uint32_t k = 0; k < ASRC_TAPS; k++)
+	{
+		acc += coef[k] * x[k];
+	}
+#endif
+
+	return acc;
+}
+
+static inline int16_t ASRC_Sat16(int32_t v)
+{
+#if ASRC_DSP
+	return (int16_t)__SSAT(v, 16);
+#else
+	if (v > 32767)
+		return 32767;
+	if (v < -32768)
+		return -32768;
+	return (int16_t)v;
+#endif
+}
+
+static void ASRC_Push(ASRC_t *asrc, const int16_t *frame)
+{
+	for (uint8_t c = 0; c < asrc->channels; c++)
+	{
+		/** written twice so the window is always contiguous */
+		asrc->history[c][asrc->index] = frame[c];
+		asrc->history[c][asrc->index + ASRC_TAPS] = frame[c];
+	}
+
+	asrc->index = (asrc->index + 1) & (ASRC_TAPS - 1);
+}
+
+void ASRC_Init(ASRC_t *asrc, uint8_t channels)
+{
+	if (!ASRC_Coef_Ready)
+		ASRC_Design();
+
+	if (channels > ASRC_MAX_CHANNELS)
+		channels = ASRC_MAX_CHANNELS;
+
+	asrc->channels = channels;
+	ASRC_Reset(asrc);
+}
+
+/** clear the history and go back to a 1:1 ratio */
+void ASRC_Reset(ASRC_t *asrc)
+{
+	memset(asrc->history, 0, sizeof(asrc->history));
+	asrc->index = 0;
+	asrc->pos = 0;
+	asrc->step = ASRC_UNITY;
+	asrc->integral = 0;
+}
+
+/** fixed ratio, input frames per output frame in 32.32 */
+void ASRC_Set_Ratio(ASRC_t *asrc, uint64_t step)
+{
+	uint64_t limit = ASRC_UNITY * ASRC_MAX_PPM / 1000000;
+
+	if (step > ASRC_UNITY + limit)
+		step = ASRC_UNITY + limit;
+	if (step < ASRC_UNITY - limit)
+		step = ASRC_UNITY - limit;
+
+	asrc->step = step;
+}
+
+/**
+ * steer the ratio so the input side holds target frames, call once per
+ * block, an input fuller than target is consumed faster
+ */
+void ASRC_Track(ASRC_t *asrc, uint32_t level, uint32_t target)
+{
+	int64_t limit = ASRC_UNITY * ASRC_MAX_PPM / 1000000;
+	int32_t integral_max = (int32_t)(limit >> ASRC_KI_SHIFT);
+	int32_t error = (int32_t)level - (int32_t)target;
+	int64_t deviation;
+
+	asrc->integral += error;
+	if (asrc->integral > integral_max)
+		asrc->integral = integral_max;
+	if (asrc->integral < -integral_max)
+		asrc->integral = -integral_max;
+
+	deviation = ((int64_t)error << ASRC_KP_SHIFT) + ((int64_t)asrc->integral << ASRC_KI_SHIFT);
+
+	if (deviation > limit)
+		deviation = limit;
+	if (deviation < -limit)
+		deviation = -limit;
+
+	asrc->step = ASRC_UNITY + deviation;
+}
+
+/**
+ * convert interleaved frames until out_frames are made or the input runs out
+ * in_frames gives the input available and returns the input consumed
+ * return frames made
+ */
+uint32_t ASRC_Process(ASRC_t *asrc, const int16_t *in, uint32_t *in_frames, int16_t *out, uint32_t out_frames)
+{
+	uint32_t consumed = 0;
+	uint32_t made = 0;
+
+	for (;;)
+	{
+		while (asrc->pos >= ASRC_UNITY)
+		{
+			if (consumed == *in_frames)
+			{
+				*in_frames = consumed;
+				return made;
+			}
+
+			ASRC_Push(asrc, &in[consumed * asrc->channels]);
+			consumed++;
+			asrc->pos -= ASRC_UNITY;
+		}
+
+		if (made == out_frames)
+			break;
+
+		uint32_t mu = (uint32_t)asrc->pos;
+		uint32_t phase = mu >> (32 - ASRC_PHASES_LOG2);
+		int32_t frac = (mu >> (32 - ASRC_PHASES_LOG2 - 15)) & 0x7FFF;
+
+		for (uint8_t c = 0; c < asrc->channels; c++)
+		{
+			const int16_t *x = &asrc->history[c][asrc->index];
+			int32_t a = ASRC_Dot(ASRC_Coef[phase], x);
+			int32_t b = ASRC_Dot(ASRC_Coef[phase + 1], x);
+			int32_t y = a + (int32_t)(((int64_t)(b - a) * frac) >> 15);
+
+			*out++ = ASRC_Sat16((y + (1 << 14)) >> 15);
+		}
+
+		made++;
+		asrc->pos += asrc->step;
+	}
+
+	*in_frames = consumed;
+	return made;
+}
+
+/**
+ * convert from one ring to the other in place, the asrc is the consumer
+ * of in and the producer of out
+ * return frames made, fewer than out_frames if in ran dry or out is full
+ */
+uint32_t ASRC_Ring(ASRC_t *asrc, PCM_Ring_t *in, PCM_Ring_t *out, uint32_t out_frames)
+{
+	uint32_t done = 0;
+
+	while (done < out_frames)
+	{
+		uint32_t in_count;
+		uint32_t out_count;
+		const int16_t *src = (const int16_t *)PCM_Ring_Read_Ptr(in, &in_count);
+		int16_t *dst = (int16_t *)PCM_Ring_Write_Ptr(out, &out_count);
+		uint32_t in_frames = in_count / asrc->channels;
+		uint32_t want = out_count / asrc->channels;
+
+		if (want > out_frames - done)
+			want = out_frames - done;
+		if (want == 0)
+			break;
+
+		uint32_t made = ASRC_Process(asrc, src, &in_frames, dst, want);
+
+		PCM_Ring_Release(in, in_frames * asrc->channels);
+		PCM_Ring_Commit(out, made * asrc->channels);
+		done += made;
+
+		/** nothing left, or nothing contiguous, to take */
+		if (!made && !in_frames)
+			break;
+	}
+
+	return done;
+}
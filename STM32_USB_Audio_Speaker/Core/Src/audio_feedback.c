@@ -0,0 +1,118 @@
+#include "audio_feedback.h"
+#include "main.h"
+
+/**
+ * feedback = i2s frames played per usb frame
+ * tim2 free runs on the timer clock and timestamps both sides, the sof
+ * edge by input capture, the i2s dma periods from their interrupt, so the
+ * timer clock accuracy cancels out of the ratio
+ */
+
+#define USB_OTG_FS_DEVICE  ((USB_OTG_DeviceTypeDef *)(USB_OTG_FS_PERIPH_BASE + USB_OTG_DEVICE_BASE))
+
+#define AUDIO_FB_FRAME_MASK            0x3FFF
+
+static uint32_t FB_Nominal;
+static uint32_t FB_Rate;
+
+/** written by the i2s dma interrupt */
+static volatile uint32_t FB_I2S_Stamp;
+static volatile uint32_t FB_I2S_Frames;
+
+/** measurement window start */
+static uint8_t FB_Started;
+static uint16_t FB_SOF_Frame;
+static uint32_t FB_SOF_Stamp;
+static uint32_t FB_I2S_Start_Stamp;
+static uint32_t FB_I2S_Start_Frames;
+
+void Audio_Feedback_Init(uint32_t freq)
+{
+	FB_Nominal = AUDIO_FB_NOMINAL(freq);
+	FB_Rate = FB_Nominal;
+	FB_Started = 0;
+
+	/** sof pulse to tim2 itr1 */
+	USB_OTG_FS->GCCFG |= USB_OTG_GCCFG_SOFOUTEN;
+
+	__HAL_RCC_TIM2_CLK_ENABLE();
+	TIM2->CR1 = 0;
+	TIM2->PSC = 0;
+	TIM2->ARR = 0xFFFFFFFF;
+	TIM2->OR = TIM_OR_ITR1_RMP_1;                       /* itr1 = otg fs sof */
+	TIM2->SMCR = TIM_SMCR_TS_0;                         /* trc = itr1 */
+	TIM2->CCMR1 = TIM_CCMR1_CC1S_0 | TIM_CCMR1_CC1S_1;  /* ic1 captures trc */
+	TIM2->CCER = TIM_CCER_CC1E;
+	TIM2->EGR = TIM_EGR_UG;
+	TIM2->CR1 = TIM_CR1_CEN;
+}
+
+/**
+ * called from PCM_Pool_Done each time the i2s dma finishes playing one
+ * of its double buffer targets, frames is the period it played
+ */
+void Audio_Feedback_I2S_Played(uint16_t frames)
+{
+	FB_I2S_Stamp = TIM2->CNT;
+	FB_I2S_Frames += frames;
+}
+
+/**
+ * call on every sof, level_error is the fill level target minus the
+ * buffered frames, positive asks the host for more
+ * return feedback value in 10.14
+ */
+uint32_t Audio_Feedback_SOF(int32_t level_error)
+{
+	uint32_t sof_stamp = TIM2->CCR1;
+	uint16_t sof_frame = (USB_OTG_FS_DEVICE->DSTS & USB_OTG_DSTS_FNSOF) >> USB_OTG_DSTS_FNSOF_Pos;
+	uint32_t i2s_stamp;
+	uint32_t i2s_frames;
+	int32_t value;
+
+	/** dma interrupt may preempt, read a matching pair */
+	do
+	{
+		i2s_frames = FB_I2S_Frames;
+		i2s_stamp = FB_I2S_Stamp;
+	} while (i2s_frames != FB_I2S_Frames);
+
+	uint16_t sof_frames = (sof_frame - FB_SOF_Frame) & AUDIO_FB_FRAME_MASK;
+
+	if (!FB_Started || sof_frames >= (1 << AUDIO_FB_WINDOW_LOG2))
+	{
+		uint32_t sof_ticks = sof_stamp - FB_SOF_Stamp;
+		uint32_t i2s_ticks = i2s_stamp - FB_I2S_Start_Stamp;
+		uint32_t played = i2s_frames - FB_I2S_Start_Frames;
+
+		if (FB_Started && played && i2s_ticks)
+		{
+			uint32_t rate = ((uint64_t)played * sof_ticks << AUDIO_FB_FRACTION_BITS)
+					/ ((uint64_t)i2s_ticks * sof_frames);
+
+			/** i2s stopped or restarted inside the window */
+			if (rate > FB_Nominal - (1 << AUDIO_FB_FRACTION_BITS)
+					&& rate < FB_Nominal + (1 << AUDIO_FB_FRACTION_BITS))
+			{
+				/** low pass, interrupt latency on the i2s stamps is the noise */
+				FB_Rate = (int32_t)FB_Rate + ((int32_t)(rate - FB_Rate) >> 2);
+			}
+		}
+
+		FB_Started = 1;
+		FB_SOF_Frame = sof_frame;
+		FB_SOF_Stamp = sof_stamp;
+		FB_I2S_Start_Stamp = i2s_stamp;
+		FB_I2S_Start_Frames = i2s_frames;
+	}
+
+	value = FB_Rate + level_error * (1 << (AUDIO_FB_FRACTION_BITS - AUDIO_FB_LEVEL_SHIFT));
+
+	/** host expects at most one frame off nominal */
+	if (value < (int32_t)(FB_Nominal - (1 << AUDIO_FB_FRACTION_BITS)))
+		value = FB_Nominal - (1 << AUDIO_FB_FRACTION_BITS);
+	if (value > (int32_t)(FB_Nominal + (1 << AUDIO_FB_FRACTION_BITS)))
+		value = FB_Nominal + (1 << AUDIO_FB_FRACTION_BITS);
+
+	return value;
+}
@@ -0,0 +1,140 @@
+#include "jitter_buffer.h"
+#include "main.h"
+
+/**
+ * packets are timestamped with the dwt cycle counter as they arrive,
+ * the deviation of their spacing from 1 ms is the host jitter
+ * target = one packet + worst deviation, clamped to the limits, the
+ * worst deviation decays so the target shrinks while the host keeps time
+ * the feedback endpoint then moves the fill level to the target
+ */
+
+static const PCM_Ring_t *JB_Ring;
+static uint32_t JB_Samples_Per_Ms;
+static uint32_t JB_Min;
+static uint32_t JB_Max;
+
+static JB_Stats_t JB_Stats;
+
+static uint8_t JB_Started;
+static uint32_t JB_Last_Stamp;
+static uint32_t JB_Last_Underruns;
+
+/** jitter_us * 16 and peak_us * 2^JB_DECAY_SHIFT, kept for resolution */
+static uint32_t JB_Jitter_Acc;
+static uint32_t JB_Peak_Acc;
+
+static void JB_Update_Target()
+{
+	uint32_t target = JB_Samples_Per_Ms + JB_Stats.peak_us * JB_Samples_Per_Ms / 1000;
+
+	/** whole frames, the ring holds interleaved stereo */
+	target &= ~1UL;
+
+	if (target < JB_Min)
+		target = JB_Min;
+	if (target > JB_Max)
+		target = JB_Max;
+
+	JB_Stats.target = target;
+}
+
+void JB_Init(const PCM_Ring_t *ring, uint32_t samples_per_ms)
+{
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+	JB_Ring = ring;
+	JB_Samples_Per_Ms = samples_per_ms;
+	JB_Started = 0;
+	JB_Last_Underruns = ring->underruns;
+	JB_Jitter_Acc = 0;
+	JB_Peak_Acc = 0;
+
+	JB_Stats.jitter_us = 0;
+	JB_Stats.peak_us = 0;
+	JB_Stats.packets = 0;
+	JB_Set_Limits(JB_MIN_MS, JB_MAX_MS);
+	JB_Reset_Stats();
+}
+
+/** set the latency range, equal limits give a fixed latency */
+void JB_Set_Limits(uint8_t min_ms, uint8_t max_ms)
+{
+	if (min_ms > max_ms)
+		min_ms = max_ms;
+
+	JB_Min = min_ms * JB_Samples_Per_Ms;
+	JB_Max = max_ms * JB_Samples_Per_Ms;
+
+	JB_Update_Target();
+}
+
+/** call from the usb interrupt after each packet is queued */
+void JB_Packet()
+{
+	uint32_t now = DWT->CYCCNT;
+	uint32_t us = (now - JB_Last_Stamp) / (SystemCoreClock / 1000000);
+	uint32_t underruns = JB_Ring->underruns;
+	uint32_t level = PCM_Ring_Count(JB_Ring);
+
+	JB_Last_Stamp = now;
+
+	if (JB_Started && us < JB_RESTART_US)
+	{
+		uint32_t deviation = (us > 1000) ? us - 1000 : 1000 - us;
+
+		/** mean deviation, rfc 3550 style, 1/16 gain */
+		JB_Jitter_Acc += deviation - ((JB_Jitter_Acc + 8) >> 4);
+
+		if (deviation << JB_DECAY_SHIFT > JB_Peak_Acc)
+			JB_Peak_Acc = deviation << JB_DECAY_SHIFT;
+		else
+			JB_Peak_Acc -= JB_Peak_Acc >> JB_DECAY_SHIFT;
+	}
+	JB_Started = 1;
+
+	/** ran dry, play it safer */
+	if (underruns != JB_Last_Underruns)
+	{
+		JB_Peak_Acc += JB_UNDERRUN_US << JB_DECAY_SHIFT;
+		JB_Last_Underruns = underruns;
+	}
+
+	/** beyond any limit, keeps the accumulator from overflowing */
+	if (JB_Peak_Acc > (JB_RESTART_US << JB_DECAY_SHIFT))
+		JB_Peak_Acc = JB_RESTART_US << JB_DECAY_SHIFT;
+
+	JB_Stats.jitter_us = JB_Jitter_Acc >> 4;
+	JB_Stats.peak_us = JB_Peak_Acc >> JB_DECAY_SHIFT;
+	JB_Stats.level = level;
+	JB_Stats.underruns = underruns;
+	JB_Stats.overruns = JB_Ring->overruns;
+	JB_Stats.packets++;
+
+	if (level < JB_Stats.level_min)
+		JB_Stats.level_min = level;
+	if (level > JB_Stats.level_max)
+		JB_Stats.level_max = level;
+
+	JB_Update_Target();
+}
+
+/** return fill level the feedback should steer to, samples */
+uint32_t JB_Target()
+{
+	return JB_Stats.target;
+}
+
+/** live statistics, safe to read from the main loop */
+const JB_Stats_t *JB_Get_Stats()
+{
+	return &JB_Stats;
+}
+
+/** restart the fill level min and max */
+void JB_Reset_Stats()
+{
+	JB_Stats.level_min = 0xFFFFFFFF;
+	JB_Stats.level_max = 0;
+}
@@ -57,9 +57,6 @@
 
 int16_t Sine_Wave[96];
 
-extern uint16_t CS43L22_Buffer[];
-extern uint8_t Ping_Flag;
-extern uint8_t Pong_Flag;
 
 /* USER CODE END PV */
 
@@ -118,12 +115,14 @@ int main(void)
 		Sine_Wave[i*2+1] = Sine_Wave[i*2];
 	}
 
+   PCM_Pool_Init();
+
    cs43l22_Init(CS43L22_I2C_ADDRESS, OUTPUT_DEVICE_HEADPHONE, 70, AUDIO_OUT_SAMPLING_FREQ);
 
    cs43l22_Play(CS43L22_I2C_ADDRESS, 0, 0);
 
-   /** first time send dummy bytes */
-   HAL_I2S_Transmit_DMA(&hi2s3, (uint16_t*)CS43L22_Buffer, AUDIO_OUT_PCM_SAMPLES);
+   /** plays silence until usb fills the ring */
+   PCM_Pool_Start();
 
   /* USER CODE END 2 */
 
@@ -131,10 +130,10 @@ int main(void)
   /* USER CODE BEGIN WHILE */
   while (1)
   {
-	  App_Loop();
     /* USER CODE END WHILE */
 
     /* USER CODE BEGIN 3 */
+    PCM_Pool_Process();
   }
   /* USER CODE END 3 */
 }
@@ -190,21 +189,6 @@ void SystemClock_Config(void)
 }
 
 /* USER CODE BEGIN 4 */
-void HAL_I2S_TxCpltCallback(I2S_HandleTypeDef *hi2s)
-{
-	if(hi2s == &hi2s3)
-	{
-		Pong_Flag = 1;
-	}
-}
-void HAL_I2S_TxHalfCpltCallback(I2S_HandleTypeDef *hi2s)
-{
-	if(hi2s == &hi2s3)
-	{
-		Ping_Flag = 1;
-	}
-}
-
 void HAL_I2S_RxHalfCpltCallback(I2S_HandleTypeDef *hi2s)
 {
 	if(hi2s == &hi2s2)
@@ -1,116 +1,195 @@
-#include <string.h>
-
 #include "pcm_buffer_pool.h"
-#include "cs43l22.h"
+#include "audio_feedback.h"
+#include "jitter_buffer.h"
+#include "asrc.h"
 #include "i2s.h"
 
-#define PCM_POOL_SIZE 10
+#if PCM_POOL_ASRC
+/** usb interrupt produces, asrc consumes in the main loop */
+static uint16_t PCM_Usb_Buffer[PCM_POOL_SAMPLES];
+static PCM_Ring_t PCM_Usb_Ring;
+
+/** asrc produces, i2s dma consumes in place */
+static uint16_t PCM_Pool_Buffer[PCM_POOL_PLAY_SAMPLES];
+static PCM_Ring_t PCM_Pool_Ring;
+
+static ASRC_t PCM_Pool_ASRC;
+#else
+/** usb interrupt produces, i2s dma consumes in place */
+static uint16_t PCM_Pool_Buffer[PCM_POOL_SAMPLES];
+static PCM_Ring_t PCM_Pool_Ring;
 
-static uint16_t PCM_Buffer_Pool[PCM_POOL_SIZE][AUDIO_OUT_PCM_SAMPLES];
+/** one ring, usb feeds the dma directly */
+#define PCM_Usb_Ring                   PCM_Pool_Ring
+#endif
 
-static uint8_t PCM_Read_Index;
-static uint8_t PCM_Write_Index;
-static uint8_t PCM_Full_Flag;
+/** usb receives here, copied to the ring before the endpoint is armed again */
+static uint16_t PCM_Rx_Buffer[AUDIO_OUT_PCM_MAX_SAMPLES];
 
-uint8_t CS43L22_CMPLT_Flag = 0;
+/** dma plays this when the ring holds less than a period */
+static uint16_t PCM_Silence[PCM_POOL_PERIOD];
 
-uint8_t Ping_Flag = 0;
-uint8_t Pong_Flag = 0;
-uint16_t CS43L22_Buffer[AUDIO_OUT_PCM_SAMPLES];
+/** 1 if dma memory 0/1 points into the ring */
+static uint8_t PCM_Queued[2];
 
-extern int16_t Sine_Wave[];
+/** samples past the ring tail handed to the dma, not yet released */
+static uint32_t PCM_Claimed;
 
-/** return 1 if entire pool is full*/
-uint8_t PCM_Pool_Is_Full()
+void PCM_Pool_Init()
 {
-	return PCM_Full_Flag;
+#if PCM_POOL_ASRC
+	PCM_Ring_Init(&PCM_Usb_Ring, PCM_Usb_Buffer, PCM_POOL_SAMPLES);
+	PCM_Ring_Init(&PCM_Pool_Ring, PCM_Pool_Buffer, PCM_POOL_PLAY_SAMPLES);
+	ASRC_Init(&PCM_Pool_ASRC, AUDIO_OUT_CHANNELS);
+#else
+	PCM_Ring_Init(&PCM_Pool_Ring, PCM_Pool_Buffer, PCM_POOL_SAMPLES);
+#endif
+	JB_Init(&PCM_Usb_Ring, AUDIO_OUT_PCM_SAMPLES);
 }
 
-/** return 1 if entire pool is empty*/
-uint8_t PCM_Pool_Is_Empty()
+/** return buffer for the next usb packet */
+uint16_t *PCM_Pool_Rx_Buffer()
 {
-	return (PCM_Pool_Get_Count() == 0);
+	return PCM_Rx_Buffer;
 }
 
-/** return number of filled buffers */
-uint8_t PCM_Pool_Get_Count()
+/** queue the packet usb just received, dropped when the ring is full */
+void PCM_Pool_Received(uint16_t samples)
 {
-	if (PCM_Full_Flag)
-		return PCM_POOL_SIZE;
-	if (PCM_Write_Index >= PCM_Read_Index)
-		return (PCM_Write_Index - PCM_Read_Index);
-	return (PCM_POOL_SIZE - (PCM_Read_Index - PCM_Write_Index));
+	if (samples > AUDIO_OUT_PCM_MAX_SAMPLES)
+		samples = AUDIO_OUT_PCM_MAX_SAMPLES;
+
+	PCM_Ring_Write(&PCM_Usb_Ring, PCM_Rx_Buffer, samples);
+
+	JB_Packet();
 }
 
-/** return pointer to next filled buffer */
-uint16_t *PCM_Pool_Next_Filled()
+/** return number of samples waiting on the usb side */
+uint32_t PCM_Pool_Get_Level()
 {
-	if(PCM_Pool_Is_Empty())
-	{
-		return NULL;
-	}
+	return PCM_Ring_Count(&PCM_Usb_Ring);
+}
 
-	uint16_t *temp = PCM_Buffer_Pool[PCM_Read_Index++];
-	PCM_Full_Flag = 0;
-	if (PCM_Read_Index == PCM_POOL_SIZE)
-		PCM_Read_Index = 0;
+/** return frames below the jitter buffer target, negative above it */
+int32_t PCM_Pool_Level_Error()
+{
+	return ((int32_t)JB_Target() - (int32_t)PCM_Pool_Get_Level()) / AUDIO_OUT_CHANNELS;
+}
 
-	return temp;
+/** overrun and underrun counters */
+const PCM_Ring_t *PCM_Pool_Get_Ring()
+{
+	return &PCM_Usb_Ring;
 }
 
-/** return pointer to next filled buffer */
-uint16_t *PCM_Pool_Next_Peek()
+/**
+ * call from the main loop, tops up the play ring through the asrc, the
+ * ratio steers the usb side to the jitter buffer target, so the drift of
+ * a host that ignores feedback is taken up here instead of by overruns
+ * and underruns
+ */
+void PCM_Pool_Process()
 {
-	if(PCM_Pool_Is_Empty())
-	{
-		return NULL;
-	}
+#if PCM_POOL_ASRC
+	uint32_t free = PCM_Ring_Free(&PCM_Pool_Ring);
+
+	/** once per played period, keeps the loop gain independent of the main loop */
+	if (free < PCM_POOL_PERIOD)
+		return;
 
-	uint16_t *temp = PCM_Buffer_Pool[PCM_Read_Index];
+	ASRC_Track(&PCM_Pool_ASRC, PCM_Ring_Count(&PCM_Usb_Ring) / AUDIO_OUT_CHANNELS,
+			JB_Target() / AUDIO_OUT_CHANNELS);
 
-	return temp;
+	ASRC_Ring(&PCM_Pool_ASRC, &PCM_Usb_Ring, &PCM_Pool_Ring, free / AUDIO_OUT_CHANNELS);
+#endif
 }
 
-/** return pointer to next empty buffer */
-uint16_t *PCM_Pool_Next_Empty()
+/**
+ * dma finished memory target, release the period it played and point
+ * it at the next one, the dma is already playing the other target
+ */
+static void PCM_Pool_Done(uint8_t target)
 {
-	if(PCM_Pool_Is_Full())
+	uint32_t count;
+	uint16_t *next;
+
+	if (PCM_Queued[target])
+	{
+		PCM_Ring_Release(&PCM_Pool_Ring, PCM_POOL_PERIOD);
+		PCM_Claimed -= PCM_POOL_PERIOD;
+	}
+
+	/** tail only moves by whole periods, so a period never wraps */
+	next = PCM_Ring_Peek(&PCM_Pool_Ring, PCM_Claimed, &count);
+
+	if (count >= PCM_POOL_PERIOD)
 	{
-		//return NULL;
+		PCM_Claimed += PCM_POOL_PERIOD;
+		PCM_Queued[target] = 1;
 	}
+	else
+	{
+		/** count starvation once, not every silent period, on the ring the jitter buffer watches */
+		if (PCM_Queued[!target])
+			PCM_Usb_Ring.underruns++;
 
-	uint16_t *temp = PCM_Buffer_Pool[PCM_Write_Index++];
-	PCM_Full_Flag = 0;
-	if (PCM_Write_Index == PCM_POOL_SIZE)
-		PCM_Write_Index = 0;
-	if (PCM_Write_Index == PCM_Read_Index)
-		PCM_Full_Flag = 1;
+		next = PCM_Silence;
+		PCM_Queued[target] = 0;
+	}
 
-	return temp;
+	HAL_DMAEx_ChangeMemory(hi2s3.hdmatx, (uint32_t)next, target ? MEMORY1 : MEMORY0);
+
+	Audio_Feedback_I2S_Played(PCM_POOL_PERIOD/AUDIO_OUT_CHANNELS);
 }
 
-void App_Loop()
+static void PCM_Pool_M0_Done(DMA_HandleTypeDef *hdma)
 {
-	if(PCM_Pool_Get_Count())
-	{
-		uint16_t *data = PCM_Pool_Next_Peek();
-		if(Ping_Flag)
-		{
-			Ping_Flag = 0;
-			for(uint16_t i=0; i<AUDIO_OUT_PCM_SAMPLES/2; i++)
-			{
-				CS43L22_Buffer[i] = data[i];
-			}
-		}
-		if(Pong_Flag)
-		{
-			Pong_Flag = 0;
-			for(uint16_t i=0; i<AUDIO_OUT_PCM_SAMPLES/2; i++)
-			{
-				CS43L22_Buffer[i+AUDIO_OUT_PCM_SAMPLES/2] = data[i+AUDIO_OUT_PCM_SAMPLES/2];
-			}
-
-			PCM_Pool_Next_Filled();
-		}
-	}
+	UNUSED(hdma);
+	PCM_Pool_Done(0);
+}
+
+static void PCM_Pool_M1_Done(DMA_HandleTypeDef *hdma)
+{
+	UNUSED(hdma);
+	PCM_Pool_Done(1);
+}
+
+/** both targets play silence until PCM_Pool_Done queues the ring */
+static void PCM_Pool_DMA_Start()
+{
+	PCM_Queued[0] = 0;
+	PCM_Queued[1] = 0;
+	PCM_Claimed = 0;
+
+	HAL_DMAEx_MultiBufferStart_IT(hi2s3.hdmatx, (uint32_t)PCM_Silence, (uint32_t)&hi2s3.Instance->DR,
+			(uint32_t)PCM_Silence, PCM_POOL_PERIOD);
+}
+
+/**
+ * a transfer error disables the stream, drop the periods it held and
+ * start it again, fifo errors leave the stream running and are ignored
+ */
+static void PCM_Pool_DMA_Error(DMA_HandleTypeDef *hdma)
+{
+	if (!(HAL_DMA_GetError(hdma) & HAL_DMA_ERROR_TE))
+		return;
+
+	PCM_Ring_Release(&PCM_Pool_Ring, PCM_Claimed);
+	PCM_Pool_DMA_Start();
+}
+
+/** start i2s3 playback, dma double buffer mode reading the ring in place */
+void PCM_Pool_Start()
+{
+	DMA_HandleTypeDef *hdma = hi2s3.hdmatx;
+
+	hdma->XferCpltCallback = PCM_Pool_M0_Done;
+	hdma->XferM1CpltCallback = PCM_Pool_M1_Done;
+	hdma->XferErrorCallback = PCM_Pool_DMA_Error;
+
+	PCM_Pool_DMA_Start();
+
+	/** same order as HAL_I2S_Transmit_DMA */
+	__HAL_I2S_ENABLE(&hi2s3);
+	SET_BIT(hi2s3.Instance->CR2, SPI_CR2_TXDMAEN);
 }
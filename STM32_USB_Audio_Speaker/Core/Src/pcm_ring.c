@@ -0,0 +1,158 @@
+#include <string.h>
+
+#include "pcm_ring.h"
+
+/**
+ * acquire on the other side's index before touching samples,
+ * release on our own index after, so samples are never seen
+ * before the index that publishes them
+ */
+#define PCM_RING_LOAD(p)               __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define PCM_RING_STORE(p, v)           __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+/** return 1 on success, 0 if size is not a power of two */
+uint8_t PCM_Ring_Init(PCM_Ring_t *ring, uint16_t *buffer, uint32_t size)
+{
+	if (!PCM_RING_IS_POW2(size))
+	{
+		return 0;
+	}
+
+	ring->buffer = buffer;
+	ring->mask = size - 1;
+	ring->head = 0;
+	ring->tail = 0;
+	ring->overruns = 0;
+	ring->underruns = 0;
+
+	return 1;
+}
+
+/** drop buffered samples, call from the consumer with the producer stopped */
+void PCM_Ring_Reset(PCM_Ring_t *ring)
+{
+	PCM_RING_STORE(&ring->tail, PCM_RING_LOAD(&ring->head));
+}
+
+uint32_t PCM_Ring_Size(const PCM_Ring_t *ring)
+{
+	return ring->mask + 1;
+}
+
+/** return samples waiting to be read */
+uint32_t PCM_Ring_Count(const PCM_Ring_t *ring)
+{
+	return PCM_RING_LOAD(&ring->head) - PCM_RING_LOAD(&ring->tail);
+}
+
+/** return samples that can be written */
+uint32_t PCM_Ring_Free(const PCM_Ring_t *ring)
+{
+	return PCM_Ring_Size(ring) - PCM_Ring_Count(ring);
+}
+
+/** write all count samples or none, return count or 0 on overrun */
+uint32_t PCM_Ring_Write(PCM_Ring_t *ring, const uint16_t *data, uint32_t count)
+{
+	uint32_t head = ring->head;
+	uint32_t tail = PCM_RING_LOAD(&ring->tail);
+
+	if (count > PCM_Ring_Size(ring) - (head - tail))
+	{
+		ring->overruns++;
+		return 0;
+	}
+
+	uint32_t index = head & ring->mask;
+	uint32_t first = PCM_Ring_Size(ring) - index;
+
+	if (first > count)
+		first = count;
+
+	memcpy(&ring->buffer[index], data, first * sizeof(uint16_t));
+	memcpy(ring->buffer, &data[first], (count - first) * sizeof(uint16_t));
+
+	PCM_RING_STORE(&ring->head, head + count);
+
+	return count;
+}
+
+/**
+ * return where the producer can write in place, count gets the
+ * contiguous free samples, finish with PCM_Ring_Commit
+ */
+uint16_t *PCM_Ring_Write_Ptr(PCM_Ring_t *ring, uint32_t *count)
+{
+	uint32_t head = ring->head;
+	uint32_t free = PCM_Ring_Size(ring) - (head - PCM_RING_LOAD(&ring->tail));
+	uint32_t index = head & ring->mask;
+
+	*count = PCM_Ring_Size(ring) - index;
+	if (*count > free)
+		*count = free;
+
+	return &ring->buffer[index];
+}
+
+void PCM_Ring_Commit(PCM_Ring_t *ring, uint32_t count)
+{
+	PCM_RING_STORE(&ring->head, ring->head + count);
+}
+
+/** read all count samples or none, return count or 0 on underrun */
+uint32_t PCM_Ring_Read(PCM_Ring_t *ring, uint16_t *data, uint32_t count)
+{
+	uint32_t tail = ring->tail;
+	uint32_t head = PCM_RING_LOAD(&ring->head);
+
+	if (count > head - tail)
+	{
+		ring->underruns++;
+		return 0;
+	}
+
+	uint32_t index = tail & ring->mask;
+	uint32_t first = PCM_Ring_Size(ring) - index;
+
+	if (first > count)
+		first = count;
+
+	memcpy(data, &ring->buffer[index], first * sizeof(uint16_t));
+	memcpy(&data[first], ring->buffer, (count - first) * sizeof(uint16_t));
+
+	PCM_RING_STORE(&ring->tail, tail + count);
+
+	return count;
+}
+
+/**
+ * return where the consumer can read in place, count gets the
+ * contiguous buffered samples, finish with PCM_Ring_Release
+ */
+uint16_t *PCM_Ring_Read_Ptr(PCM_Ring_t *ring, uint32_t *count)
+{
+	return PCM_Ring_Peek(ring, 0, count);
+}
+
+/**
+ * as PCM_Ring_Read_Ptr, offset samples past the read position, lets the
+ * consumer hold several blocks in place before releasing the first
+ */
+uint16_t *PCM_Ring_Peek(PCM_Ring_t *ring, uint32_t offset, uint32_t *count)
+{
+	uint32_t tail = ring->tail + offset;
+	uint32_t head = PCM_RING_LOAD(&ring->head);
+	uint32_t used = (head - ring->tail > offset) ? head - tail : 0;
+	uint32_t index = tail & ring->mask;
+
+	*count = PCM_Ring_Size(ring) - index;
+	if (*count > used)
+		*count = used;
+
+	return &ring->buffer[index];
+}
+
+void PCM_Ring_Release(PCM_Ring_t *ring, uint32_t count)
+{
+	PCM_RING_STORE(&ring->tail, ring->tail + count);
+}
@@ -59,7 +59,8 @@ extern "C" {
 #endif /* AUDIO_FS_BINTERVAL */
 
 #define AUDIO_OUT_EP                                  0x01U
-#define USB_AUDIO_CONFIG_DESC_SIZ                     0x6DU
+#define AUDIO_FB_EP                                   0x81U
+#define USB_AUDIO_CONFIG_DESC_SIZ                     0x76U
 #define AUDIO_INTERFACE_DESC_SIZE                     0x09U
 #define USB_AUDIO_DESC_SIZ                            0x09U
 #define AUDIO_STANDARD_ENDPOINT_DESC_SIZE             0x09U
@@ -104,6 +105,12 @@ extern "C" {
 
 
 #define AUDIO_OUT_PACKET                              (uint16_t)(((USBD_AUDIO_FREQ * 2U * 2U) / 1000U))
+/* The host may send one stereo sample more than nominal when following the feedback */
+#define AUDIO_OUT_MAX_PACKET                          (uint16_t)(AUDIO_OUT_PACKET + 4U)
+
+/* Feedback endpoint, 10.14 samples per frame, refreshed every 2^AUDIO_FB_REFRESH ms */
+#define AUDIO_FB_PACKET                               3U
+#define AUDIO_FB_REFRESH                              0x05U
 #define AUDIO_DEFAULT_VOLUME                          70U
 
 /* Number of sub-packets in the audio transfer buffer. You can modify this value but always make sure
@@ -154,6 +161,8 @@ typedef struct
   uint16_t rd_ptr;
   uint16_t wr_ptr;
   USBD_AUDIO_ControlTypeDef control;
+  uint8_t fb_busy;
+  uint8_t fb_data[4];
 } USBD_AUDIO_HandleTypeDef;
 
 
@@ -166,6 +175,7 @@ typedef struct
   int8_t (*MuteCtl)(uint8_t cmd);
   int8_t (*PeriodicTC)(uint8_t *pbuf, uint32_t size, uint8_t cmd);
   int8_t (*GetState)(void);
+  uint32_t (*GetFeedback)(void);
 } USBD_AUDIO_ItfTypeDef;
 /**
   * @}
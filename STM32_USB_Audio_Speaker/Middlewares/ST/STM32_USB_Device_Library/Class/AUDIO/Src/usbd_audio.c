@@ -17,12 +17,14 @@
   *             - Standard AC Interface Descriptor management
   *             - 1 Audio Streaming Interface (with single channel, PCM, Stereo mode)
   *             - 1 Audio Streaming Endpoint
+  *             - 1 Explicit Feedback Endpoint (10.14 format)
   *             - 1 Audio Terminal Input (1 channel)
   *             - Audio Class-Specific AC Interfaces
   *             - Audio Class-Specific AS Interfaces
   *             - AudioControl Requests: only SET_CUR and GET_CUR requests are supported (for Mute)
   *             - Audio Feature Unit (limited to Mute control)
-  *             - Audio Synchronization type: Asynchronous
+  *             - Audio Synchronization type: Asynchronous, the host paces its packets
+  *               with the feedback value reported by the interface GetFeedback
   *             - Single fixed audio sampling rate (configurable in usbd_conf.h file)
   *          The current audio class version supports the following audio features:
   *             - Pulse Coded Modulation (PCM) format
@@ -159,7 +161,7 @@ __ALIGN_BEGIN static uint8_t USBD_AUDIO_CfgDesc[USB_AUDIO_CONFIG_DESC_SIZ] __ALI
   /* Configuration 1 */
   0x09,                                 /* bLength */
   USB_DESC_TYPE_CONFIGURATION,          /* bDescriptorType */
-  LOBYTE(USB_AUDIO_CONFIG_DESC_SIZ),    /* wTotalLength  109 bytes*/
+  LOBYTE(USB_AUDIO_CONFIG_DESC_SIZ),    /* wTotalLength  118 bytes*/
   HIBYTE(USB_AUDIO_CONFIG_DESC_SIZ),
   0x02,                                 /* bNumInterfaces */
   0x01,                                 /* bConfigurationValue */
@@ -250,7 +252,7 @@ __ALIGN_BEGIN static uint8_t USBD_AUDIO_CfgDesc[USB_AUDIO_CONFIG_DESC_SIZ] __ALI
   USB_DESC_TYPE_INTERFACE,              /* bDescriptorType */
   0x01,                                 /* bInterfaceNumber */
   0x01,                                 /* bAlternateSetting */
-  0x01,                                 /* bNumEndpoints */
+  0x02,                                 /* bNumEndpoints */
   USB_DEVICE_CLASS_AUDIO,               /* bInterfaceClass */
   AUDIO_SUBCLASS_AUDIOSTREAMING,        /* bInterfaceSubClass */
   AUDIO_PROTOCOL_UNDEFINED,             /* bInterfaceProtocol */
@@ -283,11 +285,12 @@ __ALIGN_BEGIN static uint8_t USBD_AUDIO_CfgDesc[USB_AUDIO_CONFIG_DESC_SIZ] __ALI
   AUDIO_STANDARD_ENDPOINT_DESC_SIZE,    /* bLength */
   USB_DESC_TYPE_ENDPOINT,               /* bDescriptorType */
   AUDIO_OUT_EP,                         /* bEndpointAddress 1 out endpoint */
-  USBD_EP_TYPE_ISOC,                    /* bmAttributes */
-  AUDIO_PACKET_SZE(USBD_AUDIO_FREQ),    /* wMaxPacketSize in Bytes (Freq(Samples)*2(Stereo)*2(HalfWord)) */
+  0x05,                                 /* bmAttributes isochronous, asynchronous */
+  LOBYTE(AUDIO_OUT_MAX_PACKET),         /* wMaxPacketSize in Bytes ((Freq(Samples)+1)*2(Stereo)*2(HalfWord)) */
+  HIBYTE(AUDIO_OUT_MAX_PACKET),
   AUDIO_FS_BINTERVAL,                   /* bInterval */
   0x00,                                 /* bRefresh */
-  0x00,                                 /* bSynchAddress */
+  AUDIO_FB_EP,                          /* bSynchAddress */
   /* 09 byte*/
 
   /* Endpoint - Audio Streaming Descriptor*/
@@ -299,6 +302,18 @@ __ALIGN_BEGIN static uint8_t USBD_AUDIO_CfgDesc[USB_AUDIO_CONFIG_DESC_SIZ] __ALI
   0x00,                                 /* wLockDelay */
   0x00,
   /* 07 byte*/
+
+  /* Endpoint 1 - Feedback Standard Descriptor */
+  AUDIO_STANDARD_ENDPOINT_DESC_SIZE,    /* bLength */
+  USB_DESC_TYPE_ENDPOINT,               /* bDescriptorType */
+  AUDIO_FB_EP,                          /* bEndpointAddress 1 in endpoint */
+  0x11,                                 /* bmAttributes isochronous, feedback */
+  AUDIO_FB_PACKET,                      /* wMaxPacketSize 10.14 value on 3 bytes */
+  0x00,
+  AUDIO_FS_BINTERVAL,                   /* bInterval */
+  AUDIO_FB_REFRESH,                     /* bRefresh */
+  0x00,                                 /* bSynchAddress */
+  /* 09 byte*/
 } ;
 
 /* USB Standard Device Descriptor */
@@ -350,17 +365,24 @@ static uint8_t USBD_AUDIO_Init(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
   if (pdev->dev_speed == USBD_SPEED_HIGH)
   {
     pdev->ep_out[AUDIO_OUT_EP & 0xFU].bInterval = AUDIO_HS_BINTERVAL;
+    pdev->ep_in[AUDIO_FB_EP & 0xFU].bInterval = AUDIO_HS_BINTERVAL;
   }
   else   /* LOW and FULL-speed endpoints */
   {
     pdev->ep_out[AUDIO_OUT_EP & 0xFU].bInterval = AUDIO_FS_BINTERVAL;
+    pdev->ep_in[AUDIO_FB_EP & 0xFU].bInterval = AUDIO_FS_BINTERVAL;
   }
 
   /* Open EP OUT */
-  (void)USBD_LL_OpenEP(pdev, AUDIO_OUT_EP, USBD_EP_TYPE_ISOC, AUDIO_OUT_PACKET);
+  (void)USBD_LL_OpenEP(pdev, AUDIO_OUT_EP, USBD_EP_TYPE_ISOC, AUDIO_OUT_MAX_PACKET);
   pdev->ep_out[AUDIO_OUT_EP & 0xFU].is_used = 1U;
 
+  /* Open feedback EP IN */
+  (void)USBD_LL_OpenEP(pdev, AUDIO_FB_EP, USBD_EP_TYPE_ISOC, AUDIO_FB_PACKET);
+  pdev->ep_in[AUDIO_FB_EP & 0xFU].is_used = 1U;
+
   haudio->alt_setting = 0U;
+  haudio->fb_busy = 0U;
   haudio->offset = AUDIO_OFFSET_UNKNOWN;
   haudio->wr_ptr = 0U;
   haudio->rd_ptr = 0U;
@@ -376,8 +398,8 @@ static uint8_t USBD_AUDIO_Init(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
 
   /* Prepare Out endpoint to receive 1st packet */
   (void)USBD_LL_PrepareReceive(pdev, AUDIO_OUT_EP,
-		  	  	  	  	  	  (uint8_t*)PCM_Pool_Next_Empty(),
-                               AUDIO_OUT_PACKET);
+                               (uint8_t*)PCM_Pool_Rx_Buffer(),
+                               AUDIO_OUT_MAX_PACKET);
 
   return (uint8_t)USBD_OK;
 }
@@ -398,6 +420,11 @@ static uint8_t USBD_AUDIO_DeInit(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
   pdev->ep_out[AUDIO_OUT_EP & 0xFU].is_used = 0U;
   pdev->ep_out[AUDIO_OUT_EP & 0xFU].bInterval = 0U;
 
+  /* Close feedback EP IN */
+  (void)USBD_LL_CloseEP(pdev, AUDIO_FB_EP);
+  pdev->ep_in[AUDIO_FB_EP & 0xFU].is_used = 0U;
+  pdev->ep_in[AUDIO_FB_EP & 0xFU].bInterval = 0U;
+
   /* DeInit  physical Interface components */
   if (pdev->pClassData != NULL)
   {
@@ -490,6 +517,10 @@ static uint8_t USBD_AUDIO_Setup(USBD_HandleTypeDef *pdev,
         if ((uint8_t)(req->wValue) <= USBD_MAX_NUM_INTERFACES)
         {
           haudio->alt_setting = (uint8_t)(req->wValue);
+
+          /* Drop a feedback value queued for the previous setting */
+          (void)USBD_LL_FlushEP(pdev, AUDIO_FB_EP);
+          haudio->fb_busy = 0U;
         }
         else
         {
@@ -547,10 +578,15 @@ static uint8_t *USBD_AUDIO_GetCfgDesc(uint16_t *length)
   */
 static uint8_t USBD_AUDIO_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum)
 {
-  UNUSED(pdev);
-  UNUSED(epnum);
+  USBD_AUDIO_HandleTypeDef *haudio;
+  haudio = (USBD_AUDIO_HandleTypeDef *)pdev->pClassData;
+
+  /* Feedback value sent, the next one goes out on the next SOF */
+  if ((epnum == (AUDIO_FB_EP & 0x7FU)) && (haudio != NULL))
+  {
+    haudio->fb_busy = 0U;
+  }
 
-  /* Only OUT data are processed */
   return (uint8_t)USBD_OK;
 }
 
@@ -600,7 +636,28 @@ static uint8_t USBD_AUDIO_EP0_TxReady(USBD_HandleTypeDef *pdev)
   */
 static uint8_t USBD_AUDIO_SOF(USBD_HandleTypeDef *pdev)
 {
-  UNUSED(pdev);
+  USBD_AUDIO_HandleTypeDef *haudio;
+  uint32_t feedback;
+
+  haudio = (USBD_AUDIO_HandleTypeDef *)pdev->pClassData;
+
+  if ((haudio == NULL) || (((USBD_AUDIO_ItfTypeDef *)pdev->pUserData)->GetFeedback == NULL))
+  {
+    return (uint8_t)USBD_OK;
+  }
+
+  /* The rate is measured against every SOF, also while the host is not streaming */
+  feedback = ((USBD_AUDIO_ItfTypeDef *)pdev->pUserData)->GetFeedback();
+
+  if ((haudio->alt_setting == 1U) && (haudio->fb_busy == 0U))
+  {
+    haudio->fb_data[0] = (uint8_t)feedback;
+    haudio->fb_data[1] = (uint8_t)(feedback >> 8);
+    haudio->fb_data[2] = (uint8_t)(feedback >> 16);
+    haudio->fb_busy = 1U;
+
+    (void)USBD_LL_Transmit(pdev, AUDIO_FB_EP, haudio->fb_data, AUDIO_FB_PACKET);
+  }
 
   return (uint8_t)USBD_OK;
 }
@@ -616,6 +673,8 @@ void USBD_AUDIO_Sync(USBD_HandleTypeDef *pdev, AUDIO_OffsetTypeDef offset)
   USBD_AUDIO_HandleTypeDef *haudio;
   uint32_t BufferSize = AUDIO_TOTAL_BUF_SIZE / 2U;
 
+  /* Clock drift is handled by the feedback endpoint, the buffer size stays fixed */
+
   if (pdev->pClassData == NULL)
   {
     return;
@@ -636,35 +695,6 @@ void USBD_AUDIO_Sync(USBD_HandleTypeDef *pdev, AUDIO_OffsetTypeDef offset)
     }
   }
 
-  if (haudio->rd_ptr > haudio->wr_ptr)
-  {
-    if ((haudio->rd_ptr - haudio->wr_ptr) < AUDIO_OUT_PACKET)
-    {
-      BufferSize += 4U;
-    }
-    else
-    {
-      if ((haudio->rd_ptr - haudio->wr_ptr) > (AUDIO_TOTAL_BUF_SIZE - AUDIO_OUT_PACKET))
-      {
-        BufferSize -= 4U;
-      }
-    }
-  }
-  else
-  {
-    if ((haudio->wr_ptr - haudio->rd_ptr) < AUDIO_OUT_PACKET)
-    {
-       BufferSize -= 4U;
-    }
-    else
-    {
-      if ((haudio->wr_ptr - haudio->rd_ptr) > (AUDIO_TOTAL_BUF_SIZE - AUDIO_OUT_PACKET))
-      {
-         BufferSize += 4U;
-      }
-    }
-  }
-
   if (haudio->offset == AUDIO_OFFSET_FULL)
   {
     ((USBD_AUDIO_ItfTypeDef *)pdev->pUserData)->AudioCmd(&haudio->buffer[0],
@@ -682,8 +712,16 @@ void USBD_AUDIO_Sync(USBD_HandleTypeDef *pdev, AUDIO_OffsetTypeDef offset)
   */
 static uint8_t USBD_AUDIO_IsoINIncomplete(USBD_HandleTypeDef *pdev, uint8_t epnum)
 {
-  UNUSED(pdev);
   UNUSED(epnum);
+  USBD_AUDIO_HandleTypeDef *haudio;
+  haudio = (USBD_AUDIO_HandleTypeDef *)pdev->pClassData;
+
+  /* Host did not poll the feedback endpoint in this frame, send a fresh value on the next SOF */
+  if (haudio != NULL)
+  {
+    (void)USBD_LL_FlushEP(pdev, AUDIO_FB_EP);
+    haudio->fb_busy = 0U;
+  }
 
   return (uint8_t)USBD_OK;
 }
@@ -712,10 +750,13 @@ static uint8_t USBD_AUDIO_DataOut(USBD_HandleTypeDef *pdev, uint8_t epnum)
 {
   if (epnum == AUDIO_OUT_EP)
   {
+    /* Packet length follows the feedback, one sample more or less than nominal */
+    PCM_Pool_Received((uint16_t)(USBD_LL_GetRxDataSize(pdev, epnum) / 2U));
+
     /* Prepare Out endpoint to receive next audio packet */
     (void)USBD_LL_PrepareReceive(pdev, AUDIO_OUT_EP,
-                                 (uint8_t*)PCM_Pool_Next_Empty(),
-                                 AUDIO_OUT_PACKET);
+                                 (uint8_t*)PCM_Pool_Rx_Buffer(),
+                                 AUDIO_OUT_MAX_PACKET);
   }
 
   return (uint8_t)USBD_OK;
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <math.h>
+
+#include "asrc.h"
+
+/**
+ * host test, the fixed point asrc against a double precision sine
+ * resampled at the same ratio, and the fill level loop against a
+ * producer running off the consumer clock
+ */
+
+#define TEST_RATE                      48000
+#define TEST_FRAMES                    TEST_RATE
+
+/** worst THD+N accepted, the 16 tap design measures around -78 dB */
+#define TEST_THDN_MAX_DB               (-70.0)
+
+static int16_t Test_In[2 * TEST_FRAMES];
+static int16_t Test_Out[2 * TEST_FRAMES + 64];
+
+static int Test_Failed;
+
+static void Test_Check(int ok, const char *what)
+{
+	printf("%s %s\n", ok ? "pass" : "FAIL", what);
+	if (!ok)
+		Test_Failed = 1;
+}
+
+/**
+ * least squares fit of a sine at w to the output, return THD+N in dB,
+ * everything but the fitted sine is distortion and noise
+ */
+static double Test_Thdn(const int16_t *out, uint32_t frames, uint8_t channel, double w)
+{
+	uint32_t n0 = ASRC_TAPS * 4;
+	uint32_t n1 = frames - ASRC_TAPS * 4;
+	double s = 0, c = 0, err = 0, pow = 0;
+
+	for (uint32_t i = n0; i < n1; i++)
+	{
+		s += out[2 * i + channel] * sin(w * i);
+		c += out[2 * i + channel] * cos(w * i);
+	}
+
+	s *= 2.0 / (n1 - n0);
+	c *= 2.0 / (n1 - n0);
+
+	for (uint32_t i = n0; i < n1; i++)
+	{
+		double ref = s * sin(w * i) + c * cos(w * i);
+		double d = out[2 * i + channel] - ref;
+
+		err += d * d;
+		pow += ref * ref;
+	}
+
+	return 10.0 * log10(err / pow);
+}
+
+/** fixed ratio, a 1 kHz tone comes out at 1 kHz * ratio with the input level */
+static void Test_Fixed_Ratio(int32_t ppm)
+{
+	ASRC_t asrc;
+	double ratio = 1.0 + ppm / 1e6;
+	double w = 2.0 * M_PI * 1000.0 / TEST_RATE;
+	char what[80];
+
+	for (uint32_t i = 0; i < TEST_FRAMES; i++)
+	{
+		Test_In[2 * i] = (int16_t)lrint(16000.0 * sin(w * i));
+		Test_In[2 * i + 1] = (int16_t)lrint(-8000.0 * sin(w * i));
+	}
+
+	ASRC_Init(&asrc, 2);
+	ASRC_Set_Ratio(&asrc, ASRC_UNITY + (int64_t)ASRC_UNITY * ppm / 1000000);
+
+	uint32_t in_frames = TEST_FRAMES;
+	uint32_t made = ASRC_Process(&asrc, Test_In, &in_frames, Test_Out, TEST_FRAMES);
+	double expect = in_frames / ratio;
+
+	snprintf(what, sizeof(what), "%+d ppm: %u in, %u out", (int)ppm, in_frames, made);
+	/** whichever side runs out first, the other matches the ratio */
+	Test_Check(fabs(made - expect) < 2.0, what);
+
+	for (uint8_t c = 0; c < 2; c++)
+	{
+		double thdn = Test_Thdn(Test_Out, made, c, w * ratio);
+
+		snprintf(what, sizeof(what), "%+d ppm: channel %u THD+N %.1f dB", (int)ppm, c, thdn);
+		Test_Check(thdn < TEST_THDN_MAX_DB, what);
+	}
+}
+
+/**
+ * producer 300 ppm fast against the consumer, ASRC_Track must hold the
+ * input ring at the target without overruns or underruns
+ */
+static void Test_Track()
+{
+	static uint16_t in_buffer[1024];
+	static uint16_t out_buffer[256];
+	static uint16_t block[2 * 64];
+	PCM_Ring_t in, out;
+	ASRC_t asrc;
+	double produced = 0;
+	uint32_t target = 192;
+	uint32_t level = 0;
+	uint32_t overruns = 0;
+	uint32_t underruns = 0;
+	char what[80];
+
+	PCM_Ring_Init(&in, in_buffer, 1024);
+	PCM_Ring_Init(&out, out_buffer, 256);
+	ASRC_Init(&asrc, 2);
+
+	/** one 64 frame period per step, 10 minutes of audio */
+	for (uint32_t step = 0; step < 10 * 60 * TEST_RATE / 64; step++)
+	{
+		produced += 64 * 1.0003;
+		while (produced >= 48)
+		{
+			PCM_Ring_Write(&in, block, 2 * 48);
+			produced -= 48;
+		}
+
+		level = PCM_Ring_Count(&in) / 2;
+		ASRC_Track(&asrc, level, target);
+		ASRC_Ring(&asrc, &in, &out, PCM_Ring_Free(&out) / 2);
+
+		PCM_Ring_Read(&out, block, 2 * 64);
+
+		/** rings fill up during the first second */
+		if (step == TEST_RATE / 64)
+		{
+			overruns = in.overruns;
+			underruns = out.underruns;
+		}
+	}
+
+	overruns = in.overruns - overruns;
+	underruns = out.underruns - underruns;
+
+	snprintf(what, sizeof(what), "track +300 ppm: level %u target %u, %u overruns %u underruns",
+			level, target, overruns, underruns);
+	Test_Check(!overruns && !underruns && level > target - 96 && level < target + 96, what);
+}
+
+int main()
+{
+	Test_Fixed_Ratio(0);
+	Test_Fixed_Ratio(500);
+	Test_Fixed_Ratio(-500);
+	Test_Track();
+
+	return Test_Failed;
+}
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "pcm_ring.h"
+
+/**
+ * host test, one thread writes a running counter through every producer
+ * call, another reads it back through every consumer call, any lost,
+ * repeated or torn sample breaks the sequence
+ */
+
+#define TEST_RING_SIZE                 256
+#define TEST_SAMPLES                   4000000u
+
+static uint16_t Test_Buffer[TEST_RING_SIZE];
+static PCM_Ring_t Test_Ring;
+
+static uint32_t Test_Errors;
+
+/** xorshift, each thread its own state */
+static uint32_t Test_Random(uint32_t *state)
+{
+	*state ^= *state << 13;
+	*state ^= *state >> 17;
+	*state ^= *state << 5;
+	return *state;
+}
+
+static void *Test_Producer(void *arg)
+{
+	uint16_t block[64];
+	uint32_t seed = 1;
+	uint32_t next = 0;
+
+	(void)arg;
+
+	while (next < TEST_SAMPLES)
+	{
+		uint32_t count = 1 + Test_Random(&seed) % 64;
+
+		if (Test_Random(&seed) & 1)
+		{
+			for (uint32_t i = 0; i < count; i++)
+				block[i] = (uint16_t)(next + i);
+
+			uint32_t written = PCM_Ring_Write(&Test_Ring, block, count);
+
+			/** full, let the consumer run on a single core host */
+			if (!written)
+				sched_yield();
+
+			next += written;
+		}
+		else
+		{
+			uint32_t free;
+			uint16_t *dst = PCM_Ring_Write_Ptr(&Test_Ring, &free);
+
+			if (count > free)
+				count = free;
+			if (!count)
+				sched_yield();
+
+			for (uint32_t i = 0; i < count; i++)
+				dst[i] = (uint16_t)(next + i);
+
+			PCM_Ring_Commit(&Test_Ring, count);
+			next += count;
+		}
+	}
+
+	return NULL;
+}
+
+static void *Test_Consumer(void *arg)
+{
+	uint16_t block[64];
+	uint32_t seed = 2;
+	uint32_t next = 0;
+
+	(void)arg;
+
+	while (next < TEST_SAMPLES)
+	{
+		uint32_t count = 1 + Test_Random(&seed) % 64;
+		uint32_t mode = Test_Random(&seed) % 3;
+
+		if (mode == 0)
+		{
+			if (!PCM_Ring_Read(&Test_Ring, block, count))
+			{
+				/** empty, let the producer run on a single core host */
+				sched_yield();
+				continue;
+			}
+
+			for (uint32_t i = 0; i < count; i++)
+				if (block[i] != (uint16_t)(next + i))
+					Test_Errors++;
+		}
+		else
+		{
+			/** peek past a held block, as the i2s dma does with its two targets */
+			uint32_t offset = (mode == 2) ? count / 2 : 0;
+			uint32_t used;
+			uint16_t *src = PCM_Ring_Peek(&Test_Ring, offset, &used);
+
+			if (used > count - offset)
+				used = count - offset;
+
+			for (uint32_t i = 0; i < used; i++)
+				if (src[i] != (uint16_t)(next + offset + i))
+					Test_Errors++;
+
+			if (!used)
+			{
+				sched_yield();
+				continue;
+			}
+
+			/** the held samples before offset, one at a time as they may wrap */
+			for (uint32_t i = 0; i < offset; i++)
+			{
+				uint32_t one;
+
+				if (*PCM_Ring_Peek(&Test_Ring, i, &one) != (uint16_t)(next + i) || !one)
+					Test_Errors++;
+			}
+
+			count = offset + used;
+			PCM_Ring_Release(&Test_Ring, count);
+		}
+
+		next += count;
+	}
+
+	return NULL;
+}
+
+int main()
+{
+	pthread_t producer, consumer;
+
+	PCM_Ring_Init(&Test_Ring, Test_Buffer, TEST_RING_SIZE);
+
+	pthread_create(&consumer, NULL, Test_Consumer, NULL);
+	pthread_create(&producer, NULL, Test_Producer, NULL);
+	pthread_join(producer, NULL);
+	pthread_join(consumer, NULL);
+
+	printf("%s spsc %u samples, %u errors, %u overruns %u underruns\n", Test_Errors ? "FAIL" : "pass",
+			TEST_SAMPLES, Test_Errors, Test_Ring.overruns, Test_Ring.underruns);
+
+	return Test_Errors != 0;
+}
@@ -24,6 +24,7 @@
 
 /* USER CODE BEGIN INCLUDE */
 #include "pcm_buffer_pool.h"
+#include "audio_feedback.h"
 #include "cs43l22.h"
 /* USER CODE END INCLUDE */
 
@@ -124,6 +125,7 @@ static int8_t AUDIO_VolumeCtl_FS(uint8_t vol);
 static int8_t AUDIO_MuteCtl_FS(uint8_t cmd);
 static int8_t AUDIO_PeriodicTC_FS(uint8_t *pbuf, uint32_t size, uint8_t cmd);
 static int8_t AUDIO_GetState_FS(void);
+static uint32_t AUDIO_GetFeedback_FS(void);
 
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_DECLARATION */
 
@@ -142,6 +144,7 @@ USBD_AUDIO_ItfTypeDef USBD_AUDIO_fops_FS =
   AUDIO_MuteCtl_FS,
   AUDIO_PeriodicTC_FS,
   AUDIO_GetState_FS,
+  AUDIO_GetFeedback_FS,
 };
 
 /* Private functions ---------------------------------------------------------*/
@@ -155,7 +158,7 @@ USBD_AUDIO_ItfTypeDef USBD_AUDIO_fops_FS =
 static int8_t AUDIO_Init_FS(uint32_t AudioFreq, uint32_t Volume, uint32_t options)
 {
   /* USER CODE BEGIN 0 */
-  UNUSED(AudioFreq);
+  Audio_Feedback_Init(AudioFreq);
   UNUSED(Volume);
   UNUSED(options);
   return (USBD_OK);
@@ -254,6 +257,17 @@ static int8_t AUDIO_GetState_FS(void)
   /* USER CODE END 6 */
 }
 
+/**
+  * @brief  Gets the feedback value, called on every SOF.
+  * @retval Samples per frame the host should send, 10.14 format
+  */
+static uint32_t AUDIO_GetFeedback_FS(void)
+{
+  /* USER CODE BEGIN 9 */
+  return Audio_Feedback_SOF(PCM_Pool_Level_Error());
+  /* USER CODE END 9 */
+}
+
 /**
   * @brief  Manages the DMA full transfer complete event.
   * @retval None
@@ -25,6 +25,7 @@
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
 #include "usbd_cdc_if.h"
+#include "usbd_storage_if.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -47,6 +48,7 @@
 
 uint8_t CDC_RX_Buffer[32];
 volatile uint8_t CDC_RX_Count;
+uint32_t CDC_Last_Tick;
 
 /* USER CODE END PV */
 
@@ -111,6 +113,15 @@ int main(void)
   {
     /* USER CODE END WHILE */
 
+  /** msc storage access must not wait behind the cdc delay */
+  STORAGE_Process_FS();
+
+  if(HAL_GetTick() - CDC_Last_Tick < 1000)
+  {
+	  continue;
+  }
+  CDC_Last_Tick = HAL_GetTick();
+
   /** echo cdc */
   if(CDC_RX_Count)
   {
@@ -122,8 +133,6 @@ int main(void)
 	  CDC_Transmit_FS((uint8_t*)"STM32 USB Composite MSC+CDC\n", 28);
   }
 
-  HAL_Delay(1000);
-
     /* USER CODE BEGIN 3 */
   }
   /* USER CODE END 3 */
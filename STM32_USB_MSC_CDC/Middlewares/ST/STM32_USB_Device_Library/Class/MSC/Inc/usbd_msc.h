@@ -48,6 +48,12 @@ extern "C" {
 #define MSC_MEDIA_PACKET             512U
 #endif /* MSC_MEDIA_PACKET */
 
+/* Largest transfer queued at once when the storage lends its own memory,
+   kept below the 1023 packet limit of the OTG endpoint */
+#ifndef MSC_DIRECT_PACKET
+#define MSC_DIRECT_PACKET            0x4000U
+#endif /* MSC_DIRECT_PACKET */
+
 #define MSC_MAX_FS_PACKET            0x40U
 #define MSC_MAX_HS_PACKET            0x200U
 
@@ -74,6 +80,7 @@ typedef struct _USBD_STORAGE
   int8_t (* IsWriteProtected)(uint8_t lun);
   int8_t (* Read)(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
   int8_t (* Write)(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
+  int8_t (* GetBuffer)(uint8_t lun, uint8_t **buf, uint32_t blk_addr, uint16_t blk_len);
   int8_t (* GetMaxLun)(void);
   int8_t *pInquiry;
 
@@ -87,7 +94,8 @@ typedef struct
   uint8_t                  bot_state;
   uint8_t                  bot_status;
   uint32_t                 bot_data_length;
-  uint8_t                  bot_data[MSC_MEDIA_PACKET];
+  uint8_t                  *bot_data;
+  uint8_t                  bot_buffer[2][MSC_MEDIA_PACKET];
   USBD_MSC_BOT_CBWTypeDef  cbw;
   USBD_MSC_BOT_CSWTypeDef  csw;
 
@@ -101,6 +109,18 @@ typedef struct
 
   uint32_t                 scsi_blk_addr;
   uint32_t                 scsi_blk_len;
+
+  /* second half of the ping-pong buffer, accessed by MSC_BOT_Process */
+  uint8_t                  *bot_next;
+  volatile uint8_t         bot_next_state;
+  uint8_t                  bot_next_stalled;
+  uint32_t                 bot_next_addr;
+  uint32_t                 bot_next_len;
+  uint8_t                  bot_next_rearm;   /* CBW receive held back until storage returns */
+  uint8_t                  bot_next_free;    /* handle freed by MSC_BOT_Process, set by DeInit */
+
+  /* bytes being received straight into the medium, 0 when bot_data is used */
+  uint32_t                 bot_direct_len;
 }
 USBD_MSC_BOT_HandleTypeDef;
 
@@ -48,6 +48,15 @@ extern "C" {
 #define USBD_BOT_SEND_DATA                 4U       /* Send Immediate data */
 #define USBD_BOT_NO_DATA                   5U       /* No data Stage */
 
+/* Ping-pong buffer states */
+#define USBD_BOT_NEXT_NONE                 0U       /* bot_next is free */
+#define USBD_BOT_NEXT_READ                 1U       /* bot_next to be read from storage */
+#define USBD_BOT_NEXT_WRITE                2U       /* bot_next to be written to storage */
+#define USBD_BOT_NEXT_BUSY                 3U       /* Storage access ongoing */
+#define USBD_BOT_NEXT_READY                4U       /* bot_next holds read data */
+#define USBD_BOT_NEXT_ERROR                5U       /* Storage read failed */
+#define USBD_BOT_NEXT_CANCELLED            6U       /* Storage access ongoing, result dropped */
+
 #define USBD_BOT_CBW_SIGNATURE             0x43425355U
 #define USBD_BOT_CSW_SIGNATURE             0x53425355U
 #define USBD_BOT_CBW_LENGTH                31U
@@ -130,6 +139,9 @@ void MSC_BOT_SendCSW(USBD_HandleTypeDef  *pdev,
 
 void  MSC_BOT_CplClrFeature(USBD_HandleTypeDef  *pdev,
                             uint8_t epnum);
+
+void MSC_BOT_Process(USBD_HandleTypeDef  *pdev);
+uint8_t MSC_BOT_CancelNext(USBD_HandleTypeDef  *pdev);
 /**
   * @}
   */
@@ -156,6 +156,7 @@ typedef struct _SENSE_ITEM
   * @{
   */
 int8_t SCSI_ProcessCmd(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *cmd);
+void SCSI_ProcessNextCplt(USBD_HandleTypeDef *pdev, uint8_t lun, int8_t status);
 
 void SCSI_SenseCode(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t sKey,
                     uint8_t ASC);
@@ -335,10 +335,18 @@ uint8_t USBD_MSC_DeInit(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
   /* De-Init the BOT layer */
   MSC_BOT_DeInit(pdev);
 
-  /* Free MSC Class Resources */
+  /* Free MSC Class Resources, left to MSC_BOT_Process while it is
+     inside storage with this handle */
   if (pdev->pClassDataMSC != NULL)
   {
-    (void)USBD_free(pdev->pClassDataMSC);
+    if (MSC_BOT_CancelNext(pdev) != 0U)
+    {
+      ((USBD_MSC_BOT_HandleTypeDef *)pdev->pClassDataMSC)->bot_next_free = 1U;
+    }
+    else
+    {
+      (void)USBD_free(pdev->pClassDataMSC);
+    }
     pdev->pClassDataMSC = NULL;
   }
 
@@ -97,6 +97,8 @@ static int8_t SCSI_CheckAddressRange(USBD_HandleTypeDef *pdev, uint8_t lun,
 
 static int8_t SCSI_ProcessRead(USBD_HandleTypeDef *pdev, uint8_t lun);
 static int8_t SCSI_ProcessWrite(USBD_HandleTypeDef *pdev, uint8_t lun);
+static uint8_t *SCSI_GetDirectBuffer(USBD_HandleTypeDef *pdev, uint8_t lun, uint32_t *len);
+static void SCSI_PrepareWrite(USBD_HandleTypeDef *pdev, uint8_t lun);
 
 static int8_t SCSI_UpdateBotData(USBD_MSC_BOT_HandleTypeDef *hmsc,
                                  uint8_t *pBuff, uint16_t length);
@@ -434,7 +436,6 @@ static int8_t SCSI_ReadFormatCapacity(USBD_HandleTypeDef *pdev, uint8_t lun, uin
 */
 static int8_t SCSI_ModeSense6(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params)
 {
-  UNUSED(lun);
   USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassDataMSC;
   uint16_t len = MODE_SENSE6_LEN;
 
@@ -445,6 +446,12 @@ static int8_t SCSI_ModeSense6(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *pa
 
   (void)SCSI_UpdateBotData(hmsc, MSC_Mode_Sense6_data, len);
 
+  /* WP : write protected, per LUN */
+  if (((USBD_StorageTypeDef *)pdev->pUserDataMSC)->IsWriteProtected(lun) != 0)
+  {
+    hmsc->bot_data[2] |= 0x80U;
+  }
+
   return 0;
 }
 
@@ -458,7 +465,6 @@ static int8_t SCSI_ModeSense6(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *pa
 */
 static int8_t SCSI_ModeSense10(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params)
 {
-  UNUSED(lun);
   USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassDataMSC;
   uint16_t len = MODE_SENSE10_LEN;
 
@@ -469,6 +475,12 @@ static int8_t SCSI_ModeSense10(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *p
 
   (void)SCSI_UpdateBotData(hmsc, MSC_Mode_Sense10_data, len);
 
+  /* WP : write protected, per LUN */
+  if (((USBD_StorageTypeDef *)pdev->pUserDataMSC)->IsWriteProtected(lun) != 0)
+  {
+    hmsc->bot_data[3] |= 0x80U;
+  }
+
   return 0;
 }
 
@@ -672,6 +684,7 @@ static int8_t SCSI_Read10(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params
     }
 
     hmsc->bot_state = USBD_BOT_DATA_IN;
+    (void)MSC_BOT_CancelNext(pdev);
   }
   hmsc->bot_data_length = MSC_MEDIA_PACKET;
 
@@ -735,6 +748,7 @@ static int8_t SCSI_Read12(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params
     }
 
     hmsc->bot_state = USBD_BOT_DATA_IN;
+    (void)MSC_BOT_CancelNext(pdev);
   }
   hmsc->bot_data_length = MSC_MEDIA_PACKET;
 
@@ -807,11 +821,10 @@ static int8_t SCSI_Write10(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *param
       return -1;
     }
 
-    len = MIN(len, MSC_MEDIA_PACKET);
-
     /* Prepare EP to receive first data packet */
     hmsc->bot_state = USBD_BOT_DATA_OUT;
-    (void)USBD_LL_PrepareReceive(pdev, MSC_EPOUT_ADDR, hmsc->bot_data, len);
+    (void)MSC_BOT_CancelNext(pdev);
+    SCSI_PrepareWrite(pdev, lun);
   }
   else /* Write Process ongoing */
   {
@@ -891,11 +904,10 @@ static int8_t SCSI_Write12(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *param
       return -1;
     }
 
-    len = MIN(len, MSC_MEDIA_PACKET);
-
     /* Prepare EP to receive first data packet */
     hmsc->bot_state = USBD_BOT_DATA_OUT;
-    (void)USBD_LL_PrepareReceive(pdev, MSC_EPOUT_ADDR, hmsc->bot_data, len);
+    (void)MSC_BOT_CancelNext(pdev);
+    SCSI_PrepareWrite(pdev, lun);
   }
   else /* Write Process ongoing */
   {
@@ -935,7 +947,8 @@ static int8_t SCSI_Verify10(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *para
 
 /**
 * @brief  SCSI_CheckAddressRange
-*         Check address range
+*         Check address range against the capacity of this LUN, each
+*         LUN may have its own block count and size
 * @param  lun: Logical unit number
 * @param  blk_offset: first block address
 * @param  blk_nbr: number of block to be processed
@@ -946,7 +959,14 @@ static int8_t SCSI_CheckAddressRange(USBD_HandleTypeDef *pdev, uint8_t lun,
 {
   USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassDataMSC;
 
-  if ((blk_offset + blk_nbr) > hmsc->scsi_blk_nbr)
+  if (((USBD_StorageTypeDef *)pdev->pUserDataMSC)->GetCapacity(lun, &hmsc->scsi_blk_nbr,
+                                                  &hmsc->scsi_blk_size) != 0)
+  {
+    SCSI_SenseCode(pdev, lun, NOT_READY, MEDIUM_NOT_PRESENT);
+    return -1;
+  }
+
+  if ((blk_nbr > hmsc->scsi_blk_nbr) || (blk_offset > (hmsc->scsi_blk_nbr - blk_nbr)))
   {
     SCSI_SenseCode(pdev, lun, ILLEGAL_REQUEST, ADDRESS_OUT_OF_RANGE);
     return -1;
@@ -957,7 +977,9 @@ static int8_t SCSI_CheckAddressRange(USBD_HandleTypeDef *pdev, uint8_t lun,
 
 /**
 * @brief  SCSI_ProcessRead
-*         Handle Read Process
+*         Handle Read Process, the next packet is fetched into bot_next
+*         by MSC_BOT_Process while the current one is transmitted, media
+*         lending their memory through GetBuffer are sent from it directly
 * @param  lun: Logical unit number
 * @retval status
 */
@@ -965,18 +987,56 @@ static int8_t SCSI_ProcessRead(USBD_HandleTypeDef *pdev, uint8_t lun)
 {
   USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassDataMSC;
   uint32_t len = hmsc->scsi_blk_len * hmsc->scsi_blk_size;
+  uint8_t *pDirect = NULL;
+  uint8_t *pBuff;
 
-  len = MIN(len, MSC_MEDIA_PACKET);
+  if (hmsc->bot_next_state == USBD_BOT_NEXT_NONE)
+  {
+    pDirect = SCSI_GetDirectBuffer(pdev, lun, &len);
+  }
+
+  if (pDirect == NULL)
+  {
+    len = MIN(len, MSC_MEDIA_PACKET);
+  }
 
-  if (((USBD_StorageTypeDef *)pdev->pUserDataMSC)->Read(lun, hmsc->bot_data,
-                                                     hmsc->scsi_blk_addr,
-                                                     (len / hmsc->scsi_blk_size)) < 0)
+  if (pDirect != NULL) /* Sent straight from the medium */
+  {
+    (void)USBD_LL_Transmit(pdev, MSC_EPIN_ADDR, pDirect, len);
+  }
+  else if (hmsc->bot_next_state == USBD_BOT_NEXT_NONE) /* First packet */
+  {
+    if (((USBD_StorageTypeDef *)pdev->pUserDataMSC)->Read(lun, hmsc->bot_data,
+                                                       hmsc->scsi_blk_addr,
+                                                       (len / hmsc->scsi_blk_size)) < 0)
+    {
+      SCSI_SenseCode(pdev, lun, HARDWARE_ERROR, UNRECOVERED_READ_ERROR);
+      return -1;
+    }
+  }
+  else if (hmsc->bot_next_state == USBD_BOT_NEXT_READY)
   {
+    pBuff = hmsc->bot_data;
+    hmsc->bot_data = hmsc->bot_next;
+    hmsc->bot_next = pBuff;
+    hmsc->bot_next_state = USBD_BOT_NEXT_NONE;
+  }
+  else if (hmsc->bot_next_state == USBD_BOT_NEXT_ERROR)
+  {
+    hmsc->bot_next_state = USBD_BOT_NEXT_NONE;
     SCSI_SenseCode(pdev, lun, HARDWARE_ERROR, UNRECOVERED_READ_ERROR);
     return -1;
   }
+  else /* Still fetching, sent from SCSI_ProcessNextCplt */
+  {
+    hmsc->bot_next_stalled = 1U;
+    return 0;
+  }
 
-  (void)USBD_LL_Transmit(pdev, MSC_EPIN_ADDR, hmsc->bot_data, len);
+  if (pDirect == NULL)
+  {
+    (void)USBD_LL_Transmit(pdev, MSC_EPIN_ADDR, hmsc->bot_data, len);
+  }
 
   hmsc->scsi_blk_addr += (len / hmsc->scsi_blk_size);
   hmsc->scsi_blk_len -= (len / hmsc->scsi_blk_size);
@@ -988,13 +1048,24 @@ static int8_t SCSI_ProcessRead(USBD_HandleTypeDef *pdev, uint8_t lun)
   {
     hmsc->bot_state = USBD_BOT_LAST_DATA_IN;
   }
+  else if (pDirect == NULL)
+  {
+    /* Fetch next packet while this one is on the bus */
+    len = MIN((hmsc->scsi_blk_len * hmsc->scsi_blk_size), MSC_MEDIA_PACKET);
+
+    hmsc->bot_next_addr = hmsc->scsi_blk_addr;
+    hmsc->bot_next_len = len / hmsc->scsi_blk_size;
+    hmsc->bot_next_state = USBD_BOT_NEXT_READ;
+  }
 
   return 0;
 }
 
 /**
 * @brief  SCSI_ProcessWrite
-*         Handle Write Process
+*         Handle Write Process, the received packet is handed to
+*         MSC_BOT_Process and the next one is received in the other buffer,
+*         or straight into the medium when it lends its memory
 * @param  lun: Logical unit number
 * @retval status
 */
@@ -1002,36 +1073,188 @@ static int8_t SCSI_ProcessWrite(USBD_HandleTypeDef *pdev, uint8_t lun)
 {
   USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassDataMSC;
   uint32_t len = hmsc->scsi_blk_len * hmsc->scsi_blk_size;
+  uint8_t *pBuff;
 
-  len = MIN(len, MSC_MEDIA_PACKET);
+  /* Previous packet still being written, resumed from SCSI_ProcessNextCplt */
+  if (hmsc->bot_next_state != USBD_BOT_NEXT_NONE)
+  {
+    hmsc->bot_next_stalled = 1U;
+    return 0;
+  }
 
-  if (((USBD_StorageTypeDef *)pdev->pUserDataMSC)->Write(lun, hmsc->bot_data,
-                                                      hmsc->scsi_blk_addr,
-                                                      (len / hmsc->scsi_blk_size)) < 0)
+  /* Packet already landed in the medium, nothing left to store */
+  if (hmsc->bot_direct_len != 0U)
   {
-    SCSI_SenseCode(pdev, lun, HARDWARE_ERROR, WRITE_FAULT);
-    return -1;
+    len = hmsc->bot_direct_len;
+    hmsc->bot_direct_len = 0U;
+
+    hmsc->scsi_blk_addr += (len / hmsc->scsi_blk_size);
+    hmsc->scsi_blk_len -= (len / hmsc->scsi_blk_size);
+
+    /* case 12 : Ho = Do */
+    hmsc->csw.dDataResidue -= len;
+
+    if (hmsc->scsi_blk_len != 0U)
+    {
+      SCSI_PrepareWrite(pdev, lun);
+    }
+    else
+    {
+      MSC_BOT_SendCSW(pdev, USBD_CSW_CMD_PASSED);
+    }
+
+    return 0;
   }
 
+  len = MIN(len, MSC_MEDIA_PACKET);
+
+  pBuff = hmsc->bot_next;
+  hmsc->bot_next = hmsc->bot_data;
+  hmsc->bot_data = pBuff;
+
+  hmsc->bot_next_addr = hmsc->scsi_blk_addr;
+  hmsc->bot_next_len = len / hmsc->scsi_blk_size;
+  hmsc->bot_next_state = USBD_BOT_NEXT_WRITE;
+
   hmsc->scsi_blk_addr += (len / hmsc->scsi_blk_size);
   hmsc->scsi_blk_len -= (len / hmsc->scsi_blk_size);
 
-  /* case 12 : Ho = Do */
-  hmsc->csw.dDataResidue -= len;
+  if (hmsc->scsi_blk_len != 0U)
+  {
+    /* Prepare EP to Receive next packet */
+    SCSI_PrepareWrite(pdev, lun);
+  }
 
-  if (hmsc->scsi_blk_len == 0U)
+  return 0;
+}
+
+/**
+* @brief  SCSI_GetDirectBuffer
+*         Ask the storage for the memory holding the next blocks
+* @param  lun: Logical unit number
+* @param  len: set to the transfer length when the memory is lent
+* @retval pointer to the medium, NULL when data goes through bot_data
+*/
+static uint8_t *SCSI_GetDirectBuffer(USBD_HandleTypeDef *pdev, uint8_t lun, uint32_t *len)
+{
+  USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassDataMSC;
+  USBD_StorageTypeDef *pStorage = (USBD_StorageTypeDef *)pdev->pUserDataMSC;
+  uint32_t direct_len;
+  uint8_t *pBuff = NULL;
+
+  if (pStorage->GetBuffer == NULL)
   {
-    MSC_BOT_SendCSW(pdev, USBD_CSW_CMD_PASSED);
+    return NULL;
   }
-  else
+
+  direct_len = MIN((hmsc->scsi_blk_len * hmsc->scsi_blk_size), MSC_DIRECT_PACKET);
+
+  if ((pStorage->GetBuffer(lun, &pBuff, hmsc->scsi_blk_addr,
+                           (uint16_t)(direct_len / hmsc->scsi_blk_size)) != 0) || (pBuff == NULL))
   {
-    len = MIN((hmsc->scsi_blk_len * hmsc->scsi_blk_size), MSC_MEDIA_PACKET);
+    return NULL;
+  }
 
-    /* Prepare EP to Receive next packet */
+  *len = direct_len;
+
+  return pBuff;
+}
+
+/**
+* @brief  SCSI_PrepareWrite
+*         Prepare EP to receive the next data packet, straight into the
+*         medium when the storage lends its memory
+* @param  lun: Logical unit number
+* @retval None
+*/
+static void SCSI_PrepareWrite(USBD_HandleTypeDef *pdev, uint8_t lun)
+{
+  USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassDataMSC;
+  uint32_t len = hmsc->scsi_blk_len * hmsc->scsi_blk_size;
+  uint8_t *pDirect = SCSI_GetDirectBuffer(pdev, lun, &len);
+
+  if (pDirect != NULL)
+  {
+    hmsc->bot_direct_len = len;
+    (void)USBD_LL_PrepareReceive(pdev, MSC_EPOUT_ADDR, pDirect, len);
+  }
+  else
+  {
+    hmsc->bot_direct_len = 0U;
+    len = MIN(len, MSC_MEDIA_PACKET);
     (void)USBD_LL_PrepareReceive(pdev, MSC_EPOUT_ADDR, hmsc->bot_data, len);
   }
+}
 
-  return 0;
+/**
+* @brief  SCSI_ProcessNextCplt
+*         Called by MSC_BOT_Process with interrupts masked once the
+*         storage access on bot_next is done
+* @param  lun: Logical unit number
+* @param  status: storage Read/Write return value
+* @retval None
+*/
+void SCSI_ProcessNextCplt(USBD_HandleTypeDef *pdev, uint8_t lun, int8_t status)
+{
+  USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassDataMSC;
+  uint8_t stalled = hmsc->bot_next_stalled;
+
+  hmsc->bot_next_stalled = 0U;
+
+  /* Cancelled by a reset or a new command, a data stage that waited for
+     storage to return starts now */
+  if (hmsc->bot_next_state == USBD_BOT_NEXT_CANCELLED)
+  {
+    hmsc->bot_next_state = USBD_BOT_NEXT_NONE;
+
+    if ((stalled != 0U) && (hmsc->bot_state == USBD_BOT_DATA_OUT))
+    {
+      (void)SCSI_ProcessWrite(pdev, lun);
+    }
+    else if ((stalled != 0U) && (hmsc->bot_state == USBD_BOT_DATA_IN) &&
+             (SCSI_ProcessRead(pdev, lun) < 0))
+    {
+      MSC_BOT_SendCSW(pdev, USBD_CSW_CMD_FAILED);
+    }
+    return;
+  }
+
+  if (hmsc->bot_state == USBD_BOT_DATA_OUT)
+  {
+    hmsc->bot_next_state = USBD_BOT_NEXT_NONE;
+
+    if (status < 0)
+    {
+      SCSI_SenseCode(pdev, lun, HARDWARE_ERROR, WRITE_FAULT);
+      MSC_BOT_SendCSW(pdev, USBD_CSW_CMD_FAILED);
+      return;
+    }
+
+    /* case 12 : Ho = Do */
+    hmsc->csw.dDataResidue -= hmsc->bot_next_len * hmsc->scsi_blk_size;
+
+    if (stalled != 0U)
+    {
+      (void)SCSI_ProcessWrite(pdev, lun);
+    }
+    else if (hmsc->scsi_blk_len == 0U)
+    {
+      MSC_BOT_SendCSW(pdev, USBD_CSW_CMD_PASSED);
+    }
+  }
+  else if (hmsc->bot_state == USBD_BOT_DATA_IN)
+  {
+    hmsc->bot_next_state = (status < 0) ? USBD_BOT_NEXT_ERROR : USBD_BOT_NEXT_READY;
+
+    if ((stalled != 0U) && (SCSI_ProcessRead(pdev, lun) < 0))
+    {
+      MSC_BOT_SendCSW(pdev, USBD_CSW_CMD_FAILED);
+    }
+  }
+  else
+  {
+    hmsc->bot_next_state = USBD_BOT_NEXT_NONE;
+  }
 }
 
 
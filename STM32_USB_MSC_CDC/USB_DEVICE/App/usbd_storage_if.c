@@ -23,6 +23,7 @@
 #include "usbd_storage_if.h"
 
 /* USER CODE BEGIN INCLUDE */
+#include "ram_disk.h"
 
 /* USER CODE END INCLUDE */
 
@@ -32,7 +33,7 @@
 
 /* USER CODE BEGIN PV */
 /* Private variables ---------------------------------------------------------*/
-uint8_t MSC_Storage[100*1024];
+
 /* USER CODE END PV */
 
 /** @addtogroup STM32_USB_OTG_DEVICE_LIBRARY
@@ -51,7 +52,18 @@ uint8_t MSC_Storage[100*1024];
   */
 
 /* USER CODE BEGIN PRIVATE_TYPES */
-
+/**
+ * block backend bound to one lun, blocks are STORAGE_BLK_SIZ bytes
+ * write is NULL for a read only lun, get_buffer is optional
+ */
+typedef struct
+{
+  uint32_t block_count;
+  uint8_t write_protected;
+  int8_t (*read)(uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
+  int8_t (*write)(uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
+  int8_t (*get_buffer)(uint8_t **buf, uint32_t blk_addr, uint16_t blk_len);
+} STORAGE_Lun_t;
 /* USER CODE END PRIVATE_TYPES */
 
 /**
@@ -68,7 +80,15 @@ uint8_t MSC_Storage[100*1024];
 #define STORAGE_BLK_SIZ                  512
 
 /* USER CODE BEGIN PRIVATE_DEFINES */
+#undef STORAGE_LUN_NBR
+#undef STORAGE_BLK_NBR
+#undef STORAGE_BLK_SIZ
 
+/** one entry each in STORAGE_Luns and STORAGE_Inquirydata_FS */
+#define STORAGE_LUN_NBR                  1
+#define STORAGE_LUN_RAM                  0
+
+#define STORAGE_BLK_SIZ                  RAM_DISK_BLOCK_SIZE
 /* USER CODE END PRIVATE_DEFINES */
 
 /**
@@ -114,7 +134,24 @@ const int8_t STORAGE_Inquirydata_FS[] = {/* 36 */
 /* USER CODE END INQUIRY_DATA_FS */
 
 /* USER CODE BEGIN PRIVATE_VARIABLES */
+/** init runs again on every bus reset, disk content must survive it */
+static uint8_t STORAGE_Initialized;
+
+static int8_t STORAGE_Ram_Read(uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
+static int8_t STORAGE_Ram_Write(uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
+static int8_t STORAGE_Ram_GetBuffer(uint8_t **buf, uint32_t blk_addr, uint16_t blk_len);
 
+/** luns seen by host, more backends are added here and in the inquiry data */
+static const STORAGE_Lun_t STORAGE_Luns[STORAGE_LUN_NBR] =
+{
+  [STORAGE_LUN_RAM] =
+  {
+    .block_count = RAM_DISK_BLOCK_COUNT,
+    .read = STORAGE_Ram_Read,
+    .write = STORAGE_Ram_Write,
+    .get_buffer = STORAGE_Ram_GetBuffer,
+  },
+};
 /* USER CODE END PRIVATE_VARIABLES */
 
 /**
@@ -147,6 +184,7 @@ static int8_t STORAGE_IsReady_FS(uint8_t lun);
 static int8_t STORAGE_IsWriteProtected_FS(uint8_t lun);
 static int8_t STORAGE_Read_FS(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
 static int8_t STORAGE_Write_FS(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
+static int8_t STORAGE_GetBuffer_FS(uint8_t lun, uint8_t **buf, uint32_t blk_addr, uint16_t blk_len);
 static int8_t STORAGE_GetMaxLun_FS(void);
 
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_DECLARATION */
@@ -165,6 +203,7 @@ USBD_StorageTypeDef USBD_Storage_Interface_fops_FS =
   STORAGE_IsWriteProtected_FS,
   STORAGE_Read_FS,
   STORAGE_Write_FS,
+  STORAGE_GetBuffer_FS,
   STORAGE_GetMaxLun_FS,
   (int8_t *)STORAGE_Inquirydata_FS
 };
@@ -178,6 +217,11 @@ USBD_StorageTypeDef USBD_Storage_Interface_fops_FS =
 int8_t STORAGE_Init_FS(uint8_t lun)
 {
   /* USER CODE BEGIN 2 */
+  if (!STORAGE_Initialized)
+  {
+    RAM_Disk_Init();
+    STORAGE_Initialized = 1;
+  }
   return (USBD_OK);
   /* USER CODE END 2 */
 }
@@ -192,7 +236,12 @@ int8_t STORAGE_Init_FS(uint8_t lun)
 int8_t STORAGE_GetCapacity_FS(uint8_t lun, uint32_t *block_num, uint16_t *block_size)
 {
   /* USER CODE BEGIN 3 */
-  *block_num  = STORAGE_BLK_NBR;
+  if (lun >= STORAGE_LUN_NBR)
+  {
+    return (USBD_FAIL);
+  }
+
+  *block_num  = STORAGE_Luns[lun].block_count;
   *block_size = STORAGE_BLK_SIZ;
   return (USBD_OK);
   /* USER CODE END 3 */
@@ -206,6 +255,11 @@ int8_t STORAGE_GetCapacity_FS(uint8_t lun, uint32_t *block_num, uint16_t *block_
 int8_t STORAGE_IsReady_FS(uint8_t lun)
 {
   /* USER CODE BEGIN 4 */
+  if (lun >= STORAGE_LUN_NBR)
+  {
+    return (USBD_FAIL);
+  }
+
   return (USBD_OK);
   /* USER CODE END 4 */
 }
@@ -218,6 +272,11 @@ int8_t STORAGE_IsReady_FS(uint8_t lun)
 int8_t STORAGE_IsWriteProtected_FS(uint8_t lun)
 {
   /* USER CODE BEGIN 5 */
+  if (lun >= STORAGE_LUN_NBR || STORAGE_Luns[lun].write_protected || !STORAGE_Luns[lun].write)
+  {
+    return (USBD_FAIL);
+  }
+
   return (USBD_OK);
   /* USER CODE END 5 */
 }
@@ -230,16 +289,12 @@ int8_t STORAGE_IsWriteProtected_FS(uint8_t lun)
 int8_t STORAGE_Read_FS(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len)
 {
   /* USER CODE BEGIN 6 */
+  if (lun >= STORAGE_LUN_NBR)
+  {
+    return (USBD_FAIL);
+  }
 
-  uint32_t bytecount = blk_len*STORAGE_BLK_SIZ;
-  uint32_t mem_address = blk_addr*STORAGE_BLK_SIZ;
-
-  for(uint32_t i=0; i<bytecount; i++)
-      {
-	  buf[i] = MSC_Storage[mem_address+i];
-      }
-
-  return (USBD_OK);
+  return STORAGE_Luns[lun].read(buf, blk_addr, blk_len);
   /* USER CODE END 6 */
 }
 
@@ -251,19 +306,36 @@ int8_t STORAGE_Read_FS(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t bl
 int8_t STORAGE_Write_FS(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len)
 {
   /* USER CODE BEGIN 7 */
+  if (lun >= STORAGE_LUN_NBR || !STORAGE_Luns[lun].write)
+  {
+    return (USBD_FAIL);
+  }
 
-   uint32_t bytecount = blk_len*STORAGE_BLK_SIZ;
-   uint32_t mem_address = blk_addr*STORAGE_BLK_SIZ;
-
-    for(uint32_t i=0; i<bytecount; i++)
-    {
-	MSC_Storage[mem_address+i] = buf[i];
-    }
-
-  return (USBD_OK);
+  return STORAGE_Luns[lun].write(buf, blk_addr, blk_len);
   /* USER CODE END 7 */
 }
 
+/**
+  * @brief  Lends the lun memory so msc sends and receives blocks in place.
+  *         Luns that can not, like a sparse ram disk, fail and msc copies instead.
+  * @param  lun: .
+  * @param  buf: set to the first byte of blk_addr.
+  * @param  blk_addr: first block.
+  * @param  blk_len: number of blocks, all contiguous in ram.
+  * @retval USBD_OK if all operations are OK else USBD_FAIL
+  */
+int8_t STORAGE_GetBuffer_FS(uint8_t lun, uint8_t **buf, uint32_t blk_addr, uint16_t blk_len)
+{
+  /* USER CODE BEGIN 10 */
+  if (lun >= STORAGE_LUN_NBR || !STORAGE_Luns[lun].get_buffer)
+  {
+    return (USBD_FAIL);
+  }
+
+  return STORAGE_Luns[lun].get_buffer(buf, blk_addr, blk_len);
+  /* USER CODE END 10 */
+}
+
 /**
   * @brief  .
   * @param  None
@@ -277,6 +349,55 @@ int8_t STORAGE_GetMaxLun_FS(void)
 }
 
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_IMPLEMENTATION */
+/**
+ * called from main loop, runs the storage access queued by the
+ * msc ping-pong data stage
+ */
+void STORAGE_Process_FS(void)
+{
+  MSC_BOT_Process(&hUsbDeviceFS);
+}
+
+static int8_t STORAGE_Ram_Read(uint8_t *buf, uint32_t blk_addr, uint16_t blk_len)
+{
+  while (blk_len--)
+  {
+    if (!RAM_Disk_Read(blk_addr++, buf))
+    {
+      return (USBD_FAIL);
+    }
+    buf += STORAGE_BLK_SIZ;
+  }
+
+  return (USBD_OK);
+}
+
+static int8_t STORAGE_Ram_Write(uint8_t *buf, uint32_t blk_addr, uint16_t blk_len)
+{
+  while (blk_len--)
+  {
+    /* pool full, host sees a write fault */
+    if (!RAM_Disk_Write(blk_addr++, buf))
+    {
+      return (USBD_FAIL);
+    }
+    buf += STORAGE_BLK_SIZ;
+  }
+
+  return (USBD_OK);
+}
+
+/** only a flat disk is contiguous, a sparse one returns NULL */
+static int8_t STORAGE_Ram_GetBuffer(uint8_t **buf, uint32_t blk_addr, uint16_t blk_len)
+{
+  *buf = RAM_Disk_Get_Buffer(blk_addr, blk_len);
+  if (*buf == NULL)
+  {
+    return (USBD_FAIL);
+  }
+
+  return (USBD_OK);
+}
 
 /* USER CODE END PRIVATE_FUNCTIONS_IMPLEMENTATION */
 
@@ -105,6 +105,7 @@ extern USBD_StorageTypeDef USBD_Storage_Interface_fops_FS;
   */
 
 /* USER CODE BEGIN EXPORTED_FUNCTIONS */
+void STORAGE_Process_FS(void);
 
 /* USER CODE END EXPORTED_FUNCTIONS */
 
@@ -27,6 +27,8 @@ extern "C" {
 
 /* Includes ------------------------------------------------------------------*/
 #include  "usbd_msc_bot.h"
+#include  "usbd_msc_uas.h"
+#include  "usbd_msc_perf.h"
 #include  "usbd_msc_scsi.h"
 #include  "usbd_ioreq.h"
 
@@ -53,12 +55,20 @@ extern "C" {
 
 #define BOT_GET_MAX_LUN              0xFE
 #define BOT_RESET                    0xFF
-#define USB_MSC_CONFIG_DESC_SIZ      32
+#define USB_MSC_CONFIG_DESC_SIZ      85
+
+/* Alternate settings of the mass storage interface */
+#define MSC_ALT_BOT                  0x00U
+#define MSC_ALT_UAS                  0x01U
 
 
 #define MSC_EPIN_ADDR                0x81U
 #define MSC_EPOUT_ADDR               0x01U
 
+/* UAS command and status pipes, data pipes are MSC_EPIN_ADDR and MSC_EPOUT_ADDR */
+#define MSC_UAS_CMD_ADDR             0x02U
+#define MSC_UAS_STATUS_ADDR          0x82U
+
 /**
   * @}
   */
@@ -74,6 +84,12 @@ typedef struct _USBD_STORAGE
   int8_t (* IsWriteProtected)(uint8_t lun);
   int8_t (* Read)(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
   int8_t (* Write)(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
+  int8_t (* SyncCache)(uint8_t lun);
+  int8_t (* Unmap)(uint8_t lun, uint32_t blk_addr, uint32_t blk_len);
+  int8_t (* GetPhysicalBlock)(uint8_t lun, uint8_t *exponent, uint16_t *aligned_lba);
+  int8_t (* IsBusy)(uint8_t lun);
+  int8_t (* IsWriteCached)(uint8_t lun);
+  int8_t (* CanUnmap)(uint8_t lun);
   int8_t (* GetMaxLun)(void);
   int8_t *pInquiry;
 
@@ -87,7 +103,8 @@ typedef struct
   uint8_t                  bot_state;
   uint8_t                  bot_status;
   uint32_t                 bot_data_length;
-  uint8_t                  bot_data[MSC_MEDIA_PACKET];
+  uint8_t                  *bot_data;
+  uint8_t                  bot_buffer[2][MSC_MEDIA_PACKET];
   USBD_MSC_BOT_CBWTypeDef  cbw;
   USBD_MSC_BOT_CSWTypeDef  csw;
 
@@ -101,6 +118,18 @@ typedef struct
 
   uint32_t                 scsi_blk_addr;
   uint32_t                 scsi_blk_len;
+
+  /* second half of the ping-pong buffer, accessed by MSC_BOT_Process */
+  uint8_t                  *bot_next;
+  volatile uint8_t         bot_next_state;
+  uint8_t                  bot_next_stalled;
+  uint32_t                 bot_next_addr;
+  uint32_t                 bot_next_len;
+  uint8_t                  bot_next_rearm;   /* CBW receive held back until storage returns */
+  uint8_t                  bot_next_free;    /* handle freed by MSC_BOT_Process, set by DeInit */
+
+  /* command queue and status pipe of the UAS alternate setting */
+  USBD_MSC_UAS_HandleTypeDef uas;
 }
 USBD_MSC_BOT_HandleTypeDef;
 
@@ -42,8 +42,10 @@ extern "C" {
   */
 #define MODE_SENSE6_LEN                    0x17U
 #define MODE_SENSE10_LEN                   0x1BU
-#define LENGTH_INQUIRY_PAGE00              0x06U
+#define LENGTH_INQUIRY_PAGE00              0x08U
 #define LENGTH_INQUIRY_PAGE80              0x08U
+#define LENGTH_INQUIRY_PAGEB0              0x40U
+#define LENGTH_INQUIRY_PAGEB2              0x08U
 #define LENGTH_FORMAT_CAPACITIES           0x14U
 
 /**
@@ -73,6 +75,8 @@ extern "C" {
   */
 extern uint8_t MSC_Page00_Inquiry_Data[LENGTH_INQUIRY_PAGE00];
 extern uint8_t MSC_Page80_Inquiry_Data[LENGTH_INQUIRY_PAGE80];
+extern uint8_t MSC_PageB0_Inquiry_Data[LENGTH_INQUIRY_PAGEB0];
+extern uint8_t MSC_PageB2_Inquiry_Data[LENGTH_INQUIRY_PAGEB2];
 extern uint8_t MSC_Mode_Sense6_data[MODE_SENSE6_LEN];
 extern uint8_t MSC_Mode_Sense10_data[MODE_SENSE10_LEN];
 
@@ -0,0 +1,98 @@
+/**
+  ******************************************************************************
+  * @file    usbd_msc_perf.h
+  * @author  gitz
+  * @brief   Header for the usbd_msc_perf.c file
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __USBD_MSC_PERF_H
+#define __USBD_MSC_PERF_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "usbd_core.h"
+
+/** @addtogroup STM32_USB_DEVICE_LIBRARY
+  * @{
+  */
+
+/** @defgroup MSC_PERF
+  * @brief This file is the Header file for usbd_msc_perf.c
+  * @{
+  */
+
+
+/** @defgroup USBD_MSC_PERF_Exported_Defines
+  * @{
+  */
+/* 0 compiles the counters out, the vendor command then fails */
+#ifndef MSC_PERF_ENABLE
+#define MSC_PERF_ENABLE                    1U
+#endif /* MSC_PERF_ENABLE */
+
+/* Latency histogram, bucket n counts commands of 2^n to 2^(n+1) - 1 us */
+#define MSC_PERF_BUCKETS                   16U
+
+/* Opcodes counted on their own, the last entry collects the others */
+#define MSC_PERF_ENTRIES                   16U
+#define MSC_PERF_OPCODE_OTHER              0xFFU
+
+/* Vendor command report, one entry per command, see MSC_Perf_Report */
+#define MSC_PERF_REPORT_LEN                (40U + (4U * MSC_PERF_BUCKETS))
+/**
+  * @}
+  */
+
+
+/** @defgroup USBD_MSC_PERF_Exported_TypesDefinitions
+  * @{
+  */
+typedef struct
+{
+  uint32_t count;
+  uint32_t errors;                              /* completed with a failed status */
+  uint64_t total_cycles;                        /* command decode to status */
+  uint64_t media_cycles;                        /* inside storage Read/Write/SyncCache/Unmap */
+  uint32_t max_cycles;
+  uint32_t min_cycles;
+  uint32_t histogram[MSC_PERF_BUCKETS];
+}
+USBD_MSC_PerfTypeDef;
+/**
+  * @}
+  */
+
+
+/** @defgroup USBD_MSC_PERF_Exported_FunctionsPrototype
+  * @{
+  */
+void MSC_Perf_Init(void);
+void MSC_Perf_Reset(void);
+void MSC_Perf_CmdStart(uint8_t opcode);
+void MSC_Perf_CmdEnd(uint8_t CSW_Status);
+uint32_t MSC_Perf_MediaStart(void);
+void MSC_Perf_MediaEnd(uint32_t start);
+const USBD_MSC_PerfTypeDef *MSC_Perf_Get(uint8_t index, uint8_t *opcode);
+uint16_t MSC_Perf_Report(uint8_t index, uint8_t *pbuf);
+/**
+  * @}
+  */
+
+#ifdef __cplusplus
+}
+#endif
+
+/**
+  * @}
+  */
+
+/**
+  * @}
+  */
+
+#endif /* __USBD_MSC_PERF_H */
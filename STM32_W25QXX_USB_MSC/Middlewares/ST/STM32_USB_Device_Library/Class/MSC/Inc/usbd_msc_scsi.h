@@ -72,8 +72,14 @@ extern "C" {
 #define SCSI_VERIFY16                               0x8FU
 
 #define SCSI_SEND_DIAGNOSTIC                        0x1DU
+#define SCSI_SYNCHRONIZE_CACHE10                    0x35U
+#define SCSI_SYNCHRONIZE_CACHE16                    0x91U
+#define SCSI_UNMAP                                  0x42U
 #define SCSI_READ_FORMAT_CAPACITIES                 0x23U
 
+/* Vendor specific, counters of usbd_msc_perf.c */
+#define SCSI_READ_PERF_STATS                        0xC0U
+
 #define NO_SENSE                                    0U
 #define RECOVERED_ERROR                             1U
 #define NOT_READY                                   2U
@@ -156,6 +162,7 @@ typedef struct _SENSE_ITEM
   * @{
   */
 int8_t SCSI_ProcessCmd(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *cmd);
+void SCSI_ProcessNextCplt(USBD_HandleTypeDef *pdev, uint8_t lun, int8_t status);
 
 void SCSI_SenseCode(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t sKey,
                     uint8_t ASC);
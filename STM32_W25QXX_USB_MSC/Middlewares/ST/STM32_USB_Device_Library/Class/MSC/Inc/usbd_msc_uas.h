@@ -0,0 +1,166 @@
+/**
+  ******************************************************************************
+  * @file    usbd_msc_uas.h
+  * @author  gitz
+  * @brief   Header for the usbd_msc_uas.c file
+  ******************************************************************************
+  */
+
+/* Define to prevent recursive inclusion -------------------------------------*/
+#ifndef __USBD_MSC_UAS_H
+#define __USBD_MSC_UAS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Includes ------------------------------------------------------------------*/
+#include "usbd_core.h"
+
+/** @addtogroup STM32_USB_DEVICE_LIBRARY
+  * @{
+  */
+
+/** @defgroup MSC_UAS
+  * @brief This file is the Header file for usbd_msc_uas.c
+  * @{
+  */
+
+
+/** @defgroup USBD_UAS_Exported_Defines
+  * @{
+  */
+/* Information unit IDs */
+#define USBD_UAS_IU_COMMAND                0x01U
+#define USBD_UAS_IU_SENSE                  0x03U
+#define USBD_UAS_IU_RESPONSE               0x04U
+#define USBD_UAS_IU_TASK_MGMT              0x05U
+#define USBD_UAS_IU_READ_READY             0x06U
+#define USBD_UAS_IU_WRITE_READY            0x07U
+
+#define USBD_UAS_COMMAND_IU_LENGTH         32U
+#define USBD_UAS_TASK_MGMT_IU_LENGTH       16U
+#define USBD_UAS_SENSE_IU_LENGTH           16U      /* without sense data */
+#define USBD_UAS_RESPONSE_IU_LENGTH        8U
+#define USBD_UAS_READY_IU_LENGTH           4U
+#define USBD_UAS_MAX_IU_LENGTH             (USBD_UAS_SENSE_IU_LENGTH + 18U)
+
+/* Pipe usage descriptor */
+#define USBD_UAS_PIPE_USAGE_DESC           0x24U
+#define USBD_UAS_PIPE_COMMAND              0x01U
+#define USBD_UAS_PIPE_STATUS               0x02U
+#define USBD_UAS_PIPE_DATA_IN              0x03U
+#define USBD_UAS_PIPE_DATA_OUT             0x04U
+
+/* Task attributes of a command IU */
+#define USBD_UAS_TASK_SIMPLE               0x00U
+#define USBD_UAS_TASK_HEAD_OF_QUEUE        0x01U
+#define USBD_UAS_TASK_ORDERED              0x02U
+
+/* Task management functions */
+#define USBD_UAS_TMF_ABORT_TASK            0x01U
+#define USBD_UAS_TMF_ABORT_TASK_SET        0x02U
+#define USBD_UAS_TMF_CLEAR_TASK_SET        0x04U
+#define USBD_UAS_TMF_LOGICAL_UNIT_RESET    0x08U
+#define USBD_UAS_TMF_IT_NEXUS_RESET        0x10U
+#define USBD_UAS_TMF_QUERY_TASK            0x80U
+
+/* Response codes */
+#define USBD_UAS_RC_TMF_COMPLETE           0x00U
+#define USBD_UAS_RC_INVALID_IU             0x02U
+#define USBD_UAS_RC_TMF_NOT_SUPPORTED      0x04U
+#define USBD_UAS_RC_TMF_FAILED             0x05U
+#define USBD_UAS_RC_TMF_SUCCEEDED          0x08U
+#define USBD_UAS_RC_INCORRECT_LUN          0x09U
+#define USBD_UAS_RC_OVERLAPPED_TAG         0x0AU
+
+/* SCSI status of a sense IU */
+#define USBD_UAS_STATUS_GOOD               0x00U
+#define USBD_UAS_STATUS_CHECK_CONDITION    0x02U
+
+/* Commands accepted ahead of the one executing */
+#ifndef USBD_UAS_QUEUE_DEPTH
+#define USBD_UAS_QUEUE_DEPTH               4U
+#endif /* USBD_UAS_QUEUE_DEPTH */
+
+/* Task management and rejected IU answers the status pipe can hold
+   on top of the IUs owed to queued commands */
+#ifndef USBD_UAS_TMF_DEPTH
+#define USBD_UAS_TMF_DEPTH                 2U
+#endif /* USBD_UAS_TMF_DEPTH */
+
+/* IUs waiting for the status pipe, ready and sense of every queued command,
+   the command pipe is not armed unless the next IU's answers fit too */
+#define USBD_UAS_STATUS_DEPTH              ((2U * USBD_UAS_QUEUE_DEPTH) + USBD_UAS_TMF_DEPTH)
+
+/* Status IUs a received IU may cause, ready and sense of a command */
+#define USBD_UAS_IU_STATUS_MAX             2U
+
+#define USBD_UAS_NO_SLOT                   0xFFU
+
+/* Command slot states */
+#define USBD_UAS_SLOT_FREE                 0U
+#define USBD_UAS_SLOT_QUEUED               1U
+#define USBD_UAS_SLOT_ACTIVE               2U
+/**
+  * @}
+  */
+
+/** @defgroup USBD_UAS_Exported_TypesDefinitions
+  * @{
+  */
+
+typedef struct
+{
+  uint8_t  iu[USBD_UAS_COMMAND_IU_LENGTH];
+  uint8_t  state;
+  uint32_t seq;                                 /* arrival order */
+}
+USBD_MSC_UAS_SlotTypeDef;
+
+typedef struct
+{
+  USBD_MSC_UAS_SlotTypeDef slot[USBD_UAS_QUEUE_DEPTH];
+  uint8_t                  rx_slot;            /* receiving the next command IU */
+  uint8_t                  active;             /* slot executing on the data pipes */
+  uint32_t                 seq;
+
+  uint8_t                  status[USBD_UAS_STATUS_DEPTH][USBD_UAS_MAX_IU_LENGTH];
+  uint8_t                  status_len[USBD_UAS_STATUS_DEPTH];
+  uint8_t                  status_head;
+  uint8_t                  status_count;
+  uint8_t                  status_busy;
+}
+USBD_MSC_UAS_HandleTypeDef;
+
+/**
+  * @}
+  */
+
+
+/** @defgroup USBD_UAS_Exported_FunctionsPrototype
+  * @{
+  */
+void MSC_UAS_Init(USBD_HandleTypeDef *pdev);
+void MSC_UAS_DeInit(USBD_HandleTypeDef *pdev);
+void MSC_UAS_CommandOut(USBD_HandleTypeDef *pdev, uint8_t epnum);
+void MSC_UAS_StatusIn(USBD_HandleTypeDef *pdev, uint8_t epnum);
+void MSC_UAS_SendStatus(USBD_HandleTypeDef *pdev, uint8_t CSW_Status);
+void MSC_UAS_Resume(USBD_HandleTypeDef *pdev);
+/**
+  * @}
+  */
+
+#ifdef __cplusplus
+}
+#endif
+
+/**
+  * @}
+  */
+
+/**
+  * @}
+  */
+
+#endif /* __USBD_MSC_UAS_H */
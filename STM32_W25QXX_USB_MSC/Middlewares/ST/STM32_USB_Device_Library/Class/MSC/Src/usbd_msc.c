@@ -14,6 +14,7 @@
   *           Sep. 31, 1999".
   *           This driver implements the following aspects of the specification:
   *             - Bulk-Only Transport protocol
+  *             - USB Attached SCSI protocol on alternate setting 1
   *             - Subclass : SCSI transparent command set (ref. SCSI Primary Commands - 3 (SPC-3))
   *
   *  @endverbatim
@@ -91,6 +92,8 @@ uint8_t *USBD_MSC_GetFSCfgDesc(uint16_t *length);
 uint8_t *USBD_MSC_GetOtherSpeedCfgDesc(uint16_t *length);
 uint8_t *USBD_MSC_GetDeviceQualifierDescriptor(uint16_t *length);
 
+static void USBD_MSC_SetAlt(USBD_HandleTypeDef *pdev, uint8_t alt);
+
 /**
   * @}
   */
@@ -159,7 +162,66 @@ __ALIGN_BEGIN static uint8_t USBD_MSC_CfgHSDesc[USB_MSC_CONFIG_DESC_SIZ]  __ALIG
   0x02,                                            /* Bulk endpoint type */
   LOBYTE(MSC_MAX_HS_PACKET),
   HIBYTE(MSC_MAX_HS_PACKET),
-  0x00                                             /* Polling interval in milliseconds */
+  0x00,                                            /* Polling interval in milliseconds */
+
+  /********************  UAS interface, alternate setting 1 ********************/
+  0x09,                                            /* bLength: Interface Descriptor size */
+  0x04,                                            /* bDescriptorType: */
+  0x00,                                            /* bInterfaceNumber: Number of Interface */
+  MSC_ALT_UAS,                                     /* bAlternateSetting: Alternate setting */
+  0x04,                                            /* bNumEndpoints */
+  0x08,                                            /* bInterfaceClass: MSC Class */
+  0x06,                                            /* bInterfaceSubClass : SCSI transparent */
+  0x62,                                            /* nInterfaceProtocol: UAS */
+  0x05,                                            /* iInterface: */
+  /********************  UAS Endpoints ********************/
+  0x07,                                            /* Endpoint descriptor length = 7 */
+  0x05,                                            /* Endpoint descriptor type */
+  MSC_UAS_CMD_ADDR,                                /* Endpoint address (OUT, address 2) */
+  0x02,                                            /* Bulk endpoint type */
+  LOBYTE(MSC_MAX_HS_PACKET),
+  HIBYTE(MSC_MAX_HS_PACKET),
+  0x00,                                            /* Polling interval in milliseconds */
+  0x04,                                            /* Pipe usage descriptor length = 4 */
+  USBD_UAS_PIPE_USAGE_DESC,                        /* Pipe usage descriptor type */
+  USBD_UAS_PIPE_COMMAND,                           /* Command pipe */
+  0x00,                                            /* Reserved */
+
+  0x07,                                            /* Endpoint descriptor length = 7 */
+  0x05,                                            /* Endpoint descriptor type */
+  MSC_UAS_STATUS_ADDR,                             /* Endpoint address (IN, address 2) */
+  0x02,                                            /* Bulk endpoint type */
+  LOBYTE(MSC_MAX_HS_PACKET),
+  HIBYTE(MSC_MAX_HS_PACKET),
+  0x00,                                            /* Polling interval in milliseconds */
+  0x04,                                            /* Pipe usage descriptor length = 4 */
+  USBD_UAS_PIPE_USAGE_DESC,                        /* Pipe usage descriptor type */
+  USBD_UAS_PIPE_STATUS,                            /* Status pipe */
+  0x00,                                            /* Reserved */
+
+  0x07,                                            /* Endpoint descriptor length = 7 */
+  0x05,                                            /* Endpoint descriptor type */
+  MSC_EPIN_ADDR,                                   /* Endpoint address (IN, address 1) */
+  0x02,                                            /* Bulk endpoint type */
+  LOBYTE(MSC_MAX_HS_PACKET),
+  HIBYTE(MSC_MAX_HS_PACKET),
+  0x00,                                            /* Polling interval in milliseconds */
+  0x04,                                            /* Pipe usage descriptor length = 4 */
+  USBD_UAS_PIPE_USAGE_DESC,                        /* Pipe usage descriptor type */
+  USBD_UAS_PIPE_DATA_IN,                           /* Data in pipe */
+  0x00,                                            /* Reserved */
+
+  0x07,                                            /* Endpoint descriptor length = 7 */
+  0x05,                                            /* Endpoint descriptor type */
+  MSC_EPOUT_ADDR,                                  /* Endpoint address (OUT, address 1) */
+  0x02,                                            /* Bulk endpoint type */
+  LOBYTE(MSC_MAX_HS_PACKET),
+  HIBYTE(MSC_MAX_HS_PACKET),
+  0x00,                                            /* Polling interval in milliseconds */
+  0x04,                                            /* Pipe usage descriptor length = 4 */
+  USBD_UAS_PIPE_USAGE_DESC,                        /* Pipe usage descriptor type */
+  USBD_UAS_PIPE_DATA_OUT,                          /* Data out pipe */
+  0x00                                             /* Reserved */
 };
 
 /* USB Mass storage device Configuration Descriptor */
@@ -202,7 +264,66 @@ __ALIGN_BEGIN static uint8_t USBD_MSC_CfgFSDesc[USB_MSC_CONFIG_DESC_SIZ]  __ALIG
   0x02,                                            /* Bulk endpoint type */
   LOBYTE(MSC_MAX_FS_PACKET),
   HIBYTE(MSC_MAX_FS_PACKET),
-  0x00                                             /* Polling interval in milliseconds */
+  0x00,                                            /* Polling interval in milliseconds */
+
+  /********************  UAS interface, alternate setting 1 ********************/
+  0x09,                                            /* bLength: Interface Descriptor size */
+  0x04,                                            /* bDescriptorType: */
+  0x00,                                            /* bInterfaceNumber: Number of Interface */
+  MSC_ALT_UAS,                                     /* bAlternateSetting: Alternate setting */
+  0x04,                                            /* bNumEndpoints */
+  0x08,                                            /* bInterfaceClass: MSC Class */
+  0x06,                                            /* bInterfaceSubClass : SCSI transparent */
+  0x62,                                            /* nInterfaceProtocol: UAS */
+  0x05,                                            /* iInterface: */
+  /********************  UAS Endpoints ********************/
+  0x07,                                            /* Endpoint descriptor length = 7 */
+  0x05,                                            /* Endpoint descriptor type */
+  MSC_UAS_CMD_ADDR,                                /* Endpoint address (OUT, address 2) */
+  0x02,                                            /* Bulk endpoint type */
+  LOBYTE(MSC_MAX_FS_PACKET),
+  HIBYTE(MSC_MAX_FS_PACKET),
+  0x00,                                            /* Polling interval in milliseconds */
+  0x04,                                            /* Pipe usage descriptor length = 4 */
+  USBD_UAS_PIPE_USAGE_DESC,                        /* Pipe usage descriptor type */
+  USBD_UAS_PIPE_COMMAND,                           /* Command pipe */
+  0x00,                                            /* Reserved */
+
+  0x07,                                            /* Endpoint descriptor length = 7 */
+  0x05,                                            /* Endpoint descriptor type */
+  MSC_UAS_STATUS_ADDR,                             /* Endpoint address (IN, address 2) */
+  0x02,                                            /* Bulk endpoint type */
+  LOBYTE(MSC_MAX_FS_PACKET),
+  HIBYTE(MSC_MAX_FS_PACKET),
+  0x00,                                            /* Polling interval in milliseconds */
+  0x04,                                            /* Pipe usage descriptor length = 4 */
+  USBD_UAS_PIPE_USAGE_DESC,                        /* Pipe usage descriptor type */
+  USBD_UAS_PIPE_STATUS,                            /* Status pipe */
+  0x00,                                            /* Reserved */
+
+  0x07,                                            /* Endpoint descriptor length = 7 */
+  0x05,                                            /* Endpoint descriptor type */
+  MSC_EPIN_ADDR,                                   /* Endpoint address (IN, address 1) */
+  0x02,                                            /* Bulk endpoint type */
+  LOBYTE(MSC_MAX_FS_PACKET),
+  HIBYTE(MSC_MAX_FS_PACKET),
+  0x00,                                            /* Polling interval in milliseconds */
+  0x04,                                            /* Pipe usage descriptor length = 4 */
+  USBD_UAS_PIPE_USAGE_DESC,                        /* Pipe usage descriptor type */
+  USBD_UAS_PIPE_DATA_IN,                           /* Data in pipe */
+  0x00,                                            /* Reserved */
+
+  0x07,                                            /* Endpoint descriptor length = 7 */
+  0x05,                                            /* Endpoint descriptor type */
+  MSC_EPOUT_ADDR,                                  /* Endpoint address (OUT, address 1) */
+  0x02,                                            /* Bulk endpoint type */
+  LOBYTE(MSC_MAX_FS_PACKET),
+  HIBYTE(MSC_MAX_FS_PACKET),
+  0x00,                                            /* Polling interval in milliseconds */
+  0x04,                                            /* Pipe usage descriptor length = 4 */
+  USBD_UAS_PIPE_USAGE_DESC,                        /* Pipe usage descriptor type */
+  USBD_UAS_PIPE_DATA_OUT,                          /* Data out pipe */
+  0x00                                             /* Reserved */
 };
 
 __ALIGN_BEGIN static uint8_t USBD_MSC_OtherSpeedCfgDesc[USB_MSC_CONFIG_DESC_SIZ]   __ALIGN_END  =
@@ -243,7 +364,66 @@ __ALIGN_BEGIN static uint8_t USBD_MSC_OtherSpeedCfgDesc[USB_MSC_CONFIG_DESC_SIZ]
   0x02,                                           /* Bulk endpoint type */
   0x40,
   0x00,
-  0x00                                            /* Polling interval in milliseconds */
+  0x00,                                           /* Polling interval in milliseconds */
+
+  /********************  UAS interface, alternate setting 1 ********************/
+  0x09,                                           /* bLength: Interface Descriptor size */
+  0x04,                                           /* bDescriptorType: */
+  0x00,                                           /* bInterfaceNumber: Number of Interface */
+  MSC_ALT_UAS,                                    /* bAlternateSetting: Alternate setting */
+  0x04,                                           /* bNumEndpoints */
+  0x08,                                           /* bInterfaceClass: MSC Class */
+  0x06,                                           /* bInterfaceSubClass : SCSI transparent */
+  0x62,                                           /* nInterfaceProtocol: UAS */
+  0x05,                                           /* iInterface: */
+  /********************  UAS Endpoints ********************/
+  0x07,                                           /* Endpoint descriptor length = 7 */
+  0x05,                                           /* Endpoint descriptor type */
+  MSC_UAS_CMD_ADDR,                               /* Endpoint address (OUT, address 2) */
+  0x02,                                           /* Bulk endpoint type */
+  0x40,
+  0x00,
+  0x00,                                           /* Polling interval in milliseconds */
+  0x04,                                           /* Pipe usage descriptor length = 4 */
+  USBD_UAS_PIPE_USAGE_DESC,                       /* Pipe usage descriptor type */
+  USBD_UAS_PIPE_COMMAND,                          /* Command pipe */
+  0x00,                                           /* Reserved */
+
+  0x07,                                           /* Endpoint descriptor length = 7 */
+  0x05,                                           /* Endpoint descriptor type */
+  MSC_UAS_STATUS_ADDR,                            /* Endpoint address (IN, address 2) */
+  0x02,                                           /* Bulk endpoint type */
+  0x40,
+  0x00,
+  0x00,                                           /* Polling interval in milliseconds */
+  0x04,                                           /* Pipe usage descriptor length = 4 */
+  USBD_UAS_PIPE_USAGE_DESC,                       /* Pipe usage descriptor type */
+  USBD_UAS_PIPE_STATUS,                           /* Status pipe */
+  0x00,                                           /* Reserved */
+
+  0x07,                                           /* Endpoint descriptor length = 7 */
+  0x05,                                           /* Endpoint descriptor type */
+  MSC_EPIN_ADDR,                                  /* Endpoint address (IN, address 1) */
+  0x02,                                           /* Bulk endpoint type */
+  0x40,
+  0x00,
+  0x00,                                           /* Polling interval in milliseconds */
+  0x04,                                           /* Pipe usage descriptor length = 4 */
+  USBD_UAS_PIPE_USAGE_DESC,                       /* Pipe usage descriptor type */
+  USBD_UAS_PIPE_DATA_IN,                          /* Data in pipe */
+  0x00,                                           /* Reserved */
+
+  0x07,                                           /* Endpoint descriptor length = 7 */
+  0x05,                                           /* Endpoint descriptor type */
+  MSC_EPOUT_ADDR,                                 /* Endpoint address (OUT, address 1) */
+  0x02,                                           /* Bulk endpoint type */
+  0x40,
+  0x00,
+  0x00,                                           /* Polling interval in milliseconds */
+  0x04,                                           /* Pipe usage descriptor length = 4 */
+  USBD_UAS_PIPE_USAGE_DESC,                       /* Pipe usage descriptor type */
+  USBD_UAS_PIPE_DATA_OUT,                         /* Data out pipe */
+  0x00                                            /* Reserved */
 };
 
 /* USB Standard Device Descriptor */
@@ -290,6 +470,7 @@ uint8_t USBD_MSC_Init(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
   }
 
   pdev->pClassData = (void *)hmsc;
+  hmsc->interface = MSC_ALT_BOT;
 
   if (pdev->dev_speed == USBD_SPEED_HIGH)
   {
@@ -312,6 +493,9 @@ uint8_t USBD_MSC_Init(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
     pdev->ep_in[MSC_EPIN_ADDR & 0xFU].is_used = 1U;
   }
 
+  /* Start the command timing cycle counter */
+  MSC_Perf_Init();
+
   /* Init the BOT  layer */
   MSC_BOT_Init(pdev);
 
@@ -337,13 +521,27 @@ uint8_t USBD_MSC_DeInit(USBD_HandleTypeDef *pdev, uint8_t cfgidx)
   (void)USBD_LL_CloseEP(pdev, MSC_EPIN_ADDR);
   pdev->ep_in[MSC_EPIN_ADDR & 0xFU].is_used = 0U;
 
+  /* Close UAS command and status pipes */
+  (void)USBD_LL_CloseEP(pdev, MSC_UAS_CMD_ADDR);
+  pdev->ep_out[MSC_UAS_CMD_ADDR & 0xFU].is_used = 0U;
+  (void)USBD_LL_CloseEP(pdev, MSC_UAS_STATUS_ADDR);
+  pdev->ep_in[MSC_UAS_STATUS_ADDR & 0xFU].is_used = 0U;
+
   /* De-Init the BOT layer */
   MSC_BOT_DeInit(pdev);
 
-  /* Free MSC Class Resources */
+  /* Free MSC Class Resources, left to MSC_BOT_Process while it is
+     inside storage with this handle */
   if (pdev->pClassData != NULL)
   {
-    (void)USBD_free(pdev->pClassData);
+    if (MSC_BOT_CancelNext(pdev) != 0U)
+    {
+      ((USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData)->bot_next_free = 1U;
+    }
+    else
+    {
+      (void)USBD_free(pdev->pClassData);
+    }
     pdev->pClassData = NULL;
   }
 
@@ -384,7 +582,8 @@ uint8_t USBD_MSC_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
 
     case BOT_RESET :
       if ((req->wValue  == 0U) && (req->wLength == 0U) &&
-          ((req->bmRequest & 0x80U) != 0x80U))
+          ((req->bmRequest & 0x80U) != 0x80U) &&
+          (hmsc->interface == MSC_ALT_BOT))
       {
         MSC_BOT_Reset(pdev);
       }
@@ -430,9 +629,9 @@ uint8_t USBD_MSC_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
       break;
 
     case USB_REQ_SET_INTERFACE:
-      if (pdev->dev_state == USBD_STATE_CONFIGURED)
+      if ((pdev->dev_state == USBD_STATE_CONFIGURED) && (req->wValue <= MSC_ALT_UAS))
       {
-        hmsc->interface = (uint8_t)(req->wValue);
+        USBD_MSC_SetAlt(pdev, (uint8_t)(req->wValue));
       }
       else
       {
@@ -449,8 +648,11 @@ uint8_t USBD_MSC_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
           /* Flush the FIFO */
           (void)USBD_LL_FlushEP(pdev, (uint8_t)req->wIndex);
 
-          /* Handle BOT error */
-          MSC_BOT_CplClrFeature(pdev, (uint8_t)req->wIndex);
+          /* Handle BOT error, UAS reports errors in the SENSE IU */
+          if (hmsc->interface == MSC_ALT_BOT)
+          {
+            MSC_BOT_CplClrFeature(pdev, (uint8_t)req->wIndex);
+          }
         }
       }
       break;
@@ -480,7 +682,16 @@ uint8_t USBD_MSC_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req)
 */
 uint8_t USBD_MSC_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum)
 {
-  MSC_BOT_DataIn(pdev, epnum);
+  USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+
+  if ((hmsc->interface == MSC_ALT_UAS) && (epnum == (MSC_UAS_STATUS_ADDR & 0xFU)))
+  {
+    MSC_UAS_StatusIn(pdev, epnum);
+  }
+  else
+  {
+    MSC_BOT_DataIn(pdev, epnum);
+  }
 
   return (uint8_t)USBD_OK;
 }
@@ -494,11 +705,64 @@ uint8_t USBD_MSC_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum)
 */
 uint8_t USBD_MSC_DataOut(USBD_HandleTypeDef *pdev, uint8_t epnum)
 {
-  MSC_BOT_DataOut(pdev, epnum);
+  USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+
+  if ((hmsc->interface == MSC_ALT_UAS) && (epnum == (MSC_UAS_CMD_ADDR & 0xFU)))
+  {
+    MSC_UAS_CommandOut(pdev, epnum);
+  }
+  else
+  {
+    MSC_BOT_DataOut(pdev, epnum);
+  }
 
   return (uint8_t)USBD_OK;
 }
 
+/**
+* @brief  USBD_MSC_SetAlt
+*         Switch between Bulk-Only Transport and UAS, hosts without UAS
+*         support never leave alternate setting 0
+* @param  pdev: device instance
+* @param  alt: MSC_ALT_BOT or MSC_ALT_UAS
+* @retval None
+*/
+static void USBD_MSC_SetAlt(USBD_HandleTypeDef *pdev, uint8_t alt)
+{
+  USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+  uint16_t packet = (pdev->dev_speed == USBD_SPEED_HIGH) ? MSC_MAX_HS_PACKET : MSC_MAX_FS_PACKET;
+
+  if (hmsc->interface == MSC_ALT_UAS)
+  {
+    MSC_UAS_DeInit(pdev);
+
+    (void)USBD_LL_CloseEP(pdev, MSC_UAS_CMD_ADDR);
+    pdev->ep_out[MSC_UAS_CMD_ADDR & 0xFU].is_used = 0U;
+    (void)USBD_LL_CloseEP(pdev, MSC_UAS_STATUS_ADDR);
+    pdev->ep_in[MSC_UAS_STATUS_ADDR & 0xFU].is_used = 0U;
+  }
+  else
+  {
+    MSC_BOT_DeInit(pdev);
+  }
+
+  hmsc->interface = alt;
+
+  if (alt == MSC_ALT_UAS)
+  {
+    (void)USBD_LL_OpenEP(pdev, MSC_UAS_CMD_ADDR, USBD_EP_TYPE_BULK, packet);
+    pdev->ep_out[MSC_UAS_CMD_ADDR & 0xFU].is_used = 1U;
+    (void)USBD_LL_OpenEP(pdev, MSC_UAS_STATUS_ADDR, USBD_EP_TYPE_BULK, packet);
+    pdev->ep_in[MSC_UAS_STATUS_ADDR & 0xFU].is_used = 1U;
+
+    MSC_UAS_Init(pdev);
+  }
+  else
+  {
+    MSC_BOT_Init(pdev);
+  }
+}
+
 /**
 * @brief  USBD_MSC_GetHSCfgDesc
 *         return configuration descriptor
@@ -68,6 +68,10 @@ EndBSPDependencies */
   * @{
   */
 
+/* Handle whose storage access MSC_BOT_Process is running, storage is not
+   reentrant so nothing may reach it from the USB interrupt meanwhile */
+static USBD_MSC_BOT_HandleTypeDef *volatile MSC_BOT_Access;
+
 /**
   * @}
   */
@@ -79,6 +83,7 @@ EndBSPDependencies */
 static void MSC_BOT_SendData(USBD_HandleTypeDef *pdev, uint8_t *pbuf, uint32_t len);
 static void MSC_BOT_CBW_Decode(USBD_HandleTypeDef *pdev);
 static void MSC_BOT_Abort(USBD_HandleTypeDef *pdev);
+static void MSC_BOT_ReceiveCBW(USBD_HandleTypeDef *pdev);
 /**
   * @}
   */
@@ -97,6 +102,7 @@ static void MSC_BOT_Abort(USBD_HandleTypeDef *pdev);
 */
 void MSC_BOT_Init(USBD_HandleTypeDef *pdev)
 {
+  uint8_t lun;
   USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
 
   hmsc->bot_state = USBD_BOT_IDLE;
@@ -106,14 +112,22 @@ void MSC_BOT_Init(USBD_HandleTypeDef *pdev)
   hmsc->scsi_sense_head = 0U;
   hmsc->scsi_medium_state = SCSI_MEDIUM_UNLOCKED;
 
-  ((USBD_StorageTypeDef *)pdev->pUserData)->Init(0U);
+  hmsc->bot_data = hmsc->bot_buffer[0];
+  hmsc->bot_next = hmsc->bot_buffer[1];
+  hmsc->bot_next_rearm = 0U;
+  hmsc->bot_next_free = 0U;
+  (void)MSC_BOT_CancelNext(pdev);
+
+  for (lun = 0U; lun <= (uint8_t)((USBD_StorageTypeDef *)pdev->pUserData)->GetMaxLun(); lun++)
+  {
+    ((USBD_StorageTypeDef *)pdev->pUserData)->Init(lun);
+  }
 
   (void)USBD_LL_FlushEP(pdev, MSC_EPOUT_ADDR);
   (void)USBD_LL_FlushEP(pdev, MSC_EPIN_ADDR);
 
   /* Prapare EP to Receive First BOT Cmd */
-  (void)USBD_LL_PrepareReceive(pdev, MSC_EPOUT_ADDR, (uint8_t *)&hmsc->cbw,
-                               USBD_BOT_CBW_LENGTH);
+  MSC_BOT_ReceiveCBW(pdev);
 }
 
 /**
@@ -128,13 +142,13 @@ void MSC_BOT_Reset(USBD_HandleTypeDef *pdev)
 
   hmsc->bot_state  = USBD_BOT_IDLE;
   hmsc->bot_status = USBD_BOT_STATUS_RECOVERY;
+  (void)MSC_BOT_CancelNext(pdev);
 
   (void)USBD_LL_ClearStallEP(pdev, MSC_EPIN_ADDR);
   (void)USBD_LL_ClearStallEP(pdev, MSC_EPOUT_ADDR);
 
   /* Prapare EP to Receive First BOT Cmd */
-  (void)USBD_LL_PrepareReceive(pdev, MSC_EPOUT_ADDR, (uint8_t *)&hmsc->cbw,
-                               USBD_BOT_CBW_LENGTH);
+  MSC_BOT_ReceiveCBW(pdev);
 }
 
 /**
@@ -147,6 +161,54 @@ void MSC_BOT_DeInit(USBD_HandleTypeDef  *pdev)
 {
   USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
   hmsc->bot_state = USBD_BOT_IDLE;
+  hmsc->bot_next_rearm = 0U;
+  (void)MSC_BOT_CancelNext(pdev);
+}
+
+/**
+* @brief  MSC_BOT_CancelNext
+*         Drop the storage access queued on bot_next, one already running
+*         in MSC_BOT_Process stays busy and its result is dropped when it
+*         returns
+* @param  pdev: device instance
+* @retval 1 while storage is still being accessed, 0 otherwise
+*/
+uint8_t MSC_BOT_CancelNext(USBD_HandleTypeDef  *pdev)
+{
+  USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+
+  hmsc->bot_next_stalled = 0U;
+
+  if (MSC_BOT_Access == hmsc)
+  {
+    hmsc->bot_next_state = USBD_BOT_NEXT_CANCELLED;
+    return 1U;
+  }
+
+  hmsc->bot_next_state = USBD_BOT_NEXT_NONE;
+  return 0U;
+}
+
+/**
+* @brief  MSC_BOT_ReceiveCBW
+*         Arm the OUT endpoint for the next CBW, held back while storage
+*         is being accessed so the next command can not reach it from the
+*         USB interrupt, MSC_BOT_Process arms it once storage returns
+* @param  pdev: device instance
+* @retval None
+*/
+static void MSC_BOT_ReceiveCBW(USBD_HandleTypeDef *pdev)
+{
+  USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+
+  if (MSC_BOT_Access != NULL)
+  {
+    hmsc->bot_next_rearm = 1U;
+    return;
+  }
+
+  (void)USBD_LL_PrepareReceive(pdev, MSC_EPOUT_ADDR, (uint8_t *)&hmsc->cbw,
+                               USBD_BOT_CBW_LENGTH);
 }
 
 /**
@@ -226,7 +288,8 @@ static void  MSC_BOT_CBW_Decode(USBD_HandleTypeDef *pdev)
 
   if ((USBD_LL_GetRxDataSize(pdev, MSC_EPOUT_ADDR) != USBD_BOT_CBW_LENGTH) ||
       (hmsc->cbw.dSignature != USBD_BOT_CBW_SIGNATURE) ||
-      (hmsc->cbw.bLUN > 1U) || (hmsc->cbw.bCBLength < 1U) ||
+      (hmsc->cbw.bLUN > (uint8_t)((USBD_StorageTypeDef *)pdev->pUserData)->GetMaxLun()) ||
+      (hmsc->cbw.bCBLength < 1U) ||
       (hmsc->cbw.bCBLength > 16U))
   {
     SCSI_SenseCode(pdev, hmsc->cbw.bLUN, ILLEGAL_REQUEST, INVALID_CDB);
@@ -304,6 +367,15 @@ void  MSC_BOT_SendCSW(USBD_HandleTypeDef *pdev, uint8_t CSW_Status)
 {
   USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
 
+  MSC_Perf_CmdEnd(CSW_Status);
+
+  /* UAS completes the command with a SENSE IU on the status pipe */
+  if (hmsc->interface == MSC_ALT_UAS)
+  {
+    MSC_UAS_SendStatus(pdev, CSW_Status);
+    return;
+  }
+
   hmsc->csw.dSignature = USBD_BOT_CSW_SIGNATURE;
   hmsc->csw.bStatus = CSW_Status;
   hmsc->bot_state = USBD_BOT_IDLE;
@@ -369,6 +441,89 @@ void  MSC_BOT_CplClrFeature(USBD_HandleTypeDef *pdev, uint8_t epnum)
     return;
   }
 }
+
+/**
+* @brief  MSC_BOT_Process
+*         Run the storage access queued by the data stage, to be called
+*         from the main loop so that it overlaps the USB transfer of the
+*         other half of the ping-pong buffer
+* @param  pdev: device instance
+* @retval None
+*/
+void MSC_BOT_Process(USBD_HandleTypeDef *pdev)
+{
+  USBD_MSC_BOT_HandleTypeDef *hmsc;
+  uint32_t primask;
+  uint8_t state;
+  uint8_t cancelled;
+  uint32_t start;
+  int8_t ret;
+
+  /* DeInit may free the handle from the USB interrupt, read it masked */
+  primask = __get_PRIMASK();
+  __disable_irq();
+  hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+  state = (hmsc != NULL) ? hmsc->bot_next_state : USBD_BOT_NEXT_NONE;
+  if ((state == USBD_BOT_NEXT_READ) || (state == USBD_BOT_NEXT_WRITE))
+  {
+    hmsc->bot_next_state = USBD_BOT_NEXT_BUSY;
+    MSC_BOT_Access = hmsc;
+  }
+  __set_PRIMASK(primask);
+
+  start = MSC_Perf_MediaStart();
+
+  if (state == USBD_BOT_NEXT_READ)
+  {
+    ret = ((USBD_StorageTypeDef *)pdev->pUserData)->Read(hmsc->cbw.bLUN, hmsc->bot_next,
+                                                      hmsc->bot_next_addr,
+                                                      (uint16_t)hmsc->bot_next_len);
+  }
+  else if (state == USBD_BOT_NEXT_WRITE)
+  {
+    ret = ((USBD_StorageTypeDef *)pdev->pUserData)->Write(hmsc->cbw.bLUN, hmsc->bot_next,
+                                                       hmsc->bot_next_addr,
+                                                       (uint16_t)hmsc->bot_next_len);
+  }
+  else
+  {
+    return;
+  }
+
+  MSC_Perf_MediaEnd(start);
+
+  __disable_irq();
+  MSC_BOT_Access = NULL;
+
+  if (hmsc->bot_next_free != 0U)
+  {
+    /* USBD_MSC_DeInit ran meanwhile and left the handle to be freed here */
+    (void)USBD_free(hmsc);
+  }
+  else
+  {
+    cancelled = (hmsc->bot_next_state == USBD_BOT_NEXT_CANCELLED) ? 1U : 0U;
+
+    /* A result cancelled meanwhile is dropped there */
+    SCSI_ProcessNextCplt(pdev, hmsc->cbw.bLUN, ret);
+
+    /* UAS commands held back by an abort can start now */
+    if ((cancelled != 0U) && (hmsc->interface == MSC_ALT_UAS))
+    {
+      MSC_UAS_Resume(pdev);
+    }
+  }
+
+  /* Reset or Init ran meanwhile, the next CBW can be received now */
+  hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+  if ((hmsc != NULL) && (hmsc->bot_next_rearm != 0U))
+  {
+    hmsc->bot_next_rearm = 0U;
+    (void)USBD_LL_PrepareReceive(pdev, MSC_EPOUT_ADDR, (uint8_t *)&hmsc->cbw,
+                                 USBD_BOT_CBW_LENGTH);
+  }
+  __set_PRIMASK(primask);
+}
 /**
   * @}
   */
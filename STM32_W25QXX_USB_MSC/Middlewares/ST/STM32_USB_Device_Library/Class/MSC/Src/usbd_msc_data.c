@@ -73,7 +73,9 @@ uint8_t MSC_Page00_Inquiry_Data[LENGTH_INQUIRY_PAGE00] =
   0x00,
   (LENGTH_INQUIRY_PAGE00 - 4U),
   0x00,
-  0x80
+  0x80,
+  0xB0,
+  0xB2
 };
 
 /* USB Mass storage VPD Page 0x80 Inquiry Data for Unit Serial Number */
@@ -89,6 +91,44 @@ uint8_t MSC_Page80_Inquiry_Data[LENGTH_INQUIRY_PAGE80] =
   0x20
  };
 
+/* USB Mass storage VPD Page 0xB0 Inquiry Data for Block Limits */
+uint8_t MSC_PageB0_Inquiry_Data[LENGTH_INQUIRY_PAGEB0] =
+{
+  0x00,
+  0xB0,
+  0x00,
+  (LENGTH_INQUIRY_PAGEB0 - 4U),
+  0x00, 0x00, 0x00, 0x00,   /* transfer lengths not reported */
+  0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00,
+  0xFF, 0xFF, 0xFF, 0xFF,   /* Maximum unmap LBA count : no limit */
+  0x00, 0x00, 0x00,         /* Maximum unmap block descriptor count */
+  (uint8_t)((MSC_MEDIA_PACKET - 8U) / 16U),
+  0x00, 0x00, 0x00, 0x01,   /* Optimal unmap granularity : 1 block */
+  0x00, 0x00, 0x00, 0x00,   /* Unmap granularity alignment */
+  0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00
+};
+
+/* USB Mass storage VPD Page 0xB2 Inquiry Data for Logical Block Provisioning */
+uint8_t MSC_PageB2_Inquiry_Data[LENGTH_INQUIRY_PAGEB2] =
+{
+  0x00,
+  0xB2,
+  0x00,
+  (LENGTH_INQUIRY_PAGEB2 - 4U),
+  0x00,
+  0x00,     /* LBPU, set per LUN by SCSI_Inquiry */
+  0x00,     /* Provisioning type, set per LUN by SCSI_Inquiry */
+  0x00
+};
+
 /* USB Mass storage sense 6 Data */
 uint8_t MSC_Mode_Sense6_data[MODE_SENSE6_LEN] =
 {
@@ -98,7 +138,7 @@ uint8_t MSC_Mode_Sense6_data[MODE_SENSE6_LEN] =
   0x00,
   0x08,
   0x12,
-  0x00,
+  0x00,     /* WCE, set per LUN by SCSI_ModeSense */
   0x00,
   0x00,
   0x00,
@@ -131,7 +171,7 @@ uint8_t MSC_Mode_Sense10_data[MODE_SENSE10_LEN] =
   0x00,
   0x08,
   0x12,
-  0x00,
+  0x00,     /* WCE, set per LUN by SCSI_ModeSense */
   0x00,
   0x00,
   0x00,
@@ -0,0 +1,340 @@
+/**
+  ******************************************************************************
+  * @file    usbd_msc_perf.c
+  * @author  gitz
+  * @brief   Per opcode SCSI command counters and latency histograms.
+  *
+  * @verbatim
+  *
+  *          ===================================================================
+  *                                MSC Perf Description
+  *          ===================================================================
+  *           Timed with the DWT cycle counter. A command is timed from its
+  *           first SCSI_ProcessCmd call, right after the CBW or command IU
+  *           is decoded, to its CSW or SENSE IU. Media time is the part spent
+  *           inside the storage Read/Write/SyncCache/Unmap callbacks, the
+  *           rest (total - media) is USB transfer and protocol time. With the
+  *           ping-pong data stage a storage access overlaps the transfer of
+  *           the other packet, so total - media is the bus time not hidden
+  *           behind the media.
+  *
+  *           Counters survive USB resets, they are cleared by MSC_Perf_Reset
+  *           or by the vendor command with the reset bit set.
+  *
+  *           Vendor command SCSI_READ_PERF_STATS (0xC0), data in:
+  *             CDB[1] bit 0 : clear all counters after this report
+  *             CDB[2]       : entry index, 0 to MSC_PERF_ENTRIES - 1
+  *             CDB[3..4]    : allocation length
+  *           e.g. sg_raw -r 104 /dev/sdX c0 00 08 00 68 00 00 00 00 00
+  *           Report, big endian:
+  *             0      : MSC_PERF_ENTRIES
+  *             1      : opcode of the entry, 0xFF for all others
+  *             2      : MSC_PERF_BUCKETS
+  *             3      : reserved
+  *             4..7   : core clock in Hz, cycles / (clock / 1e6) = us
+  *             8..11  : commands
+  *             12..15 : failed commands
+  *             16..23 : total cycles
+  *             24..31 : media cycles
+  *             32..35 : max cycles
+  *             36..39 : min cycles
+  *             40..   : histogram, 4 bytes per bucket
+  *
+  *  @endverbatim
+  *
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include "usbd_msc_perf.h"
+#include "usbd_msc_bot.h"
+#include "usbd_msc_scsi.h"
+
+/** @addtogroup STM32_USB_DEVICE_LIBRARY
+  * @{
+  */
+
+
+/** @defgroup MSC_PERF
+  * @brief Mass storage instrumentation module
+  * @{
+  */
+
+/** @defgroup MSC_PERF_Private_Variables
+  * @{
+  */
+#if (MSC_PERF_ENABLE != 0U)
+static const uint8_t MSC_Perf_Opcodes[MSC_PERF_ENTRIES] =
+{
+  SCSI_TEST_UNIT_READY,
+  SCSI_REQUEST_SENSE,
+  SCSI_INQUIRY,
+  SCSI_MODE_SENSE6,
+  SCSI_MODE_SENSE10,
+  SCSI_READ_FORMAT_CAPACITIES,
+  SCSI_READ_CAPACITY10,
+  SCSI_READ_CAPACITY16,
+  SCSI_READ10,
+  SCSI_READ12,
+  SCSI_WRITE10,
+  SCSI_WRITE12,
+  SCSI_VERIFY10,
+  SCSI_SYNCHRONIZE_CACHE10,
+  SCSI_UNMAP,
+  MSC_PERF_OPCODE_OTHER,
+};
+
+static USBD_MSC_PerfTypeDef MSC_Perf[MSC_PERF_ENTRIES];
+
+/* Command in flight */
+static uint8_t MSC_Perf_Active;
+static uint8_t MSC_Perf_Entry;
+static uint32_t MSC_Perf_Start;
+static volatile uint32_t MSC_Perf_Media;
+#endif /* MSC_PERF_ENABLE */
+/**
+  * @}
+  */
+
+
+/** @defgroup MSC_PERF_Private_Functions
+  * @{
+  */
+
+/**
+* @brief  MSC_Perf_Put32
+*         Store a big endian 32 bit value
+* @param  pbuf: destination
+* @param  value: value
+* @retval None
+*/
+static void MSC_Perf_Put32(uint8_t *pbuf, uint32_t value)
+{
+  pbuf[0] = (uint8_t)(value >> 24);
+  pbuf[1] = (uint8_t)(value >> 16);
+  pbuf[2] = (uint8_t)(value >> 8);
+  pbuf[3] = (uint8_t)value;
+}
+
+/**
+* @brief  MSC_Perf_Init
+*         Start the DWT cycle counter, counters are kept
+* @retval None
+*/
+void MSC_Perf_Init(void)
+{
+#if (MSC_PERF_ENABLE != 0U)
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+
+  MSC_Perf_Active = 0U;
+#endif /* MSC_PERF_ENABLE */
+}
+
+/**
+* @brief  MSC_Perf_Reset
+*         Clear all counters
+* @retval None
+*/
+void MSC_Perf_Reset(void)
+{
+#if (MSC_PERF_ENABLE != 0U)
+  uint8_t i;
+
+  for (i = 0U; i < MSC_PERF_ENTRIES; i++)
+  {
+    (void)USBD_memset(&MSC_Perf[i], 0, sizeof(MSC_Perf[i]));
+  }
+#endif /* MSC_PERF_ENABLE */
+}
+
+/**
+* @brief  MSC_Perf_CmdStart
+*         A new command is decoded
+* @param  opcode: CDB byte 0
+* @retval None
+*/
+void MSC_Perf_CmdStart(uint8_t opcode)
+{
+#if (MSC_PERF_ENABLE != 0U)
+  uint8_t i;
+
+  for (i = 0U; i < (MSC_PERF_ENTRIES - 1U); i++)
+  {
+    if (MSC_Perf_Opcodes[i] == opcode)
+    {
+      break;
+    }
+  }
+
+  MSC_Perf_Entry = i;
+  MSC_Perf_Media = 0U;
+  MSC_Perf_Start = DWT->CYCCNT;
+  MSC_Perf_Active = 1U;
+#else
+  UNUSED(opcode);
+#endif /* MSC_PERF_ENABLE */
+}
+
+/**
+* @brief  MSC_Perf_CmdEnd
+*         The command status is sent, account it to its opcode
+* @param  CSW_Status: CSW status
+* @retval None
+*/
+void MSC_Perf_CmdEnd(uint8_t CSW_Status)
+{
+#if (MSC_PERF_ENABLE != 0U)
+  USBD_MSC_PerfTypeDef *perf = &MSC_Perf[MSC_Perf_Entry];
+  uint32_t cycles = DWT->CYCCNT - MSC_Perf_Start;
+  uint32_t us = cycles / (SystemCoreClock / 1000000U);
+  uint32_t bucket = 0U;
+
+  /* A failed CBW is completed without ever reaching the SCSI layer */
+  if (MSC_Perf_Active == 0U)
+  {
+    return;
+  }
+  MSC_Perf_Active = 0U;
+
+  if (us != 0U)
+  {
+    bucket = 31U - __CLZ(us);
+  }
+  if (bucket >= MSC_PERF_BUCKETS)
+  {
+    bucket = MSC_PERF_BUCKETS - 1U;
+  }
+
+  if ((perf->count == 0U) || (cycles < perf->min_cycles))
+  {
+    perf->min_cycles = cycles;
+  }
+  if (cycles > perf->max_cycles)
+  {
+    perf->max_cycles = cycles;
+  }
+
+  perf->count++;
+  perf->total_cycles += cycles;
+  perf->media_cycles += MSC_Perf_Media;
+  perf->histogram[bucket]++;
+
+  if (CSW_Status != USBD_CSW_CMD_PASSED)
+  {
+    perf->errors++;
+  }
+#else
+  UNUSED(CSW_Status);
+#endif /* MSC_PERF_ENABLE */
+}
+
+/**
+* @brief  MSC_Perf_MediaStart
+*         Called before a storage access
+* @retval timestamp for MSC_Perf_MediaEnd
+*/
+uint32_t MSC_Perf_MediaStart(void)
+{
+#if (MSC_PERF_ENABLE != 0U)
+  return DWT->CYCCNT;
+#else
+  return 0U;
+#endif /* MSC_PERF_ENABLE */
+}
+
+/**
+* @brief  MSC_Perf_MediaEnd
+*         Called after a storage access, adds it to the command media time
+* @param  start: MSC_Perf_MediaStart return value
+* @retval None
+*/
+void MSC_Perf_MediaEnd(uint32_t start)
+{
+#if (MSC_PERF_ENABLE != 0U)
+  MSC_Perf_Media += DWT->CYCCNT - start;
+#else
+  UNUSED(start);
+#endif /* MSC_PERF_ENABLE */
+}
+
+/**
+* @brief  MSC_Perf_Get
+*         Counters of one entry, for on target logging
+* @param  index: entry, 0 to MSC_PERF_ENTRIES - 1
+* @param  opcode: set to the opcode of the entry
+* @retval counters, NULL if index is out of range or counters are compiled out
+*/
+const USBD_MSC_PerfTypeDef *MSC_Perf_Get(uint8_t index, uint8_t *opcode)
+{
+#if (MSC_PERF_ENABLE != 0U)
+  if (index >= MSC_PERF_ENTRIES)
+  {
+    return NULL;
+  }
+
+  *opcode = MSC_Perf_Opcodes[index];
+
+  return &MSC_Perf[index];
+#else
+  UNUSED(index);
+  UNUSED(opcode);
+
+  return NULL;
+#endif /* MSC_PERF_ENABLE */
+}
+
+/**
+* @brief  MSC_Perf_Report
+*         Fill the vendor command report of one entry
+* @param  index: entry, 0 to MSC_PERF_ENTRIES - 1
+* @param  pbuf: MSC_PERF_REPORT_LEN bytes
+* @retval report length, 0 if index is out of range
+*/
+uint16_t MSC_Perf_Report(uint8_t index, uint8_t *pbuf)
+{
+  const USBD_MSC_PerfTypeDef *perf;
+  uint8_t opcode;
+  uint8_t n;
+
+  perf = MSC_Perf_Get(index, &opcode);
+  if (perf == NULL)
+  {
+    return 0U;
+  }
+
+  pbuf[0] = MSC_PERF_ENTRIES;
+  pbuf[1] = opcode;
+  pbuf[2] = MSC_PERF_BUCKETS;
+  pbuf[3] = 0U;
+
+  MSC_Perf_Put32(&pbuf[4], SystemCoreClock);
+  MSC_Perf_Put32(&pbuf[8], perf->count);
+  MSC_Perf_Put32(&pbuf[12], perf->errors);
+  MSC_Perf_Put32(&pbuf[16], (uint32_t)(perf->total_cycles >> 32));
+  MSC_Perf_Put32(&pbuf[20], (uint32_t)perf->total_cycles);
+  MSC_Perf_Put32(&pbuf[24], (uint32_t)(perf->media_cycles >> 32));
+  MSC_Perf_Put32(&pbuf[28], (uint32_t)perf->media_cycles);
+  MSC_Perf_Put32(&pbuf[32], perf->max_cycles);
+  MSC_Perf_Put32(&pbuf[36], perf->min_cycles);
+
+  for (n = 0U; n < MSC_PERF_BUCKETS; n++)
+  {
+    MSC_Perf_Put32(&pbuf[40U + (4U * n)], perf->histogram[n]);
+  }
+
+  return MSC_PERF_REPORT_LEN;
+}
+/**
+  * @}
+  */
+
+
+/**
+  * @}
+  */
+
+
+/**
+  * @}
+  */
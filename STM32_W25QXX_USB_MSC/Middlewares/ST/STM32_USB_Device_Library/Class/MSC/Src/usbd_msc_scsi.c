@@ -92,8 +92,16 @@ static int8_t SCSI_Write12(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *param
 static int8_t SCSI_Read10(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params);
 static int8_t SCSI_Read12(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params);
 static int8_t SCSI_Verify10(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params);
+static int8_t SCSI_SynchronizeCache(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params);
+static int8_t SCSI_Unmap(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params);
+static int8_t SCSI_ProcessUnmap(USBD_HandleTypeDef *pdev, uint8_t lun);
+static int8_t SCSI_ReadPerfStats(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params);
 static int8_t SCSI_CheckAddressRange(USBD_HandleTypeDef *pdev, uint8_t lun,
                                      uint32_t blk_offset, uint32_t blk_nbr);
+static int8_t SCSI_GetPhysicalBlock(USBD_HandleTypeDef *pdev, uint8_t lun,
+                                    uint8_t *exponent, uint16_t *aligned_lba);
+static uint8_t SCSI_IsWriteCached(USBD_HandleTypeDef *pdev, uint8_t lun);
+static uint8_t SCSI_CanUnmap(USBD_HandleTypeDef *pdev, uint8_t lun);
 
 static int8_t SCSI_ProcessRead(USBD_HandleTypeDef *pdev, uint8_t lun);
 static int8_t SCSI_ProcessWrite(USBD_HandleTypeDef *pdev, uint8_t lun);
@@ -123,6 +131,12 @@ int8_t SCSI_ProcessCmd(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *cmd)
   int8_t ret;
   USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
 
+  /* First call of a command, later ones are its data stages */
+  if (hmsc->bot_state == USBD_BOT_IDLE)
+  {
+    MSC_Perf_CmdStart(cmd[0]);
+  }
+
   switch (cmd[0])
   {
   case SCSI_TEST_UNIT_READY:
@@ -185,6 +199,19 @@ int8_t SCSI_ProcessCmd(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *cmd)
     ret = SCSI_Verify10(pdev, lun, cmd);
     break;
 
+  case SCSI_SYNCHRONIZE_CACHE10:
+  case SCSI_SYNCHRONIZE_CACHE16:
+    ret = SCSI_SynchronizeCache(pdev, lun, cmd);
+    break;
+
+  case SCSI_UNMAP:
+    ret = SCSI_Unmap(pdev, lun, cmd);
+    break;
+
+  case SCSI_READ_PERF_STATS:
+    ret = SCSI_ReadPerfStats(pdev, lun, cmd);
+    break;
+
   default:
     SCSI_SenseCode(pdev, lun, ILLEGAL_REQUEST, INVALID_CDB);
     hmsc->bot_status = USBD_BOT_STATUS_ERROR;
@@ -247,6 +274,9 @@ static int8_t SCSI_Inquiry(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *param
 {
   uint8_t *pPage;
   uint16_t len;
+  uint8_t exponent;
+  uint16_t aligned_lba;
+  uint16_t i;
   USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
 
   if (hmsc->cbw.dDataLength == 0U)
@@ -265,6 +295,44 @@ static int8_t SCSI_Inquiry(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *param
     {
       (void)SCSI_UpdateBotData(hmsc, MSC_Page80_Inquiry_Data, LENGTH_INQUIRY_PAGE80);
     }
+    else if (params[2] == 0xB0U) /* Request for VPD page 0xB0 Block Limits */
+    {
+      (void)SCSI_UpdateBotData(hmsc, MSC_PageB0_Inquiry_Data, LENGTH_INQUIRY_PAGEB0);
+
+      if (SCSI_GetPhysicalBlock(pdev, hmsc->cbw.bLUN, &exponent, &aligned_lba) == 0)
+      {
+        /* Optimal transfer length granularity and optimal unmap granularity : one physical block */
+        hmsc->bot_data[6] = (uint8_t)((1U << exponent) >> 8);
+        hmsc->bot_data[7] = (uint8_t)(1U << exponent);
+        hmsc->bot_data[30] = (uint8_t)((1U << exponent) >> 8);
+        hmsc->bot_data[31] = (uint8_t)(1U << exponent);
+
+        /* UGAVALID, unmap granularity alignment */
+        hmsc->bot_data[32] = 0x80U;
+        hmsc->bot_data[34] = (uint8_t)(aligned_lba >> 8);
+        hmsc->bot_data[35] = (uint8_t)aligned_lba;
+      }
+
+      /* No unmap limits for a LUN that can not unmap */
+      if (SCSI_CanUnmap(pdev, hmsc->cbw.bLUN) == 0U)
+      {
+        for (i = 20U; i < 28U; i++)
+        {
+          hmsc->bot_data[i] = 0U;
+        }
+      }
+    }
+    else if (params[2] == 0xB2U) /* Request for VPD page 0xB2 Logical Block Provisioning */
+    {
+      (void)SCSI_UpdateBotData(hmsc, MSC_PageB2_Inquiry_Data, LENGTH_INQUIRY_PAGEB2);
+
+      /* LBPU and thin provisioning, unmapped blocks do not read zero */
+      if (SCSI_CanUnmap(pdev, hmsc->cbw.bLUN) != 0U)
+      {
+        hmsc->bot_data[5] = 0x80U;
+        hmsc->bot_data[6] = 0x02U;
+      }
+    }
     else /* Request Not supported */
     {
       SCSI_SenseCode(pdev, hmsc->cbw.bLUN, ILLEGAL_REQUEST,
@@ -339,6 +407,8 @@ static int8_t SCSI_ReadCapacity16(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t
 {
   UNUSED(params);
   uint8_t idx;
+  uint8_t exponent;
+  uint16_t aligned_lba;
   int8_t ret;
   USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
 
@@ -370,6 +440,20 @@ static int8_t SCSI_ReadCapacity16(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t
   hmsc->bot_data[10] = (uint8_t)(hmsc->scsi_blk_size >>  8);
   hmsc->bot_data[11] = (uint8_t)(hmsc->scsi_blk_size);
 
+  /* Logical blocks per physical block exponent and lowest aligned LBA */
+  if (SCSI_GetPhysicalBlock(pdev, lun, &exponent, &aligned_lba) == 0)
+  {
+    hmsc->bot_data[13] = exponent & 0x0FU;
+    hmsc->bot_data[14] = (uint8_t)(aligned_lba >> 8) & 0x3FU;
+    hmsc->bot_data[15] = (uint8_t)aligned_lba;
+  }
+
+  /* LBPME : logical block provisioning management, UNMAP is supported */
+  if (SCSI_CanUnmap(pdev, lun) != 0U)
+  {
+    hmsc->bot_data[14] |= 0x80U;
+  }
+
   hmsc->bot_data_length = ((uint32_t)params[10] << 24) |
                           ((uint32_t)params[11] << 16) |
                           ((uint32_t)params[12] <<  8) |
@@ -434,7 +518,6 @@ static int8_t SCSI_ReadFormatCapacity(USBD_HandleTypeDef *pdev, uint8_t lun, uin
 */
 static int8_t SCSI_ModeSense6(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params)
 {
-  UNUSED(lun);
   USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
   uint16_t len = MODE_SENSE6_LEN;
 
@@ -445,6 +528,18 @@ static int8_t SCSI_ModeSense6(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *pa
 
   (void)SCSI_UpdateBotData(hmsc, MSC_Mode_Sense6_data, len);
 
+  /* WP : write protected, per LUN */
+  if (((USBD_StorageTypeDef *)pdev->pUserData)->IsWriteProtected(lun) != 0)
+  {
+    hmsc->bot_data[2] |= 0x80U;
+  }
+
+  /* WCE : caching page, write cache enabled, per LUN */
+  if (SCSI_IsWriteCached(pdev, lun) != 0U)
+  {
+    hmsc->bot_data[6] |= 0x04U;
+  }
+
   return 0;
 }
 
@@ -458,7 +553,6 @@ static int8_t SCSI_ModeSense6(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *pa
 */
 static int8_t SCSI_ModeSense10(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params)
 {
-  UNUSED(lun);
   USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
   uint16_t len = MODE_SENSE10_LEN;
 
@@ -469,6 +563,18 @@ static int8_t SCSI_ModeSense10(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *p
 
   (void)SCSI_UpdateBotData(hmsc, MSC_Mode_Sense10_data, len);
 
+  /* WP : write protected, per LUN */
+  if (((USBD_StorageTypeDef *)pdev->pUserData)->IsWriteProtected(lun) != 0)
+  {
+    hmsc->bot_data[3] |= 0x80U;
+  }
+
+  /* WCE : caching page, write cache enabled, per LUN */
+  if (SCSI_IsWriteCached(pdev, lun) != 0U)
+  {
+    hmsc->bot_data[10] |= 0x04U;
+  }
+
   return 0;
 }
 
@@ -561,6 +667,8 @@ static int8_t SCSI_StartStopUnit(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t
 {
   UNUSED(lun);
   USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+  uint32_t start;
+  int8_t ret;
 
   if ((hmsc->scsi_medium_state == SCSI_MEDIUM_LOCKED) && ((params[4] & 0x3U) == 2U))
   {
@@ -569,6 +677,20 @@ static int8_t SCSI_StartStopUnit(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t
     return -1;
   }
 
+  if (((params[4] & 0x1U) == 0U) &&
+      (((USBD_StorageTypeDef *)pdev->pUserData)->SyncCache != NULL)) /* START=0 */
+  {
+    start = MSC_Perf_MediaStart();
+    ret = ((USBD_StorageTypeDef *)pdev->pUserData)->SyncCache(lun);
+    MSC_Perf_MediaEnd(start);
+
+    if (ret != 0)
+    {
+      SCSI_SenseCode(pdev, lun, HARDWARE_ERROR, WRITE_FAULT);
+      return -1;
+    }
+  }
+
   if ((params[4] & 0x3U) == 0x1U) /* START=1 */
   {
     hmsc->scsi_medium_state = SCSI_MEDIUM_UNLOCKED;
@@ -672,6 +794,7 @@ static int8_t SCSI_Read10(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params
     }
 
     hmsc->bot_state = USBD_BOT_DATA_IN;
+    (void)MSC_BOT_CancelNext(pdev);
   }
   hmsc->bot_data_length = MSC_MEDIA_PACKET;
 
@@ -735,6 +858,7 @@ static int8_t SCSI_Read12(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params
     }
 
     hmsc->bot_state = USBD_BOT_DATA_IN;
+    (void)MSC_BOT_CancelNext(pdev);
   }
   hmsc->bot_data_length = MSC_MEDIA_PACKET;
 
@@ -811,6 +935,7 @@ static int8_t SCSI_Write10(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *param
 
     /* Prepare EP to receive first data packet */
     hmsc->bot_state = USBD_BOT_DATA_OUT;
+    (void)MSC_BOT_CancelNext(pdev);
     (void)USBD_LL_PrepareReceive(pdev, MSC_EPOUT_ADDR, hmsc->bot_data, len);
   }
   else /* Write Process ongoing */
@@ -895,6 +1020,7 @@ static int8_t SCSI_Write12(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *param
 
     /* Prepare EP to receive first data packet */
     hmsc->bot_state = USBD_BOT_DATA_OUT;
+    (void)MSC_BOT_CancelNext(pdev);
     (void)USBD_LL_PrepareReceive(pdev, MSC_EPOUT_ADDR, hmsc->bot_data, len);
   }
   else /* Write Process ongoing */
@@ -933,9 +1059,211 @@ static int8_t SCSI_Verify10(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *para
   return 0;
 }
 
+/**
+* @brief  SCSI_SynchronizeCache
+*         Process Synchronize Cache 10/16 command, the whole cache is
+*         written back whatever the LBA range
+* @param  lun: Logical unit number
+* @param  params: Command parameters
+* @retval status
+*/
+static int8_t SCSI_SynchronizeCache(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params)
+{
+  UNUSED(params);
+  USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+  uint32_t start;
+  int8_t ret;
+
+  if (((USBD_StorageTypeDef *)pdev->pUserData)->SyncCache != NULL)
+  {
+    start = MSC_Perf_MediaStart();
+    ret = ((USBD_StorageTypeDef *)pdev->pUserData)->SyncCache(lun);
+    MSC_Perf_MediaEnd(start);
+
+    if (ret != 0)
+    {
+      SCSI_SenseCode(pdev, lun, HARDWARE_ERROR, WRITE_FAULT);
+      return -1;
+    }
+  }
+
+  hmsc->bot_data_length = 0U;
+
+  return 0;
+}
+
+/**
+* @brief  SCSI_Unmap
+*         Process Unmap command, the parameter list is received in
+*         bot_data then every block descriptor is passed to the storage
+* @param  lun: Logical unit number
+* @param  params: Command parameters
+* @retval status
+*/
+static int8_t SCSI_Unmap(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params)
+{
+  USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+  uint32_t len;
+
+  if (hmsc->bot_state != USBD_BOT_IDLE) /* Parameter list received */
+  {
+    return SCSI_ProcessUnmap(pdev, lun);
+  }
+
+  if (SCSI_CanUnmap(pdev, lun) == 0U)
+  {
+    SCSI_SenseCode(pdev, lun, ILLEGAL_REQUEST, INVALID_CDB);
+    return -1;
+  }
+
+  len = ((uint32_t)params[7] << 8) | (uint32_t)params[8];
+
+  /* Empty parameter list : nothing to unmap */
+  if (len == 0U)
+  {
+    hmsc->bot_data_length = 0U;
+    return 0;
+  }
+
+  /* case 8 : Hi <> Do, cases 3,11,13 : Hn,Ho <> D0 */
+  if (((hmsc->cbw.bmFlags & 0x80U) == 0x80U) || (hmsc->cbw.dDataLength != len) ||
+      (len > MSC_MEDIA_PACKET))
+  {
+    SCSI_SenseCode(pdev, hmsc->cbw.bLUN, ILLEGAL_REQUEST, INVALID_CDB);
+    return -1;
+  }
+
+  if (((USBD_StorageTypeDef *)pdev->pUserData)->IsReady(lun) != 0)
+  {
+    SCSI_SenseCode(pdev, lun, NOT_READY, MEDIUM_NOT_PRESENT);
+    return -1;
+  }
+
+  if (((USBD_StorageTypeDef *)pdev->pUserData)->IsWriteProtected(lun) != 0)
+  {
+    SCSI_SenseCode(pdev, lun, NOT_READY, WRITE_PROTECTED);
+    return -1;
+  }
+
+  /* Prepare EP to receive the parameter list */
+  hmsc->bot_state = USBD_BOT_DATA_OUT;
+  (void)USBD_LL_PrepareReceive(pdev, MSC_EPOUT_ADDR, hmsc->bot_data, len);
+
+  return 0;
+}
+
+/**
+* @brief  SCSI_ProcessUnmap
+*         Walk the Unmap block descriptors received in bot_data
+* @param  lun: Logical unit number
+* @retval status
+*/
+static int8_t SCSI_ProcessUnmap(USBD_HandleTypeDef *pdev, uint8_t lun)
+{
+  USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+  uint32_t len = hmsc->cbw.dDataLength;
+  uint32_t desc_len;
+  uint32_t blk_addr;
+  uint32_t blk_len;
+  uint8_t *desc;
+  uint32_t start;
+  int8_t ret;
+
+  hmsc->csw.dDataResidue -= len;
+
+  desc_len = ((uint32_t)hmsc->bot_data[2] << 8) | (uint32_t)hmsc->bot_data[3];
+
+  if ((len < 8U) || ((desc_len + 8U) > len) || ((desc_len % 16U) != 0U))
+  {
+    SCSI_SenseCode(pdev, lun, ILLEGAL_REQUEST, INVALID_FIELD_IN_PARAMETER_LIST);
+    return -1;
+  }
+
+  for (desc = &hmsc->bot_data[8]; desc < &hmsc->bot_data[8U + desc_len]; desc += 16U)
+  {
+    blk_addr = ((uint32_t)desc[4] << 24) |
+               ((uint32_t)desc[5] << 16) |
+               ((uint32_t)desc[6] <<  8) |
+                (uint32_t)desc[7];
+
+    blk_len = ((uint32_t)desc[8] << 24) |
+              ((uint32_t)desc[9] << 16) |
+              ((uint32_t)desc[10] <<  8) |
+               (uint32_t)desc[11];
+
+    /* upper 32 bits of the 64 bit LBA must be zero */
+    if ((desc[0] | desc[1] | desc[2] | desc[3]) != 0U)
+    {
+      SCSI_SenseCode(pdev, lun, ILLEGAL_REQUEST, ADDRESS_OUT_OF_RANGE);
+      return -1;
+    }
+
+    if (blk_len == 0U)
+    {
+      continue;
+    }
+
+    if (SCSI_CheckAddressRange(pdev, lun, blk_addr, blk_len) < 0)
+    {
+      return -1; /* error */
+    }
+
+    start = MSC_Perf_MediaStart();
+    ret = ((USBD_StorageTypeDef *)pdev->pUserData)->Unmap(lun, blk_addr, blk_len);
+    MSC_Perf_MediaEnd(start);
+
+    if (ret != 0)
+    {
+      SCSI_SenseCode(pdev, lun, HARDWARE_ERROR, WRITE_FAULT);
+      return -1;
+    }
+  }
+
+  MSC_BOT_SendCSW(pdev, USBD_CSW_CMD_PASSED);
+
+  return 0;
+}
+
+/**
+* @brief  SCSI_ReadPerfStats
+*         Process the vendor command returning the counters of one opcode,
+*         report layout in usbd_msc_perf.c
+* @param  lun: Logical unit number
+* @param  params: Command parameters
+* @retval status
+*/
+static int8_t SCSI_ReadPerfStats(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t *params)
+{
+  USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+  uint16_t len;
+
+  if (hmsc->cbw.dDataLength == 0U)
+  {
+    SCSI_SenseCode(pdev, lun, ILLEGAL_REQUEST, INVALID_CDB);
+    return -1;
+  }
+
+  len = MSC_Perf_Report(params[2], hmsc->bot_data);
+  if (len == 0U)
+  {
+    SCSI_SenseCode(pdev, lun, ILLEGAL_REQUEST, INVALID_FIELED_IN_COMMAND);
+    return -1;
+  }
+
+  if ((params[1] & 0x01U) != 0U)
+  {
+    MSC_Perf_Reset();
+  }
+
+  hmsc->bot_data_length = MIN(len, ((uint16_t)params[3] << 8) | (uint16_t)params[4]);
+
+  return 0;
+}
+
 /**
 * @brief  SCSI_CheckAddressRange
-*         Check address range
+*         Check address range against the capacity of this LUN, each
+*         LUN may have its own block count and size
 * @param  lun: Logical unit number
 * @param  blk_offset: first block address
 * @param  blk_nbr: number of block to be processed
@@ -946,7 +1274,14 @@ static int8_t SCSI_CheckAddressRange(USBD_HandleTypeDef *pdev, uint8_t lun,
 {
   USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
 
-  if ((blk_offset + blk_nbr) > hmsc->scsi_blk_nbr)
+  if (((USBD_StorageTypeDef *)pdev->pUserData)->GetCapacity(lun, &hmsc->scsi_blk_nbr,
+                                                  &hmsc->scsi_blk_size) != 0)
+  {
+    SCSI_SenseCode(pdev, lun, NOT_READY, MEDIUM_NOT_PRESENT);
+    return -1;
+  }
+
+  if ((blk_nbr > hmsc->scsi_blk_nbr) || (blk_offset > (hmsc->scsi_blk_nbr - blk_nbr)))
   {
     SCSI_SenseCode(pdev, lun, ILLEGAL_REQUEST, ADDRESS_OUT_OF_RANGE);
     return -1;
@@ -955,9 +1290,80 @@ static int8_t SCSI_CheckAddressRange(USBD_HandleTypeDef *pdev, uint8_t lun,
   return 0;
 }
 
+/**
+* @brief  SCSI_GetPhysicalBlock
+*         Get the logical blocks per physical block exponent of the medium
+* @param  lun: Logical unit number
+* @param  exponent: physical block is (1 << exponent) logical blocks
+* @param  aligned_lba: first logical block aligned on a physical block
+* @retval status, -1 when the medium does not report a physical block
+*/
+static int8_t SCSI_GetPhysicalBlock(USBD_HandleTypeDef *pdev, uint8_t lun,
+                                    uint8_t *exponent, uint16_t *aligned_lba)
+{
+  USBD_StorageTypeDef *pStorage = (USBD_StorageTypeDef *)pdev->pUserData;
+
+  *exponent = 0U;
+  *aligned_lba = 0U;
+
+  if (pStorage->GetPhysicalBlock == NULL)
+  {
+    return -1;
+  }
+
+  if (pStorage->GetPhysicalBlock(lun, exponent, aligned_lba) != 0)
+  {
+    *exponent = 0U;
+    *aligned_lba = 0U;
+    return -1;
+  }
+
+  return 0;
+}
+
+/**
+* @brief  SCSI_IsWriteCached
+*         Tell whether writes to the LUN may stay in a volatile cache
+*         until SYNCHRONIZE CACHE, reported as WCE in the caching page
+* @param  lun: Logical unit number
+* @retval 1 when written data is cached, 0 otherwise
+*/
+static uint8_t SCSI_IsWriteCached(USBD_HandleTypeDef *pdev, uint8_t lun)
+{
+  USBD_StorageTypeDef *pStorage = (USBD_StorageTypeDef *)pdev->pUserData;
+
+  if ((pStorage->IsWriteCached == NULL) || (pStorage->IsWriteCached(lun) == 0))
+  {
+    return 0U;
+  }
+
+  return 1U;
+}
+
+/**
+* @brief  SCSI_CanUnmap
+*         Tell whether the LUN releases blocks on UNMAP, reported as
+*         LBPME in READ CAPACITY(16) and LBPU in VPD page 0xB2
+* @param  lun: Logical unit number
+* @retval 1 when UNMAP is supported, 0 otherwise
+*/
+static uint8_t SCSI_CanUnmap(USBD_HandleTypeDef *pdev, uint8_t lun)
+{
+  USBD_StorageTypeDef *pStorage = (USBD_StorageTypeDef *)pdev->pUserData;
+
+  if ((pStorage->Unmap == NULL) || (pStorage->CanUnmap == NULL) ||
+      (pStorage->CanUnmap(lun) == 0))
+  {
+    return 0U;
+  }
+
+  return 1U;
+}
+
 /**
 * @brief  SCSI_ProcessRead
-*         Handle Read Process
+*         Handle Read Process, the next packet is fetched into bot_next
+*         by MSC_BOT_Process while the current one is transmitted
 * @param  lun: Logical unit number
 * @retval status
 */
@@ -965,16 +1371,44 @@ static int8_t SCSI_ProcessRead(USBD_HandleTypeDef *pdev, uint8_t lun)
 {
   USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
   uint32_t len = hmsc->scsi_blk_len * hmsc->scsi_blk_size;
+  uint8_t *pBuff;
+  uint32_t start;
+  int8_t ret;
 
   len = MIN(len, MSC_MEDIA_PACKET);
 
-  if (((USBD_StorageTypeDef *)pdev->pUserData)->Read(lun, hmsc->bot_data,
-                                                     hmsc->scsi_blk_addr,
-                                                     (len / hmsc->scsi_blk_size)) < 0)
+  if (hmsc->bot_next_state == USBD_BOT_NEXT_NONE) /* First packet */
+  {
+    start = MSC_Perf_MediaStart();
+    ret = ((USBD_StorageTypeDef *)pdev->pUserData)->Read(lun, hmsc->bot_data,
+                                                         hmsc->scsi_blk_addr,
+                                                         (len / hmsc->scsi_blk_size));
+    MSC_Perf_MediaEnd(start);
+
+    if (ret < 0)
+    {
+      SCSI_SenseCode(pdev, lun, HARDWARE_ERROR, UNRECOVERED_READ_ERROR);
+      return -1;
+    }
+  }
+  else if (hmsc->bot_next_state == USBD_BOT_NEXT_READY)
+  {
+    pBuff = hmsc->bot_data;
+    hmsc->bot_data = hmsc->bot_next;
+    hmsc->bot_next = pBuff;
+    hmsc->bot_next_state = USBD_BOT_NEXT_NONE;
+  }
+  else if (hmsc->bot_next_state == USBD_BOT_NEXT_ERROR)
   {
+    hmsc->bot_next_state = USBD_BOT_NEXT_NONE;
     SCSI_SenseCode(pdev, lun, HARDWARE_ERROR, UNRECOVERED_READ_ERROR);
     return -1;
   }
+  else /* Still fetching, sent from SCSI_ProcessNextCplt */
+  {
+    hmsc->bot_next_stalled = 1U;
+    return 0;
+  }
 
   (void)USBD_LL_Transmit(pdev, MSC_EPIN_ADDR, hmsc->bot_data, len);
 
@@ -988,42 +1422,54 @@ static int8_t SCSI_ProcessRead(USBD_HandleTypeDef *pdev, uint8_t lun)
   {
     hmsc->bot_state = USBD_BOT_LAST_DATA_IN;
   }
+  else
+  {
+    /* Fetch next packet while this one is on the bus */
+    len = MIN((hmsc->scsi_blk_len * hmsc->scsi_blk_size), MSC_MEDIA_PACKET);
+
+    hmsc->bot_next_addr = hmsc->scsi_blk_addr;
+    hmsc->bot_next_len = len / hmsc->scsi_blk_size;
+    hmsc->bot_next_state = USBD_BOT_NEXT_READ;
+  }
 
   return 0;
 }
 
 /**
 * @brief  SCSI_ProcessWrite
-*         Handle Write Process
+*         Handle Write Process, the received packet is handed to
+*         MSC_BOT_Process and the next one is received in the other buffer
 * @param  lun: Logical unit number
 * @retval status
 */
 static int8_t SCSI_ProcessWrite(USBD_HandleTypeDef *pdev, uint8_t lun)
 {
+  UNUSED(lun);
   USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
   uint32_t len = hmsc->scsi_blk_len * hmsc->scsi_blk_size;
+  uint8_t *pBuff;
 
-  len = MIN(len, MSC_MEDIA_PACKET);
-
-  if (((USBD_StorageTypeDef *)pdev->pUserData)->Write(lun, hmsc->bot_data,
-                                                      hmsc->scsi_blk_addr,
-                                                      (len / hmsc->scsi_blk_size)) < 0)
+  /* Previous packet still being written, resumed from SCSI_ProcessNextCplt */
+  if (hmsc->bot_next_state != USBD_BOT_NEXT_NONE)
   {
-    SCSI_SenseCode(pdev, lun, HARDWARE_ERROR, WRITE_FAULT);
-    return -1;
+    hmsc->bot_next_stalled = 1U;
+    return 0;
   }
 
+  len = MIN(len, MSC_MEDIA_PACKET);
+
+  pBuff = hmsc->bot_next;
+  hmsc->bot_next = hmsc->bot_data;
+  hmsc->bot_data = pBuff;
+
+  hmsc->bot_next_addr = hmsc->scsi_blk_addr;
+  hmsc->bot_next_len = len / hmsc->scsi_blk_size;
+  hmsc->bot_next_state = USBD_BOT_NEXT_WRITE;
+
   hmsc->scsi_blk_addr += (len / hmsc->scsi_blk_size);
   hmsc->scsi_blk_len -= (len / hmsc->scsi_blk_size);
 
-  /* case 12 : Ho = Do */
-  hmsc->csw.dDataResidue -= len;
-
-  if (hmsc->scsi_blk_len == 0U)
-  {
-    MSC_BOT_SendCSW(pdev, USBD_CSW_CMD_PASSED);
-  }
-  else
+  if (hmsc->scsi_blk_len != 0U)
   {
     len = MIN((hmsc->scsi_blk_len * hmsc->scsi_blk_size), MSC_MEDIA_PACKET);
 
@@ -1034,6 +1480,77 @@ static int8_t SCSI_ProcessWrite(USBD_HandleTypeDef *pdev, uint8_t lun)
   return 0;
 }
 
+/**
+* @brief  SCSI_ProcessNextCplt
+*         Called by MSC_BOT_Process with interrupts masked once the
+*         storage access on bot_next is done
+* @param  lun: Logical unit number
+* @param  status: storage Read/Write return value
+* @retval None
+*/
+void SCSI_ProcessNextCplt(USBD_HandleTypeDef *pdev, uint8_t lun, int8_t status)
+{
+  USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+  uint8_t stalled = hmsc->bot_next_stalled;
+
+  hmsc->bot_next_stalled = 0U;
+
+  /* Cancelled by a reset or a new command, a data stage that waited for
+     storage to return starts now */
+  if (hmsc->bot_next_state == USBD_BOT_NEXT_CANCELLED)
+  {
+    hmsc->bot_next_state = USBD_BOT_NEXT_NONE;
+
+    if ((stalled != 0U) && (hmsc->bot_state == USBD_BOT_DATA_OUT))
+    {
+      (void)SCSI_ProcessWrite(pdev, lun);
+    }
+    else if ((stalled != 0U) && (hmsc->bot_state == USBD_BOT_DATA_IN) &&
+             (SCSI_ProcessRead(pdev, lun) < 0))
+    {
+      MSC_BOT_SendCSW(pdev, USBD_CSW_CMD_FAILED);
+    }
+    return;
+  }
+
+  if (hmsc->bot_state == USBD_BOT_DATA_OUT)
+  {
+    hmsc->bot_next_state = USBD_BOT_NEXT_NONE;
+
+    if (status < 0)
+    {
+      SCSI_SenseCode(pdev, lun, HARDWARE_ERROR, WRITE_FAULT);
+      MSC_BOT_SendCSW(pdev, USBD_CSW_CMD_FAILED);
+      return;
+    }
+
+    /* case 12 : Ho = Do */
+    hmsc->csw.dDataResidue -= hmsc->bot_next_len * hmsc->scsi_blk_size;
+
+    if (stalled != 0U)
+    {
+      (void)SCSI_ProcessWrite(pdev, lun);
+    }
+    else if (hmsc->scsi_blk_len == 0U)
+    {
+      MSC_BOT_SendCSW(pdev, USBD_CSW_CMD_PASSED);
+    }
+  }
+  else if (hmsc->bot_state == USBD_BOT_DATA_IN)
+  {
+    hmsc->bot_next_state = (status < 0) ? USBD_BOT_NEXT_ERROR : USBD_BOT_NEXT_READY;
+
+    if ((stalled != 0U) && (SCSI_ProcessRead(pdev, lun) < 0))
+    {
+      MSC_BOT_SendCSW(pdev, USBD_CSW_CMD_FAILED);
+    }
+  }
+  else
+  {
+    hmsc->bot_next_state = USBD_BOT_NEXT_NONE;
+  }
+}
+
 
 /**
 * @brief  SCSI_UpdateBotData
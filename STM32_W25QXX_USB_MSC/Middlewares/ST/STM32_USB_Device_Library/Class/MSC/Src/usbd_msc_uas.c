@@ -0,0 +1,814 @@
+/**
+  ******************************************************************************
+  * @file    usbd_msc_uas.c
+  * @author  gitz
+  * @brief   This file provides the USB Attached SCSI (UAS) transport.
+  *
+  * @verbatim
+  *
+  *          ===================================================================
+  *                                UAS Transport Description
+  *          ===================================================================
+  *           Selected by alternate setting 1 of the mass storage interface,
+  *           alternate setting 0 keeps Bulk-Only Transport for other hosts.
+  *           Four pipes, command (MSC_UAS_CMD_ADDR), status (MSC_UAS_STATUS_ADDR),
+  *           data in (MSC_EPIN_ADDR) and data out (MSC_EPOUT_ADDR), the data
+  *           pipes are the BOT endpoints so the SCSI layer drives them unchanged.
+  *
+  *           Command IUs are accepted into USBD_UAS_QUEUE_DEPTH tagged slots
+  *           while one command runs on the data pipes. The next one is picked
+  *           when the running one completes: head of queue tasks first, then
+  *           the oldest simple task whose LUN is not busy (IsBusy), so commands
+  *           for an idle LUN complete while the flash finishes an erase.
+  *           Ordered tasks are never passed.
+  *
+  *           USB 2.0 flow without streams: READ READY / WRITE READY IU on the
+  *           status pipe before the data phase, SENSE IU after it.
+  *
+  *  @endverbatim
+  *
+  ******************************************************************************
+  */
+
+/* Includes ------------------------------------------------------------------*/
+#include "usbd_msc_uas.h"
+#include "usbd_msc.h"
+#include "usbd_msc_scsi.h"
+#include "usbd_ioreq.h"
+
+/** @addtogroup STM32_USB_DEVICE_LIBRARY
+  * @{
+  */
+
+
+/** @defgroup MSC_UAS
+  * @brief UAS protocol module
+  * @{
+  */
+
+/** @defgroup MSC_UAS_Private_FunctionPrototypes
+  * @{
+  */
+static void MSC_UAS_Start(USBD_HandleTypeDef *pdev, uint8_t slot);
+static void MSC_UAS_Schedule(USBD_HandleTypeDef *pdev);
+static void MSC_UAS_TaskMgmt(USBD_HandleTypeDef *pdev, uint8_t *iu);
+static void MSC_UAS_Abort(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t all_luns);
+static void MSC_UAS_Rearm(USBD_HandleTypeDef *pdev);
+static uint8_t MSC_UAS_FindTag(USBD_MSC_UAS_HandleTypeDef *huas, uint16_t tag);
+static uint8_t MSC_UAS_FreeSlot(USBD_MSC_UAS_HandleTypeDef *huas);
+static uint32_t MSC_UAS_DataLength(USBD_HandleTypeDef *pdev, uint8_t lun,
+                                   uint8_t *cdb, uint8_t *flags);
+static void MSC_UAS_SendReady(USBD_HandleTypeDef *pdev, uint8_t iu_id);
+static void MSC_UAS_SendResponse(USBD_HandleTypeDef *pdev, uint16_t tag, uint8_t code);
+static void MSC_UAS_QueueStatus(USBD_HandleTypeDef *pdev, uint8_t *iu, uint8_t len);
+static void MSC_UAS_StatusNext(USBD_HandleTypeDef *pdev);
+/**
+  * @}
+  */
+
+
+/** @defgroup MSC_UAS_Private_Functions
+  * @{
+  */
+
+
+/**
+* @brief  MSC_UAS_Init
+*         Initialize the UAS transport, called when alternate setting 1 is selected
+* @param  pdev: device instance
+* @retval None
+*/
+void MSC_UAS_Init(USBD_HandleTypeDef *pdev)
+{
+  USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+  USBD_MSC_UAS_HandleTypeDef *huas = &hmsc->uas;
+  uint8_t i;
+
+  hmsc->bot_state = USBD_BOT_IDLE;
+  hmsc->bot_status = USBD_BOT_STATUS_NORMAL;
+
+  hmsc->bot_data = hmsc->bot_buffer[0];
+  hmsc->bot_next = hmsc->bot_buffer[1];
+  (void)MSC_BOT_CancelNext(pdev);
+
+  for (i = 0U; i < USBD_UAS_QUEUE_DEPTH; i++)
+  {
+    huas->slot[i].state = USBD_UAS_SLOT_FREE;
+  }
+
+  huas->active = USBD_UAS_NO_SLOT;
+  huas->seq = 0U;
+  huas->status_head = 0U;
+  huas->status_count = 0U;
+  huas->status_busy = 0U;
+
+  (void)USBD_LL_FlushEP(pdev, MSC_UAS_CMD_ADDR);
+  (void)USBD_LL_FlushEP(pdev, MSC_UAS_STATUS_ADDR);
+  (void)USBD_LL_FlushEP(pdev, MSC_EPOUT_ADDR);
+  (void)USBD_LL_FlushEP(pdev, MSC_EPIN_ADDR);
+
+  /* Prepare command pipe to receive the first command IU */
+  huas->rx_slot = 0U;
+  (void)USBD_LL_PrepareReceive(pdev, MSC_UAS_CMD_ADDR, huas->slot[0].iu,
+                               USBD_UAS_COMMAND_IU_LENGTH);
+}
+
+/**
+* @brief  MSC_UAS_DeInit
+*         Drop queued commands, called when leaving alternate setting 1
+* @param  pdev: device instance
+* @retval None
+*/
+void MSC_UAS_DeInit(USBD_HandleTypeDef *pdev)
+{
+  USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+  uint8_t i;
+
+  for (i = 0U; i < USBD_UAS_QUEUE_DEPTH; i++)
+  {
+    hmsc->uas.slot[i].state = USBD_UAS_SLOT_FREE;
+  }
+
+  hmsc->uas.active = USBD_UAS_NO_SLOT;
+  hmsc->uas.status_count = 0U;
+  hmsc->uas.status_busy = 0U;
+  hmsc->bot_state = USBD_BOT_IDLE;
+  (void)MSC_BOT_CancelNext(pdev);
+}
+
+/**
+* @brief  MSC_UAS_CommandOut
+*         Queue the command IU received on the command pipe, or answer a
+*         task management IU
+* @param  pdev: device instance
+* @param  epnum: endpoint index
+* @retval None
+*/
+void MSC_UAS_CommandOut(USBD_HandleTypeDef *pdev, uint8_t epnum)
+{
+  UNUSED(epnum);
+
+  USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+  USBD_MSC_UAS_HandleTypeDef *huas = &hmsc->uas;
+  uint8_t *iu = huas->slot[huas->rx_slot].iu;
+  uint32_t len = USBD_LL_GetRxDataSize(pdev, MSC_UAS_CMD_ADDR);
+  uint16_t tag = ((uint16_t)iu[2] << 8) | (uint16_t)iu[3];
+
+  if ((iu[0] == USBD_UAS_IU_COMMAND) && (len == USBD_UAS_COMMAND_IU_LENGTH))
+  {
+    if ((iu[6] >> 2) != 0U) /* Additional CDB bytes not supported */
+    {
+      MSC_UAS_SendResponse(pdev, tag, USBD_UAS_RC_INVALID_IU);
+    }
+    else if ((iu[8] != 0U) ||
+             (iu[9] > (uint8_t)((USBD_StorageTypeDef *)pdev->pUserData)->GetMaxLun()))
+    {
+      MSC_UAS_SendResponse(pdev, tag, USBD_UAS_RC_INCORRECT_LUN);
+    }
+    else if (MSC_UAS_FindTag(huas, tag) != USBD_UAS_NO_SLOT)
+    {
+      MSC_UAS_SendResponse(pdev, tag, USBD_UAS_RC_OVERLAPPED_TAG);
+    }
+    else
+    {
+      huas->slot[huas->rx_slot].state = USBD_UAS_SLOT_QUEUED;
+      huas->slot[huas->rx_slot].seq = huas->seq++;
+    }
+  }
+  else if ((iu[0] == USBD_UAS_IU_TASK_MGMT) && (len >= USBD_UAS_TASK_MGMT_IU_LENGTH))
+  {
+    MSC_UAS_TaskMgmt(pdev, iu);
+  }
+  else
+  {
+    MSC_UAS_SendResponse(pdev, tag, USBD_UAS_RC_INVALID_IU);
+  }
+
+  /* Queue or status pipe full, the host is NAKed until room is made */
+  huas->rx_slot = USBD_UAS_NO_SLOT;
+  MSC_UAS_Rearm(pdev);
+
+  MSC_UAS_Schedule(pdev);
+}
+
+/**
+* @brief  MSC_UAS_StatusIn
+*         Status pipe IU sent, send the next one and start a queued command
+* @param  pdev: device instance
+* @param  epnum: endpoint index
+* @retval None
+*/
+void MSC_UAS_StatusIn(USBD_HandleTypeDef *pdev, uint8_t epnum)
+{
+  UNUSED(epnum);
+
+  USBD_MSC_UAS_HandleTypeDef *huas = &((USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData)->uas;
+
+  if (huas->status_count != 0U)
+  {
+    huas->status_head = (huas->status_head + 1U) % USBD_UAS_STATUS_DEPTH;
+    huas->status_count--;
+  }
+
+  MSC_UAS_StatusNext(pdev);
+  MSC_UAS_Rearm(pdev);
+  MSC_UAS_Schedule(pdev);
+}
+
+/**
+* @brief  MSC_UAS_SendStatus
+*         Complete the running command with a SENSE IU, called through
+*         MSC_BOT_SendCSW so the SCSI layer is transport agnostic
+* @param  pdev: device instance
+* @param  CSW_Status : CSW status
+* @retval None
+*/
+void MSC_UAS_SendStatus(USBD_HandleTypeDef *pdev, uint8_t CSW_Status)
+{
+  USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+  USBD_MSC_UAS_HandleTypeDef *huas = &hmsc->uas;
+  uint8_t iu[USBD_UAS_MAX_IU_LENGTH] = {0U};
+  uint8_t len = USBD_UAS_SENSE_IU_LENGTH;
+  uint8_t *sense = &iu[USBD_UAS_SENSE_IU_LENGTH];
+
+  iu[0] = USBD_UAS_IU_SENSE;
+  iu[2] = (uint8_t)(hmsc->cbw.dTag >> 8);
+  iu[3] = (uint8_t)hmsc->cbw.dTag;
+  iu[6] = USBD_UAS_STATUS_GOOD;
+
+  if (CSW_Status != USBD_CSW_CMD_PASSED)
+  {
+    /* Autosense, same fixed format as REQUEST SENSE */
+    iu[6] = USBD_UAS_STATUS_CHECK_CONDITION;
+    iu[15] = REQUEST_SENSE_DATA_LEN;
+    len += REQUEST_SENSE_DATA_LEN;
+
+    sense[0] = 0x70U;
+    sense[7] = REQUEST_SENSE_DATA_LEN - 8U;
+
+    if (hmsc->scsi_sense_head != hmsc->scsi_sense_tail)
+    {
+      sense[2] = (uint8_t)hmsc->scsi_sense[hmsc->scsi_sense_head].Skey;
+      sense[12] = (uint8_t)hmsc->scsi_sense[hmsc->scsi_sense_head].w.b.ASC;
+      sense[13] = (uint8_t)hmsc->scsi_sense[hmsc->scsi_sense_head].w.b.ASCQ;
+      hmsc->scsi_sense_head++;
+
+      if (hmsc->scsi_sense_head == SENSE_LIST_DEEPTH)
+      {
+        hmsc->scsi_sense_head = 0U;
+      }
+    }
+  }
+
+  hmsc->bot_state = USBD_BOT_IDLE;
+
+  /* Next command is started once the IU is on the bus, see MSC_UAS_StatusIn,
+     queued before the slot is freed so MSC_UAS_FreeSlot counts it */
+  MSC_UAS_QueueStatus(pdev, iu, len);
+
+  if (huas->active != USBD_UAS_NO_SLOT)
+  {
+    huas->slot[huas->active].state = USBD_UAS_SLOT_FREE;
+    huas->active = USBD_UAS_NO_SLOT;
+    MSC_UAS_Rearm(pdev);
+  }
+}
+
+/**
+* @brief  MSC_UAS_Resume
+*         Called by MSC_BOT_Process once a storage access cancelled by
+*         MSC_UAS_Abort has returned, starts the command held back meanwhile
+* @param  pdev: device instance
+* @retval None
+*/
+void MSC_UAS_Resume(USBD_HandleTypeDef *pdev)
+{
+  MSC_UAS_Schedule(pdev);
+}
+
+/**
+* @brief  MSC_UAS_Start
+*         Run a queued command through the SCSI layer, the CBW is filled
+*         from the command IU so the SCSI checks apply as for BOT
+* @param  pdev: device instance
+* @param  slot: queued command
+* @retval None
+*/
+static void MSC_UAS_Start(USBD_HandleTypeDef *pdev, uint8_t slot)
+{
+  USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+  uint8_t *iu = hmsc->uas.slot[slot].iu;
+  uint8_t lun = iu[9];
+  uint8_t i;
+
+  hmsc->uas.slot[slot].state = USBD_UAS_SLOT_ACTIVE;
+  hmsc->uas.active = slot;
+
+  for (i = 0U; i < 16U; i++)
+  {
+    hmsc->cbw.CB[i] = iu[16U + i];
+  }
+
+  hmsc->cbw.dTag = ((uint32_t)iu[2] << 8) | (uint32_t)iu[3];
+  hmsc->cbw.bLUN = lun;
+  hmsc->cbw.bCBLength = 16U;
+  hmsc->cbw.dDataLength = MSC_UAS_DataLength(pdev, lun, &hmsc->cbw.CB[0], &hmsc->cbw.bmFlags);
+
+  hmsc->csw.dTag = hmsc->cbw.dTag;
+  hmsc->csw.dDataResidue = hmsc->cbw.dDataLength;
+
+  hmsc->bot_state = USBD_BOT_IDLE;
+  hmsc->bot_status = USBD_BOT_STATUS_NORMAL;
+  hmsc->bot_data_length = 0U;
+
+  if (SCSI_ProcessCmd(pdev, lun, &hmsc->cbw.CB[0]) < 0)
+  {
+    MSC_UAS_SendStatus(pdev, USBD_CSW_CMD_FAILED);
+  }
+  /* Burst xfer, data already queued on the data pipe */
+  else if ((hmsc->bot_state == USBD_BOT_DATA_IN) ||
+           (hmsc->bot_state == USBD_BOT_LAST_DATA_IN))
+  {
+    MSC_UAS_SendReady(pdev, USBD_UAS_IU_READ_READY);
+  }
+  else if (hmsc->bot_state == USBD_BOT_DATA_OUT)
+  {
+    MSC_UAS_SendReady(pdev, USBD_UAS_IU_WRITE_READY);
+  }
+  else if ((hmsc->bot_data_length > 0U) && (hmsc->cbw.dDataLength > 0U))
+  {
+    hmsc->bot_state = USBD_BOT_SEND_DATA;
+    (void)USBD_LL_Transmit(pdev, MSC_EPIN_ADDR, hmsc->bot_data,
+                           MIN(hmsc->cbw.dDataLength, hmsc->bot_data_length));
+    MSC_UAS_SendReady(pdev, USBD_UAS_IU_READ_READY);
+  }
+  else
+  {
+    MSC_UAS_SendStatus(pdev, USBD_CSW_CMD_PASSED);
+  }
+}
+
+/**
+* @brief  MSC_UAS_Schedule
+*         Start the next queued command if none is running
+* @param  pdev: device instance
+* @retval None
+*/
+static void MSC_UAS_Schedule(USBD_HandleTypeDef *pdev)
+{
+  USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+  USBD_MSC_UAS_HandleTypeDef *huas = &hmsc->uas;
+  USBD_StorageTypeDef *storage = (USBD_StorageTypeDef *)pdev->pUserData;
+  uint8_t order[USBD_UAS_QUEUE_DEPTH];
+  uint8_t count = 0U;
+  uint8_t pick = USBD_UAS_NO_SLOT;
+  uint8_t i;
+  uint8_t j;
+
+  /* Storage is not reentrant, the next command waits for a cancelled
+     access to return, see MSC_UAS_Resume */
+  if ((huas->active != USBD_UAS_NO_SLOT) ||
+      (hmsc->bot_next_state == USBD_BOT_NEXT_CANCELLED))
+  {
+    return;
+  }
+
+  /* Queued slots in arrival order, head of queue tasks go first */
+  for (i = 0U; i < USBD_UAS_QUEUE_DEPTH; i++)
+  {
+    if (huas->slot[i].state != USBD_UAS_SLOT_QUEUED)
+    {
+      continue;
+    }
+
+    j = count++;
+    while ((j > 0U) && ((huas->slot[order[j - 1U]].seq - huas->slot[i].seq) < 0x80000000U))
+    {
+      order[j] = order[j - 1U];
+      j--;
+    }
+    order[j] = i;
+
+    if (((huas->slot[i].iu[4] & 0x07U) == USBD_UAS_TASK_HEAD_OF_QUEUE) &&
+        ((pick == USBD_UAS_NO_SLOT) ||
+         ((huas->slot[pick].seq - huas->slot[i].seq) < 0x80000000U)))
+    {
+      pick = i;
+    }
+  }
+
+  if (count == 0U)
+  {
+    return;
+  }
+
+  for (i = 0U; (i < count) && (pick == USBD_UAS_NO_SLOT); i++)
+  {
+    uint8_t *iu = huas->slot[order[i]].iu;
+
+    if ((iu[4] & 0x07U) == USBD_UAS_TASK_ORDERED)
+    {
+      /* Barrier, runs only once everything before it is done */
+      if (i == 0U)
+      {
+        pick = order[i];
+      }
+      break;
+    }
+
+    if ((storage->IsBusy == NULL) || (storage->IsBusy(iu[9]) == 0))
+    {
+      pick = order[i];
+    }
+  }
+
+  /* Every candidate waits on a busy LUN, keep arrival order */
+  if (pick == USBD_UAS_NO_SLOT)
+  {
+    pick = order[0];
+  }
+
+  MSC_UAS_Start(pdev, pick);
+}
+
+/**
+* @brief  MSC_UAS_TaskMgmt
+*         Handle a task management IU and answer with a RESPONSE IU
+* @param  pdev: device instance
+* @param  iu: task management IU
+* @retval None
+*/
+static void MSC_UAS_TaskMgmt(USBD_HandleTypeDef *pdev, uint8_t *iu)
+{
+  USBD_MSC_UAS_HandleTypeDef *huas = &((USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData)->uas;
+  uint16_t tag = ((uint16_t)iu[2] << 8) | (uint16_t)iu[3];
+  uint8_t slot = MSC_UAS_FindTag(huas, ((uint16_t)iu[6] << 8) | (uint16_t)iu[7]);
+  uint8_t code = USBD_UAS_RC_TMF_COMPLETE;
+
+  switch (iu[4])
+  {
+  case USBD_UAS_TMF_ABORT_TASK:
+    if (slot == USBD_UAS_NO_SLOT)
+    {
+      /* Already completed */
+    }
+    else if (slot == huas->active)
+    {
+      /* Data phase under way, the host escalates to a reset */
+      code = USBD_UAS_RC_TMF_FAILED;
+    }
+    else
+    {
+      huas->slot[slot].state = USBD_UAS_SLOT_FREE;
+      MSC_UAS_Rearm(pdev);
+    }
+    break;
+
+  case USBD_UAS_TMF_QUERY_TASK:
+    if (slot != USBD_UAS_NO_SLOT)
+    {
+      code = USBD_UAS_RC_TMF_SUCCEEDED;
+    }
+    break;
+
+  case USBD_UAS_TMF_ABORT_TASK_SET:
+  case USBD_UAS_TMF_CLEAR_TASK_SET:
+  case USBD_UAS_TMF_LOGICAL_UNIT_RESET:
+    MSC_UAS_Abort(pdev, iu[9], 0U);
+    break;
+
+  case USBD_UAS_TMF_IT_NEXUS_RESET:
+    MSC_UAS_Abort(pdev, 0U, 1U);
+    break;
+
+  default:
+    code = USBD_UAS_RC_TMF_NOT_SUPPORTED;
+    break;
+  }
+
+  MSC_UAS_SendResponse(pdev, tag, code);
+}
+
+/**
+* @brief  MSC_UAS_Abort
+*         Drop the commands of a LUN, the running one is cut short without status
+* @param  pdev: device instance
+* @param  lun: Logical unit number
+* @param  all_luns: ignore lun and drop every command
+* @retval None
+*/
+static void MSC_UAS_Abort(USBD_HandleTypeDef *pdev, uint8_t lun, uint8_t all_luns)
+{
+  USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+  USBD_MSC_UAS_HandleTypeDef *huas = &hmsc->uas;
+  uint16_t packet = (pdev->dev_speed == USBD_SPEED_HIGH) ? MSC_MAX_HS_PACKET : MSC_MAX_FS_PACKET;
+  uint8_t i;
+
+  for (i = 0U; i < USBD_UAS_QUEUE_DEPTH; i++)
+  {
+    if ((huas->slot[i].state == USBD_UAS_SLOT_QUEUED) &&
+        ((all_luns != 0U) || (huas->slot[i].iu[9] == lun)))
+    {
+      huas->slot[i].state = USBD_UAS_SLOT_FREE;
+    }
+  }
+
+  if ((huas->active != USBD_UAS_NO_SLOT) &&
+      ((all_luns != 0U) || (huas->slot[huas->active].iu[9] == lun)))
+  {
+    huas->slot[huas->active].state = USBD_UAS_SLOT_FREE;
+    huas->active = USBD_UAS_NO_SLOT;
+
+    /* Same as MSC_BOT_Reset, a storage access still running in
+       MSC_BOT_Process is cancelled and holds back MSC_UAS_Schedule */
+    hmsc->bot_state = USBD_BOT_IDLE;
+    (void)MSC_BOT_CancelNext(pdev);
+
+    /* Cancel transfers left on the data pipes */
+    (void)USBD_LL_CloseEP(pdev, MSC_EPIN_ADDR);
+    (void)USBD_LL_CloseEP(pdev, MSC_EPOUT_ADDR);
+    (void)USBD_LL_OpenEP(pdev, MSC_EPIN_ADDR, USBD_EP_TYPE_BULK, packet);
+    (void)USBD_LL_OpenEP(pdev, MSC_EPOUT_ADDR, USBD_EP_TYPE_BULK, packet);
+  }
+
+  MSC_UAS_Rearm(pdev);
+}
+
+/**
+* @brief  MSC_UAS_Rearm
+*         Receive the next command IU if the queue or the status pipe was full
+* @param  pdev: device instance
+* @retval None
+*/
+static void MSC_UAS_Rearm(USBD_HandleTypeDef *pdev)
+{
+  USBD_MSC_UAS_HandleTypeDef *huas = &((USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData)->uas;
+
+  if (huas->rx_slot != USBD_UAS_NO_SLOT)
+  {
+    return;
+  }
+
+  huas->rx_slot = MSC_UAS_FreeSlot(huas);
+
+  if (huas->rx_slot != USBD_UAS_NO_SLOT)
+  {
+    (void)USBD_LL_PrepareReceive(pdev, MSC_UAS_CMD_ADDR, huas->slot[huas->rx_slot].iu,
+                                 USBD_UAS_COMMAND_IU_LENGTH);
+  }
+}
+
+/**
+* @brief  MSC_UAS_FindTag
+*         Slot holding a queued or running command
+* @param  huas: UAS handle
+* @param  tag: command tag
+* @retval slot, USBD_UAS_NO_SLOT if none
+*/
+static uint8_t MSC_UAS_FindTag(USBD_MSC_UAS_HandleTypeDef *huas, uint16_t tag)
+{
+  uint8_t i;
+
+  for (i = 0U; i < USBD_UAS_QUEUE_DEPTH; i++)
+  {
+    if ((huas->slot[i].state != USBD_UAS_SLOT_FREE) &&
+        (huas->slot[i].iu[2] == (uint8_t)(tag >> 8)) &&
+        (huas->slot[i].iu[3] == (uint8_t)tag))
+    {
+      return i;
+    }
+  }
+
+  return USBD_UAS_NO_SLOT;
+}
+
+/**
+* @brief  MSC_UAS_FreeSlot
+*         Slot to receive the next command IU in, only if the status queue
+*         has room for every IU still owed to queued commands and for the
+*         answers to the next one, so no status IU is ever dropped
+* @param  huas: UAS handle
+* @retval slot, USBD_UAS_NO_SLOT if the queue or the status pipe is full
+*/
+static uint8_t MSC_UAS_FreeSlot(USBD_MSC_UAS_HandleTypeDef *huas)
+{
+  uint8_t slot = USBD_UAS_NO_SLOT;
+  uint32_t owed = USBD_UAS_IU_STATUS_MAX;
+  uint8_t i;
+
+  for (i = 0U; i < USBD_UAS_QUEUE_DEPTH; i++)
+  {
+    if (huas->slot[i].state != USBD_UAS_SLOT_FREE)
+    {
+      owed += USBD_UAS_IU_STATUS_MAX;
+    }
+    else if (slot == USBD_UAS_NO_SLOT)
+    {
+      slot = i;
+    }
+  }
+
+  if ((huas->status_count + owed) > USBD_UAS_STATUS_DEPTH)
+  {
+    return USBD_UAS_NO_SLOT;
+  }
+
+  return slot;
+}
+
+/**
+* @brief  MSC_UAS_DataLength
+*         A command IU has no transfer length, derive it from the CDB as
+*         the host would have put it in the CBW
+* @param  pdev: device instance
+* @param  lun: Logical unit number
+* @param  cdb: command descriptor block
+* @param  flags: set to the CBW direction, 0x80 for data in
+* @retval expected transfer length in bytes
+*/
+static uint32_t MSC_UAS_DataLength(USBD_HandleTypeDef *pdev, uint8_t lun,
+                                   uint8_t *cdb, uint8_t *flags)
+{
+  USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+  uint32_t blocks = 0U;
+  uint32_t len = 0U;
+
+  *flags = 0x80U;
+
+  switch (cdb[0])
+  {
+  case SCSI_READ10:
+    blocks = ((uint32_t)cdb[7] << 8) | (uint32_t)cdb[8];
+    break;
+
+  case SCSI_READ12:
+    blocks = ((uint32_t)cdb[6] << 24) | ((uint32_t)cdb[7] << 16) |
+             ((uint32_t)cdb[8] << 8) | (uint32_t)cdb[9];
+    break;
+
+  case SCSI_WRITE10:
+    *flags = 0U;
+    blocks = ((uint32_t)cdb[7] << 8) | (uint32_t)cdb[8];
+    break;
+
+  case SCSI_WRITE12:
+    *flags = 0U;
+    blocks = ((uint32_t)cdb[6] << 24) | ((uint32_t)cdb[7] << 16) |
+             ((uint32_t)cdb[8] << 8) | (uint32_t)cdb[9];
+    break;
+
+  case SCSI_INQUIRY:
+  case SCSI_READ_PERF_STATS:
+    len = ((uint32_t)cdb[3] << 8) | (uint32_t)cdb[4];
+    break;
+
+  case SCSI_REQUEST_SENSE:
+  case SCSI_MODE_SENSE6:
+    len = cdb[4];
+    break;
+
+  case SCSI_MODE_SENSE10:
+  case SCSI_READ_FORMAT_CAPACITIES:
+    len = ((uint32_t)cdb[7] << 8) | (uint32_t)cdb[8];
+    break;
+
+  case SCSI_READ_CAPACITY10:
+    len = 8U;
+    break;
+
+  case SCSI_READ_CAPACITY16:
+    len = ((uint32_t)cdb[10] << 24) | ((uint32_t)cdb[11] << 16) |
+          ((uint32_t)cdb[12] << 8) | (uint32_t)cdb[13];
+    break;
+
+  case SCSI_UNMAP:
+    *flags = 0U;
+    len = ((uint32_t)cdb[7] << 8) | (uint32_t)cdb[8];
+    break;
+
+  default:
+    *flags = 0U;
+    break;
+  }
+
+  if ((blocks != 0U) &&
+      (((USBD_StorageTypeDef *)pdev->pUserData)->GetCapacity(lun, &hmsc->scsi_blk_nbr,
+                                                         &hmsc->scsi_blk_size) == 0))
+  {
+    len = blocks * hmsc->scsi_blk_size;
+  }
+
+  return len;
+}
+
+/**
+* @brief  MSC_UAS_SendReady
+*         Tell the host the data phase of the running command can start
+* @param  pdev: device instance
+* @param  iu_id: USBD_UAS_IU_READ_READY or USBD_UAS_IU_WRITE_READY
+* @retval None
+*/
+static void MSC_UAS_SendReady(USBD_HandleTypeDef *pdev, uint8_t iu_id)
+{
+  USBD_MSC_BOT_HandleTypeDef *hmsc = (USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData;
+  uint8_t iu[USBD_UAS_READY_IU_LENGTH];
+
+  iu[0] = iu_id;
+  iu[1] = 0U;
+  iu[2] = (uint8_t)(hmsc->cbw.dTag >> 8);
+  iu[3] = (uint8_t)hmsc->cbw.dTag;
+
+  MSC_UAS_QueueStatus(pdev, iu, USBD_UAS_READY_IU_LENGTH);
+}
+
+/**
+* @brief  MSC_UAS_SendResponse
+*         Answer a task management or rejected command IU
+* @param  pdev: device instance
+* @param  tag: tag of the IU answered
+* @param  code: response code
+* @retval None
+*/
+static void MSC_UAS_SendResponse(USBD_HandleTypeDef *pdev, uint16_t tag, uint8_t code)
+{
+  uint8_t iu[USBD_UAS_RESPONSE_IU_LENGTH] = {0U};
+
+  iu[0] = USBD_UAS_IU_RESPONSE;
+  iu[2] = (uint8_t)(tag >> 8);
+  iu[3] = (uint8_t)tag;
+  iu[7] = code;
+
+  MSC_UAS_QueueStatus(pdev, iu, USBD_UAS_RESPONSE_IU_LENGTH);
+}
+
+/**
+* @brief  MSC_UAS_QueueStatus
+*         Queue an IU for the status pipe, sent in order
+* @param  pdev: device instance
+* @param  iu: IU, copied
+* @param  len: IU length
+* @retval None
+*/
+static void MSC_UAS_QueueStatus(USBD_HandleTypeDef *pdev, uint8_t *iu, uint8_t len)
+{
+  USBD_MSC_UAS_HandleTypeDef *huas = &((USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData)->uas;
+  uint8_t n;
+  uint8_t i;
+
+  /* Can not happen, MSC_UAS_FreeSlot only takes an IU in when its
+     answers and those owed to queued commands fit */
+  if (huas->status_count == USBD_UAS_STATUS_DEPTH)
+  {
+    return;
+  }
+
+  n = (huas->status_head + huas->status_count) % USBD_UAS_STATUS_DEPTH;
+
+  for (i = 0U; i < len; i++)
+  {
+    huas->status[n][i] = iu[i];
+  }
+
+  huas->status_len[n] = len;
+  huas->status_count++;
+
+  if (huas->status_busy == 0U)
+  {
+    MSC_UAS_StatusNext(pdev);
+  }
+}
+
+/**
+* @brief  MSC_UAS_StatusNext
+*         Send the IU at the head of the status queue
+* @param  pdev: device instance
+* @retval None
+*/
+static void MSC_UAS_StatusNext(USBD_HandleTypeDef *pdev)
+{
+  USBD_MSC_UAS_HandleTypeDef *huas = &((USBD_MSC_BOT_HandleTypeDef *)pdev->pClassData)->uas;
+
+  if (huas->status_count == 0U)
+  {
+    huas->status_busy = 0U;
+    return;
+  }
+
+  huas->status_busy = 1U;
+
+  (void)USBD_LL_Transmit(pdev, MSC_UAS_STATUS_ADDR, huas->status[huas->status_head],
+                         huas->status_len[huas->status_head]);
+}
+/**
+  * @}
+  */
+
+
+/**
+  * @}
+  */
+
+
+/**
+  * @}
+  */
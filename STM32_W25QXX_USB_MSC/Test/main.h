@@ -0,0 +1,51 @@
+#ifndef __MAIN_H
+#define __MAIN_H
+
+#include <stdint.h>
+
+/**
+ * host stand-in for the cube main.h and hal, only what the W25QXX driver
+ * uses. spi and gpio handles point at a modelled flash, @see sim_flash.h
+ */
+
+typedef enum
+{
+	HAL_OK = 0,
+	HAL_ERROR,
+	HAL_BUSY,
+	HAL_TIMEOUT,
+} HAL_StatusTypeDef;
+
+typedef enum
+{
+	GPIO_PIN_RESET = 0,
+	GPIO_PIN_SET,
+} GPIO_PinState;
+
+struct Sim_Flash;
+
+typedef struct
+{
+	struct Sim_Flash *flash;
+} SPI_HandleTypeDef;
+
+typedef struct
+{
+	struct Sim_Flash *flash;
+} GPIO_TypeDef;
+
+#define GPIO_PIN_6                     ((uint16_t)0x0040)
+
+uint32_t HAL_GetTick(void);
+void HAL_GPIO_WritePin(GPIO_TypeDef *port, uint16_t pin, GPIO_PinState state);
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef *hspi, uint8_t *data, uint16_t size, uint32_t timeout);
+HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef *hspi, uint8_t *data, uint16_t size, uint32_t timeout);
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef *hspi, uint8_t *data, uint16_t size);
+HAL_StatusTypeDef HAL_SPI_Receive_DMA(SPI_HandleTypeDef *hspi, uint8_t *data, uint16_t size);
+
+/** implemented by the driver, called from the modelled dma interrupt */
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi);
+void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi);
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi);
+
+#endif /* __MAIN_H */
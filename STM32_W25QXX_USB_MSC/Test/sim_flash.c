@@ -0,0 +1,664 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include "sim_flash.h"
+
+#define SIM_MAX_FLASH                  4
+
+/** real time the cpu gets to make a hal call before it counts as waiting on dma, us */
+#define SIM_IRQ_US                     20
+
+volatile uint64_t Sim_Time;
+uint32_t Sim_Violations;
+
+static Sim_Flash_t *Sim_Flash[SIM_MAX_FLASH];
+
+/** set while the cpu is inside a hal call, the dma interrupt is held back meanwhile */
+static volatile sig_atomic_t Sim_In_Hal;
+static volatile sig_atomic_t Sim_Irq_Held;
+static uint64_t Sim_Armed_Time;
+
+static void Sim_Violation(Sim_Flash_t *flash, const char *what)
+{
+	Sim_Violations++;
+	printf("flash %06X at %.3f ms: %s, command %02X\n", (unsigned)flash->id, Sim_Time / 1e6, what,
+			flash->command_length ? flash->command[0] : 0);
+}
+
+/** dma in flight that ends first, NULL if none */
+static Sim_Flash_t *Sim_Next_Dma(void)
+{
+	Sim_Flash_t *next = NULL;
+
+	for (uint8_t i = 0; i < SIM_MAX_FLASH; i++)
+	{
+		Sim_Flash_t *flash = Sim_Flash[i];
+
+		if (flash && flash->dma_active && (!next || flash->dma_end < next->dma_end))
+			next = flash;
+	}
+
+	return next;
+}
+
+static void Sim_Arm(void)
+{
+	struct itimerval timer = { { 0, 0 }, { 0, SIM_IRQ_US } };
+
+	if (!Sim_Next_Dma())
+		return;
+
+	Sim_Armed_Time = Sim_Time;
+	setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+/**
+ * the dma interrupt, completes every transfer that ended by now. fired by
+ * the real timer with the modelled clock unchanged since it was armed,
+ * the cpu spins on dma_busy and the clock jumps to the first end
+ */
+static void Sim_Irq(int signal)
+{
+	Sim_Flash_t *flash;
+
+	(void)signal;
+
+	if (Sim_In_Hal)
+	{
+		Sim_Irq_Held = 1;
+		return;
+	}
+	Sim_Irq_Held = 0;
+
+	flash = Sim_Next_Dma();
+	if (flash && flash->dma_end > Sim_Time)
+	{
+		if (Sim_Time != Sim_Armed_Time)
+		{
+			Sim_Arm();
+			return;
+		}
+		Sim_Time = flash->dma_end;
+	}
+
+	while ((flash = Sim_Next_Dma()) && flash->dma_end <= Sim_Time)
+	{
+		flash->dma_active = 0;
+
+		if (flash->dma_rx)
+			HAL_SPI_RxCpltCallback(&flash->hspi);
+		else
+			HAL_SPI_TxCpltCallback(&flash->hspi);
+	}
+
+	Sim_Arm();
+}
+
+static void Sim_Enter(void)
+{
+	Sim_In_Hal = 1;
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+}
+
+static void Sim_Leave(void)
+{
+	Sim_Flash_t *flash;
+
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	Sim_In_Hal = 0;
+
+	flash = Sim_Next_Dma();
+	if (Sim_Irq_Held || (flash && flash->dma_end <= Sim_Time))
+		raise(SIGALRM);
+}
+
+/** a power cut leaves the first half of an erase blank */
+static void Sim_Tear_Erase(Sim_Flash_t *flash)
+{
+	memset(flash->memory + flash->erase_address, 0xFF, flash->erase_size / 2);
+	flash->erase_size = 0;
+}
+
+/** 1 when the armed power cut hits this program or erase */
+static uint8_t Sim_Cut_Hit(Sim_Flash_t *flash, uint32_t address)
+{
+	if (!flash->cut_count || address < flash->cut_low || address >= flash->cut_high)
+		return 0;
+
+	if (--flash->cut_count)
+		return 0;
+
+	flash->cut_address = address;
+	return 1;
+}
+
+/** finish an erase whose time is up */
+static void Sim_Update(Sim_Flash_t *flash)
+{
+	if (flash->erase_size && !flash->suspended && Sim_Time >= flash->busy_until)
+	{
+		memset(flash->memory + flash->erase_address, 0xFF, flash->erase_size);
+		flash->erase_size = 0;
+	}
+}
+
+static uint8_t Sim_Busy(Sim_Flash_t *flash)
+{
+	Sim_Update(flash);
+
+	return Sim_Time < flash->busy_until;
+}
+
+static uint32_t Sim_Address(Sim_Flash_t *flash)
+{
+	uint32_t address = 0;
+
+	for (uint8_t i = 0; i < flash->address_bytes; i++)
+		address = (address << 8) | flash->command[1 + i];
+
+	return address;
+}
+
+/** next byte a read class command shifts out */
+static uint8_t Sim_Read_Byte(Sim_Flash_t *flash)
+{
+	uint8_t cmd = flash->command[0];
+	uint32_t index = flash->stream++;
+	uint32_t address;
+
+	switch (cmd)
+	{
+	case 0x05:
+		return (Sim_Busy(flash) ? 0x01 : 0x00) | (flash->wel ? 0x02 : 0x00);
+
+	case 0x9F:
+		return index < 3 ? flash->id >> (16 - 8 * index) : 0xFF;
+
+	case 0x5A:
+		address = (flash->command[1] << 16) | (flash->command[2] << 8) | flash->command[3];
+		return flash->has_sfdp && address + index < sizeof(flash->sfdp) ? flash->sfdp[address + index] : 0xFF;
+
+	case 0x03:
+	case 0x0B:
+	case 0x3B:
+	case 0x6B:
+		address = (Sim_Address(flash) + index) % flash->size;
+		return flash->memory[address];
+	}
+
+	return 0xFF;
+}
+
+/** checks a read class command once its data phase starts */
+static void Sim_Read_Start(Sim_Flash_t *flash)
+{
+	uint8_t cmd = flash->command[0];
+	uint32_t header = 1;
+
+	if (!flash->command_length)
+	{
+		Sim_Violation(flash, "receive without command");
+		return;
+	}
+
+	switch (cmd)
+	{
+	case 0x05:
+	case 0x9F:
+		break;
+
+	case 0x5A:
+		header = 5;
+		break;
+
+	case 0x03:
+	case 0x0B:
+	case 0x3B:
+	case 0x6B:
+		header = 1 + flash->address_bytes + (cmd != 0x03);
+		break;
+
+	default:
+		Sim_Violation(flash, "receive after unknown command");
+		return;
+	}
+
+	if (flash->command_length != header)
+		Sim_Violation(flash, "wrong address or dummy bytes");
+
+	if (cmd != 0x05 && Sim_Busy(flash))
+		Sim_Violation(flash, "command while busy");
+}
+
+static void Sim_Erase(Sim_Flash_t *flash, uint32_t size, uint64_t ns)
+{
+	if (!flash->wel)
+	{
+		Sim_Violation(flash, "erase without write enable");
+		return;
+	}
+	if (flash->erase_size)
+	{
+		Sim_Violation(flash, "erase while an erase is suspended");
+		return;
+	}
+
+	flash->erase_address = Sim_Address(flash) / size * size % flash->size;
+	flash->erase_size = size;
+	flash->busy_until = Sim_Time + ns;
+	flash->wel = 0;
+	flash->erases++;
+
+	if (Sim_Cut_Hit(flash, flash->erase_address))
+	{
+		Sim_Tear_Erase(flash);
+		siglongjmp(*flash->cut_jump, 1);
+	}
+}
+
+static void Sim_Program(Sim_Flash_t *flash)
+{
+	uint32_t header = 1 + flash->address_bytes;
+	uint32_t address = Sim_Address(flash);
+	uint32_t count = flash->command_length - header;
+	uint8_t cut;
+
+	if (!flash->wel)
+	{
+		Sim_Violation(flash, "program without write enable");
+		return;
+	}
+	if (flash->erase_size && address < flash->erase_address + flash->erase_size
+			&& address + count > flash->erase_address)
+	{
+		Sim_Violation(flash, "program in suspended erase");
+		return;
+	}
+
+	cut = Sim_Cut_Hit(flash, address);
+	if (cut)
+		count /= 2;
+
+	/** a page program wraps at the end of the page */
+	for (uint32_t i = 0; i < count; i++)
+	{
+		uint32_t a = (address & ~0xFFu) | ((address + i) & 0xFF);
+
+		flash->memory[a % flash->size] &= flash->command[header + i];
+	}
+
+	flash->busy_until = Sim_Time + SIM_PROGRAM_NS(count);
+	flash->wel = 0;
+	flash->programs++;
+	flash->programmed_bytes += count;
+
+	if (cut)
+		siglongjmp(*flash->cut_jump, 1);
+}
+
+/** cs going high ends the command, writes take effect */
+static void Sim_Execute(Sim_Flash_t *flash)
+{
+	uint8_t cmd = flash->command[0];
+
+	if (!flash->command_length)
+		return;
+
+	flash->commands++;
+
+	if (Sim_Busy(flash) && cmd != 0x05 && cmd != 0x75)
+	{
+		/** status and suspend are accepted, programs during a suspended erase after tSUS */
+		Sim_Violation(flash, "command while busy");
+		return;
+	}
+
+	switch (cmd)
+	{
+	case 0x06:
+		flash->wel = 1;
+		break;
+
+	case 0x04:
+		flash->wel = 0;
+		break;
+
+	case 0x02:
+		Sim_Program(flash);
+		break;
+
+	case 0x20:
+		Sim_Erase(flash, 4096, SIM_SECTOR_ERASE_NS);
+		break;
+
+	case 0x52:
+		Sim_Erase(flash, 32768, SIM_BLOCK32_ERASE_NS);
+		break;
+
+	case 0xD8:
+		Sim_Erase(flash, 65536, SIM_BLOCK64_ERASE_NS);
+		break;
+
+	case 0x75:
+		/** ignored unless an erase runs */
+		if (flash->erase_size && !flash->suspended && Sim_Time < flash->busy_until)
+		{
+			flash->erase_left = flash->busy_until - Sim_Time;
+			flash->busy_until = Sim_Time + SIM_SUSPEND_NS;
+			flash->suspended = 1;
+			flash->suspends++;
+		}
+		break;
+
+	case 0x7A:
+		if (flash->suspended)
+		{
+			flash->busy_until = Sim_Time + flash->erase_left;
+			flash->suspended = 0;
+		}
+		break;
+
+	case 0xB7:
+		flash->address_bytes = 4;
+		break;
+
+	case 0x05:
+	case 0x9F:
+	case 0x5A:
+	case 0x03:
+	case 0x0B:
+	case 0x3B:
+	case 0x6B:
+		break;
+
+	default:
+		Sim_Violation(flash, "unknown command");
+		break;
+	}
+}
+
+/** shift bytes in, command, address and dummies or page program data */
+static void Sim_Shift_In(Sim_Flash_t *flash, const uint8_t *data, uint16_t size)
+{
+	if (!flash->selected)
+	{
+		Sim_Violation(flash, "transfer with cs high");
+		return;
+	}
+	if (flash->stream)
+	{
+		Sim_Violation(flash, "transmit after data phase");
+		return;
+	}
+	if (flash->command_length + size > sizeof(flash->command))
+	{
+		Sim_Violation(flash, "command too long");
+		return;
+	}
+
+	memcpy(flash->command + flash->command_length, data, size);
+	flash->command_length += size;
+}
+
+static void Sim_Shift_Out(Sim_Flash_t *flash, uint8_t *data, uint16_t size)
+{
+	if (!flash->selected)
+	{
+		Sim_Violation(flash, "transfer with cs high");
+		return;
+	}
+	if (!flash->stream)
+		Sim_Read_Start(flash);
+
+	if (flash->erase_size && flash->command[0] != 0x05 && flash->command[0] != 0x9F && flash->command[0] != 0x5A)
+	{
+		uint32_t address = Sim_Address(flash) + flash->stream;
+
+		if (address < flash->erase_address + flash->erase_size && address + size > flash->erase_address)
+			Sim_Violation(flash, "read in suspended erase");
+	}
+
+	for (uint16_t i = 0; i < size; i++)
+		data[i] = Sim_Read_Byte(flash);
+
+	flash->read_bytes += size;
+}
+
+static uint64_t Sim_Spi_Ns(uint32_t bytes)
+{
+	return (uint64_t)bytes * 8 * 1000000000u / SIM_SPI_HZ;
+}
+
+static HAL_StatusTypeDef Sim_Dma_Start(SPI_HandleTypeDef *hspi, uint16_t size, uint8_t rx)
+{
+	Sim_Flash_t *flash = hspi->flash;
+
+	if (flash->dma_active)
+	{
+		Sim_Violation(flash, "dma started while one runs");
+		return HAL_BUSY;
+	}
+
+	Sim_Time += SIM_HAL_NS;
+
+	flash->dma_active = 1;
+	flash->dma_rx = rx;
+	flash->dma_end = Sim_Time + Sim_Spi_Ns(size);
+	flash->dma_transfers++;
+
+	Sim_Arm();
+
+	return HAL_OK;
+}
+
+void Sim_Flash_Init(Sim_Flash_t *flash, uint32_t id, uint32_t size, uint8_t sfdp)
+{
+	static const uint32_t table[11] =
+	{
+		0x00412001, /* 4K erase 0x20, 1-1-2 and 1-1-4 reads, 3 byte address */
+		0,          /* density, filled in below */
+		0x6B08EB44, /* 1-1-4 read 0x6B, 8 wait states */
+		0xBB423B08, /* 1-1-2 read 0x3B, 8 wait states */
+		0xFFFFFFFF,
+		0xFFFFFFFF,
+		0xFFFFFFFF,
+		0x520F200C, /* 4K 0x20, 32K 0x52 */
+		0xFF00D810, /* 64K 0xD8 */
+		0x00000000,
+		0x00000080, /* 256 byte page */
+	};
+	static struct sigaction action;
+	uint8_t i = 0;
+
+	memset(flash, 0, sizeof(*flash));
+	flash->hspi.flash = flash;
+	flash->cs_port.flash = flash;
+	flash->id = id;
+	flash->size = size;
+	flash->address_bytes = 3;
+	flash->has_sfdp = sfdp;
+	flash->memory = malloc(size);
+	memset(flash->memory, 0xFF, size);
+
+	memset(flash->sfdp, 0xFF, sizeof(flash->sfdp));
+	memcpy(flash->sfdp, "SFDP", 4);
+	flash->sfdp[4] = 0x06;
+	flash->sfdp[5] = 0x01;
+	flash->sfdp[6] = 0x00;
+	/** parameter header 0, basic table id 0xFF00, 11 dwords at 0x80 */
+	flash->sfdp[8] = 0x00;
+	flash->sfdp[9] = 0x06;
+	flash->sfdp[10] = 0x01;
+	flash->sfdp[11] = 11;
+	flash->sfdp[12] = 0x80;
+	flash->sfdp[13] = 0x00;
+	flash->sfdp[14] = 0x00;
+	flash->sfdp[15] = 0xFF;
+	for (uint8_t d = 0; d < 11; d++)
+	{
+		uint32_t dword = table[d];
+
+		if (d == 0 && size > 16 * 1024 * 1024)
+			dword |= 1 << 17;
+		if (d == 1)
+			dword = size * 8 - 1;
+
+		for (uint8_t b = 0; b < 4; b++)
+			flash->sfdp[0x80 + d * 4 + b] = dword >> (8 * b);
+	}
+
+	while (i < SIM_MAX_FLASH && Sim_Flash[i])
+		i++;
+	if (i < SIM_MAX_FLASH)
+		Sim_Flash[i] = flash;
+
+	if (!action.sa_handler)
+	{
+		action.sa_handler = Sim_Irq;
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGALRM, &action, NULL);
+	}
+}
+
+void Sim_Flash_Free(Sim_Flash_t *flash)
+{
+	for (uint8_t i = 0; i < SIM_MAX_FLASH; i++)
+		if (Sim_Flash[i] == flash)
+			Sim_Flash[i] = NULL;
+
+	free(flash->memory);
+	flash->memory = NULL;
+}
+
+void Sim_Flash_Cut(Sim_Flash_t *flash, uint32_t n, uint32_t low, uint32_t high, sigjmp_buf *jump)
+{
+	flash->cut_count = n;
+	flash->cut_low = low;
+	flash->cut_high = high;
+	flash->cut_jump = jump;
+}
+
+void Sim_Flash_Power_On(Sim_Flash_t *flash)
+{
+	struct itimerval timer = { { 0, 0 }, { 0, 0 } };
+
+	setitimer(ITIMER_REAL, &timer, NULL);
+	Sim_In_Hal = 0;
+	Sim_Irq_Held = 0;
+
+	if (flash->erase_size && (flash->suspended || Sim_Time < flash->busy_until))
+		Sim_Tear_Erase(flash);
+	Sim_Update(flash);
+
+	flash->address_bytes = 3;
+	flash->wel = 0;
+	flash->busy_until = Sim_Time;
+	flash->suspended = 0;
+	flash->selected = 0;
+	flash->dma_active = 0;
+	flash->cut_count = 0;
+	flash->cut_jump = NULL;
+}
+
+void Sim_Idle(uint64_t ns)
+{
+	Sim_Enter();
+	Sim_Time += ns;
+	Sim_Leave();
+}
+
+uint32_t HAL_GetTick(void)
+{
+	uint32_t tick;
+
+	Sim_Enter();
+	Sim_Time += SIM_TICK_NS;
+	tick = Sim_Time / 1000000;
+	Sim_Leave();
+
+	return tick;
+}
+
+void HAL_GPIO_WritePin(GPIO_TypeDef *port, uint16_t pin, GPIO_PinState state)
+{
+	Sim_Flash_t *flash = port->flash;
+
+	(void)pin;
+
+	Sim_Enter();
+	Sim_Time += SIM_TICK_NS;
+
+	if (state == GPIO_PIN_RESET)
+	{
+		if (flash->selected)
+			Sim_Violation(flash, "cs already low");
+		if (flash->dma_active)
+			Sim_Violation(flash, "cs low while dma runs");
+
+		flash->selected = 1;
+		flash->command_length = 0;
+		flash->stream = 0;
+	}
+	else if (flash->selected)
+	{
+		if (flash->dma_active)
+			Sim_Violation(flash, "cs high while dma runs");
+
+		Sim_Execute(flash);
+		flash->selected = 0;
+	}
+
+	Sim_Leave();
+}
+
+HAL_StatusTypeDef HAL_SPI_Transmit(SPI_HandleTypeDef *hspi, uint8_t *data, uint16_t size, uint32_t timeout)
+{
+	(void)timeout;
+
+	Sim_Enter();
+	Sim_Time += SIM_HAL_NS + Sim_Spi_Ns(size);
+	Sim_Shift_In(hspi->flash, data, size);
+	Sim_Leave();
+
+	return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_SPI_Receive(SPI_HandleTypeDef *hspi, uint8_t *data, uint16_t size, uint32_t timeout)
+{
+	(void)timeout;
+
+	Sim_Enter();
+	Sim_Time += SIM_HAL_NS + Sim_Spi_Ns(size);
+	Sim_Shift_Out(hspi->flash, data, size);
+	Sim_Leave();
+
+	return HAL_OK;
+}
+
+/** data is shifted in now, the transfer completes later from the dma interrupt */
+HAL_StatusTypeDef HAL_SPI_Transmit_DMA(SPI_HandleTypeDef *hspi, uint8_t *data, uint16_t size)
+{
+	HAL_StatusTypeDef status;
+
+	Sim_Enter();
+	Sim_Shift_In(hspi->flash, data, size);
+	status = Sim_Dma_Start(hspi, size, 0);
+	Sim_Leave();
+
+	return status;
+}
+
+HAL_StatusTypeDef HAL_SPI_Receive_DMA(SPI_HandleTypeDef *hspi, uint8_t *data, uint16_t size)
+{
+	HAL_StatusTypeDef status;
+
+	Sim_Enter();
+	Sim_Shift_Out(hspi->flash, data, size);
+	status = Sim_Dma_Start(hspi, size, 1);
+	Sim_Leave();
+
+	return status;
+}
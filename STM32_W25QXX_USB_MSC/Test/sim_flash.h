@@ -0,0 +1,106 @@
+#ifndef SIM_FLASH_H_
+#define SIM_FLASH_H_
+
+#include <stdint.h>
+#include <setjmp.h>
+
+#include "main.h"
+
+/**
+ * modelled W25Q part on its own spi bus, for host tests of the driver
+ *
+ * time is a modelled clock in ns. every hal call costs SIM_HAL_NS of cpu
+ * plus 8 spi clocks per byte for blocking transfers, program and erase
+ * keep the part busy for their typical datasheet time. a dma transfer
+ * completes SIM_SPI_HZ clocks later through a SIGALRM handler standing
+ * in for the dma interrupt, it runs as soon as the modelled clock passes
+ * the end of the transfer, or jumps the clock there when the cpu only
+ * spins on the driver's dma_busy flag. dma on separate buses overlaps
+ *
+ * commands the part would reject, reads of a suspended erase range and
+ * programs without write enable are counted in Sim_Violations
+ *
+ * a power cut tears the command it hits, a program sets only the first
+ * half of its bytes and an erase blanks only the first half of its range
+ */
+
+/** spi1 at APB2 84 MHz, prescaler 16 @see spi.c */
+#define SIM_SPI_HZ                     5250000u
+
+#define SIM_HAL_NS                     1000u
+#define SIM_TICK_NS                    200u
+#define SIM_PROGRAM_NS(bytes)          (20000u + 1500u * (bytes))
+#define SIM_SECTOR_ERASE_NS            45000000u
+#define SIM_BLOCK32_ERASE_NS           120000000u
+#define SIM_BLOCK64_ERASE_NS           150000000u
+#define SIM_SUSPEND_NS                 20000u
+
+typedef struct Sim_Flash
+{
+	SPI_HandleTypeDef hspi;
+	GPIO_TypeDef cs_port;
+
+	uint8_t *memory;
+	uint32_t size;
+	uint32_t id;
+	uint8_t sfdp[256];
+	uint8_t has_sfdp;
+
+	uint8_t address_bytes;
+	uint8_t wel;
+	uint64_t busy_until;
+
+	/** erase in progress, size 0 if none */
+	uint32_t erase_address;
+	uint32_t erase_size;
+	uint8_t suspended;
+	uint64_t erase_left;
+
+	/** command and data shifted in while cs is low */
+	uint8_t selected;
+	uint8_t command[1 + 4 + 4 + 256];
+	uint32_t command_length;
+	uint32_t stream;
+
+	/** dma in flight on this bus */
+	volatile uint8_t dma_active;
+	uint8_t dma_rx;
+	uint64_t dma_end;
+
+	/** power cut armed by Sim_Flash_Cut */
+	uint32_t cut_count;
+	uint32_t cut_low;
+	uint32_t cut_high;
+	uint32_t cut_address;
+	sigjmp_buf *cut_jump;
+
+	uint32_t commands;
+	uint32_t dma_transfers;
+	uint32_t programs;
+	uint32_t erases;
+	uint32_t suspends;
+	uint64_t read_bytes;
+	uint64_t programmed_bytes;
+} Sim_Flash_t;
+
+extern volatile uint64_t Sim_Time;
+extern uint32_t Sim_Violations;
+
+/** size bytes of blank flash answering jedec id, with a JESD216 table if sfdp is set */
+void Sim_Flash_Init(Sim_Flash_t *flash, uint32_t id, uint32_t size, uint8_t sfdp);
+void Sim_Flash_Free(Sim_Flash_t *flash);
+
+/**
+ * power fails at the n-th program or erase from now that starts in
+ * [low, high), the command is torn and siglongjmp(jump) leaves the code
+ * under test, cut_address tells where it hit
+ */
+void Sim_Flash_Cut(Sim_Flash_t *flash, uint32_t n, uint32_t low, uint32_t high, sigjmp_buf *jump);
+
+/** power back on, an erase in flight is torn, transfers in flight are lost */
+void Sim_Flash_Power_On(Sim_Flash_t *flash);
+
+/** let the modelled cpu idle until ns later, pending dma interrupts run meanwhile */
+void Sim_Idle(uint64_t ns);
+
+#endif /* SIM_FLASH_H_ */
@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "w25qxx_ftl.h"
+#include "sim_flash.h"
+
+/**
+ * host simulator, the W25QXX ftl on a modelled W25Q64. sequential and
+ * random 4K write workloads report write amplification and sustained
+ * MB/s in modelled time, one W25QXX_FTL_Process call per host write as
+ * the main loop does, and bursts with idle time between them show how
+ * much background erases take off the writes. then power is cut at
+ * random program and erase commands in data, journal and checkpoint
+ * sectors, and every sector must read back after the next init
+ */
+
+#define TEST_SIZE                      (8 * 1024 * 1024)
+
+/** host idle between bursts, enough for the erased pool to refill */
+#define TEST_BURST                     16
+#define TEST_IDLE_NS                   1000000000u
+#define TEST_POLL_NS                   50000u
+
+/** logical sectors the power cut workload touches */
+#define TEST_WORKING                   256
+
+#define TEST_SLOTS_END                 (2 * W25QXX_FTL_SLOT_SECTORS * W25QXX_SECTOR_SIZE)
+#define TEST_JOURNAL_END               (W25QXX_FTL_META_SECTORS * W25QXX_SECTOR_SIZE)
+
+static Sim_Flash_t Test_Sim;
+static W25QXX_Handle_t Test_Flash;
+static W25QXX_Handle_t *Test_Chips[W25QXX_FTL_CHIPS] = { &Test_Flash };
+
+/** what each logical sector must read back, the write cut by power loss may leave either */
+static uint8_t Test_Expect[W25QXX_FTL_MAX_SECTOR_COUNT][W25QXX_SECTOR_SIZE];
+static uint8_t Test_Old[W25QXX_SECTOR_SIZE];
+static int32_t Test_Pending = -1;
+
+static uint8_t Test_Buffer[W25QXX_SECTOR_SIZE];
+static uint32_t Test_Count;
+static uint32_t Test_Seed = 1;
+
+static sigjmp_buf Test_Jump;
+
+static int Test_Failed;
+
+static void Test_Check(int ok, const char *what)
+{
+	printf("%s %s\n", ok ? "pass" : "FAIL", what);
+	if (!ok)
+		Test_Failed = 1;
+}
+
+/** xorshift */
+static uint32_t Test_Random()
+{
+	Test_Seed ^= Test_Seed << 13;
+	Test_Seed ^= Test_Seed >> 17;
+	Test_Seed ^= Test_Seed << 5;
+	return Test_Seed;
+}
+
+static void Test_Power_On()
+{
+	Sim_Flash_Power_On(&Test_Sim);
+	W25QXX_Init(&Test_Flash, W25QXX_READ_AUTO);
+	W25QXX_FTL_Init(Test_Chips);
+	Test_Count = W25QXX_FTL_Get_Sector_Count();
+}
+
+/**
+ * new random data, or with clear_only set the old data with some bits
+ * cleared, which the ftl programs in place
+ */
+static void Test_Write(uint32_t sector, uint8_t clear_only)
+{
+	memcpy(Test_Old, Test_Expect[sector], W25QXX_SECTOR_SIZE);
+
+	for (uint32_t i = 0; i < W25QXX_SECTOR_SIZE; i += 4)
+	{
+		uint32_t r = Test_Random();
+
+		if (clear_only)
+			r |= Test_Random();
+		for (uint8_t b = 0; b < 4; b++)
+			Test_Buffer[i + b] = clear_only ? Test_Old[i + b] & (r >> (8 * b)) : r >> (8 * b);
+	}
+
+	Test_Pending = sector;
+	memcpy(Test_Expect[sector], Test_Buffer, W25QXX_SECTOR_SIZE);
+	W25QXX_FTL_Write(sector, Test_Buffer);
+	Test_Pending = -1;
+}
+
+static void Test_Unmap(uint32_t sector)
+{
+	memcpy(Test_Old, Test_Expect[sector], W25QXX_SECTOR_SIZE);
+
+	Test_Pending = sector;
+	memset(Test_Expect[sector], 0xFF, W25QXX_SECTOR_SIZE);
+	W25QXX_FTL_Unmap(sector);
+	Test_Pending = -1;
+}
+
+/**
+ * sectors that do not read back, the one whose write was cut may hold
+ * old or new data, or a mix of both in a torn in place program
+ */
+static uint32_t Test_Verify(uint32_t count)
+{
+	uint32_t bad = 0;
+
+	for (uint32_t s = 0; s < count; s++)
+	{
+		W25QXX_FTL_Read(s, Test_Buffer);
+
+		if ((int32_t)s != Test_Pending)
+		{
+			bad += memcmp(Test_Buffer, Test_Expect[s], W25QXX_SECTOR_SIZE) != 0;
+			continue;
+		}
+
+		for (uint32_t i = 0; i < W25QXX_SECTOR_SIZE; i++)
+		{
+			if (Test_Buffer[i] != Test_Expect[s][i] && Test_Buffer[i] != Test_Old[i])
+			{
+				bad++;
+				break;
+			}
+		}
+
+		/** what survived is now expected */
+		memcpy(Test_Expect[s], Test_Buffer, W25QXX_SECTOR_SIZE);
+	}
+
+	return bad;
+}
+
+/**
+ * write amplification is flash bytes programmed per host byte, data +
+ * journal + checkpoints. with burst set the host idles TEST_IDLE_NS
+ * after that many writes while the main loop keeps calling
+ * W25QXX_FTL_Process, MB/s leaves the idle time out
+ */
+static void Test_Workload(const char *name, uint32_t writes, uint8_t random, uint32_t burst)
+{
+	W25QXX_FTL_Stats_t before = *W25QXX_FTL_Get_Stats();
+	const W25QXX_FTL_Stats_t *stats = W25QXX_FTL_Get_Stats();
+	uint64_t busy = 0;
+	double amplification, speed;
+	char what[160];
+
+	for (uint32_t i = 0; i < writes; i++)
+	{
+		uint64_t start = Sim_Time;
+
+		Test_Write(random ? Test_Random() % Test_Count : i % Test_Count, 0);
+		W25QXX_FTL_Process();
+		busy += Sim_Time - start;
+
+		if (burst && (i + 1) % burst == 0)
+		{
+			uint64_t next = Sim_Time + TEST_IDLE_NS;
+
+			while (Sim_Time < next)
+			{
+				Sim_Idle(TEST_POLL_NS);
+				W25QXX_FTL_Process();
+			}
+		}
+	}
+
+	amplification = (double)(stats->programmed_bytes - before.programmed_bytes) / writes / W25QXX_SECTOR_SIZE;
+	speed = (double)writes * W25QXX_SECTOR_SIZE / (busy / 1e9) / 1e6;
+
+	snprintf(what, sizeof(what), "%s %u x 4K: write amplification %.3f, %.3f MB/s, "
+			"%u erases, %u in foreground, %u checkpoints",
+			name, writes, amplification, speed, stats->erases - before.erases,
+			stats->foreground_erases - before.foreground_erases, stats->checkpoints - before.checkpoints);
+	Test_Check(amplification < 1.05 && Test_Verify(Test_Count) == 0, what);
+}
+
+/** power cut at the n-th program or erase in [low, high), n below limit */
+static void Test_Power_Cut(const char *name, uint32_t low, uint32_t high, uint32_t limit, uint32_t rounds)
+{
+	/** volatile, siglongjmp lands back in this frame */
+	volatile uint32_t torn = 0;
+	volatile uint32_t bad = 0;
+	volatile uint32_t checkpoints = 0;
+	char what[140];
+
+	for (volatile uint32_t r = 0; r < rounds; r++)
+	{
+		if (!sigsetjmp(Test_Jump, 1))
+		{
+			Sim_Flash_Cut(&Test_Sim, 1 + Test_Random() % limit, low, high, &Test_Jump);
+
+			for (;;)
+			{
+				uint32_t sector = Test_Random() % TEST_WORKING;
+				uint32_t op = Test_Random() % 10;
+
+				if (op == 0)
+					Test_Unmap(sector);
+				else
+					Test_Write(sector, op == 1);
+
+				W25QXX_FTL_Process();
+			}
+		}
+
+		/** stats restart at init, torn sectors are found after the previous cut */
+		checkpoints += W25QXX_FTL_Get_Stats()->checkpoints;
+		torn += W25QXX_FTL_Get_Stats()->torn_sectors;
+
+		Test_Power_On();
+		bad += Test_Verify(TEST_WORKING);
+		Test_Pending = -1;
+	}
+
+	snprintf(what, sizeof(what), "%u power cuts in %s: %u checkpoints, %u torn sectors found, %u bad sectors",
+			rounds, name, checkpoints, torn, bad);
+	Test_Check(bad == 0, what);
+}
+
+int main()
+{
+	Sim_Flash_Init(&Test_Sim, 0xEF4017, TEST_SIZE, 1);
+	Test_Flash.hspi = &Test_Sim.hspi;
+	Test_Flash.cs_port = &Test_Sim.cs_port;
+	Test_Flash.cs_pin = GPIO_PIN_6;
+
+	memset(Test_Expect, 0xFF, sizeof(Test_Expect));
+	Test_Power_On();
+
+	Test_Workload("sequential", Test_Count, 0, 0);
+	Test_Workload("random", Test_Count, 1, 0);
+	Test_Workload("random in bursts", 32 * TEST_BURST, 1, TEST_BURST);
+
+	Test_Power_On();
+	Test_Check(Test_Verify(Test_Count) == 0, "every sector reads back after init");
+
+	Test_Power_Cut("data sectors", TEST_JOURNAL_END, TEST_SIZE, 400, 30);
+	Test_Power_Cut("journal", TEST_SLOTS_END, TEST_JOURNAL_END, 200, 30);
+	Test_Power_Cut("checkpoint slots", 0, TEST_SLOTS_END, 60, 10);
+
+	Test_Check(Test_Verify(Test_Count) == 0, "every sector reads back after the power cuts");
+	Test_Check(!Sim_Violations, "no command the part would reject");
+
+	return Test_Failed;
+}
@@ -0,0 +1,248 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "w25qxx.h"
+#include "sim_flash.h"
+
+/**
+ * host test, the W25QXX driver against a modelled W25Q64 on each of two
+ * spi buses. checks probing, data, erase suspend and chained dma reads,
+ * then reports read and program throughput in modelled time, and how
+ * much dma reads on both buses overlap
+ */
+
+#define TEST_SIZE                      (8 * 1024 * 1024)
+#define TEST_BENCH_BYTES               (1024 * 1024)
+
+static Sim_Flash_t Test_Sim[2];
+static W25QXX_Handle_t Test_Flash[2];
+
+static uint8_t Test_Data[TEST_BENCH_BYTES];
+static uint8_t Test_Read[TEST_BENCH_BYTES];
+
+static volatile uint32_t Test_Callbacks;
+static volatile uint8_t Test_Error;
+
+static int Test_Failed;
+
+static void Test_Check(int ok, const char *what)
+{
+	printf("%s %s\n", ok ? "pass" : "FAIL", what);
+	if (!ok)
+		Test_Failed = 1;
+}
+
+static void Test_Done(uint8_t error)
+{
+	Test_Callbacks++;
+	Test_Error |= error;
+}
+
+static void Test_Fill(uint8_t *buffer, uint32_t count, uint32_t seed)
+{
+	for (uint32_t i = 0; i < count; i++)
+	{
+		seed = seed * 1103515245 + 12345;
+		buffer[i] = seed >> 16;
+	}
+}
+
+static void Test_Open(uint8_t n, uint32_t id, uint32_t size, uint8_t sfdp)
+{
+	if (Test_Sim[n].memory)
+		Sim_Flash_Free(&Test_Sim[n]);
+
+	Sim_Flash_Init(&Test_Sim[n], id, size, sfdp);
+	Test_Flash[n].hspi = &Test_Sim[n].hspi;
+	Test_Flash[n].cs_port = &Test_Sim[n].cs_port;
+	Test_Flash[n].cs_pin = GPIO_PIN_6;
+}
+
+/** geometry from sfdp, from the jedec id without it, and 4 byte addressing above 16M */
+static void Test_Probe()
+{
+	const W25QXX_Info_t *info;
+	char what[80];
+	uint8_t ok;
+
+	Test_Open(0, 0xEF4019, 32 * 1024 * 1024, 1);
+	ok = W25QXX_Init(&Test_Flash[0], W25QXX_READ_AUTO);
+	info = W25QXX_Get_Info(&Test_Flash[0]);
+	snprintf(what, sizeof(what), "W25Q256 sfdp: %u sectors, %u byte address, read mode %u",
+			info->sector_count, info->address_bytes, W25QXX_Get_Read_Mode(&Test_Flash[0]));
+	Test_Check(ok && info->sfdp && info->sector_count == 8192 && info->address_bytes == 4
+			&& Test_Sim[0].address_bytes == 4 && W25QXX_Get_Read_Mode(&Test_Flash[0]) == W25QXX_READ_FAST
+			&& info->erase_cmd[0] == 0x20 && info->erase_cmd[1] == 0x52 && info->erase_cmd[2] == 0xD8, what);
+
+	Test_Fill(Test_Data, 300, 1);
+	W25QXX_Erase_Sector(&Test_Flash[0], 5000);
+	W25QXX_Program(&Test_Flash[0], 5000 * 4096 + 100, Test_Data, 300);
+	W25QXX_Read(&Test_Flash[0], 5000 * 4096 + 100, Test_Read, 300);
+	Test_Check(!memcmp(Test_Data, Test_Read, 300), "W25Q256 program and read above 16M");
+
+	Test_Open(1, 0xEF4018, 16 * 1024 * 1024, 0);
+	ok = W25QXX_Init(&Test_Flash[1], W25QXX_READ_AUTO);
+	info = W25QXX_Get_Info(&Test_Flash[1]);
+	snprintf(what, sizeof(what), "W25Q128 jedec id only: %u sectors, %u byte address",
+			info->sector_count, info->address_bytes);
+	Test_Check(ok && !info->sfdp && info->sector_count == 4096 && info->address_bytes == 3, what);
+
+	Test_Open(0, 0xEF4017, TEST_SIZE, 1);
+	Test_Open(1, 0xEF4017, TEST_SIZE, 1);
+	Test_Check(W25QXX_Init(&Test_Flash[0], W25QXX_READ_AUTO) && W25QXX_Init(&Test_Flash[1], W25QXX_READ_AUTO)
+			&& W25QXX_Get_Info(&Test_Flash[0])->sector_count == 2048, "two W25Q64 on two buses");
+}
+
+/** unaligned program across pages, and the three outcomes of W25QXX_Write_Sector */
+static void Test_Data_Path()
+{
+	W25QXX_Handle_t *flash = &Test_Flash[0];
+	const W25QXX_Stats_t *stats = W25QXX_Get_Stats(flash);
+	W25QXX_Stats_t before = *stats;
+
+	Test_Fill(Test_Data, 3 * 4096, 2);
+	W25QXX_Erase_Sectors(flash, 16, 3);
+	W25QXX_Program(flash, 16 * 4096 + 77, Test_Data, 3 * 4096 - 77);
+	W25QXX_Read(flash, 16 * 4096 + 77, Test_Read, 3 * 4096 - 77);
+	Test_Check(!memcmp(Test_Data, Test_Read, 3 * 4096 - 77), "unaligned program over 3 sectors");
+
+	/** blank sector is programmed in place, then left alone */
+	W25QXX_Write_Sector(flash, 20, Test_Data);
+	W25QXX_Write_Sector(flash, 20, Test_Data);
+	for (uint32_t i = 0; i < 4096; i++)
+		Test_Data[i] &= 0xF0;
+	W25QXX_Write_Sector(flash, 20, Test_Data);
+	Test_Data[0] = 0xFF;
+	W25QXX_Write_Sector(flash, 20, Test_Data);
+	W25QXX_Read(flash, 20 * 4096, Test_Read, 4096);
+
+	Test_Check(!memcmp(Test_Data, Test_Read, 4096) && stats->writes_skipped == before.writes_skipped + 1
+			&& stats->erases_avoided == before.erases_avoided + 2 && stats->erases == before.erases + 1,
+			"write sector skips, programs in place, erases");
+}
+
+/** a read longer than W25QXX_DMA_CHUNK streams under one command */
+static void Test_Chained_Read()
+{
+	W25QXX_Handle_t *flash = &Test_Flash[0];
+	uint32_t count = 3 * W25QXX_DMA_CHUNK + 100;
+	uint32_t commands = Test_Sim[0].commands;
+	uint32_t transfers = Test_Sim[0].dma_transfers;
+	char what[80];
+
+	Test_Fill(Test_Data, count, 3);
+	W25QXX_Erase_Sectors(flash, 64, (count + 4095) / 4096);
+	W25QXX_Program(flash, 64 * 4096, Test_Data, count);
+
+	commands = Test_Sim[0].commands;
+	transfers = Test_Sim[0].dma_transfers;
+	Test_Callbacks = 0;
+	Test_Error = 0;
+	memset(Test_Read, 0, count);
+
+	W25QXX_Read_DMA(flash, 64 * 4096, Test_Read, count, Test_Done);
+	W25QXX_DMA_Wait(flash);
+
+	snprintf(what, sizeof(what), "chained read %u bytes: %u dma transfers, %u commands, %u callbacks",
+			count, Test_Sim[0].dma_transfers - transfers, Test_Sim[0].commands - commands, Test_Callbacks);
+	Test_Check(!memcmp(Test_Data, Test_Read, count) && !Test_Error && Test_Callbacks == 1
+			&& Test_Sim[0].dma_transfers - transfers == 4 && Test_Sim[0].commands - commands == 1, what);
+}
+
+/** reads and programs outside a background erase suspend it, the erase still completes */
+static void Test_Suspend()
+{
+	W25QXX_Handle_t *flash = &Test_Flash[0];
+	uint32_t suspends = Test_Sim[0].suspends;
+	uint64_t start;
+	uint32_t polls = 0;
+	char what[80];
+
+	Test_Fill(Test_Data, 4096, 4);
+	W25QXX_Program(flash, 200 * 4096, Test_Data, 4096);
+	W25QXX_Erase_Sectors(flash, 201, 1);
+
+	start = Sim_Time;
+	W25QXX_Erase_Start(flash, 200, 1);
+
+	W25QXX_Read(flash, 64 * 4096, Test_Read, 4096);
+	W25QXX_Erase_Busy(flash);
+	Sim_Idle(5000000);
+	W25QXX_Program(flash, 201 * 4096, Test_Data, 256);
+
+	while (W25QXX_Erase_Busy(flash))
+		polls++;
+
+	W25QXX_Read(flash, 200 * 4096, Test_Read, 4096);
+	for (uint32_t i = 0; i < 4096; i++)
+		if (Test_Read[i] != 0xFF)
+			polls = 0;
+	W25QXX_Read(flash, 201 * 4096, Test_Read, 256);
+
+	snprintf(what, sizeof(what), "erase suspended %u times, done after %.1f ms",
+			Test_Sim[0].suspends - suspends, (Sim_Time - start) / 1e6);
+	Test_Check(polls && Test_Sim[0].suspends - suspends == 2 && !memcmp(Test_Data, Test_Read, 256)
+			&& Sim_Time - start >= SIM_SECTOR_ERASE_NS, what);
+}
+
+/** modelled MB/s of blocking reads, programs, and dma reads on both buses at once */
+static void Test_Throughput()
+{
+	uint32_t chunk = 4096;
+	uint64_t start;
+	double read, program, single, dual;
+	char what[100];
+
+	Test_Fill(Test_Data, TEST_BENCH_BYTES, 5);
+	for (uint8_t n = 0; n < 2; n++)
+	{
+		W25QXX_Erase_Sectors(&Test_Flash[n], 512, TEST_BENCH_BYTES / 4096);
+		W25QXX_Program(&Test_Flash[n], 512 * 4096, Test_Data, TEST_BENCH_BYTES);
+	}
+
+	start = Sim_Time;
+	for (uint32_t offset = 0; offset < TEST_BENCH_BYTES; offset += chunk)
+		W25QXX_Read(&Test_Flash[0], 512 * 4096 + offset, Test_Read + offset, chunk);
+	read = TEST_BENCH_BYTES / ((Sim_Time - start) / 1e9) / 1e6;
+	Test_Check(!memcmp(Test_Data, Test_Read, TEST_BENCH_BYTES), "benchmark data read back");
+
+	W25QXX_Erase_Sectors(&Test_Flash[0], 1024, 64);
+	start = Sim_Time;
+	W25QXX_Program(&Test_Flash[0], 1024 * 4096, Test_Data, 64 * 4096);
+	program = 64 * 4096 / ((Sim_Time - start) / 1e9) / 1e6;
+
+	start = Sim_Time;
+	W25QXX_Read_DMA(&Test_Flash[0], 512 * 4096, Test_Read, TEST_BENCH_BYTES / 2, NULL);
+	W25QXX_DMA_Wait(&Test_Flash[0]);
+	W25QXX_Read_DMA(&Test_Flash[0], 512 * 4096 + TEST_BENCH_BYTES / 2, Test_Read + TEST_BENCH_BYTES / 2,
+			TEST_BENCH_BYTES / 2, NULL);
+	W25QXX_DMA_Wait(&Test_Flash[0]);
+	single = TEST_BENCH_BYTES / ((Sim_Time - start) / 1e9) / 1e6;
+
+	memset(Test_Read, 0, TEST_BENCH_BYTES);
+	start = Sim_Time;
+	W25QXX_Read_DMA(&Test_Flash[0], 512 * 4096, Test_Read, TEST_BENCH_BYTES / 2, NULL);
+	W25QXX_Read_DMA(&Test_Flash[1], 512 * 4096 + TEST_BENCH_BYTES / 2, Test_Read + TEST_BENCH_BYTES / 2,
+			TEST_BENCH_BYTES / 2, NULL);
+	W25QXX_DMA_Wait(&Test_Flash[0]);
+	W25QXX_DMA_Wait(&Test_Flash[1]);
+	dual = TEST_BENCH_BYTES / ((Sim_Time - start) / 1e9) / 1e6;
+
+	snprintf(what, sizeof(what), "4K reads %.2f MB/s, programs %.3f MB/s, dma reads 1 bus %.2f MB/s, 2 buses %.2f MB/s",
+			read, program, single, dual);
+	Test_Check(!memcmp(Test_Data, Test_Read, TEST_BENCH_BYTES) && dual > 1.5 * single && single >= read, what);
+}
+
+int main()
+{
+	Test_Probe();
+	Test_Data_Path();
+	Test_Chained_Read();
+	Test_Suspend();
+	Test_Throughput();
+
+	Test_Check(!Sim_Violations, "no command the part would reject");
+
+	return Test_Failed;
+}
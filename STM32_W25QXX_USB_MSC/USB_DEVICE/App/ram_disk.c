@@ -0,0 +1,257 @@
+/*
+ * ram_disk.c
+ *
+ *  Created on: 17-Oct-2026
+ *      Author: gitz
+ */
+
+#include <string.h>
+
+#include "ram_disk.h"
+
+static uint8_t RAM_Disk_Pool[RAM_DISK_POOL_BLOCKS][RAM_DISK_BLOCK_SIZE];
+
+static RAM_Disk_Stats_t RAM_Disk_Stats;
+
+#if RAM_DISK_SPARSE
+
+/** pool block + 1 holding each disk block, 0 for an all zero block */
+static uint8_t RAM_Disk_Map[RAM_DISK_BLOCK_COUNT];
+
+/** disk blocks pointing at each pool block, 0 when the pool block is free */
+static uint8_t RAM_Disk_Refs[RAM_DISK_POOL_BLOCKS];
+
+#if RAM_DISK_DEDUP
+static uint32_t RAM_Disk_Hash[RAM_DISK_POOL_BLOCKS];
+#endif
+
+/** free search starts here, blocks below were taken last time */
+static uint8_t RAM_Disk_Next_Free;
+
+/**
+ * fnv-1a over 32 bit words of a block
+ * return 0 when every byte is zero, the hash otherwise
+ */
+static uint32_t RAM_Disk_Hash_Block(const uint8_t *buffer)
+    {
+    uint32_t hash = 2166136261U;
+    uint32_t bits = 0;
+    uint32_t word;
+
+    for (uint16_t i = 0; i < RAM_DISK_BLOCK_SIZE; i += 4)
+	{
+	memcpy(&word, &buffer[i], 4);
+	bits |= word;
+	hash = (hash ^ word) * 16777619U;
+	}
+
+    if (!bits)
+	{
+	return 0;
+	}
+
+    /** 0 is reserved for the zero block */
+    return hash ? hash : 1;
+    }
+
+static void RAM_Disk_Release(uint8_t entry)
+    {
+    if (entry && --RAM_Disk_Refs[entry - 1] == 0)
+	{
+	RAM_Disk_Stats.used_blocks--;
+	}
+    }
+
+/** return pool block + 1, 0 if the pool is full */
+static uint8_t RAM_Disk_Alloc(void)
+    {
+    for (uint16_t n = 0; n < RAM_DISK_POOL_BLOCKS; n++)
+	{
+	uint8_t i = RAM_Disk_Next_Free;
+
+	RAM_Disk_Next_Free = (i + 1) % RAM_DISK_POOL_BLOCKS;
+
+	if (RAM_Disk_Refs[i] == 0)
+	    {
+	    RAM_Disk_Stats.used_blocks++;
+	    return i + 1;
+	    }
+	}
+
+    return 0;
+    }
+
+#if RAM_DISK_DEDUP
+/** return pool block + 1 already holding buffer, 0 if none */
+static uint8_t RAM_Disk_Find(const uint8_t *buffer, uint32_t hash)
+    {
+    for (uint8_t i = 0; i < RAM_DISK_POOL_BLOCKS; i++)
+	{
+	if (RAM_Disk_Refs[i] && RAM_Disk_Refs[i] < 255 && RAM_Disk_Hash[i] == hash
+		&& memcmp(RAM_Disk_Pool[i], buffer, RAM_DISK_BLOCK_SIZE) == 0)
+	    {
+	    return i + 1;
+	    }
+	}
+
+    return 0;
+    }
+#endif
+
+#endif /* RAM_DISK_SPARSE */
+
+void RAM_Disk_Init(void)
+    {
+#if RAM_DISK_SPARSE
+    memset(RAM_Disk_Map, 0, sizeof(RAM_Disk_Map));
+    memset(RAM_Disk_Refs, 0, sizeof(RAM_Disk_Refs));
+    RAM_Disk_Next_Free = 0;
+#endif
+
+    memset(&RAM_Disk_Stats, 0, sizeof(RAM_Disk_Stats));
+    }
+
+/** copy one block to buffer, return 0 if block is out of range */
+uint8_t RAM_Disk_Read(uint32_t block, uint8_t *buffer)
+    {
+    if (block >= RAM_DISK_BLOCK_COUNT)
+	{
+	return 0;
+	}
+
+#if RAM_DISK_SPARSE
+    uint8_t entry = RAM_Disk_Map[block];
+
+    if (!entry)
+	{
+	memset(buffer, 0, RAM_DISK_BLOCK_SIZE);
+	return 1;
+	}
+
+    block = entry - 1;
+#endif
+
+    memcpy(buffer, RAM_Disk_Pool[block], RAM_DISK_BLOCK_SIZE);
+
+    return 1;
+    }
+
+/**
+ * store one block
+ * sparse disk drops all zero blocks, shares blocks already stored and
+ * overwrites in place when the old block is not shared
+ * return 0 if block is out of range or the pool is full
+ */
+uint8_t RAM_Disk_Write(uint32_t block, const uint8_t *buffer)
+    {
+    if (block >= RAM_DISK_BLOCK_COUNT)
+	{
+	return 0;
+	}
+
+#if RAM_DISK_SPARSE
+    uint8_t old = RAM_Disk_Map[block];
+    uint8_t entry;
+    uint32_t hash = RAM_Disk_Hash_Block(buffer);
+
+    if (!hash)
+	{
+	RAM_Disk_Stats.zero_writes++;
+	RAM_Disk_Release(old);
+	RAM_Disk_Map[block] = 0;
+	return 1;
+	}
+
+#if RAM_DISK_DEDUP
+    entry = RAM_Disk_Find(buffer, hash);
+    if (entry)
+	{
+	RAM_Disk_Stats.dedup_hits++;
+	if (entry != old)
+	    {
+	    RAM_Disk_Refs[entry - 1]++;
+	    RAM_Disk_Release(old);
+	    RAM_Disk_Map[block] = entry;
+	    }
+	return 1;
+	}
+#endif
+
+    if (old && RAM_Disk_Refs[old - 1] == 1)
+	{
+	entry = old;
+	}
+    else
+	{
+	entry = RAM_Disk_Alloc();
+	if (!entry)
+	    {
+	    RAM_Disk_Stats.full_errors++;
+	    return 0;
+	    }
+
+	RAM_Disk_Refs[entry - 1] = 1;
+	RAM_Disk_Release(old);
+	RAM_Disk_Map[block] = entry;
+	}
+
+#if RAM_DISK_DEDUP
+    RAM_Disk_Hash[entry - 1] = hash;
+#endif
+
+    block = entry - 1;
+#endif
+
+    memcpy(RAM_Disk_Pool[block], buffer, RAM_DISK_BLOCK_SIZE);
+
+    return 1;
+    }
+
+/** release one block, it reads back as zeros, return 0 if block is out of range */
+uint8_t RAM_Disk_Unmap(uint32_t block)
+    {
+    if (block >= RAM_DISK_BLOCK_COUNT)
+	{
+	return 0;
+	}
+
+#if RAM_DISK_SPARSE
+    RAM_Disk_Release(RAM_Disk_Map[block]);
+    RAM_Disk_Map[block] = 0;
+#else
+    memset(RAM_Disk_Pool[block], 0, RAM_DISK_BLOCK_SIZE);
+#endif
+
+    return 1;
+    }
+
+/**
+ * memory holding count blocks from block, msc sends and receives them in place
+ * only a flat disk is contiguous, NULL makes msc copy through its own buffer
+ */
+uint8_t *RAM_Disk_Get_Buffer(uint32_t block, uint32_t count)
+    {
+#if RAM_DISK_SPARSE
+    UNUSED(block);
+    UNUSED(count);
+
+    return NULL;
+#else
+    if (block + count > RAM_DISK_BLOCK_COUNT)
+	{
+	return NULL;
+	}
+
+    return RAM_Disk_Pool[block];
+#endif
+    }
+
+/** used_blocks * RAM_DISK_BLOCK_SIZE is the sram actually taken by data */
+const RAM_Disk_Stats_t *RAM_Disk_Get_Stats(void)
+    {
+#if !RAM_DISK_SPARSE
+    RAM_Disk_Stats.used_blocks = RAM_DISK_POOL_BLOCKS;
+#endif
+
+    return &RAM_Disk_Stats;
+    }
@@ -0,0 +1,54 @@
+/*
+ * ram_disk.h
+ *
+ *  Created on: 17-Oct-2026
+ *      Author: gitz
+ */
+
+#ifndef RAM_DISK_H_
+#define RAM_DISK_H_
+
+#include "main.h"
+
+#define RAM_DISK_BLOCK_SIZE    512
+
+/** sram blocks holding data, at most 255 so a map entry fits one byte */
+#define RAM_DISK_POOL_BLOCKS   64
+
+/**
+ * 1: blocks are looked up through a map, all zero blocks take no pool
+ * space and the disk can be larger than the pool
+ * 0: flat array of RAM_DISK_POOL_BLOCKS blocks, lent to msc by RAM_Disk_Get_Buffer
+ */
+#define RAM_DISK_SPARSE        1
+
+/** sparse only, blocks with identical content share one pool block */
+#define RAM_DISK_DEDUP         1
+
+#if RAM_DISK_SPARSE
+/** capacity seen by host, writes fail once the pool is full */
+#define RAM_DISK_BLOCK_COUNT   (1024*1024/RAM_DISK_BLOCK_SIZE)
+#else
+#define RAM_DISK_BLOCK_COUNT   RAM_DISK_POOL_BLOCKS
+#endif
+
+#if RAM_DISK_POOL_BLOCKS > 255
+#error "RAM_DISK_POOL_BLOCKS must fit a one byte map entry"
+#endif
+
+typedef struct
+    {
+    uint32_t used_blocks;   /* pool blocks holding data */
+    uint32_t zero_writes;   /* blocks written as all zero, not stored */
+    uint32_t dedup_hits;    /* blocks written that matched a stored block */
+    uint32_t full_errors;   /* writes refused because the pool was full */
+    } RAM_Disk_Stats_t;
+
+void RAM_Disk_Init(void);
+uint8_t RAM_Disk_Read(uint32_t block, uint8_t *buffer);
+uint8_t RAM_Disk_Write(uint32_t block, const uint8_t *buffer);
+uint8_t RAM_Disk_Unmap(uint32_t block);
+uint8_t *RAM_Disk_Get_Buffer(uint32_t block, uint32_t count);
+const RAM_Disk_Stats_t *RAM_Disk_Get_Stats(void);
+
+#endif /* RAM_DISK_H_ */
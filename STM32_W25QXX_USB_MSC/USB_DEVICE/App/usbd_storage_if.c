@@ -23,7 +23,15 @@
 #include "usbd_storage_if.h"
 
 /* USER CODE BEGIN INCLUDE */
+#include <stdio.h>
+#include <string.h>
+
+#include "spi.h"
+#include "ram_disk.h"
+#include "vfat.h"
 #include "w25qxx.h"
+#include "w25qxx_cache.h"
+#include "w25qxx_ftl.h"
 /* USER CODE END INCLUDE */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -51,7 +59,31 @@
   */
 
 /* USER CODE BEGIN PRIVATE_TYPES */
+typedef enum
+    {
+    STORAGE_CACHE_NONE = 0,      /* backend has no write cache */
+    STORAGE_CACHE_WRITE_BACK,    /* dirty data written on idle, sync or stop unit */
+    STORAGE_CACHE_WRITE_THROUGH, /* synced after every write command */
+    } STORAGE_Cache_t;
 
+/**
+ * block backend bound to one lun, blocks are STORAGE_BLK_SIZ bytes
+ * write is NULL for a read only lun, ready, busy, unmap and sync are optional
+ * busy is polled from the usb interrupt, it must not touch the spi bus
+ */
+typedef struct
+    {
+    uint32_t (*block_count)(void);
+    uint8_t exponent;            /* physical block is 1 << exponent blocks */
+    uint8_t write_protected;
+    STORAGE_Cache_t cache;
+    uint8_t (*ready)(void);
+    uint8_t (*busy)(void);
+    int8_t (*read)(uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
+    int8_t (*write)(uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
+    int8_t (*unmap)(uint32_t blk_addr, uint32_t blk_len);
+    void (*sync)(void);
+    } STORAGE_Lun_t;
 /* USER CODE END PRIVATE_TYPES */
 
 /**
@@ -68,11 +100,35 @@
 #define STORAGE_BLK_SIZ                  0x200
 
 /* USER CODE BEGIN PRIVATE_DEFINES */
+#undef STORAGE_LUN_NBR
 #undef STORAGE_BLK_NBR
 #undef STORAGE_BLK_SIZ
 
-#define STORAGE_BLK_NBR                  W25QXX_SECTOR_COUNT
-#define STORAGE_BLK_SIZ                  W25QXX_SECTOR_SIZE
+/** one entry each in STORAGE_Luns and STORAGE_Inquirydata_FS */
+#define STORAGE_LUN_NBR                  3
+#define STORAGE_LUN_FLASH                0
+#define STORAGE_LUN_RAM                  1
+#define STORAGE_LUN_VFAT                 2
+
+/**
+ * host sees 512 byte logical blocks on every lun, on flash 8 of them make
+ * one 4K sector, the physical block is reported through READ CAPACITY(16)
+ * so aligned hosts write whole sectors, unaligned writes are merged by the cache
+ */
+#define STORAGE_BLK_SIZ                  0x200
+#define STORAGE_BLK_EXPONENT             3
+#define STORAGE_BLK_PER_SECTOR           (1 << STORAGE_BLK_EXPONENT)
+
+#if (STORAGE_BLK_SIZ * STORAGE_BLK_PER_SECTOR) != W25QXX_SECTOR_SIZE
+#error "STORAGE_BLK_EXPONENT does not match W25QXX_SECTOR_SIZE"
+#endif
+
+#if RAM_DISK_BLOCK_SIZE != STORAGE_BLK_SIZ || VFAT_SECTOR_SIZE != STORAGE_BLK_SIZ
+#error "every lun must use STORAGE_BLK_SIZ blocks"
+#endif
+
+/** STATS.TXT is padded with spaces to this size */
+#define STORAGE_STATS_SIZE               512
 /* USER CODE END PRIVATE_DEFINES */
 
 /**
@@ -111,13 +167,112 @@ const int8_t STORAGE_Inquirydata_FS[] = {/* 36 */
   0x00,	
   0x00,
   'S', 'T', 'M', ' ', ' ', ' ', ' ', ' ', /* Manufacturer : 8 bytes */
-  'P', 'r', 'o', 'd', 'u', 'c', 't', ' ', /* Product      : 16 Bytes */
+  'W', '2', '5', 'Q', 'X', 'X', ' ', 'F', /* Product      : 16 Bytes */
+  'l', 'a', 's', 'h', ' ', ' ', ' ', ' ',
+  '0', '.', '0' ,'1',                     /* Version      : 4 Bytes */
+
+  /* LUN 1 */
+  0x00,
+  0x80,
+  0x02,
+  0x02,
+  (STANDARD_INQUIRY_DATA_LEN - 5),
+  0x00,
+  0x00,
+  0x00,
+  'S', 'T', 'M', ' ', ' ', ' ', ' ', ' ', /* Manufacturer : 8 bytes */
+  'R', 'A', 'M', ' ', 'D', 'i', 's', 'k', /* Product      : 16 Bytes */
+  ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ',
+  '0', '.', '0' ,'1',                     /* Version      : 4 Bytes */
+
+  /* LUN 2 */
+  0x00,
+  0x80,
+  0x02,
+  0x02,
+  (STANDARD_INQUIRY_DATA_LEN - 5),
+  0x00,
+  0x00,
+  0x00,
+  'S', 'T', 'M', ' ', ' ', ' ', ' ', ' ', /* Manufacturer : 8 bytes */
+  'E', 'x', 'p', 'o', 'r', 't', ' ', ' ', /* Product      : 16 Bytes */
   ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ',
   '0', '.', '0' ,'1'                      /* Version      : 4 Bytes */
 }; 
 /* USER CODE END INQUIRY_DATA_FS */
 
 /* USER CODE BEGIN PRIVATE_VARIABLES */
+/** init runs again on every bus reset, cache and ftl state must survive it */
+static uint8_t STORAGE_Initialized;
+
+/**
+ * flash devices striped by the ftl, W25QXX_FTL_CHIPS 2 needs spi2 with
+ * dma and a W25QXX2_CS pin set up in cube
+ */
+static W25QXX_Handle_t STORAGE_Flash[W25QXX_FTL_CHIPS] =
+    {
+	{ .hspi = &hspi1, .cs_port = W25QXX_CS_GPIO_Port, .cs_pin = W25QXX_CS_Pin },
+#if W25QXX_FTL_CHIPS > 1
+	{ .hspi = &hspi2, .cs_port = W25QXX2_CS_GPIO_Port, .cs_pin = W25QXX2_CS_Pin },
+#endif
+    };
+
+static W25QXX_Handle_t *STORAGE_Chips[W25QXX_FTL_CHIPS];
+
+static uint32_t STORAGE_Flash_Blocks(void);
+static uint8_t STORAGE_Flash_Ready(void);
+static uint8_t STORAGE_Flash_Busy(void);
+static int8_t STORAGE_Flash_Read(uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
+static int8_t STORAGE_Flash_Write(uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
+static int8_t STORAGE_Flash_Unmap(uint32_t blk_addr, uint32_t blk_len);
+static uint32_t STORAGE_Ram_Blocks(void);
+static int8_t STORAGE_Ram_Read(uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
+static int8_t STORAGE_Ram_Write(uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
+static int8_t STORAGE_Ram_Unmap(uint32_t blk_addr, uint32_t blk_len);
+static int8_t STORAGE_Vfat_Read(uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
+static void STORAGE_Image_Read(uint32_t offset, uint8_t *buffer, uint32_t count);
+static uint32_t STORAGE_Image_Size(void);
+static void STORAGE_Stats_Read(uint32_t offset, uint8_t *buffer, uint32_t count);
+
+/**
+ * flash through the ftl and cache for bulk data, a small sparse ram disk
+ * for scratch, and a read only fat16 volume exporting the raw flash and stats
+ */
+static const STORAGE_Lun_t STORAGE_Luns[STORAGE_LUN_NBR] =
+    {
+	[STORAGE_LUN_FLASH] =
+	    {
+	    .block_count = STORAGE_Flash_Blocks,
+	    .exponent = STORAGE_BLK_EXPONENT,
+	    .cache = STORAGE_CACHE_WRITE_BACK,
+	    .ready = STORAGE_Flash_Ready,
+	    .busy = STORAGE_Flash_Busy,
+	    .read = STORAGE_Flash_Read,
+	    .write = STORAGE_Flash_Write,
+	    .unmap = STORAGE_Flash_Unmap,
+	    .sync = W25QXX_Cache_Flush,
+	    },
+	[STORAGE_LUN_RAM] =
+	    {
+	    .block_count = STORAGE_Ram_Blocks,
+	    .read = STORAGE_Ram_Read,
+	    .write = STORAGE_Ram_Write,
+	    .unmap = STORAGE_Ram_Unmap,
+	    },
+	[STORAGE_LUN_VFAT] =
+	    {
+	    .block_count = VFAT_Get_Sector_Count,
+	    .write_protected = 1,
+	    .read = STORAGE_Vfat_Read,
+	    },
+    };
+
+/** files of the STORAGE_LUN_VFAT volume, contents are read when host reads them */
+static const VFAT_File_t STORAGE_Files[] =
+    {
+	{ "FLASH   BIN", W25QXX_FTL_MAX_SIZE, STORAGE_Image_Size, STORAGE_Image_Read },
+	{ "STATS   TXT", STORAGE_STATS_SIZE, NULL, STORAGE_Stats_Read },
+    };
 
 /* USER CODE END PRIVATE_VARIABLES */
 
@@ -151,6 +306,12 @@ static int8_t STORAGE_IsReady_FS(uint8_t lun);
 static int8_t STORAGE_IsWriteProtected_FS(uint8_t lun);
 static int8_t STORAGE_Read_FS(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
 static int8_t STORAGE_Write_FS(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len);
+static int8_t STORAGE_SyncCache_FS(uint8_t lun);
+static int8_t STORAGE_Unmap_FS(uint8_t lun, uint32_t blk_addr, uint32_t blk_len);
+static int8_t STORAGE_GetPhysicalBlock_FS(uint8_t lun, uint8_t *exponent, uint16_t *aligned_lba);
+static int8_t STORAGE_IsBusy_FS(uint8_t lun);
+static int8_t STORAGE_IsWriteCached_FS(uint8_t lun);
+static int8_t STORAGE_CanUnmap_FS(uint8_t lun);
 static int8_t STORAGE_GetMaxLun_FS(void);
 
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_DECLARATION */
@@ -169,6 +330,12 @@ USBD_StorageTypeDef USBD_Storage_Interface_fops_FS =
   STORAGE_IsWriteProtected_FS,
   STORAGE_Read_FS,
   STORAGE_Write_FS,
+  STORAGE_SyncCache_FS,
+  STORAGE_Unmap_FS,
+  STORAGE_GetPhysicalBlock_FS,
+  STORAGE_IsBusy_FS,
+  STORAGE_IsWriteCached_FS,
+  STORAGE_CanUnmap_FS,
   STORAGE_GetMaxLun_FS,
   (int8_t *)STORAGE_Inquirydata_FS
 };
@@ -182,12 +349,24 @@ USBD_StorageTypeDef USBD_Storage_Interface_fops_FS =
 int8_t STORAGE_Init_FS(uint8_t lun)
 {
   /* USER CODE BEGIN 2 */
-    W25QXX_Init();
-    if(W25QXX_Read_ID() == W25QXX_ID)
+    if (STORAGE_Initialized)
 	{
 	return (USBD_OK);
 	}
-  return (USBD_FAIL);
+    for (uint8_t i = 0; i < W25QXX_FTL_CHIPS; i++)
+	{
+	STORAGE_Chips[i] = &STORAGE_Flash[i];
+	if (!W25QXX_Init(STORAGE_Chips[i], W25QXX_READ_AUTO))
+	    {
+	    return (USBD_FAIL);
+	    }
+	}
+    W25QXX_FTL_Init(STORAGE_Chips);
+    W25QXX_Cache_Init();
+    RAM_Disk_Init();
+    VFAT_Init(STORAGE_Files, sizeof(STORAGE_Files) / sizeof(STORAGE_Files[0]));
+    STORAGE_Initialized = 1;
+  return (USBD_OK);
   /* USER CODE END 2 */
 }
 
@@ -201,7 +380,11 @@ int8_t STORAGE_Init_FS(uint8_t lun)
 int8_t STORAGE_GetCapacity_FS(uint8_t lun, uint32_t *block_num, uint16_t *block_size)
 {
   /* USER CODE BEGIN 3 */
-  *block_num  = STORAGE_BLK_NBR;
+    if (lun >= STORAGE_LUN_NBR)
+	{
+	return (USBD_FAIL);
+	}
+  *block_num  = STORAGE_Luns[lun].block_count();
   *block_size = STORAGE_BLK_SIZ;
   return (USBD_OK);
   /* USER CODE END 3 */
@@ -215,7 +398,8 @@ int8_t STORAGE_GetCapacity_FS(uint8_t lun, uint32_t *block_num, uint16_t *block_
 int8_t STORAGE_IsReady_FS(uint8_t lun)
 {
   /* USER CODE BEGIN 4 */
-    if(W25QXX_Read_ID() == W25QXX_ID)
+    if (STORAGE_Initialized && lun < STORAGE_LUN_NBR
+	    && (!STORAGE_Luns[lun].ready || STORAGE_Luns[lun].ready()))
 	{
 	return (USBD_OK);
 	}
@@ -231,6 +415,10 @@ int8_t STORAGE_IsReady_FS(uint8_t lun)
 int8_t STORAGE_IsWriteProtected_FS(uint8_t lun)
 {
   /* USER CODE BEGIN 5 */
+    if (lun >= STORAGE_LUN_NBR || STORAGE_Luns[lun].write_protected || !STORAGE_Luns[lun].write)
+	{
+	return (USBD_FAIL);
+	}
   return (USBD_OK);
   /* USER CODE END 5 */
 }
@@ -243,8 +431,11 @@ int8_t STORAGE_IsWriteProtected_FS(uint8_t lun)
 int8_t STORAGE_Read_FS(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len)
 {
   /* USER CODE BEGIN 6 */
-    W25QXX_Read(blk_addr*STORAGE_BLK_SIZ, buf, blk_len*STORAGE_BLK_SIZ);
-  return (USBD_OK);
+    if (lun >= STORAGE_LUN_NBR)
+	{
+	return (USBD_FAIL);
+	}
+  return STORAGE_Luns[lun].read(buf, blk_addr, blk_len);
   /* USER CODE END 6 */
 }
 
@@ -256,11 +447,123 @@ int8_t STORAGE_Read_FS(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t bl
 int8_t STORAGE_Write_FS(uint8_t lun, uint8_t *buf, uint32_t blk_addr, uint16_t blk_len)
 {
   /* USER CODE BEGIN 7 */
-    W25QXX_Write(blk_addr*STORAGE_BLK_SIZ, buf, blk_len*STORAGE_BLK_SIZ);
+    if (lun >= STORAGE_LUN_NBR || !STORAGE_Luns[lun].write
+	    || STORAGE_Luns[lun].write(buf, blk_addr, blk_len) != USBD_OK)
+	{
+	return (USBD_FAIL);
+	}
+    if (STORAGE_Luns[lun].cache == STORAGE_CACHE_WRITE_THROUGH && STORAGE_Luns[lun].sync)
+	{
+	STORAGE_Luns[lun].sync();
+	}
   return (USBD_OK);
   /* USER CODE END 7 */
 }
 
+/**
+  * @brief  Writes back cached data of a lun, called on SYNCHRONIZE CACHE and STOP UNIT.
+  * @param  lun: .
+  * @retval USBD_OK if all operations are OK else USBD_FAIL
+  */
+int8_t STORAGE_SyncCache_FS(uint8_t lun)
+{
+  /* USER CODE BEGIN 9 */
+    if (lun < STORAGE_LUN_NBR && STORAGE_Luns[lun].sync)
+	{
+	STORAGE_Luns[lun].sync();
+	}
+  return (USBD_OK);
+  /* USER CODE END 9 */
+}
+
+/**
+  * @brief  Releases blocks on SCSI UNMAP, ignored by luns that can not release blocks.
+  * @param  lun: .
+  * @param  blk_addr: first block.
+  * @param  blk_len: number of blocks.
+  * @retval USBD_OK if all operations are OK else USBD_FAIL
+  */
+int8_t STORAGE_Unmap_FS(uint8_t lun, uint32_t blk_addr, uint32_t blk_len)
+{
+  /* USER CODE BEGIN 10 */
+    if (lun < STORAGE_LUN_NBR && STORAGE_Luns[lun].unmap)
+	{
+	return STORAGE_Luns[lun].unmap(blk_addr, blk_len);
+	}
+  return (USBD_OK);
+  /* USER CODE END 10 */
+}
+
+/**
+  * @brief  Physical block reported by READ CAPACITY(16) and the block limits page.
+  * @param  lun: .
+  * @param  exponent: logical blocks per physical block is 1 << exponent.
+  * @param  aligned_lba: first logical block starting a physical block.
+  * @retval USBD_OK if all operations are OK else USBD_FAIL
+  */
+int8_t STORAGE_GetPhysicalBlock_FS(uint8_t lun, uint8_t *exponent, uint16_t *aligned_lba)
+{
+  /* USER CODE BEGIN 11 */
+    if (lun >= STORAGE_LUN_NBR)
+	{
+	return (USBD_FAIL);
+	}
+    *exponent = STORAGE_Luns[lun].exponent;
+    *aligned_lba = 0;
+  return (USBD_OK);
+  /* USER CODE END 11 */
+}
+
+/**
+  * @brief  Tells the UAS scheduler a lun would stall the next command, an
+  *         erase is running, so queued commands for other luns go first.
+  * @param  lun: .
+  * @retval 1 if busy, 0 otherwise
+  */
+int8_t STORAGE_IsBusy_FS(uint8_t lun)
+{
+  /* USER CODE BEGIN 12 */
+    if (lun < STORAGE_LUN_NBR && STORAGE_Luns[lun].busy && STORAGE_Luns[lun].busy())
+	{
+	return 1;
+	}
+  return 0;
+  /* USER CODE END 12 */
+}
+
+/**
+  * @brief  Reported as WCE in the caching mode page, only a write back lun
+  *         holds written data until SYNCHRONIZE CACHE.
+  * @param  lun: .
+  * @retval 1 if writes are cached, 0 otherwise
+  */
+int8_t STORAGE_IsWriteCached_FS(uint8_t lun)
+{
+  /* USER CODE BEGIN 13 */
+    if (lun < STORAGE_LUN_NBR && STORAGE_Luns[lun].cache == STORAGE_CACHE_WRITE_BACK)
+	{
+	return 1;
+	}
+  return 0;
+  /* USER CODE END 13 */
+}
+
+/**
+  * @brief  Reported as LBPME and LBPU, a read only lun never releases blocks.
+  * @param  lun: .
+  * @retval 1 if UNMAP is supported, 0 otherwise
+  */
+int8_t STORAGE_CanUnmap_FS(uint8_t lun)
+{
+  /* USER CODE BEGIN 14 */
+    if (lun < STORAGE_LUN_NBR && STORAGE_Luns[lun].unmap && !STORAGE_Luns[lun].write_protected)
+	{
+	return 1;
+	}
+  return 0;
+  /* USER CODE END 14 */
+}
+
 /**
   * @brief  .
   * @param  None
@@ -274,6 +577,253 @@ int8_t STORAGE_GetMaxLun_FS(void)
 }
 
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_IMPLEMENTATION */
+static uint32_t STORAGE_Flash_Blocks(void)
+    {
+    return W25QXX_FTL_Get_Sector_Count() * STORAGE_BLK_PER_SECTOR;
+    }
+
+/**
+ * id cached by W25QXX_Init, called on every TEST UNIT READY from the usb
+ * interrupt, spi traffic here would suspend erases and race the read-ahead dma
+ */
+static uint8_t STORAGE_Flash_Ready(void)
+    {
+    for (uint8_t i = 0; i < W25QXX_FTL_CHIPS; i++)
+	{
+	uint32_t id = W25QXX_Get_Info(&STORAGE_Flash[i])->id;
+
+	if (id == 0 || id == 0xFFFFFF)
+	    {
+	    return 0;
+	    }
+	}
+
+    return 1;
+    }
+
+/** background erase or dma running on any chip, state only, no spi access */
+static uint8_t STORAGE_Flash_Busy(void)
+    {
+    for (uint8_t i = 0; i < W25QXX_FTL_CHIPS; i++)
+	{
+	if (STORAGE_Flash[i].erase_state != W25QXX_ERASE_IDLE || STORAGE_Flash[i].dma_busy)
+	    {
+	    return 1;
+	    }
+	}
+
+    return 0;
+    }
+
+/** blocks are split per 4K sector, partial sectors go through the cache read-modify-write */
+static int8_t STORAGE_Flash_Read(uint8_t *buf, uint32_t blk_addr, uint16_t blk_len)
+    {
+    while (blk_len)
+	{
+	uint16_t offset = blk_addr % STORAGE_BLK_PER_SECTOR;
+	uint16_t count = STORAGE_BLK_PER_SECTOR - offset;
+
+	if (count > blk_len)
+	    {
+	    count = blk_len;
+	    }
+
+	W25QXX_Cache_Read_Part(blk_addr / STORAGE_BLK_PER_SECTOR, offset * STORAGE_BLK_SIZ, buf,
+		count * STORAGE_BLK_SIZ);
+
+	buf += count * STORAGE_BLK_SIZ;
+	blk_addr += count;
+	blk_len -= count;
+	}
+    return (USBD_OK);
+    }
+
+static int8_t STORAGE_Flash_Write(uint8_t *buf, uint32_t blk_addr, uint16_t blk_len)
+    {
+    while (blk_len)
+	{
+	uint16_t offset = blk_addr % STORAGE_BLK_PER_SECTOR;
+	uint16_t count = STORAGE_BLK_PER_SECTOR - offset;
+
+	if (count > blk_len)
+	    {
+	    count = blk_len;
+	    }
+
+	W25QXX_Cache_Write_Part(blk_addr / STORAGE_BLK_PER_SECTOR, offset * STORAGE_BLK_SIZ, buf,
+		count * STORAGE_BLK_SIZ);
+
+	buf += count * STORAGE_BLK_SIZ;
+	blk_addr += count;
+	blk_len -= count;
+	}
+    return (USBD_OK);
+    }
+
+/**
+ * released sectors read back as 0xFF and are erased in background
+ * only sectors fully covered by the range are released
+ */
+static int8_t STORAGE_Flash_Unmap(uint32_t blk_addr, uint32_t blk_len)
+    {
+    uint32_t sector = (blk_addr + STORAGE_BLK_PER_SECTOR - 1) / STORAGE_BLK_PER_SECTOR;
+    uint32_t end = (blk_addr + blk_len) / STORAGE_BLK_PER_SECTOR;
+
+    while (sector < end)
+	{
+	W25QXX_Cache_Discard(sector);
+	W25QXX_FTL_Unmap(sector++);
+	}
+    return (USBD_OK);
+    }
+
+static uint32_t STORAGE_Ram_Blocks(void)
+    {
+    return RAM_DISK_BLOCK_COUNT;
+    }
+
+static int8_t STORAGE_Ram_Read(uint8_t *buf, uint32_t blk_addr, uint16_t blk_len)
+    {
+    while (blk_len--)
+	{
+	if (!RAM_Disk_Read(blk_addr++, buf))
+	    {
+	    return (USBD_FAIL);
+	    }
+	buf += STORAGE_BLK_SIZ;
+	}
+    return (USBD_OK);
+    }
+
+/** fails with a write fault once the ram disk pool is full */
+static int8_t STORAGE_Ram_Write(uint8_t *buf, uint32_t blk_addr, uint16_t blk_len)
+    {
+    while (blk_len--)
+	{
+	if (!RAM_Disk_Write(blk_addr++, buf))
+	    {
+	    return (USBD_FAIL);
+	    }
+	buf += STORAGE_BLK_SIZ;
+	}
+    return (USBD_OK);
+    }
+
+/** released blocks give their pool space back and read back as zeros */
+static int8_t STORAGE_Ram_Unmap(uint32_t blk_addr, uint32_t blk_len)
+    {
+    while (blk_len--)
+	{
+	RAM_Disk_Unmap(blk_addr++);
+	}
+    return (USBD_OK);
+    }
+
+static int8_t STORAGE_Vfat_Read(uint8_t *buf, uint32_t blk_addr, uint16_t blk_len)
+    {
+    VFAT_Read(blk_addr, buf, blk_len);
+    return (USBD_OK);
+    }
+
+/** FLASH.BIN, raw content of chip 0 including ftl metadata */
+static void STORAGE_Image_Read(uint32_t offset, uint8_t *buffer, uint32_t count)
+    {
+    W25QXX_Read(&STORAGE_Flash[0], offset, buffer, count);
+    }
+
+static uint32_t STORAGE_Image_Size(void)
+    {
+    return W25QXX_Get_Info(&STORAGE_Flash[0])->total_size;
+    }
+
+/** STATS.TXT, ftl, cache and driver counters, generated again on every read */
+static void STORAGE_Stats_Read(uint32_t offset, uint8_t *buffer, uint32_t count)
+    {
+    const W25QXX_FTL_Stats_t *ftl = W25QXX_FTL_Get_Stats();
+    const W25QXX_Cache_Stats_t *cache = W25QXX_Cache_Get_Stats();
+    const W25QXX_Stats_t *flash = W25QXX_Get_Stats(&STORAGE_Flash[0]);
+    char text[STORAGE_STATS_SIZE + 1];
+    int len;
+
+    len = snprintf(text, sizeof(text),
+	    "host_sectors %lu\r\nprogrammed_bytes %lu\r\nerases %lu\r\n"
+	    "foreground_erases %lu\r\nblock_erases %lu\r\ncheckpoints %lu\r\n"
+	    "torn_sectors %lu\r\nunmapped %lu\r\nread_hits %lu\r\nread_misses %lu\r\n"
+	    "prefetched %lu\r\nprefetch_used %lu\r\nrmw_reads %lu\r\n"
+	    "erases_avoided %lu\r\nwrites_skipped %lu\r\n",
+	    (unsigned long) ftl->host_sectors, (unsigned long) ftl->programmed_bytes,
+	    (unsigned long) ftl->erases, (unsigned long) ftl->foreground_erases,
+	    (unsigned long) ftl->block_erases, (unsigned long) ftl->checkpoints,
+	    (unsigned long) ftl->torn_sectors, (unsigned long) ftl->unmapped,
+	    (unsigned long) cache->read_hits, (unsigned long) cache->read_misses,
+	    (unsigned long) cache->prefetched, (unsigned long) cache->prefetch_used,
+	    (unsigned long) cache->rmw_reads, (unsigned long) flash->erases_avoided,
+	    (unsigned long) flash->writes_skipped);
+
+    if (len < 0)
+	{
+	len = 0;
+	}
+    if (len < STORAGE_STATS_SIZE)
+	{
+	memset(&text[len], ' ', STORAGE_STATS_SIZE - len);
+	}
+
+    memcpy(buffer, &text[offset], count);
+    }
+
+/**
+ * called from main loop, first runs the flash access queued by the msc
+ * ping-pong data stage, then fetches the read-ahead window if a
+ * sequential read is running, else writes back one dirty sector once the
+ * host stopped writing for W25QXX_CACHE_IDLE_MS, else lets the ftl start
+ * or poll a background erase or checkpoint step, reads arriving meanwhile
+ * suspend the erase
+ * usb interrupt is masked so msc can not touch the cache meanwhile,
+ * read-ahead unmasks it while dma moves the data, one run per device at
+ * a time
+ */
+void STORAGE_Process_FS(void)
+    {
+    uint8_t prefetch;
+    uint8_t done;
+
+    MSC_BOT_Process(&hUsbDeviceFS);
+
+    if (!STORAGE_Initialized)
+	{
+	return;
+	}
+
+    HAL_NVIC_DisableIRQ(OTG_FS_IRQn);
+    prefetch = W25QXX_Cache_Prefetch_Start();
+    HAL_NVIC_EnableIRQ(OTG_FS_IRQn);
+
+    if (prefetch)
+	{
+	do
+	    {
+	    W25QXX_Cache_Prefetch_Wait();
+
+	    HAL_NVIC_DisableIRQ(OTG_FS_IRQn);
+	    done = W25QXX_Cache_Prefetch_End();
+	    HAL_NVIC_EnableIRQ(OTG_FS_IRQn);
+	    }
+	while (!done);
+	return;
+	}
+
+    HAL_NVIC_DisableIRQ(OTG_FS_IRQn);
+    if (W25QXX_Cache_Is_Idle())
+	{
+	W25QXX_Cache_Flush_One();
+	}
+    else
+	{
+	W25QXX_FTL_Process();
+	}
+    HAL_NVIC_EnableIRQ(OTG_FS_IRQn);
+    }
 
 /* USER CODE END PRIVATE_FUNCTIONS_IMPLEMENTATION */
 
@@ -0,0 +1,261 @@
+/*
+ * vfat.c
+ *
+ *  Created on: 17-Oct-2026
+ *      Author: gitz
+ */
+
+#include <string.h>
+
+#include "vfat.h"
+
+/** layout, boot sector, two fat copies, root directory then data */
+#define VFAT_FAT_ENTRIES       (VFAT_SECTOR_SIZE/2)
+#define VFAT_FAT_SECTORS       ((VFAT_CLUSTER_COUNT + 2 + VFAT_FAT_ENTRIES - 1)/VFAT_FAT_ENTRIES)
+#define VFAT_FAT_START         1
+#define VFAT_ROOT_START        (VFAT_FAT_START + 2*VFAT_FAT_SECTORS)
+#define VFAT_ROOT_SECTORS      (VFAT_ROOT_ENTRIES*32/VFAT_SECTOR_SIZE)
+#define VFAT_DATA_START        (VFAT_ROOT_START + VFAT_ROOT_SECTORS)
+#define VFAT_SECTOR_COUNT      (VFAT_DATA_START + VFAT_CLUSTER_COUNT*VFAT_CLUSTER_SECTORS)
+
+/** 17-Oct-2026 00:00, fat date is years since 1980, month, day */
+#define VFAT_DATE              (((2026 - 1980) << 9) | (10 << 5) | 17)
+#define VFAT_LABEL             "W25QXX     "
+
+#if VFAT_MAX_FILES >= VFAT_ROOT_ENTRIES
+#error "root directory also holds the volume label"
+#endif
+
+static const VFAT_File_t *VFAT_Files;
+static uint8_t VFAT_File_Count;
+
+/** clusters given to each file at init, first is 0 for a file without any */
+static uint32_t VFAT_First_Cluster[VFAT_MAX_FILES];
+static uint32_t VFAT_Clusters[VFAT_MAX_FILES];
+
+static void VFAT_Put16(uint8_t *buffer, uint16_t value)
+    {
+    buffer[0] = value;
+    buffer[1] = value >> 8;
+    }
+
+static void VFAT_Put32(uint8_t *buffer, uint32_t value)
+    {
+    VFAT_Put16(buffer, value);
+    VFAT_Put16(buffer + 2, value >> 16);
+    }
+
+/** current size, capped to the clusters given at init */
+static uint32_t VFAT_File_Size(uint8_t file)
+    {
+    uint32_t size = VFAT_Files[file].max_size;
+
+    if (VFAT_Files[file].size)
+	{
+	size = VFAT_Files[file].size();
+	}
+
+    if (size > VFAT_Clusters[file] * VFAT_CLUSTER_SIZE)
+	{
+	size = VFAT_Clusters[file] * VFAT_CLUSTER_SIZE;
+	}
+
+    return size;
+    }
+
+static void VFAT_Boot_Sector(uint8_t *buffer)
+    {
+    memcpy(buffer, "\xEB\x3C\x90MSDOS5.0", 11);
+    VFAT_Put16(&buffer[11], VFAT_SECTOR_SIZE);
+    buffer[13] = VFAT_CLUSTER_SECTORS;
+    VFAT_Put16(&buffer[14], VFAT_FAT_START);  /* reserved sectors */
+    buffer[16] = 2;                           /* fat copies */
+    VFAT_Put16(&buffer[17], VFAT_ROOT_ENTRIES);
+#if VFAT_SECTOR_COUNT < 0x10000
+    VFAT_Put16(&buffer[19], VFAT_SECTOR_COUNT);
+#else
+    VFAT_Put32(&buffer[32], VFAT_SECTOR_COUNT);
+#endif
+    buffer[21] = 0xF8;                        /* fixed disk */
+    VFAT_Put16(&buffer[22], VFAT_FAT_SECTORS);
+    VFAT_Put16(&buffer[24], 63);              /* sectors per track */
+    VFAT_Put16(&buffer[26], 255);             /* heads */
+    buffer[36] = 0x80;                        /* drive number */
+    buffer[38] = 0x29;                        /* extended boot signature */
+    VFAT_Put32(&buffer[39], 0x25071017);      /* volume serial */
+    memcpy(&buffer[43], VFAT_LABEL, 11);
+    memcpy(&buffer[54], "FAT16   ", 8);
+    buffer[510] = 0x55;
+    buffer[511] = 0xAA;
+    }
+
+/** one sector of the fat, each file is a single chain of consecutive clusters */
+static void VFAT_Fat_Sector(uint32_t fat_sector, uint8_t *buffer)
+    {
+    uint32_t first_entry = fat_sector * VFAT_FAT_ENTRIES;
+
+    if (fat_sector == 0)
+	{
+	VFAT_Put16(&buffer[0], 0xFFF8);
+	VFAT_Put16(&buffer[2], 0xFFFF);
+	}
+
+    for (uint8_t i = 0; i < VFAT_File_Count; i++)
+	{
+	uint32_t used = (VFAT_File_Size(i) + VFAT_CLUSTER_SIZE - 1) / VFAT_CLUSTER_SIZE;
+	uint32_t last = VFAT_First_Cluster[i] + used - 1;
+	uint32_t n = VFAT_First_Cluster[i];
+
+	if (!used || last < first_entry || n >= first_entry + VFAT_FAT_ENTRIES)
+	    {
+	    continue;
+	    }
+
+	if (n < first_entry)
+	    {
+	    n = first_entry;
+	    }
+
+	for (; n <= last && n < first_entry + VFAT_FAT_ENTRIES; n++)
+	    {
+	    VFAT_Put16(&buffer[(n - first_entry) * 2], n == last ? 0xFFFF : n + 1);
+	    }
+	}
+    }
+
+/** one sector of the root directory, volume label first then the file table */
+static void VFAT_Root_Sector(uint32_t root_sector, uint8_t *buffer)
+    {
+    uint32_t first_entry = root_sector * (VFAT_SECTOR_SIZE / 32);
+
+    for (uint32_t n = 0; n < VFAT_SECTOR_SIZE / 32; n++)
+	{
+	uint8_t *entry = &buffer[n * 32];
+	uint32_t index = first_entry + n;
+
+	if (index == 0)
+	    {
+	    memcpy(entry, VFAT_LABEL, 11);
+	    entry[11] = 0x08;
+	    VFAT_Put16(&entry[24], VFAT_DATE);
+	    }
+	else if (index <= VFAT_File_Count)
+	    {
+	    uint8_t file = index - 1;
+	    uint32_t size = VFAT_File_Size(file);
+
+	    memcpy(entry, VFAT_Files[file].name, 11);
+	    entry[11] = 0x21;                 /* read only, archive */
+	    VFAT_Put16(&entry[16], VFAT_DATE); /* created */
+	    VFAT_Put16(&entry[18], VFAT_DATE); /* accessed */
+	    VFAT_Put16(&entry[24], VFAT_DATE); /* modified */
+	    VFAT_Put16(&entry[26], size ? VFAT_First_Cluster[file] : 0);
+	    VFAT_Put32(&entry[28], size);
+	    }
+	}
+    }
+
+/**
+ * give each file consecutive clusters for its max_size, in table order
+ * files past the end of the volume are truncated
+ * the table must stay valid, names and sizes are read again on every access
+ */
+void VFAT_Init(const VFAT_File_t *files, uint8_t file_count)
+    {
+    uint32_t cluster = 2;
+
+    if (file_count > VFAT_MAX_FILES)
+	{
+	file_count = VFAT_MAX_FILES;
+	}
+
+    VFAT_Files = files;
+    VFAT_File_Count = file_count;
+
+    for (uint8_t i = 0; i < file_count; i++)
+	{
+	uint32_t clusters = (files[i].max_size + VFAT_CLUSTER_SIZE - 1) / VFAT_CLUSTER_SIZE;
+
+	if (clusters > VFAT_CLUSTER_COUNT + 2 - cluster)
+	    {
+	    clusters = VFAT_CLUSTER_COUNT + 2 - cluster;
+	    }
+
+	VFAT_First_Cluster[i] = clusters ? cluster : 0;
+	VFAT_Clusters[i] = clusters;
+	cluster += clusters;
+	}
+    }
+
+uint32_t VFAT_Get_Sector_Count(void)
+    {
+    return VFAT_SECTOR_COUNT;
+    }
+
+/**
+ * read count sectors of the volume
+ * consecutive sectors of one file are fetched with a single read callback
+ */
+void VFAT_Read(uint32_t sector, uint8_t *buffer, uint32_t count)
+    {
+    while (count)
+	{
+	uint32_t run = 1;
+
+	memset(buffer, 0, VFAT_SECTOR_SIZE);
+
+	if (sector == 0)
+	    {
+	    VFAT_Boot_Sector(buffer);
+	    }
+	else if (sector < VFAT_ROOT_START)
+	    {
+	    VFAT_Fat_Sector((sector - VFAT_FAT_START) % VFAT_FAT_SECTORS, buffer);
+	    }
+	else if (sector < VFAT_DATA_START)
+	    {
+	    VFAT_Root_Sector(sector - VFAT_ROOT_START, buffer);
+	    }
+	else if (sector < VFAT_SECTOR_COUNT)
+	    {
+	    uint32_t cluster = (sector - VFAT_DATA_START) / VFAT_CLUSTER_SECTORS + 2;
+
+	    for (uint8_t i = 0; i < VFAT_File_Count; i++)
+		{
+		if (VFAT_Clusters[i] && cluster >= VFAT_First_Cluster[i]
+			&& cluster < VFAT_First_Cluster[i] + VFAT_Clusters[i])
+		    {
+		    uint32_t start = VFAT_DATA_START + (VFAT_First_Cluster[i] - 2) * VFAT_CLUSTER_SECTORS;
+		    uint32_t end = start + VFAT_Clusters[i] * VFAT_CLUSTER_SECTORS;
+		    uint32_t offset = (sector - start) * VFAT_SECTOR_SIZE;
+		    uint32_t size = VFAT_File_Size(i);
+		    uint32_t valid = 0;
+
+		    run = end - sector;
+		    if (run > count)
+			{
+			run = count;
+			}
+
+		    if (offset < size)
+			{
+			valid = size - offset;
+			if (valid > run * VFAT_SECTOR_SIZE)
+			    {
+			    valid = run * VFAT_SECTOR_SIZE;
+			    }
+			VFAT_Files[i].read(offset, buffer, valid);
+			}
+
+		    /** zero the tail of the last cluster */
+		    memset(buffer + valid, 0, run * VFAT_SECTOR_SIZE - valid);
+		    break;
+		    }
+		}
+	    }
+
+	sector += run;
+	buffer += run * VFAT_SECTOR_SIZE;
+	count -= run;
+	}
+    }
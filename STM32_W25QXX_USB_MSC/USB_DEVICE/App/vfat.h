@@ -0,0 +1,48 @@
+/*
+ * vfat.h
+ *
+ *  Created on: 17-Oct-2026
+ *      Author: gitz
+ */
+
+#ifndef VFAT_H_
+#define VFAT_H_
+
+#include "main.h"
+
+/**
+ * read only fat16 volume generated sector by sector from a file table,
+ * boot sector, fat and root directory are computed on every read and file
+ * data is pulled from the file read callbacks, nothing is kept in ram
+ */
+
+#define VFAT_SECTOR_SIZE       512
+#define VFAT_CLUSTER_SECTORS   8
+#define VFAT_CLUSTER_SIZE      (VFAT_SECTOR_SIZE*VFAT_CLUSTER_SECTORS)
+
+/** 4085 to 65524 clusters make a fat16 volume, 8192 x 4K = 32M */
+#define VFAT_CLUSTER_COUNT     8192
+
+#define VFAT_ROOT_ENTRIES      512
+#define VFAT_MAX_FILES         16
+
+typedef struct
+    {
+    /** 8.3 name space padded without the dot, "FLASH   BIN" */
+    char name[11];
+
+    /** clusters reserved for the file, its size never grows above this */
+    uint32_t max_size;
+
+    /** current size, NULL when always max_size */
+    uint32_t (*size)(void);
+
+    /** fill buffer with count bytes from offset, never past size */
+    void (*read)(uint32_t offset, uint8_t *buffer, uint32_t count);
+    } VFAT_File_t;
+
+void VFAT_Init(const VFAT_File_t *files, uint8_t file_count);
+uint32_t VFAT_Get_Sector_Count(void);
+void VFAT_Read(uint32_t sector, uint8_t *buffer, uint32_t count);
+
+#endif /* VFAT_H_ */
@@ -5,222 +5,878 @@
  *      Author: gitz
  */
 
+#include <stddef.h>
+#include <string.h>
+
 #include "w25qxx.h"
 
+/** indexed by W25QXX_Read_Mode_t, copied to each handle, dual and quad entries are updated from sfdp */
+static const W25QXX_Read_Cmd_t W25QXX_Read_Cmds[] =
+    {
+	{ 0x03, 0, 1 },
+	{ 0x0B, 1, 1 },
+	{ 0x3B, 1, 2 },
+	{ 0x6B, 1, 4 },
+    };
+
+/** W25Q64 geometry, used for a part without sfdp */
+static const W25QXX_Info_t W25QXX_Default_Info =
+    {
+    .id = W25QXX_ID,
+    .total_size = W25QXX_TOTAL_SIZE,
+    .sector_count = W25QXX_SECTOR_COUNT,
+    .page_size = W25QXX_PAGE_SIZE,
+    .address_bytes = 3,
+    .erase_cmd = { 0x20, 0x52, 0xD8 },
+    .read_modes = 0x0F,
+    };
+
+/** initialized devices, spi interrupt callbacks look up the one owning the bus */
+static W25QXX_Handle_t *W25QXX_Instances[W25QXX_MAX_INSTANCES];
+
 /**
- * spi configured in cube @see spi.c
+ * start dma for the next piece of a streaming read, cs is left low
+ * returns 0 if the transfer could not be started
+ */
+static uint8_t W25QXX_DMA_Next_Chunk(W25QXX_Handle_t *hflash)
+    {
+    uint16_t chunk = W25QXX_DMA_CHUNK;
+    uint8_t *ptr = hflash->dma_ptr;
+
+    if (hflash->dma_left < chunk)
+	{
+	chunk = hflash->dma_left;
+	}
+
+    hflash->dma_ptr += chunk;
+    hflash->dma_left -= chunk;
+
+    return HAL_SPI_Receive_DMA(hflash->hspi, ptr, chunk) == HAL_OK;
+    }
+
+/**
+ * pull cs low once a dma transfer started elsewhere is done, the only
+ * place commands wait on dma. an interrupt may start a command while
+ * main loop waits on dma or streams a read-ahead
+ */
+static void W25QXX_Select(W25QXX_Handle_t *hflash)
+    {
+    W25QXX_DMA_Wait(hflash);
+    HAL_GPIO_WritePin(hflash->cs_port, hflash->cs_pin, GPIO_PIN_RESET);
+    }
+
+/** sfdp read wait states plus mode clocks are at most 31 + 7, 4 bytes */
+#define W25QXX_MAX_DUMMY_BYTES 4
+
+/**
+ * send command, 24 or 32 bit address and dummy bytes as a single transfer
+ * cs must already be low
+ */
+static void W25QXX_Send_Command(W25QXX_Handle_t *hflash, uint8_t cmd, uint32_t address, uint8_t dummy_bytes)
+    {
+    uint8_t header[1 + 4 + W25QXX_MAX_DUMMY_BYTES];
+    uint8_t n = 0;
+
+    memset(header, 0x00, sizeof(header));
+    if (dummy_bytes > W25QXX_MAX_DUMMY_BYTES)
+	{
+	dummy_bytes = W25QXX_MAX_DUMMY_BYTES;
+	}
+
+    header[n++] = cmd;
+    if (hflash->info.address_bytes == 4)
+	{
+	header[n++] = address >> 24;
+	}
+    header[n++] = address >> 16;
+    header[n++] = address >> 8;
+    header[n++] = address;
+
+    HAL_SPI_Transmit(hflash->hspi, header, n + dummy_bytes, 100);
+    }
+
+static void W25QXX_Send_Byte(W25QXX_Handle_t *hflash, uint8_t cmd)
+    {
+    W25QXX_Select(hflash);
+
+    HAL_SPI_Transmit(hflash->hspi, &cmd, 1, 100);
+
+    HAL_GPIO_WritePin(hflash->cs_port, hflash->cs_pin, GPIO_PIN_SET);
+    }
+
+/**
+ * reads are not accepted while an erase runs, suspend it (0x75)
+ * flash stops being busy within tSUS (20us)
+ */
+static void W25QXX_Suspend(W25QXX_Handle_t *hflash)
+    {
+    if (hflash->erase_state != W25QXX_ERASE_RUNNING)
+	{
+	return;
+	}
+
+    /** give the erase some run time since last resume */
+    while ((HAL_GetTick() - hflash->resume_tick) <= W25QXX_RESUME_MIN_MS)
+	{
+	if ((W25QXX_Read_Status(hflash) & 0x01) == 0)
+	    {
+	    hflash->erase_state = W25QXX_ERASE_IDLE;
+	    return;
+	    }
+	}
+
+    W25QXX_Send_Byte(hflash, 0x75);
+    W25QXX_Wait_Busy(hflash);
+
+    hflash->erase_state = W25QXX_ERASE_SUSPENDED;
+    }
+
+static void W25QXX_Resume(W25QXX_Handle_t *hflash)
+    {
+    /** resume is ignored while a program issued during suspend still runs */
+    W25QXX_Wait_Busy(hflash);
+
+    W25QXX_Send_Byte(hflash, 0x7A);
+
+    hflash->erase_state = W25QXX_ERASE_RUNNING;
+    hflash->resume_tick = HAL_GetTick();
+    }
+
+/** read the jedec sfdp table (0x5A), always 24 bit address and 8 dummy clocks */
+static void W25QXX_Read_SFDP(W25QXX_Handle_t *hflash, uint32_t address, uint8_t *buffer, uint16_t count)
+    {
+    uint8_t header[5];
+
+    header[0] = 0x5A;
+    header[1] = address >> 16;
+    header[2] = address >> 8;
+    header[3] = address;
+    header[4] = 0x00;
+
+    W25QXX_Select(hflash);
+
+    HAL_SPI_Transmit(hflash->hspi, header, 5, 100);
+
+    HAL_SPI_Receive(hflash->hspi, buffer, count, 100);
+
+    HAL_GPIO_WritePin(hflash->cs_port, hflash->cs_pin, GPIO_PIN_SET);
+    }
+
+/** 4 byte little endian sfdp dword */
+static uint32_t W25QXX_SFDP_Dword(const uint8_t *table, uint8_t n)
+    {
+    const uint8_t *p = table + (n - 1) * 4;
+
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+    }
+
+/**
+ * parse the basic flash parameter table, JESD216
+ * dword 1   4K erase, 1-1-2/1-1-4 read support, address bytes
+ * dword 2   density
+ * dword 3/4 1-1-4 and 1-1-2 read opcode and wait states
+ * dword 8/9 erase types, size as power of 2 and opcode
+ * dword 11  page size as power of 2
+ * return 0 when there is no usable table
+ */
+static uint8_t W25QXX_Probe_SFDP(W25QXX_Handle_t *hflash)
+    {
+    uint8_t header[16];
+    uint8_t table[11 * 4];
+    uint32_t dword;
+    uint32_t length;
+    uint32_t pointer;
+
+    W25QXX_Read_SFDP(hflash, 0, header, sizeof(header));
+
+    /** 'SFDP' signature and parameter header 0 is the basic table, id 0xFF00 */
+    if (header[0] != 'S' || header[1] != 'F' || header[2] != 'D' || header[3] != 'P'
+	    || header[8] != 0x00 || header[15] != 0xFF)
+	{
+	return 0;
+	}
+
+    length = header[11];
+    pointer = header[12] | (header[13] << 8) | (header[14] << 16);
+
+    if (length < 9)
+	{
+	return 0;
+	}
+    if (length > sizeof(table) / 4)
+	{
+	length = sizeof(table) / 4;
+	}
+
+    memset(table, 0xFF, sizeof(table));
+    W25QXX_Read_SFDP(hflash, pointer, table, length * 4);
+
+    dword = W25QXX_SFDP_Dword(table, 2);
+    if (dword & 0x80000000)
+	{
+	/** 2^n bits, only used above 4 Gbit, 32 bit total_size holds up to 2^34 */
+	uint32_t n = dword & 0x7FFFFFFF;
+
+	hflash->info.total_size = n >= 32 && n < 35 ? 1UL << (n - 3) : 0;
+	}
+    else
+	{
+	hflash->info.total_size = (dword + 1) / 8;
+	}
+
+    dword = W25QXX_SFDP_Dword(table, 1);
+    hflash->info.address_bytes = ((dword >> 17) & 0x03) == 0x02 ? 4 : 3;
+    if (hflash->info.total_size > 16 * 1024 * 1024)
+	{
+	hflash->info.address_bytes = 4;
+	}
+
+    hflash->info.read_modes = (1 << W25QXX_READ_NORMAL) | (1 << W25QXX_READ_FAST);
+    if (dword & (1 << 16))
+	{
+	uint32_t d4 = W25QXX_SFDP_Dword(table, 4);
+
+	hflash->info.read_modes |= 1 << W25QXX_READ_DUAL;
+	hflash->read_cmds[W25QXX_READ_DUAL].cmd = d4 >> 8;
+	hflash->read_cmds[W25QXX_READ_DUAL].dummy_bytes = ((d4 & 0x1F) + ((d4 >> 5) & 0x07)) / 8;
+	}
+    if (dword & (1 << 22))
+	{
+	uint32_t d3 = W25QXX_SFDP_Dword(table, 3);
+
+	hflash->info.read_modes |= 1 << W25QXX_READ_QUAD;
+	hflash->read_cmds[W25QXX_READ_QUAD].cmd = d3 >> 24;
+	hflash->read_cmds[W25QXX_READ_QUAD].dummy_bytes = (((d3 >> 16) & 0x1F) + ((d3 >> 21) & 0x07)) / 8;
+	}
+
+    memset(hflash->info.erase_cmd, 0, sizeof(hflash->info.erase_cmd));
+    for (uint8_t i = 0; i < 4; i++)
+	{
+	uint8_t size = table[7 * 4 + i * 2];
+	uint8_t opcode = table[7 * 4 + i * 2 + 1];
+
+	if (size == 12)
+	    {
+	    hflash->info.erase_cmd[0] = opcode;
+	    }
+	else if (size == 15)
+	    {
+	    hflash->info.erase_cmd[1] = opcode;
+	    }
+	else if (size == 16)
+	    {
+	    hflash->info.erase_cmd[2] = opcode;
+	    }
+	}
+
+    hflash->info.page_size = W25QXX_PAGE_SIZE;
+    if (length >= 11)
+	{
+	hflash->info.page_size = 1UL << ((W25QXX_SFDP_Dword(table, 11) >> 4) & 0x0F);
+	}
+
+    return 1;
+    }
+
+/**
+ * hspi, cs_port and cs_pin must be set, driver state is reset
  * gpio configured in cube @see gpio.c
- * cs pin defined in @see main.h
+ *
+ * geometry, erase opcodes and read modes come from sfdp, parts without
+ * it keep the W25Q64 defaults with size taken from the jedec id capacity
+ * byte. parts above 16M are switched to 4 byte addressing (0xB7)
+ *
+ * W25QXX_READ_AUTO picks the fastest supported mode, any mode is
+ * downgraded to fast read when it needs more data lines than
+ * W25QXX_BUS_WIDTH or the part does not support it
+ *
+ * return 0 when no usable flash answered
  */
-void W25QXX_Init(void)
+uint8_t W25QXX_Init(W25QXX_Handle_t *hflash, W25QXX_Read_Mode_t read_mode)
+    {
+    uint8_t capacity;
+    uint8_t i = 0;
+
+    memset(&hflash->info, 0, sizeof(W25QXX_Handle_t) - offsetof(W25QXX_Handle_t, info));
+    hflash->info = W25QXX_Default_Info;
+    memcpy(hflash->read_cmds, W25QXX_Read_Cmds, sizeof(hflash->read_cmds));
+
+    while (i < W25QXX_MAX_INSTANCES && W25QXX_Instances[i] && W25QXX_Instances[i] != hflash)
+	{
+	i++;
+	}
+    if (i == W25QXX_MAX_INSTANCES)
+	{
+	return 0;
+	}
+    W25QXX_Instances[i] = hflash;
+
+    W25QXX_Read_Status(hflash);
+
+    hflash->info.id = W25QXX_Read_ID(hflash);
+    if (hflash->info.id == 0 || hflash->info.id == 0xFFFFFF)
+	{
+	return 0;
+	}
+
+    hflash->info.sfdp = W25QXX_Probe_SFDP(hflash);
+    if (!hflash->info.sfdp)
+	{
+	capacity = hflash->info.id & 0xFF;
+	hflash->info.total_size = capacity >= 0x10 && capacity <= 0x1F ? 1UL << capacity : W25QXX_TOTAL_SIZE;
+	hflash->info.address_bytes = hflash->info.total_size > 16 * 1024 * 1024 ? 4 : 3;
+	}
+
+    if (!hflash->info.total_size || !hflash->info.erase_cmd[0] || hflash->info.page_size < W25QXX_PAGE_SIZE)
+	{
+	return 0;
+	}
+
+    hflash->info.sector_count = hflash->info.total_size / W25QXX_SECTOR_SIZE;
+
+    if (hflash->info.address_bytes == 4)
+	{
+	W25QXX_Send_Byte(hflash, 0xB7);
+	}
+
+    if (read_mode == W25QXX_READ_AUTO)
+	{
+	read_mode = W25QXX_READ_QUAD;
+	while (read_mode > W25QXX_READ_FAST
+		&& (!(hflash->info.read_modes & (1 << read_mode))
+			|| hflash->read_cmds[read_mode].data_lines > W25QXX_BUS_WIDTH))
+	    {
+	    read_mode--;
+	    }
+	}
+
+    if (read_mode > W25QXX_READ_QUAD
+	    || !(hflash->info.read_modes & (1 << read_mode))
+	    || hflash->read_cmds[read_mode].data_lines > W25QXX_BUS_WIDTH)
+	{
+	read_mode = W25QXX_READ_FAST;
+	}
+
+    hflash->read_mode = read_mode;
+
+    return 1;
+    }
+
+const W25QXX_Info_t *W25QXX_Get_Info(W25QXX_Handle_t *hflash)
+    {
+    return &hflash->info;
+    }
+
+W25QXX_Read_Mode_t W25QXX_Get_Read_Mode(W25QXX_Handle_t *hflash)
     {
-    W25QXX_Read_Status();
+    return hflash->read_mode;
     }
 
-uint8_t W25QXX_Read_Status(void)
+uint8_t W25QXX_Read_Status(W25QXX_Handle_t *hflash)
     {
     uint8_t cmd = 0x05;
     uint8_t result;
 
-    HAL_GPIO_WritePin(W25QXX_CS_GPIO_Port, W25QXX_CS_Pin, GPIO_PIN_RESET);
+    W25QXX_Select(hflash);
 
-    HAL_SPI_Transmit(&W25QXX_SPI, &cmd, 1, 100);
+    HAL_SPI_Transmit(hflash->hspi, &cmd, 1, 100);
 
-    HAL_SPI_Receive(&W25QXX_SPI, &result, 1, 100);
+    HAL_SPI_Receive(hflash->hspi, &result, 1, 100);
 
-    HAL_GPIO_WritePin(W25QXX_CS_GPIO_Port, W25QXX_CS_Pin, GPIO_PIN_SET);
+    HAL_GPIO_WritePin(hflash->cs_port, hflash->cs_pin, GPIO_PIN_SET);
 
     return result;
     }
 
-uint32_t W25QXX_Read_ID(void)
+uint32_t W25QXX_Read_ID(W25QXX_Handle_t *hflash)
     {
     uint8_t cmd = 0x9F;
     uint8_t ret;
     uint32_t result;
 
-    HAL_GPIO_WritePin(W25QXX_CS_GPIO_Port, W25QXX_CS_Pin, GPIO_PIN_RESET);
+    W25QXX_Suspend(hflash);
+
+    W25QXX_Select(hflash);
 
-    HAL_SPI_Transmit(&W25QXX_SPI, &cmd, 1, 100);
+    HAL_SPI_Transmit(hflash->hspi, &cmd, 1, 100);
     cmd = 0x00;
 
-    HAL_SPI_Receive(&W25QXX_SPI, &ret, 1, 100);
+    HAL_SPI_Receive(hflash->hspi, &ret, 1, 100);
     result = ret << 16;
 
-    HAL_SPI_Receive(&W25QXX_SPI, &ret, 1, 100);
+    HAL_SPI_Receive(hflash->hspi, &ret, 1, 100);
     result |= ret << 8;
 
-    HAL_SPI_Receive(&W25QXX_SPI, &ret, 1, 100);
+    HAL_SPI_Receive(hflash->hspi, &ret, 1, 100);
     result |= ret;
 
-    HAL_GPIO_WritePin(W25QXX_CS_GPIO_Port, W25QXX_CS_Pin, GPIO_PIN_SET);
+    HAL_GPIO_WritePin(hflash->cs_port, hflash->cs_pin, GPIO_PIN_SET);
 
     return result;
     }
 
 
-void W25QXX_Read_Unique_ID(uint8_t *buff)
+void W25QXX_Read_Unique_ID(W25QXX_Handle_t *hflash, uint8_t *buff)
     {
     uint8_t cmd = 0x9F;
     uint8_t ret;
 
-    HAL_GPIO_WritePin(W25QXX_CS_GPIO_Port, W25QXX_CS_Pin, GPIO_PIN_RESET);
+    W25QXX_Suspend(hflash);
 
-    HAL_SPI_Transmit(&W25QXX_SPI, &cmd, 1, 100);
+    W25QXX_Select(hflash);
+
+    HAL_SPI_Transmit(hflash->hspi, &cmd, 1, 100);
     cmd = 0x00;
-    HAL_SPI_Transmit(&W25QXX_SPI, &cmd, 1, 100);
-    HAL_SPI_Transmit(&W25QXX_SPI, &cmd, 1, 100);
-    HAL_SPI_Transmit(&W25QXX_SPI, &cmd, 1, 100);
-    HAL_SPI_Transmit(&W25QXX_SPI, &cmd, 1, 100);
+    HAL_SPI_Transmit(hflash->hspi, &cmd, 1, 100);
+    HAL_SPI_Transmit(hflash->hspi, &cmd, 1, 100);
+    HAL_SPI_Transmit(hflash->hspi, &cmd, 1, 100);
+    HAL_SPI_Transmit(hflash->hspi, &cmd, 1, 100);
 
     for (uint8_t i = 0; i < 8; i++)
 	{
-	HAL_SPI_Receive(&W25QXX_SPI, &ret, 1, 100);
+	HAL_SPI_Receive(hflash->hspi, &ret, 1, 100);
 	buff[i] = ret;
 	}
-    HAL_GPIO_WritePin(W25QXX_CS_GPIO_Port, W25QXX_CS_Pin, GPIO_PIN_SET);
+    HAL_GPIO_WritePin(hflash->cs_port, hflash->cs_pin, GPIO_PIN_SET);
     }
 
 
-void W25QXX_Write_Enable(void)
+static void W25QXX_Send_Write_Enable(W25QXX_Handle_t *hflash)
     {
     uint8_t cmd = 0x06;
 
-    HAL_GPIO_WritePin(W25QXX_CS_GPIO_Port, W25QXX_CS_Pin, GPIO_PIN_RESET);
+    W25QXX_Select(hflash);
+
+    HAL_SPI_Transmit(hflash->hspi, &cmd, 1, 100);
+
+    HAL_GPIO_WritePin(hflash->cs_port, hflash->cs_pin, GPIO_PIN_SET);
+    }
+
+void W25QXX_Write_Enable(W25QXX_Handle_t *hflash)
+    {
+    /** no erase while a background erase is pending */
+    W25QXX_Erase_Wait(hflash);
+
+    W25QXX_Send_Write_Enable(hflash);
+    }
 
-    HAL_SPI_Transmit(&W25QXX_SPI, &cmd, 1, 100);
+/**
+ * write enable for a page program, a background erase elsewhere in the
+ * chip is suspended instead of waited for, W25QXX_Erase_Busy resumes it
+ */
+static void W25QXX_Program_Enable(W25QXX_Handle_t *hflash, uint32_t address, uint16_t count)
+    {
+    if (hflash->erase_state != W25QXX_ERASE_IDLE
+	    && address < hflash->erase_address + hflash->erase_size
+	    && address + count > hflash->erase_address)
+	{
+	W25QXX_Erase_Wait(hflash);
+	}
+    else
+	{
+	W25QXX_Suspend(hflash);
+	}
 
-    HAL_GPIO_WritePin(W25QXX_CS_GPIO_Port, W25QXX_CS_Pin, GPIO_PIN_SET);
+    W25QXX_Send_Write_Enable(hflash);
     }
 
-void W25QXX_Write_Disable(void)
+void W25QXX_Write_Disable(W25QXX_Handle_t *hflash)
     {
     uint8_t cmd = 0x04;
 
-    HAL_GPIO_WritePin(W25QXX_CS_GPIO_Port, W25QXX_CS_Pin, GPIO_PIN_RESET);
+    W25QXX_Select(hflash);
 
-    HAL_SPI_Transmit(&W25QXX_SPI, &cmd, 1, 100);
+    HAL_SPI_Transmit(hflash->hspi, &cmd, 1, 100);
 
-    HAL_GPIO_WritePin(W25QXX_CS_GPIO_Port, W25QXX_CS_Pin, GPIO_PIN_SET);
+    HAL_GPIO_WritePin(hflash->cs_port, hflash->cs_pin, GPIO_PIN_SET);
     }
 
-void W25QXX_Wait_Busy(void)
+void W25QXX_Wait_Busy(W25QXX_Handle_t *hflash)
     {
-    while ((W25QXX_Read_Status() & 0x01) == 0x01);
+    while ((W25QXX_Read_Status(hflash) & 0x01) == 0x01);
     }
 
-void W25QXX_Erase_Chip(void)
+void W25QXX_Erase_Chip(W25QXX_Handle_t *hflash)
     {
     uint8_t cmd = 0xC7;
 
-    W25QXX_Write_Enable();
-    W25QXX_Wait_Busy();
+    W25QXX_Write_Enable(hflash);
+    W25QXX_Wait_Busy(hflash);
 
-    HAL_GPIO_WritePin(W25QXX_CS_GPIO_Port, W25QXX_CS_Pin, GPIO_PIN_RESET);
+    W25QXX_Select(hflash);
 
-    HAL_SPI_Transmit(&W25QXX_SPI, &cmd, 1, 100);
+    HAL_SPI_Transmit(hflash->hspi, &cmd, 1, 100);
 
-    HAL_GPIO_WritePin(W25QXX_CS_GPIO_Port, W25QXX_CS_Pin, GPIO_PIN_SET);
+    HAL_GPIO_WritePin(hflash->cs_port, hflash->cs_pin, GPIO_PIN_SET);
+
+    W25QXX_Wait_Busy(hflash);
+    }
 
-    W25QXX_Wait_Busy();
+void W25QXX_Read(W25QXX_Handle_t *hflash, uint32_t address, uint8_t *buffer, uint32_t count)
+    {
+    W25QXX_Read_DMA(hflash, address, buffer, count, NULL);
+    W25QXX_DMA_Wait(hflash);
     }
 
-void W25QXX_Read(uint32_t address, uint8_t *buffer, uint16_t count)
+/**
+ * start a read, data phase runs on dma, cs stays low while the dma
+ * interrupt chains one transfer per W25QXX_DMA_CHUNK bytes so a long
+ * range streams without resending command and address
+ * cs is released and callback is called from dma interrupt at the end
+ */
+void W25QXX_Read_DMA(W25QXX_Handle_t *hflash, uint32_t address, uint8_t *buffer, uint32_t count, W25QXX_Callback_t callback)
     {
-    uint8_t cmd = 0x03;
-    uint8_t temp;
+    const W25QXX_Read_Cmd_t *read_cmd = &hflash->read_cmds[hflash->read_mode];
+
+    W25QXX_DMA_Wait(hflash);
+
+    hflash->dma_ptr = buffer;
+    hflash->dma_left = count;
 
     if (!count)
 	{
+	if (callback)
+	    {
+	    callback(0);
+	    }
 	return;
 	}
 
-    HAL_GPIO_WritePin(W25QXX_CS_GPIO_Port, W25QXX_CS_Pin, GPIO_PIN_RESET);
+    W25QXX_Suspend(hflash);
 
-    HAL_SPI_Transmit(&W25QXX_SPI, &cmd, 1, 100);
+    W25QXX_Select(hflash);
 
-    temp = address>>16;
-    HAL_SPI_Transmit(&W25QXX_SPI, &temp, 1, 100);
+    W25QXX_Send_Command(hflash, read_cmd->cmd, address, read_cmd->dummy_bytes);
 
-    temp = address>>8;
-    HAL_SPI_Transmit(&W25QXX_SPI, &temp, 1, 100);
+    hflash->dma_callback = callback;
+    hflash->dma_busy = 1;
 
-    temp = address;
-    HAL_SPI_Transmit(&W25QXX_SPI, &temp, 1, 100);
+    if (!W25QXX_DMA_Next_Chunk(hflash))
+	{
+	HAL_SPI_ErrorCallback(hflash->hspi);
+	}
+    }
 
-    HAL_SPI_Receive(&W25QXX_SPI, buffer, count, 5000);
+/**
+ * send write enable and an erase command, cs is released right away
+ * flash stays busy until the erase is done
+ */
+static void W25QXX_Erase_Cmd(W25QXX_Handle_t *hflash, uint8_t cmd, uint32_t address)
+    {
+    W25QXX_Write_Enable(hflash);
+    W25QXX_Wait_Busy(hflash);
 
-    HAL_GPIO_WritePin(W25QXX_CS_GPIO_Port, W25QXX_CS_Pin, GPIO_PIN_SET);
+    W25QXX_Select(hflash);
+
+    W25QXX_Send_Command(hflash, cmd, address, 0);
+
+    HAL_GPIO_WritePin(hflash->cs_port, hflash->cs_pin, GPIO_PIN_SET);
     }
 
-void W25QXX_Erase_Sector(uint32_t sector_number)
+/** erase opcode for 1, W25QXX_HALF_BLOCK_SECTORS or W25QXX_BLOCK_SECTORS sectors */
+static uint8_t W25QXX_Erase_Opcode(W25QXX_Handle_t *hflash, uint32_t sector_count)
     {
-    uint8_t cmd = 0x20;
-    uint8_t temp;
-    uint32_t address = sector_number*W25QXX_SECTOR_SIZE;
+    if (sector_count == W25QXX_BLOCK_SECTORS)
+	{
+	return hflash->info.erase_cmd[2];
+	}
+    else if (sector_count == W25QXX_HALF_BLOCK_SECTORS)
+	{
+	return hflash->info.erase_cmd[1];
+	}
+    return hflash->info.erase_cmd[0];
+    }
 
-    W25QXX_Write_Enable();
-    W25QXX_Wait_Busy();
+void W25QXX_Erase_Sector(W25QXX_Handle_t *hflash, uint32_t sector_number)
+    {
+    W25QXX_Erase_Cmd(hflash, hflash->info.erase_cmd[0], sector_number*W25QXX_SECTOR_SIZE);
 
-    HAL_GPIO_WritePin(W25QXX_CS_GPIO_Port, W25QXX_CS_Pin, GPIO_PIN_RESET);
+    W25QXX_Wait_Busy(hflash);
+    }
 
-    HAL_SPI_Transmit(&W25QXX_SPI, &cmd, 1, 100);
+/**
+ * largest erase granule starting at sector_number that fits in sector_count
+ * and that the part supports
+ * return W25QXX_BLOCK_SECTORS, W25QXX_HALF_BLOCK_SECTORS or 1
+ */
+uint32_t W25QXX_Erase_Size(W25QXX_Handle_t *hflash, uint32_t sector_number, uint32_t sector_count)
+    {
+    if (hflash->info.erase_cmd[2]
+	    && sector_number % W25QXX_BLOCK_SECTORS == 0 && sector_count >= W25QXX_BLOCK_SECTORS)
+	{
+	return W25QXX_BLOCK_SECTORS;
+	}
+    else if (hflash->info.erase_cmd[1]
+	    && sector_number % W25QXX_HALF_BLOCK_SECTORS == 0 && sector_count >= W25QXX_HALF_BLOCK_SECTORS)
+	{
+	return W25QXX_HALF_BLOCK_SECTORS;
+	}
+    return 1;
+    }
 
-    temp = address>>16;
-    HAL_SPI_Transmit(&W25QXX_SPI, &temp, 1, 100);
+/**
+ * erase a sector range with the fewest commands, a 64K block erase
+ * takes ~150ms against ~45ms for each of its 16 sectors
+ */
+void W25QXX_Erase_Sectors(W25QXX_Handle_t *hflash, uint32_t sector_number, uint32_t sector_count)
+    {
+    while (sector_count)
+	{
+	uint32_t sectors = W25QXX_Erase_Size(hflash, sector_number, sector_count);
 
-    temp = address>>8;
-    HAL_SPI_Transmit(&W25QXX_SPI, &temp, 1, 100);
+	W25QXX_Erase_Cmd(hflash, W25QXX_Erase_Opcode(hflash, sectors), sector_number*W25QXX_SECTOR_SIZE);
+	W25QXX_Wait_Busy(hflash);
 
-    temp = address;
-    HAL_SPI_Transmit(&W25QXX_SPI, &temp, 1, 100);
+	sector_number += sectors;
+	sector_count -= sectors;
+	}
+    }
 
-    HAL_GPIO_WritePin(W25QXX_CS_GPIO_Port, W25QXX_CS_Pin, GPIO_PIN_SET);
+/**
+ * start a background erase of 1, W25QXX_HALF_BLOCK_SECTORS or
+ * W25QXX_BLOCK_SECTORS aligned sectors, see W25QXX_Erase_Size
+ * flash stays busy for ~45ms per sector, poll W25QXX_Erase_Busy, reads
+ * and page programs outside the erased range meanwhile suspend the erase
+ */
+void W25QXX_Erase_Start(W25QXX_Handle_t *hflash, uint32_t sector_number, uint32_t sector_count)
+    {
+    W25QXX_Erase_Cmd(hflash, W25QXX_Erase_Opcode(hflash, sector_count), sector_number*W25QXX_SECTOR_SIZE);
 
-    W25QXX_Wait_Busy();
+    hflash->erase_address = sector_number*W25QXX_SECTOR_SIZE;
+    hflash->erase_size = sector_count*W25QXX_SECTOR_SIZE;
+    hflash->erase_state = W25QXX_ERASE_RUNNING;
+    hflash->resume_tick = HAL_GetTick();
+    hflash->poll_tick = hflash->resume_tick;
     }
 
-void W25QXX_Write_Page(uint32_t address, uint8_t *buffer, uint16_t count)
+/**
+ * non blocking, resumes a suspended erase and polls status at most once per tick
+ * return 1 while background erase is not finished
+ */
+uint8_t W25QXX_Erase_Busy(W25QXX_Handle_t *hflash)
+    {
+    if (hflash->erase_state == W25QXX_ERASE_IDLE)
+	{
+	return 0;
+	}
+
+    if (hflash->erase_state == W25QXX_ERASE_SUSPENDED)
+	{
+	W25QXX_Resume(hflash);
+	return 1;
+	}
+
+    if (HAL_GetTick() == hflash->poll_tick)
+	{
+	return 1;
+	}
+    hflash->poll_tick = HAL_GetTick();
+
+    if ((W25QXX_Read_Status(hflash) & 0x01) == 0x01)
+	{
+	return 1;
+	}
+
+    hflash->erase_state = W25QXX_ERASE_IDLE;
+    return 0;
+    }
+
+/** block until background erase is done */
+void W25QXX_Erase_Wait(W25QXX_Handle_t *hflash)
+    {
+    if (hflash->erase_state == W25QXX_ERASE_SUSPENDED)
+	{
+	W25QXX_Resume(hflash);
+	}
+
+    if (hflash->erase_state == W25QXX_ERASE_RUNNING)
+	{
+	W25QXX_Wait_Busy(hflash);
+	hflash->erase_state = W25QXX_ERASE_IDLE;
+	}
+    }
+
+void W25QXX_Write_Page(W25QXX_Handle_t *hflash, uint32_t address, uint8_t *buffer, uint16_t count)
+    {
+    W25QXX_Write_Page_DMA(hflash, address, buffer, count, NULL);
+    W25QXX_DMA_Wait(hflash);
+    W25QXX_Wait_Busy(hflash);
+    }
+
+/**
+ * start a page program, data phase runs on dma
+ * callback is called once data is shifted out, flash is still busy
+ * programming at that point, poll status before next command
+ */
+void W25QXX_Write_Page_DMA(W25QXX_Handle_t *hflash, uint32_t address, uint8_t *buffer, uint16_t count, W25QXX_Callback_t callback)
     {
     uint8_t cmd = 0x02;
-    uint8_t temp;
 
     if (!count || count > W25QXX_PAGE_SIZE)
 	{
+	if (callback)
+	    {
+	    callback(0);
+	    }
 	return;
 	}
 
-    W25QXX_Write_Enable();
-    W25QXX_Wait_Busy();
+    W25QXX_DMA_Wait(hflash);
+
+    W25QXX_Program_Enable(hflash, address, count);
+    W25QXX_Wait_Busy(hflash);
 
-    HAL_GPIO_WritePin(W25QXX_CS_GPIO_Port, W25QXX_CS_Pin, GPIO_PIN_RESET);
+    W25QXX_Select(hflash);
 
-    HAL_SPI_Transmit(&W25QXX_SPI, &cmd, 1, 100);
+    W25QXX_Send_Command(hflash, cmd, address, 0);
 
-    temp = address>>16;
-    HAL_SPI_Transmit(&W25QXX_SPI, &temp, 1, 100);
+    hflash->dma_callback = callback;
+    hflash->dma_busy = 1;
 
-    temp = address>>8;
-    HAL_SPI_Transmit(&W25QXX_SPI, &temp, 1, 100);
+    if (HAL_SPI_Transmit_DMA(hflash->hspi, buffer, count) != HAL_OK)
+	{
+	HAL_SPI_ErrorCallback(hflash->hspi);
+	}
+    }
 
-    temp = address;
-    HAL_SPI_Transmit(&W25QXX_SPI, &temp, 1, 100);
+/**
+ * whole sectors go through W25QXX_Write_Sector so unchanged
+ * or bit clearing writes skip the erase
+ */
+void W25QXX_Write(W25QXX_Handle_t *hflash, uint32_t address, uint8_t *buffer, uint32_t count)
+    {
 
-    HAL_SPI_Transmit(&W25QXX_SPI, buffer, count, 5000);
+    while (address % W25QXX_SECTOR_SIZE == 0 && count >= W25QXX_SECTOR_SIZE)
+	{
+	W25QXX_Write_Sector(hflash, address / W25QXX_SECTOR_SIZE, buffer);
+	address += W25QXX_SECTOR_SIZE;
+	buffer += W25QXX_SECTOR_SIZE;
+	count -= W25QXX_SECTOR_SIZE;
+	}
 
-    HAL_GPIO_WritePin(W25QXX_CS_GPIO_Port, W25QXX_CS_Pin, GPIO_PIN_SET);
+    if (!count)
+	{
+	return;
+	}
 
-    W25QXX_Wait_Busy();
+    if (address % W25QXX_SECTOR_SIZE == 0)
+	{
+	W25QXX_Erase_Sector(hflash, address / W25QXX_SECTOR_SIZE);
+	}
+
+    W25QXX_Program(hflash, address, buffer, count);
     }
 
-void W25QXX_Write(uint32_t address, uint8_t *buffer, uint32_t count)
+/**
+ * read back sector page by page and compare with buffer
+ * bit n of changed_pages is set when page n differs
+ */
+W25QXX_Sector_Check_t W25QXX_Check_Sector(W25QXX_Handle_t *hflash, uint32_t sector_number, uint8_t *buffer, uint16_t *changed_pages)
     {
+    uint8_t page[W25QXX_PAGE_SIZE];
+    uint32_t address = sector_number * W25QXX_SECTOR_SIZE;
+    W25QXX_Sector_Check_t result = W25QXX_SECTOR_SAME;
 
-    if (address % W25QXX_SECTOR_SIZE == 0)
+    *changed_pages = 0;
+
+    for (uint8_t p = 0; p < W25QXX_SECTOR_PAGES; p++)
+	{
+	uint8_t *data = buffer + p * W25QXX_PAGE_SIZE;
+
+	W25QXX_Read(hflash, address + p * W25QXX_PAGE_SIZE, page, W25QXX_PAGE_SIZE);
+
+	if (memcmp(page, data, W25QXX_PAGE_SIZE) == 0)
+	    {
+	    continue;
+	    }
+
+	*changed_pages |= 1 << p;
+
+	if (result == W25QXX_SECTOR_NEEDS_ERASE)
+	    {
+	    continue;
+	    }
+
+	result = W25QXX_SECTOR_PROGRAMMABLE;
+
+	for (uint16_t i = 0; i < W25QXX_PAGE_SIZE; i++)
+	    {
+	    /** program can only clear bits */
+	    if ((page[i] & data[i]) != data[i])
+		{
+		result = W25QXX_SECTOR_NEEDS_ERASE;
+		break;
+		}
+	    }
+	}
+
+    return result;
+    }
+
+/** program selected pages of a sector, all 0xFF pages are skipped as program can not change them */
+void W25QXX_Program_Pages(W25QXX_Handle_t *hflash, uint32_t sector_number, uint8_t *buffer, uint16_t pages)
+    {
+    uint32_t address = sector_number * W25QXX_SECTOR_SIZE;
+
+    for (uint8_t p = 0; p < W25QXX_SECTOR_PAGES; p++)
+	{
+	uint8_t *data = buffer + p * W25QXX_PAGE_SIZE;
+	uint16_t i = 0;
+
+	if (!(pages & (1 << p)))
+	    {
+	    continue;
+	    }
+
+	while (i < W25QXX_PAGE_SIZE && data[i] == 0xFF)
+	    {
+	    i++;
+	    }
+
+	if (i < W25QXX_PAGE_SIZE)
+	    {
+	    W25QXX_Write_Page(hflash, address + p * W25QXX_PAGE_SIZE, data, W25QXX_PAGE_SIZE);
+	    }
+	}
+    }
+
+/**
+ * write one sector, erase only when some bit has to go from 0 to 1
+ * identical data is not written at all
+ */
+void W25QXX_Write_Sector(W25QXX_Handle_t *hflash, uint32_t sector_number, uint8_t *buffer)
+    {
+    uint16_t changed_pages;
+    W25QXX_Sector_Check_t check = W25QXX_Check_Sector(hflash, sector_number, buffer, &changed_pages);
+
+    if (check == W25QXX_SECTOR_SAME)
+	{
+	hflash->stats.writes_skipped++;
+	}
+    else if (check == W25QXX_SECTOR_PROGRAMMABLE)
+	{
+	W25QXX_Program_Pages(hflash, sector_number, buffer, changed_pages);
+	hflash->stats.erases_avoided++;
+	}
+    else
 	{
-	W25QXX_Erase_Sector(address / W25QXX_SECTOR_SIZE);
+	W25QXX_Erase_Sector(hflash, sector_number);
+	W25QXX_Program_Pages(hflash, sector_number, buffer, 0xFFFF);
+	hflash->stats.erases++;
 	}
+    }
+
+const W25QXX_Stats_t *W25QXX_Get_Stats(W25QXX_Handle_t *hflash)
+    {
+    return &hflash->stats;
+    }
 
+/**
+ * program any length split on page boundaries, no erase
+ * target range must already be erased
+ */
+void W25QXX_Program(W25QXX_Handle_t *hflash, uint32_t address, uint8_t *buffer, uint32_t count)
+    {
     uint16_t bytes_to_write = W25QXX_PAGE_SIZE - address % W25QXX_PAGE_SIZE;
 
     if (count < bytes_to_write)
@@ -228,7 +884,7 @@ void W25QXX_Write(uint32_t address, uint8_t *buffer, uint32_t count)
 	bytes_to_write = count;
 	}
 
-    W25QXX_Write_Page(address, buffer, bytes_to_write);
+    W25QXX_Write_Page(hflash, address, buffer, bytes_to_write);
 
     address += bytes_to_write;
     buffer += bytes_to_write;
@@ -238,11 +894,91 @@ void W25QXX_Write(uint32_t address, uint8_t *buffer, uint32_t count)
 
     while (pages--)
 	{
-	W25QXX_Write_Page(address, buffer, W25QXX_PAGE_SIZE);
+	W25QXX_Write_Page(hflash, address, buffer, W25QXX_PAGE_SIZE);
 	address += W25QXX_PAGE_SIZE;
 	buffer += W25QXX_PAGE_SIZE;
 	count -= W25QXX_PAGE_SIZE;
 	}
 
-    W25QXX_Write_Page(address, buffer, count);
+    W25QXX_Write_Page(hflash, address, buffer, count);
+    }
+
+uint8_t W25QXX_DMA_Is_Busy(W25QXX_Handle_t *hflash)
+    {
+    return hflash->dma_busy;
+    }
+
+/**
+ * dma interrupt must be able to preempt the caller,
+ * usb interrupt runs at lower priority @see usbd_conf.c
+ */
+void W25QXX_DMA_Wait(W25QXX_Handle_t *hflash)
+    {
+    while (hflash->dma_busy);
+    }
+
+static void W25QXX_DMA_Cplt(W25QXX_Handle_t *hflash, uint8_t error)
+    {
+    W25QXX_Callback_t callback = hflash->dma_callback;
+
+    HAL_GPIO_WritePin(hflash->cs_port, hflash->cs_pin, GPIO_PIN_SET);
+
+    hflash->dma_callback = NULL;
+    hflash->dma_busy = 0;
+
+    if (callback)
+	{
+	callback(error);
+	}
+    }
+
+/** device whose dma runs on hspi, NULL if none */
+static W25QXX_Handle_t *W25QXX_Find(SPI_HandleTypeDef *hspi)
+    {
+    for (uint8_t i = 0; i < W25QXX_MAX_INSTANCES; i++)
+	{
+	if (W25QXX_Instances[i] && W25QXX_Instances[i]->hspi == hspi)
+	    {
+	    return W25QXX_Instances[i];
+	    }
+	}
+
+    return NULL;
+    }
+
+void HAL_SPI_TxCpltCallback(SPI_HandleTypeDef *hspi)
+    {
+    W25QXX_Handle_t *hflash = W25QXX_Find(hspi);
+
+    if (hflash)
+	{
+	W25QXX_DMA_Cplt(hflash, 0);
+	}
+    }
+
+void HAL_SPI_RxCpltCallback(SPI_HandleTypeDef *hspi)
+    {
+    W25QXX_Handle_t *hflash = W25QXX_Find(hspi);
+
+    if (hflash)
+	{
+	if (!hflash->dma_left)
+	    {
+	    W25QXX_DMA_Cplt(hflash, 0);
+	    }
+	else if (!W25QXX_DMA_Next_Chunk(hflash))
+	    {
+	    W25QXX_DMA_Cplt(hflash, 1);
+	    }
+	}
+    }
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi)
+    {
+    W25QXX_Handle_t *hflash = W25QXX_Find(hspi);
+
+    if (hflash)
+	{
+	W25QXX_DMA_Cplt(hflash, 1);
+	}
     }
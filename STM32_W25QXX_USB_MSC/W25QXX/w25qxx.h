@@ -10,6 +10,7 @@
 
 #include "main.h"
 
+/** fallback geometry for a part without sfdp table, W25Q64 */
 #define W25QXX_TOTAL_SIZE     (8*1024*1024)
 #define W25QXX_ID             0xEF4017
 #define W25QXX_PAGE_SIZE      256
@@ -18,22 +19,140 @@
 #define	W25QXX_SECTOR_COUNT   (W25QXX_TOTAL_SIZE/W25QXX_SECTOR_SIZE)
 
 #define W25QXX_BLOCK_COUNT    128
-#define W25QXX_ADDRESS_WIDTH  24
-
-extern SPI_HandleTypeDef hspi1;
-#define W25QXX_SPI       hspi1
-
-void W25QXX_Init(void);
-uint8_t W25QXX_Read_Status(void);
-uint32_t W25QXX_Read_ID(void);
-void W25QXX_Read_Unique_ID(uint8_t *buff);
-void W25QXX_Write_Enable(void);
-void W25QXX_Write_Disable(void);
-void W25QXX_Wait_Busy(void);
-void W25QXX_Erase_Chip(void);
-void W25QXX_Read(uint32_t address, uint8_t *buffer, uint16_t count);
-void W25QXX_Write_Page(uint32_t address, uint8_t *buffer, uint16_t count);
-void W25QXX_Erase_Sector(uint32_t sector_number);
-void W25QXX_Write(uint32_t address, uint8_t *buffer, uint32_t count);
+#define W25QXX_BLOCK_SIZE     (64*1024)
+
+/** sectors covered by the 0x52 32K and 0xD8 64K block erase */
+#define W25QXX_HALF_BLOCK_SECTORS  (W25QXX_BLOCK_SIZE/2/W25QXX_SECTOR_SIZE)
+#define W25QXX_BLOCK_SECTORS       (W25QXX_BLOCK_SIZE/W25QXX_SECTOR_SIZE)
+
+/** number of data lines wired between mcu and flash, spi is 1 (mosi/miso) */
+#define W25QXX_BUS_WIDTH      1
+
+/** devices that can be initialized at once, each on its own spi */
+#define W25QXX_MAX_INSTANCES  2
+
+typedef enum
+    {
+    W25QXX_READ_NORMAL = 0, /* 0x03, no dummy, lowest clock */
+    W25QXX_READ_FAST,       /* 0x0B, 8 dummy clocks */
+    W25QXX_READ_DUAL,       /* 0x3B, 8 dummy clocks, data on io0-io1 */
+    W25QXX_READ_QUAD,       /* 0x6B, 8 dummy clocks, data on io0-io3 */
+    W25QXX_READ_AUTO,       /* fastest mode the part and W25QXX_BUS_WIDTH support */
+    } W25QXX_Read_Mode_t;
+
+/** geometry probed at W25QXX_Init */
+typedef struct
+    {
+    uint32_t id;           /* jedec id */
+    uint32_t total_size;   /* bytes */
+    uint32_t sector_count; /* 4K sectors */
+    uint32_t page_size;    /* program page, driver programs W25QXX_PAGE_SIZE at a time */
+    uint8_t address_bytes; /* 3, or 4 above 16M */
+    uint8_t sfdp;          /* 1 if geometry came from sfdp, 0 if from jedec id */
+    uint8_t erase_cmd[3];  /* 4K, 32K and 64K erase opcode, 0 if not supported */
+    uint8_t read_modes;    /* bit n set when W25QXX_Read_Mode_t n is supported */
+    } W25QXX_Info_t;
+
+#define W25QXX_SECTOR_PAGES   (W25QXX_SECTOR_SIZE/W25QXX_PAGE_SIZE)
+
+/** result of comparing new sector data against flash content */
+typedef enum
+    {
+    W25QXX_SECTOR_SAME = 0,    /* nothing to write */
+    W25QXX_SECTOR_PROGRAMMABLE, /* only 1->0 changes, program without erase */
+    W25QXX_SECTOR_NEEDS_ERASE,  /* some bit goes 0->1 */
+    } W25QXX_Sector_Check_t;
+
+typedef struct
+    {
+    uint32_t erases;         /* sector erases done by W25QXX_Write_Sector */
+    uint32_t erases_avoided; /* sector changed but only cleared bits */
+    uint32_t writes_skipped; /* sector already held the data */
+    } W25QXX_Stats_t;
+
+/** a read may suspend a running erase only this long after it was resumed, so the erase keeps progressing */
+#define W25QXX_RESUME_MIN_MS  1
+
+/** largest single spi dma transfer, longer reads are chained with cs held low */
+#define W25QXX_DMA_CHUNK      0xF000
+
+/** called from dma interrupt when a transfer ends, error is non zero on spi/dma error */
+typedef void (*W25QXX_Callback_t)(uint8_t error);
+
+typedef struct
+    {
+    uint8_t cmd;
+    uint8_t dummy_bytes;
+    uint8_t data_lines;
+    } W25QXX_Read_Cmd_t;
+
+typedef enum
+    {
+    W25QXX_ERASE_IDLE = 0,
+    W25QXX_ERASE_RUNNING,
+    W25QXX_ERASE_SUSPENDED,
+    } W25QXX_Erase_State_t;
+
+/**
+ * one flash device, fill hspi, cs_port and cs_pin then call W25QXX_Init
+ * spi configured in cube @see spi.c, cs pin defined in @see main.h
+ * the rest is driver state
+ */
+typedef struct
+    {
+    SPI_HandleTypeDef *hspi;
+    GPIO_TypeDef *cs_port;
+    uint16_t cs_pin;
+
+    W25QXX_Info_t info;
+    W25QXX_Read_Mode_t read_mode;
+    W25QXX_Read_Cmd_t read_cmds[4];
+    W25QXX_Stats_t stats;
+
+    /** set while a dma transfer owns the spi bus, cleared from dma interrupt */
+    volatile uint8_t dma_busy;
+    W25QXX_Callback_t dma_callback;
+
+    /** rest of a streaming read, cs stays low until it is received */
+    uint8_t *dma_ptr;
+    uint32_t dma_left;
+
+    /** background erase started by W25QXX_Erase_Start */
+    W25QXX_Erase_State_t erase_state;
+    uint32_t erase_address;
+    uint32_t erase_size;
+    uint32_t resume_tick;
+    uint32_t poll_tick;
+    } W25QXX_Handle_t;
+
+uint8_t W25QXX_Init(W25QXX_Handle_t *hflash, W25QXX_Read_Mode_t read_mode);
+const W25QXX_Info_t *W25QXX_Get_Info(W25QXX_Handle_t *hflash);
+W25QXX_Read_Mode_t W25QXX_Get_Read_Mode(W25QXX_Handle_t *hflash);
+uint8_t W25QXX_Read_Status(W25QXX_Handle_t *hflash);
+uint32_t W25QXX_Read_ID(W25QXX_Handle_t *hflash);
+void W25QXX_Read_Unique_ID(W25QXX_Handle_t *hflash, uint8_t *buff);
+void W25QXX_Write_Enable(W25QXX_Handle_t *hflash);
+void W25QXX_Write_Disable(W25QXX_Handle_t *hflash);
+void W25QXX_Wait_Busy(W25QXX_Handle_t *hflash);
+void W25QXX_Erase_Chip(W25QXX_Handle_t *hflash);
+void W25QXX_Read(W25QXX_Handle_t *hflash, uint32_t address, uint8_t *buffer, uint32_t count);
+void W25QXX_Write_Page(W25QXX_Handle_t *hflash, uint32_t address, uint8_t *buffer, uint16_t count);
+void W25QXX_Erase_Sector(W25QXX_Handle_t *hflash, uint32_t sector_number);
+uint32_t W25QXX_Erase_Size(W25QXX_Handle_t *hflash, uint32_t sector_number, uint32_t sector_count);
+void W25QXX_Erase_Sectors(W25QXX_Handle_t *hflash, uint32_t sector_number, uint32_t sector_count);
+void W25QXX_Erase_Start(W25QXX_Handle_t *hflash, uint32_t sector_number, uint32_t sector_count);
+uint8_t W25QXX_Erase_Busy(W25QXX_Handle_t *hflash);
+void W25QXX_Erase_Wait(W25QXX_Handle_t *hflash);
+void W25QXX_Write(W25QXX_Handle_t *hflash, uint32_t address, uint8_t *buffer, uint32_t count);
+void W25QXX_Program(W25QXX_Handle_t *hflash, uint32_t address, uint8_t *buffer, uint32_t count);
+W25QXX_Sector_Check_t W25QXX_Check_Sector(W25QXX_Handle_t *hflash, uint32_t sector_number, uint8_t *buffer, uint16_t *changed_pages);
+void W25QXX_Program_Pages(W25QXX_Handle_t *hflash, uint32_t sector_number, uint8_t *buffer, uint16_t pages);
+void W25QXX_Write_Sector(W25QXX_Handle_t *hflash, uint32_t sector_number, uint8_t *buffer);
+const W25QXX_Stats_t *W25QXX_Get_Stats(W25QXX_Handle_t *hflash);
+
+void W25QXX_Read_DMA(W25QXX_Handle_t *hflash, uint32_t address, uint8_t *buffer, uint32_t count, W25QXX_Callback_t callback);
+void W25QXX_Write_Page_DMA(W25QXX_Handle_t *hflash, uint32_t address, uint8_t *buffer, uint16_t count, W25QXX_Callback_t callback);
+uint8_t W25QXX_DMA_Is_Busy(W25QXX_Handle_t *hflash);
+void W25QXX_DMA_Wait(W25QXX_Handle_t *hflash);
 
 #endif /* W25QXX_H_ */
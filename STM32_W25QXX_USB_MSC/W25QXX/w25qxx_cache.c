@@ -0,0 +1,409 @@
+/*
+ * w25qxx_cache.c
+ *
+ *  Created on: 17-Oct-2026
+ *      Author: gitz
+ */
+
+#include <string.h>
+
+#include "w25qxx_cache.h"
+#include "w25qxx_ftl.h"
+
+#define W25QXX_CACHE_INVALID      0xFFFFFFFF
+
+typedef struct
+    {
+    uint32_t sector;
+    uint32_t last_used;
+    uint8_t dirty;
+    uint8_t prefetched; /* loaded by read-ahead, not read by host yet */
+    } W25QXX_Cache_Line_t;
+
+static uint8_t W25QXX_Cache_Data[W25QXX_CACHE_LINES][W25QXX_SECTOR_SIZE];
+static W25QXX_Cache_Line_t W25QXX_Cache_Lines[W25QXX_CACHE_LINES];
+
+/** incremented on every access, oldest last_used is evicted first */
+static uint32_t W25QXX_Cache_Clock;
+static uint32_t W25QXX_Cache_Last_Write;
+
+/** sequential stream detection, next sector expected and read-ahead window */
+static uint32_t W25QXX_Cache_Next_Read = W25QXX_CACHE_INVALID;
+static uint32_t W25QXX_Cache_Ahead_Sector;
+static uint32_t W25QXX_Cache_Ahead_End;
+
+/** read-ahead lands here first, copied into lines only if no write raced it */
+static uint8_t W25QXX_Cache_Ahead_Data[W25QXX_CACHE_READ_AHEAD][W25QXX_SECTOR_SIZE];
+static uint32_t W25QXX_Cache_Ahead_Pending = W25QXX_CACHE_INVALID;
+static uint32_t W25QXX_Cache_Ahead_Count;
+static uint32_t W25QXX_Cache_Ahead_Generation;
+
+/** bumped on every write or discard */
+static uint32_t W25QXX_Cache_Generation;
+
+static W25QXX_Cache_Stats_t W25QXX_Cache_Stats;
+
+static int8_t W25QXX_Cache_Find(uint32_t sector)
+    {
+    for (uint8_t i = 0; i < W25QXX_CACHE_LINES; i++)
+	{
+	if (W25QXX_Cache_Lines[i].sector == sector)
+	    {
+	    return i;
+	    }
+	}
+
+    return -1;
+    }
+
+static void W25QXX_Cache_Write_Back(uint8_t line)
+    {
+    if (W25QXX_Cache_Lines[line].dirty)
+	{
+	W25QXX_FTL_Write(W25QXX_Cache_Lines[line].sector, W25QXX_Cache_Data[line]);
+	W25QXX_Cache_Lines[line].dirty = 0;
+	}
+    }
+
+/** free line if any, else least recently used one after writing it back */
+static uint8_t W25QXX_Cache_Evict(void)
+    {
+    uint8_t victim = 0;
+
+    for (uint8_t i = 0; i < W25QXX_CACHE_LINES; i++)
+	{
+	if (W25QXX_Cache_Lines[i].sector == W25QXX_CACHE_INVALID)
+	    {
+	    return i;
+	    }
+
+	if (W25QXX_Cache_Lines[i].last_used < W25QXX_Cache_Lines[victim].last_used)
+	    {
+	    victim = i;
+	    }
+	}
+
+    W25QXX_Cache_Write_Back(victim);
+
+    return victim;
+    }
+
+/** free line if any, else least recently used clean line, -1 when every line is dirty */
+static int8_t W25QXX_Cache_Evict_Clean(void)
+    {
+    int8_t victim = -1;
+
+    for (uint8_t i = 0; i < W25QXX_CACHE_LINES; i++)
+	{
+	if (W25QXX_Cache_Lines[i].sector == W25QXX_CACHE_INVALID)
+	    {
+	    return i;
+	    }
+
+	if (!W25QXX_Cache_Lines[i].dirty
+		&& (victim < 0
+			|| W25QXX_Cache_Lines[i].last_used < W25QXX_Cache_Lines[victim].last_used))
+	    {
+	    victim = i;
+	    }
+	}
+
+    return victim;
+    }
+
+void W25QXX_Cache_Init(void)
+    {
+    for (uint8_t i = 0; i < W25QXX_CACHE_LINES; i++)
+	{
+	W25QXX_Cache_Lines[i].sector = W25QXX_CACHE_INVALID;
+	W25QXX_Cache_Lines[i].last_used = 0;
+	W25QXX_Cache_Lines[i].dirty = 0;
+	W25QXX_Cache_Lines[i].prefetched = 0;
+	}
+
+    W25QXX_Cache_Clock = 0;
+    W25QXX_Cache_Next_Read = W25QXX_CACHE_INVALID;
+    W25QXX_Cache_Ahead_Sector = 0;
+    W25QXX_Cache_Ahead_End = 0;
+    W25QXX_Cache_Ahead_Pending = W25QXX_CACHE_INVALID;
+    }
+
+/**
+ * read count bytes at offset of one sector, served from ram when it is cached
+ * misses are kept in a clean line, a read following the previous one
+ * opens the read-ahead window for W25QXX_Cache_Prefetch_Start
+ */
+void W25QXX_Cache_Read_Part(uint32_t sector, uint16_t offset, uint8_t *buffer, uint16_t count)
+    {
+    int8_t line = W25QXX_Cache_Find(sector);
+
+    if (sector == W25QXX_Cache_Next_Read)
+	{
+	if (W25QXX_Cache_Ahead_Sector <= sector)
+	    {
+	    W25QXX_Cache_Ahead_Sector = sector + 1;
+	    }
+	W25QXX_Cache_Ahead_End = sector + 1 + W25QXX_CACHE_READ_AHEAD;
+	}
+    W25QXX_Cache_Next_Read = sector + 1;
+
+    if (line >= 0)
+	{
+	W25QXX_Cache_Stats.read_hits++;
+
+	if (W25QXX_Cache_Lines[line].prefetched)
+	    {
+	    W25QXX_Cache_Lines[line].prefetched = 0;
+	    W25QXX_Cache_Stats.prefetch_used++;
+	    }
+
+	W25QXX_Cache_Lines[line].last_used = ++W25QXX_Cache_Clock;
+	memcpy(buffer, &W25QXX_Cache_Data[line][offset], count);
+	return;
+	}
+
+    W25QXX_Cache_Stats.read_misses++;
+
+    if (count == W25QXX_SECTOR_SIZE)
+	{
+	/** whole sector, read straight into host buffer and keep a copy if a clean line is free */
+	W25QXX_FTL_Read(sector, buffer);
+
+	line = W25QXX_Cache_Evict_Clean();
+	if (line >= 0)
+	    {
+	    memcpy(W25QXX_Cache_Data[line], buffer, W25QXX_SECTOR_SIZE);
+	    }
+	}
+    else
+	{
+	/** part of a sector, the next part is likely read right after so always keep it */
+	line = W25QXX_Cache_Evict_Clean();
+	if (line < 0)
+	    {
+	    line = W25QXX_Cache_Evict();
+	    }
+
+	W25QXX_FTL_Read(sector, W25QXX_Cache_Data[line]);
+	memcpy(buffer, &W25QXX_Cache_Data[line][offset], count);
+	}
+
+    if (line >= 0)
+	{
+	W25QXX_Cache_Lines[line].sector = sector;
+	W25QXX_Cache_Lines[line].dirty = 0;
+	W25QXX_Cache_Lines[line].prefetched = 0;
+	W25QXX_Cache_Lines[line].last_used = ++W25QXX_Cache_Clock;
+	}
+    }
+
+/**
+ * write count bytes at offset of one sector into ram, flash is only touched
+ * on eviction or flush, a partial write to an uncached sector first loads
+ * the old sector so the rest of it survives (read-modify-write)
+ */
+void W25QXX_Cache_Write_Part(uint32_t sector, uint16_t offset, uint8_t *buffer, uint16_t count)
+    {
+    int8_t line = W25QXX_Cache_Find(sector);
+
+    if (line < 0)
+	{
+	line = W25QXX_Cache_Evict();
+
+	if (count != W25QXX_SECTOR_SIZE)
+	    {
+	    W25QXX_FTL_Read(sector, W25QXX_Cache_Data[line]);
+	    W25QXX_Cache_Stats.rmw_reads++;
+	    }
+
+	W25QXX_Cache_Lines[line].sector = sector;
+	}
+
+    memcpy(&W25QXX_Cache_Data[line][offset], buffer, count);
+    W25QXX_Cache_Lines[line].dirty = 1;
+    W25QXX_Cache_Lines[line].prefetched = 0;
+    W25QXX_Cache_Lines[line].last_used = ++W25QXX_Cache_Clock;
+    W25QXX_Cache_Generation++;
+
+    W25QXX_Cache_Last_Write = HAL_GetTick();
+    }
+
+/** read one whole sector @see W25QXX_Cache_Read_Part */
+void W25QXX_Cache_Read(uint32_t sector, uint8_t *buffer)
+    {
+    W25QXX_Cache_Read_Part(sector, 0, buffer, W25QXX_SECTOR_SIZE);
+    }
+
+/** write one whole sector @see W25QXX_Cache_Write_Part */
+void W25QXX_Cache_Write(uint32_t sector, uint8_t *buffer)
+    {
+    W25QXX_Cache_Write_Part(sector, 0, buffer, W25QXX_SECTOR_SIZE);
+    }
+
+/** drop a cached sector without writing it back, used when host unmaps it */
+void W25QXX_Cache_Discard(uint32_t sector)
+    {
+    int8_t line = W25QXX_Cache_Find(sector);
+
+    if (line >= 0)
+	{
+	W25QXX_Cache_Lines[line].sector = W25QXX_CACHE_INVALID;
+	W25QXX_Cache_Lines[line].dirty = 0;
+	}
+
+    W25QXX_Cache_Generation++;
+    }
+
+/** write back all dirty lines, lines stay valid for reads */
+void W25QXX_Cache_Flush(void)
+    {
+    for (uint8_t i = 0; i < W25QXX_CACHE_LINES; i++)
+	{
+	W25QXX_Cache_Write_Back(i);
+	}
+    }
+
+/**
+ * write back a single dirty line
+ * return 1 if a line was written, 0 if cache is clean
+ */
+uint8_t W25QXX_Cache_Flush_One(void)
+    {
+    for (uint8_t i = 0; i < W25QXX_CACHE_LINES; i++)
+	{
+	if (W25QXX_Cache_Lines[i].dirty)
+	    {
+	    W25QXX_Cache_Write_Back(i);
+	    return 1;
+	    }
+	}
+
+    return 0;
+    }
+
+/** return 1 when dirty lines wait and no write arrived for W25QXX_CACHE_IDLE_MS */
+uint8_t W25QXX_Cache_Is_Idle(void)
+    {
+    if ((HAL_GetTick() - W25QXX_Cache_Last_Write) < W25QXX_CACHE_IDLE_MS)
+	{
+	return 0;
+	}
+
+    for (uint8_t i = 0; i < W25QXX_CACHE_LINES; i++)
+	{
+	if (W25QXX_Cache_Lines[i].dirty)
+	    {
+	    return 1;
+	    }
+	}
+
+    return 0;
+    }
+
+/**
+ * start reading the next uncached run of the read-ahead window with
+ * W25QXX_FTL_Read_Range_Start, up to W25QXX_CACHE_READ_AHEAD sectors
+ * only command phases touch the spi bus, call with usb masked then
+ * unmask, W25QXX_Cache_Prefetch_Wait and W25QXX_Cache_Prefetch_End
+ * with usb masked until it returns 1
+ * return 1 if a read was started
+ */
+uint8_t W25QXX_Cache_Prefetch_Start(void)
+    {
+    uint32_t end = W25QXX_Cache_Ahead_End;
+    uint32_t sector;
+
+    if (end > W25QXX_FTL_Get_Sector_Count())
+	{
+	end = W25QXX_FTL_Get_Sector_Count();
+	}
+
+    while (W25QXX_Cache_Ahead_Sector < end && W25QXX_Cache_Find(W25QXX_Cache_Ahead_Sector) >= 0)
+	{
+	W25QXX_Cache_Ahead_Sector++;
+	}
+
+    sector = W25QXX_Cache_Ahead_Sector;
+    while (W25QXX_Cache_Ahead_Sector < end
+	    && W25QXX_Cache_Ahead_Sector - sector < W25QXX_CACHE_READ_AHEAD
+	    && W25QXX_Cache_Find(W25QXX_Cache_Ahead_Sector) < 0)
+	{
+	W25QXX_Cache_Ahead_Sector++;
+	}
+
+    if (W25QXX_Cache_Ahead_Sector == sector)
+	{
+	return 0;
+	}
+
+    W25QXX_Cache_Ahead_Pending = sector;
+    W25QXX_Cache_Ahead_Count = W25QXX_Cache_Ahead_Sector - sector;
+    W25QXX_Cache_Ahead_Generation = W25QXX_Cache_Generation;
+
+    W25QXX_FTL_Read_Range_Start(sector, W25QXX_Cache_Ahead_Count, W25QXX_Cache_Ahead_Data[0]);
+
+    return 1;
+    }
+
+/** wait for the reads started by W25QXX_Cache_Prefetch_Start or W25QXX_Cache_Prefetch_End */
+void W25QXX_Cache_Prefetch_Wait(void)
+    {
+    W25QXX_FTL_Read_Range_Wait();
+    }
+
+/**
+ * start the next runs of the read-ahead, once all are read install the
+ * sectors in clean lines, all are dropped if host wrote meanwhile
+ * return 0 while reads are still running
+ */
+uint8_t W25QXX_Cache_Prefetch_End(void)
+    {
+    uint32_t sector = W25QXX_Cache_Ahead_Pending;
+    int8_t line;
+
+    if (sector != W25QXX_CACHE_INVALID && W25QXX_FTL_Read_Range_Next())
+	{
+	return 0;
+	}
+
+    W25QXX_Cache_Ahead_Pending = W25QXX_CACHE_INVALID;
+
+    if (sector == W25QXX_CACHE_INVALID || W25QXX_Cache_Ahead_Generation != W25QXX_Cache_Generation)
+	{
+	return 1;
+	}
+
+    for (uint32_t i = 0; i < W25QXX_Cache_Ahead_Count; i++)
+	{
+	if (W25QXX_Cache_Find(sector + i) >= 0)
+	    {
+	    continue;
+	    }
+
+	/** out of clean lines once it would evict a sector of this read-ahead */
+	line = W25QXX_Cache_Evict_Clean();
+	if (line < 0 || (W25QXX_Cache_Lines[line].sector >= sector && W25QXX_Cache_Lines[line].sector < sector + i))
+	    {
+	    break;
+	    }
+
+	memcpy(W25QXX_Cache_Data[line], W25QXX_Cache_Ahead_Data[i], W25QXX_SECTOR_SIZE);
+	W25QXX_Cache_Lines[line].sector = sector + i;
+	W25QXX_Cache_Lines[line].dirty = 0;
+	W25QXX_Cache_Lines[line].prefetched = 1;
+	W25QXX_Cache_Lines[line].last_used = ++W25QXX_Cache_Clock;
+
+	W25QXX_Cache_Stats.prefetched++;
+	}
+
+    return 1;
+    }
+
+/**
+ * hit rate is read_hits / (read_hits + read_misses), accuracy is prefetch_used / prefetched
+ * rmw_reads counts host writes not aligned on a 4K sector
+ */
+const W25QXX_Cache_Stats_t *W25QXX_Cache_Get_Stats(void)
+    {
+    return &W25QXX_Cache_Stats;
+    }
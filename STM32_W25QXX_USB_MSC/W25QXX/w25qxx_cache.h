@@ -0,0 +1,45 @@
+/*
+ * w25qxx_cache.h
+ *
+ *  Created on: 17-Oct-2026
+ *      Author: gitz
+ */
+
+#ifndef W25QXX_CACHE_H_
+#define W25QXX_CACHE_H_
+
+#include "w25qxx.h"
+
+/** number of 4K sectors held in ram, each line costs W25QXX_SECTOR_SIZE bytes */
+#define W25QXX_CACHE_LINES        8
+
+/** sectors fetched ahead of a sequential read stream */
+#define W25QXX_CACHE_READ_AHEAD   3
+
+/** dirty lines are written back after this many ms without a write */
+#define W25QXX_CACHE_IDLE_MS      500
+
+typedef struct
+    {
+    uint32_t read_hits;
+    uint32_t read_misses;
+    uint32_t prefetched;     /* sectors loaded by read-ahead */
+    uint32_t prefetch_used;  /* prefetched sectors later read by host */
+    uint32_t rmw_reads;      /* partial writes that had to load the sector first */
+    } W25QXX_Cache_Stats_t;
+
+void W25QXX_Cache_Init(void);
+void W25QXX_Cache_Read(uint32_t sector, uint8_t *buffer);
+void W25QXX_Cache_Write(uint32_t sector, uint8_t *buffer);
+void W25QXX_Cache_Read_Part(uint32_t sector, uint16_t offset, uint8_t *buffer, uint16_t count);
+void W25QXX_Cache_Write_Part(uint32_t sector, uint16_t offset, uint8_t *buffer, uint16_t count);
+void W25QXX_Cache_Discard(uint32_t sector);
+void W25QXX_Cache_Flush(void);
+uint8_t W25QXX_Cache_Flush_One(void);
+uint8_t W25QXX_Cache_Is_Idle(void);
+uint8_t W25QXX_Cache_Prefetch_Start(void);
+void W25QXX_Cache_Prefetch_Wait(void);
+uint8_t W25QXX_Cache_Prefetch_End(void);
+const W25QXX_Cache_Stats_t *W25QXX_Cache_Get_Stats(void);
+
+#endif /* W25QXX_CACHE_H_ */
@@ -0,0 +1,1093 @@
+/*
+ * w25qxx_ftl.c
+ *
+ *  Created on: 17-Oct-2026
+ *      Author: gitz
+ *
+ * log structured translation layer, every host write goes to an erased
+ * data sector and the old copy turns stale. stale sectors are erased in
+ * background so the write path normally never waits for an erase.
+ *
+ * map changes are appended to the journal. journal has two halves, half
+ * s & 1 starts with a mark record of checkpoint sequence s and holds every
+ * change since checkpoint s started. once half of it is used the next
+ * checkpoint runs in background: the other half is erased and takes the
+ * records, the other slot is erased and map and wear table are programmed
+ * a page at a time while writes go on, header last. at init latest
+ * checkpoint is loaded, its journal half is replayed, then the other half
+ * too when it belongs to a checkpoint cut off before its header.
+ *
+ * sectors released by host unmap are marked in a free bitmap and get
+ * erased in background first, whatever the erased pool size.
+ *
+ * a data sector is programmed before its journal record, power lost in
+ * between leaves it dirty while checkpoint and journal still call it
+ * erased. every sector found erased at init is blank checked before it
+ * is first used and turns stale if it is not.
+ *
+ * when the whole 64K or 32K flash block around the chosen sector is stale,
+ * it is erased with one block erase command instead.
+ *
+ * with several devices each one runs its own background erase, writes
+ * prefer a device that is not erasing and journal programs suspend the
+ * erase on device 0. the cache read-ahead streams each device's runs of
+ * its window on that device's own dma, so the devices read concurrently.
+ */
+
+#include <string.h>
+
+#include "w25qxx_ftl.h"
+
+/** changes with the flash format, older checkpoints are not loaded */
+#define W25QXX_FTL_MAGIC              0x4C544658
+#define W25QXX_FTL_UNMAPPED           0xFFFF
+#define W25QXX_FTL_RECORD_ERASE       0xFFFE
+#define W25QXX_FTL_RECORD_MARK        0xFFFD
+#define W25QXX_FTL_RECORD_EMPTY       0xFFFFFFFF
+#define W25QXX_FTL_ERASED_FLAG        0x80000000
+#define W25QXX_FTL_HALF_SECTORS       (W25QXX_FTL_JOURNAL_SECTORS/2)
+#define W25QXX_FTL_HALF_RECORDS       (W25QXX_FTL_HALF_SECTORS*W25QXX_SECTOR_SIZE/4)
+#define W25QXX_FTL_JOURNAL_ADDRESS    (2*W25QXX_FTL_SLOT_SECTORS*W25QXX_SECTOR_SIZE)
+#define W25QXX_FTL_HALF_ADDRESS(h)    (W25QXX_FTL_JOURNAL_ADDRESS + (h)*W25QXX_FTL_HALF_SECTORS*W25QXX_SECTOR_SIZE)
+#define W25QXX_FTL_WEAR_PER_PAGE      (W25QXX_PAGE_SIZE/4)
+
+#define W25QXX_FTL_CHIP(p)            W25QXX_FTL_Chips[(p) % W25QXX_FTL_CHIPS]
+#define W25QXX_FTL_DATA_SECTOR(p)     (W25QXX_FTL_META_SECTORS + (p) / W25QXX_FTL_CHIPS)
+#define W25QXX_FTL_DATA_ADDRESS(p)    (W25QXX_FTL_DATA_SECTOR(p)*W25QXX_SECTOR_SIZE)
+#define W25QXX_FTL_SLOT_ADDRESS(s)    ((s)*W25QXX_FTL_SLOT_SECTORS*W25QXX_SECTOR_SIZE)
+#define W25QXX_FTL_MAP_EXTRA_OFFSET   ((1 + W25QXX_FTL_WEAR_SECTORS)*W25QXX_SECTOR_SIZE)
+
+/** checkpoints and journal live on device 0 */
+#define W25QXX_FTL_META_CHIP          W25QXX_FTL_Chips[0]
+
+/** background checkpoint starts once the journal half holds this many records */
+#define W25QXX_FTL_CHECKPOINT_RECORDS (W25QXX_FTL_HALF_RECORDS/2)
+
+typedef enum
+    {
+    W25QXX_FTL_STALE = 0, /* needs erase, also used for unknown content */
+    W25QXX_FTL_ERASED,
+    W25QXX_FTL_VALID,
+    } W25QXX_FTL_State_t;
+
+typedef enum
+    {
+    W25QXX_FTL_CHECKPOINT_IDLE = 0,
+    W25QXX_FTL_CHECKPOINT_ERASE_JOURNAL, /* erasing the journal half of the next sequence */
+    W25QXX_FTL_CHECKPOINT_ERASE_SLOT,    /* journal switched, erasing the other slot */
+    W25QXX_FTL_CHECKPOINT_PROGRAM,       /* map then wear table a page per step, header last */
+    } W25QXX_FTL_Checkpoint_State_t;
+
+/** last bytes of first slot sector, programmed last so a torn checkpoint is ignored */
+typedef struct
+    {
+    uint32_t magic;
+    uint32_t sequence;
+    uint32_t logical_count;
+    uint32_t data_count;
+    } W25QXX_FTL_Header_t;
+
+#define W25QXX_FTL_HEADER_OFFSET      (W25QXX_SECTOR_SIZE - sizeof(W25QXX_FTL_Header_t))
+
+static W25QXX_Handle_t *W25QXX_FTL_Chips[W25QXX_FTL_CHIPS];
+
+static uint16_t W25QXX_FTL_Map[W25QXX_FTL_MAX_SECTOR_COUNT];
+static uint32_t W25QXX_FTL_Wear[W25QXX_FTL_MAX_DATA_SECTORS];
+static uint8_t W25QXX_FTL_State[W25QXX_FTL_MAX_DATA_SECTORS];
+
+/** geometry of the probed flash, set by W25QXX_FTL_Init */
+static uint32_t W25QXX_FTL_Data_Count;
+static uint32_t W25QXX_FTL_Sector_Count;
+
+/** physical sectors freed by unmap and not yet erased, not saved in checkpoints */
+static uint32_t W25QXX_FTL_Free[(W25QXX_FTL_MAX_DATA_SECTORS + 31) / 32];
+
+/** erased sectors loaded or replayed at init and not blank checked yet */
+static uint32_t W25QXX_FTL_Unverified[(W25QXX_FTL_MAX_DATA_SECTORS + 31) / 32];
+
+/** latest complete checkpoint, its slot, and the journal half records go to */
+static uint32_t W25QXX_FTL_Sequence;
+static uint8_t W25QXX_FTL_Slot;
+static uint8_t W25QXX_FTL_Journal_Half;
+static uint32_t W25QXX_FTL_Journal_Next;
+static uint32_t W25QXX_FTL_Erased_Count;
+static W25QXX_FTL_Stats_t W25QXX_FTL_Stats;
+
+/** per device, first data sector erased in background by W25QXX_FTL_Process, -1 if none */
+static int32_t W25QXX_FTL_Erasing[W25QXX_FTL_CHIPS];
+static uint32_t W25QXX_FTL_Erasing_Count[W25QXX_FTL_CHIPS];
+
+/** checkpoint of sequence + 1 in progress, sectors still to erase, bytes of map then wear table programmed */
+static W25QXX_FTL_Checkpoint_State_t W25QXX_FTL_Checkpoint_State;
+static uint32_t W25QXX_FTL_Checkpoint_Sector;
+static uint32_t W25QXX_FTL_Checkpoint_End;
+static uint8_t W25QXX_FTL_Checkpoint_Erasing;
+static uint32_t W25QXX_FTL_Checkpoint_Offset;
+
+/** W25QXX_FTL_Read_Range_Start arguments, and per device next sector of the range to look at */
+static uint32_t W25QXX_FTL_Range_Sector;
+static uint32_t W25QXX_FTL_Range_Count;
+static uint8_t *W25QXX_FTL_Range_Buffer;
+static uint32_t W25QXX_FTL_Range_Next[W25QXX_FTL_CHIPS];
+
+static uint8_t W25QXX_FTL_Checkpoint_Step(uint8_t wait);
+
+static void W25QXX_FTL_Program(W25QXX_Handle_t *chip, uint32_t address, uint8_t *buffer, uint32_t count)
+    {
+    W25QXX_Program(chip, address, buffer, count);
+    W25QXX_FTL_Stats.programmed_bytes += count;
+    }
+
+/** next checkpoint takes the journal half and the slot the previous one left */
+static void W25QXX_FTL_Checkpoint_Begin(void)
+    {
+    W25QXX_FTL_Checkpoint_State = W25QXX_FTL_CHECKPOINT_ERASE_JOURNAL;
+    W25QXX_FTL_Checkpoint_Sector = W25QXX_FTL_HALF_ADDRESS((W25QXX_FTL_Sequence + 1) & 1) / W25QXX_SECTOR_SIZE;
+    W25QXX_FTL_Checkpoint_End = W25QXX_FTL_Checkpoint_Sector + W25QXX_FTL_HALF_SECTORS;
+    }
+
+/** erasing the slot starts once new records go to the new journal half */
+static void W25QXX_FTL_Checkpoint_Erase_Slot(void)
+    {
+    W25QXX_FTL_Checkpoint_State = W25QXX_FTL_CHECKPOINT_ERASE_SLOT;
+    W25QXX_FTL_Checkpoint_Sector = W25QXX_FTL_SLOT_ADDRESS(!W25QXX_FTL_Slot) / W25QXX_SECTOR_SIZE;
+    W25QXX_FTL_Checkpoint_End = W25QXX_FTL_Checkpoint_Sector + W25QXX_FTL_SLOT_SECTORS;
+    }
+
+/** first record of the erased journal half, later records go there */
+static void W25QXX_FTL_Checkpoint_Switch(void)
+    {
+    uint32_t record = ((uint32_t) W25QXX_FTL_RECORD_MARK << 16) | ((W25QXX_FTL_Sequence + 1) & 0xFFFF);
+
+    W25QXX_FTL_Journal_Half = (W25QXX_FTL_Sequence + 1) & 1;
+    W25QXX_FTL_Program(W25QXX_FTL_META_CHIP, W25QXX_FTL_HALF_ADDRESS(W25QXX_FTL_Journal_Half), (uint8_t*) &record, 4);
+    W25QXX_FTL_Journal_Next = 1;
+
+    W25QXX_FTL_Checkpoint_Erase_Slot();
+    }
+
+/**
+ * program the next page of the checkpoint, map then wear table with
+ * erased flag packed in top bit, header last so a torn one is ignored
+ * return 0 once the header is written
+ */
+static uint8_t W25QXX_FTL_Checkpoint_Page(void)
+    {
+    uint32_t address = W25QXX_FTL_SLOT_ADDRESS(!W25QXX_FTL_Slot);
+    uint32_t page[W25QXX_FTL_WEAR_PER_PAGE];
+    uint32_t map_bytes = W25QXX_FTL_Sector_Count * 2;
+    uint32_t map_head = map_bytes;
+    uint32_t offset = W25QXX_FTL_Checkpoint_Offset;
+    W25QXX_FTL_Header_t header;
+
+    if (map_head > W25QXX_FTL_HEADER_OFFSET)
+	{
+	map_head = W25QXX_FTL_HEADER_OFFSET;
+	}
+
+    /** map in front of the header, the rest after the wear table */
+    if (offset < map_bytes)
+	{
+	uint32_t end = offset < map_head ? map_head : map_bytes;
+	uint32_t n = end - offset;
+
+	if (n > W25QXX_PAGE_SIZE)
+	    {
+	    n = W25QXX_PAGE_SIZE;
+	    }
+
+	W25QXX_FTL_Program(W25QXX_FTL_META_CHIP,
+		offset < map_head ? address + offset : address + W25QXX_FTL_MAP_EXTRA_OFFSET + offset - map_head,
+		(uint8_t*) W25QXX_FTL_Map + offset, n);
+	W25QXX_FTL_Checkpoint_Offset += n;
+	return 1;
+	}
+
+    offset = (offset - map_bytes) / 4;
+    if (offset < W25QXX_FTL_Data_Count)
+	{
+	uint32_t n = W25QXX_FTL_Data_Count - offset;
+
+	if (n > W25QXX_FTL_WEAR_PER_PAGE)
+	    {
+	    n = W25QXX_FTL_WEAR_PER_PAGE;
+	    }
+
+	for (uint32_t i = 0; i < n; i++)
+	    {
+	    page[i] = W25QXX_FTL_Wear[offset + i];
+
+	    if (W25QXX_FTL_State[offset + i] == W25QXX_FTL_ERASED)
+		{
+		page[i] |= W25QXX_FTL_ERASED_FLAG;
+		}
+	    }
+
+	W25QXX_FTL_Program(W25QXX_FTL_META_CHIP, address + W25QXX_SECTOR_SIZE + offset * 4, (uint8_t*) page, n * 4);
+	W25QXX_FTL_Checkpoint_Offset += n * 4;
+	return 1;
+	}
+
+    header.magic = W25QXX_FTL_MAGIC;
+    header.sequence = W25QXX_FTL_Sequence + 1;
+    header.logical_count = W25QXX_FTL_Sector_Count;
+    header.data_count = W25QXX_FTL_Data_Count;
+
+    W25QXX_FTL_Program(W25QXX_FTL_META_CHIP, address + W25QXX_FTL_HEADER_OFFSET, (uint8_t*) &header, sizeof(header));
+
+    W25QXX_FTL_Sequence++;
+    W25QXX_FTL_Slot = !W25QXX_FTL_Slot;
+    W25QXX_FTL_Checkpoint_State = W25QXX_FTL_CHECKPOINT_IDLE;
+
+    W25QXX_FTL_Stats.checkpoints++;
+
+    return 0;
+    }
+
+/**
+ * advance the checkpoint by one erase or one page program, erases run in
+ * background on device 0 after a data erase there finished, unless wait
+ * is set, then every erase is waited for
+ * return 1 while the checkpoint is not finished
+ */
+static uint8_t W25QXX_FTL_Checkpoint_Step(uint8_t wait)
+    {
+    W25QXX_Handle_t *chip = W25QXX_FTL_META_CHIP;
+
+    if (W25QXX_FTL_Checkpoint_State == W25QXX_FTL_CHECKPOINT_IDLE)
+	{
+	return 0;
+	}
+
+    if (W25QXX_FTL_Checkpoint_State == W25QXX_FTL_CHECKPOINT_PROGRAM)
+	{
+	return W25QXX_FTL_Checkpoint_Page();
+	}
+
+    /** one erase at a time per device, W25QXX_FTL_Process records a data erase on device 0 first */
+    if (!wait && W25QXX_FTL_Erasing[0] >= 0)
+	{
+	return 1;
+	}
+
+    if (W25QXX_FTL_Checkpoint_Erasing || W25QXX_FTL_Erasing[0] >= 0)
+	{
+	if (!wait && W25QXX_Erase_Busy(chip))
+	    {
+	    return 1;
+	    }
+
+	W25QXX_Erase_Wait(chip);
+	W25QXX_FTL_Checkpoint_Erasing = 0;
+	}
+
+    if (W25QXX_FTL_Checkpoint_Sector < W25QXX_FTL_Checkpoint_End)
+	{
+	uint32_t n = W25QXX_Erase_Size(chip, W25QXX_FTL_Checkpoint_Sector,
+		W25QXX_FTL_Checkpoint_End - W25QXX_FTL_Checkpoint_Sector);
+
+	W25QXX_Erase_Start(chip, W25QXX_FTL_Checkpoint_Sector, n);
+	W25QXX_FTL_Checkpoint_Sector += n;
+	W25QXX_FTL_Checkpoint_Erasing = 1;
+	return 1;
+	}
+
+    if (W25QXX_FTL_Checkpoint_State == W25QXX_FTL_CHECKPOINT_ERASE_JOURNAL)
+	{
+	W25QXX_FTL_Checkpoint_Switch();
+	}
+    else
+	{
+	W25QXX_FTL_Checkpoint_State = W25QXX_FTL_CHECKPOINT_PROGRAM;
+	W25QXX_FTL_Checkpoint_Offset = 0;
+	}
+
+    return 1;
+    }
+
+/**
+ * journal half filled before the background checkpoint switched to the
+ * other one, run checkpoints in foreground until a half has room
+ */
+static void W25QXX_FTL_Checkpoint_Force(void)
+    {
+    while (W25QXX_FTL_Journal_Next == W25QXX_FTL_HALF_RECORDS)
+	{
+	if (W25QXX_FTL_Checkpoint_State == W25QXX_FTL_CHECKPOINT_IDLE)
+	    {
+	    W25QXX_FTL_Checkpoint_Begin();
+	    }
+
+	W25QXX_FTL_Checkpoint_Step(1);
+	}
+    }
+
+static void W25QXX_FTL_Journal_Append(uint16_t logical, uint16_t physical)
+    {
+    uint32_t record = ((uint32_t) logical << 16) | physical;
+
+    if (W25QXX_FTL_Journal_Next == W25QXX_FTL_HALF_RECORDS)
+	{
+	W25QXX_FTL_Checkpoint_Force();
+	}
+
+    W25QXX_FTL_Program(W25QXX_FTL_META_CHIP,
+	    W25QXX_FTL_HALF_ADDRESS(W25QXX_FTL_Journal_Half) + W25QXX_FTL_Journal_Next * 4, (uint8_t*) &record, 4);
+    W25QXX_FTL_Journal_Next++;
+    }
+
+static void W25QXX_FTL_Erased(uint16_t physical)
+    {
+    W25QXX_FTL_Wear[physical]++;
+    W25QXX_FTL_Free[physical / 32] &= ~(1UL << (physical % 32));
+    W25QXX_FTL_Unverified[physical / 32] &= ~(1UL << (physical % 32));
+
+    W25QXX_FTL_State[physical] = W25QXX_FTL_ERASED;
+    W25QXX_FTL_Erased_Count++;
+
+    W25QXX_FTL_Stats.erases++;
+    }
+
+static void W25QXX_FTL_Erase_Data(uint16_t physical)
+    {
+    W25QXX_Erase_Sector(W25QXX_FTL_CHIP(physical), W25QXX_FTL_DATA_SECTOR(physical));
+
+    W25QXX_FTL_Erased(physical);
+    }
+
+/** record a finished background erase of a device, its sectors are W25QXX_FTL_CHIPS apart */
+static void W25QXX_FTL_Erase_Finish(uint8_t chip)
+    {
+    int32_t physical = W25QXX_FTL_Erasing[chip];
+
+    if (physical < 0)
+	{
+	return;
+	}
+
+    W25QXX_Erase_Wait(W25QXX_FTL_Chips[chip]);
+
+    W25QXX_FTL_Erasing[chip] = -1;
+
+    for (uint32_t i = 0; i < W25QXX_FTL_Erasing_Count[chip]; i++)
+	{
+	W25QXX_FTL_Erased(physical + i * W25QXX_FTL_CHIPS);
+	W25QXX_FTL_Journal_Append(W25QXX_FTL_RECORD_ERASE, physical + i * W25QXX_FTL_CHIPS);
+	}
+    }
+
+/** 1 if physical is part of a background erase still in progress */
+static uint8_t W25QXX_FTL_Is_Erasing(uint32_t physical)
+    {
+    uint8_t chip = physical % W25QXX_FTL_CHIPS;
+    int32_t first = W25QXX_FTL_Erasing[chip];
+
+    return first >= 0 && physical >= (uint32_t) first
+	    && (physical - first) / W25QXX_FTL_CHIPS < W25QXX_FTL_Erasing_Count[chip];
+    }
+
+/**
+ * least worn sector in given state on a device, or on any device when
+ * chip is negative, then devices without a background erase come first
+ * sectors being erased are skipped
+ * return -1 if there is none
+ */
+static int32_t W25QXX_FTL_Find(W25QXX_FTL_State_t state, int8_t chip)
+    {
+    int32_t best = -1;
+    uint8_t best_busy = 0;
+
+    for (uint32_t p = 0; p < W25QXX_FTL_Data_Count; p++)
+	{
+	uint8_t busy = W25QXX_FTL_Erasing[p % W25QXX_FTL_CHIPS] >= 0;
+
+	if (W25QXX_FTL_State[p] != state
+		|| (chip >= 0 && p % W25QXX_FTL_CHIPS != (uint8_t) chip)
+		|| W25QXX_FTL_Is_Erasing(p))
+	    {
+	    continue;
+	    }
+
+	if (best < 0 || busy < best_busy
+		|| (busy == best_busy && W25QXX_FTL_Wear[p] < W25QXX_FTL_Wear[best]))
+	    {
+	    best = p;
+	    best_busy = busy;
+	    }
+	}
+
+    return best;
+    }
+
+/** 1 if every byte of a data sector reads 0xFF, read a page at a time */
+static uint8_t W25QXX_FTL_Is_Blank_Sector(uint16_t physical)
+    {
+    uint32_t page[W25QXX_PAGE_SIZE / 4];
+
+    for (uint32_t offset = 0; offset < W25QXX_SECTOR_SIZE; offset += W25QXX_PAGE_SIZE)
+	{
+	W25QXX_Read(W25QXX_FTL_CHIP(physical), W25QXX_FTL_DATA_ADDRESS(physical) + offset, (uint8_t*) page, W25QXX_PAGE_SIZE);
+
+	for (uint32_t i = 0; i < W25QXX_PAGE_SIZE / 4; i++)
+	    {
+	    if (page[i] != 0xFFFFFFFF)
+		{
+		return 0;
+		}
+	    }
+	}
+
+    return 1;
+    }
+
+/**
+ * dynamic wear leveling, least worn erased sector is used first,
+ * preferring a device with no background erase. a sector still
+ * unverified since init is blank checked first and made stale when a
+ * torn program left data in it, queued for erase like an unmapped one
+ * so it is not found again after the next init
+ * falls back to erasing a stale sector when erased pool is empty
+ */
+static uint16_t W25QXX_FTL_Allocate(void)
+    {
+    int32_t physical = W25QXX_FTL_Find(W25QXX_FTL_ERASED, -1);
+
+    while (physical >= 0 && (W25QXX_FTL_Unverified[physical / 32] & (1UL << (physical % 32))))
+	{
+	W25QXX_FTL_Unverified[physical / 32] &= ~(1UL << (physical % 32));
+
+	if (W25QXX_FTL_Is_Blank_Sector(physical))
+	    {
+	    break;
+	    }
+
+	W25QXX_FTL_State[physical] = W25QXX_FTL_STALE;
+	W25QXX_FTL_Free[physical / 32] |= 1UL << (physical % 32);
+	W25QXX_FTL_Erased_Count--;
+	W25QXX_FTL_Stats.torn_sectors++;
+
+	physical = W25QXX_FTL_Find(W25QXX_FTL_ERASED, -1);
+	}
+
+    if (physical < 0)
+	{
+	/** spare sectors guarantee a stale one exists */
+	physical = W25QXX_FTL_Find(W25QXX_FTL_STALE, -1);
+	W25QXX_FTL_Erase_Data(physical);
+	W25QXX_FTL_Journal_Append(W25QXX_FTL_RECORD_ERASE, physical);
+	W25QXX_FTL_Stats.foreground_erases++;
+	}
+
+    return physical;
+    }
+
+/** no valid checkpoint, start with an empty map, every data sector is stale */
+static void W25QXX_FTL_Format(void)
+    {
+    memset(W25QXX_FTL_Map, 0xFF, sizeof(W25QXX_FTL_Map));
+    memset(W25QXX_FTL_Wear, 0, sizeof(W25QXX_FTL_Wear));
+    memset(W25QXX_FTL_State, W25QXX_FTL_STALE, sizeof(W25QXX_FTL_State));
+
+    W25QXX_FTL_Sequence = 0;
+    W25QXX_FTL_Slot = 1;
+    W25QXX_FTL_Erased_Count = 0;
+
+    /** no journal half is usable before the first checkpoint switches to one */
+    W25QXX_FTL_Journal_Half = 0;
+    W25QXX_FTL_Journal_Next = W25QXX_FTL_HALF_RECORDS;
+
+    W25QXX_FTL_Checkpoint_Begin();
+    while (W25QXX_FTL_Checkpoint_Step(1));
+    }
+
+static uint8_t W25QXX_FTL_Load(uint8_t slot)
+    {
+    uint32_t address = W25QXX_FTL_SLOT_ADDRESS(slot);
+    uint32_t page[W25QXX_FTL_WEAR_PER_PAGE];
+    uint32_t map_head = W25QXX_FTL_Sector_Count * 2;
+
+    if (map_head > W25QXX_FTL_HEADER_OFFSET)
+	{
+	map_head = W25QXX_FTL_HEADER_OFFSET;
+	W25QXX_Read(W25QXX_FTL_META_CHIP, address + W25QXX_FTL_MAP_EXTRA_OFFSET,
+		(uint8_t*) W25QXX_FTL_Map + map_head, W25QXX_FTL_Sector_Count * 2 - map_head);
+	}
+    W25QXX_Read(W25QXX_FTL_META_CHIP, address, (uint8_t*) W25QXX_FTL_Map, map_head);
+
+    for (uint32_t p = 0; p < W25QXX_FTL_Data_Count; p += W25QXX_FTL_WEAR_PER_PAGE)
+	{
+	uint32_t n = W25QXX_FTL_Data_Count - p;
+
+	if (n > W25QXX_FTL_WEAR_PER_PAGE)
+	    {
+	    n = W25QXX_FTL_WEAR_PER_PAGE;
+	    }
+
+	W25QXX_Read(W25QXX_FTL_META_CHIP, address + W25QXX_SECTOR_SIZE + p * 4, (uint8_t*) page, n * 4);
+
+	for (uint32_t i = 0; i < n; i++)
+	    {
+	    W25QXX_FTL_Wear[p + i] = page[i] & ~W25QXX_FTL_ERASED_FLAG;
+	    W25QXX_FTL_State[p + i] = (page[i] & W25QXX_FTL_ERASED_FLAG) ?
+		    W25QXX_FTL_ERASED : W25QXX_FTL_STALE;
+	    }
+	}
+
+    for (uint32_t l = 0; l < W25QXX_FTL_Sector_Count; l++)
+	{
+	if (W25QXX_FTL_Map[l] == W25QXX_FTL_UNMAPPED)
+	    {
+	    continue;
+	    }
+
+	if (W25QXX_FTL_Map[l] >= W25QXX_FTL_Data_Count)
+	    {
+	    return 0;
+	    }
+
+	W25QXX_FTL_State[W25QXX_FTL_Map[l]] = W25QXX_FTL_VALID;
+	}
+
+    return 1;
+    }
+
+/**
+ * replay the journal half of a checkpoint sequence
+ * return records in it, 0 when it does not start with the sequence mark
+ */
+static uint32_t W25QXX_FTL_Replay(uint8_t half, uint32_t sequence)
+    {
+    uint32_t records[W25QXX_FTL_WEAR_PER_PAGE];
+    uint32_t next = 0;
+
+    while (next < W25QXX_FTL_HALF_RECORDS)
+	{
+	W25QXX_Read(W25QXX_FTL_META_CHIP, W25QXX_FTL_HALF_ADDRESS(half) + next * 4, (uint8_t*) records, sizeof(records));
+
+	for (uint32_t i = 0; i < W25QXX_FTL_WEAR_PER_PAGE; i++)
+	    {
+	    uint16_t logical = records[i] >> 16;
+	    uint16_t physical = records[i];
+
+	    if (next == 0 && records[i] != (((uint32_t) W25QXX_FTL_RECORD_MARK << 16) | (sequence & 0xFFFF)))
+		{
+		return 0;
+		}
+
+	    if (records[i] == W25QXX_FTL_RECORD_EMPTY)
+		{
+		return next;
+		}
+
+	    if (next++ == 0)
+		{
+		continue;
+		}
+
+	    if (physical == W25QXX_FTL_UNMAPPED && logical < W25QXX_FTL_Sector_Count)
+		{
+		if (W25QXX_FTL_Map[logical] != W25QXX_FTL_UNMAPPED)
+		    {
+		    W25QXX_FTL_State[W25QXX_FTL_Map[logical]] = W25QXX_FTL_STALE;
+		    }
+
+		W25QXX_FTL_Map[logical] = W25QXX_FTL_UNMAPPED;
+		continue;
+		}
+
+	    if (physical >= W25QXX_FTL_Data_Count)
+		{
+		continue;
+		}
+
+	    if (logical == W25QXX_FTL_RECORD_ERASE)
+		{
+		W25QXX_FTL_Wear[physical]++;
+		W25QXX_FTL_State[physical] = W25QXX_FTL_ERASED;
+		}
+	    else if (logical < W25QXX_FTL_Sector_Count)
+		{
+		if (W25QXX_FTL_Map[logical] != W25QXX_FTL_UNMAPPED)
+		    {
+		    W25QXX_FTL_State[W25QXX_FTL_Map[logical]] = W25QXX_FTL_STALE;
+		    }
+
+		W25QXX_FTL_Map[logical] = physical;
+		W25QXX_FTL_State[physical] = W25QXX_FTL_VALID;
+		}
+	    }
+	}
+
+    return next;
+    }
+
+/**
+ * chips holds W25QXX_FTL_CHIPS initialized devices, device 0 keeps the
+ * checkpoints and journal, the smallest device sets the stripe size
+ */
+void W25QXX_FTL_Init(W25QXX_Handle_t **chips)
+    {
+    W25QXX_FTL_Header_t header[2];
+    int8_t slot = -1;
+    uint32_t sectors = W25QXX_FTL_CHIP_SECTORS;
+    uint32_t records;
+
+    for (uint8_t c = 0; c < W25QXX_FTL_CHIPS; c++)
+	{
+	W25QXX_FTL_Chips[c] = chips[c];
+	W25QXX_FTL_Erasing[c] = -1;
+
+	if (sectors > W25QXX_Get_Info(chips[c])->sector_count)
+	    {
+	    sectors = W25QXX_Get_Info(chips[c])->sector_count;
+	    }
+	}
+    W25QXX_FTL_Data_Count = W25QXX_FTL_CHIPS * (sectors - W25QXX_FTL_META_SECTORS);
+    W25QXX_FTL_Sector_Count = W25QXX_FTL_Data_Count - W25QXX_FTL_SPARE_SECTORS;
+
+    memset(&W25QXX_FTL_Stats, 0, sizeof(W25QXX_FTL_Stats));
+    memset(W25QXX_FTL_Free, 0, sizeof(W25QXX_FTL_Free));
+    memset(W25QXX_FTL_Unverified, 0, sizeof(W25QXX_FTL_Unverified));
+    W25QXX_FTL_Checkpoint_State = W25QXX_FTL_CHECKPOINT_IDLE;
+    W25QXX_FTL_Checkpoint_Erasing = 0;
+
+    for (uint8_t i = 0; i < 2; i++)
+	{
+	W25QXX_Read(W25QXX_FTL_META_CHIP, W25QXX_FTL_SLOT_ADDRESS(i) + W25QXX_FTL_HEADER_OFFSET,
+		(uint8_t*) &header[i], sizeof(W25QXX_FTL_Header_t));
+
+	if (header[i].magic != W25QXX_FTL_MAGIC
+		|| header[i].logical_count != W25QXX_FTL_Sector_Count
+		|| header[i].data_count != W25QXX_FTL_Data_Count)
+	    {
+	    continue;
+	    }
+
+	if (slot < 0 || header[i].sequence > header[slot].sequence)
+	    {
+	    slot = i;
+	    }
+	}
+
+    if (slot < 0 || !W25QXX_FTL_Load(slot))
+	{
+	W25QXX_FTL_Format();
+	return;
+	}
+
+    W25QXX_FTL_Slot = slot;
+    W25QXX_FTL_Sequence = header[slot].sequence;
+
+    /** the other half has the next mark when that checkpoint lost power before its header */
+    W25QXX_FTL_Journal_Half = W25QXX_FTL_Sequence & 1;
+    W25QXX_FTL_Journal_Next = W25QXX_FTL_Replay(W25QXX_FTL_Journal_Half, W25QXX_FTL_Sequence);
+    if (!W25QXX_FTL_Journal_Next)
+	{
+	W25QXX_FTL_Journal_Next = W25QXX_FTL_HALF_RECORDS;
+	W25QXX_FTL_Checkpoint_Begin();
+	}
+    else
+	{
+	records = W25QXX_FTL_Replay(!W25QXX_FTL_Journal_Half, W25QXX_FTL_Sequence + 1);
+	if (records)
+	    {
+	    W25QXX_FTL_Journal_Half = !W25QXX_FTL_Journal_Half;
+	    W25QXX_FTL_Journal_Next = records;
+	    W25QXX_FTL_Checkpoint_Erase_Slot();
+	    }
+	}
+
+    W25QXX_FTL_Erased_Count = 0;
+    for (uint32_t p = 0; p < W25QXX_FTL_Data_Count; p++)
+	{
+	if (W25QXX_FTL_State[p] == W25QXX_FTL_ERASED)
+	    {
+	    W25QXX_FTL_Erased_Count++;
+	    W25QXX_FTL_Unverified[p / 32] |= 1UL << (p % 32);
+	    }
+	}
+    }
+
+static uint8_t W25QXX_FTL_Is_Blank(uint8_t *buffer)
+    {
+    for (uint16_t i = 0; i < W25QXX_SECTOR_SIZE; i++)
+	{
+	if (buffer[i] != 0xFF)
+	    {
+	    return 0;
+	    }
+	}
+
+    return 1;
+    }
+
+/** device and flash address holding a logical sector, NULL if unmapped */
+W25QXX_Handle_t *W25QXX_FTL_Locate(uint32_t sector, uint32_t *address)
+    {
+    uint16_t physical;
+
+    if (sector >= W25QXX_FTL_Sector_Count || W25QXX_FTL_Map[sector] == W25QXX_FTL_UNMAPPED)
+	{
+	return NULL;
+	}
+
+    physical = W25QXX_FTL_Map[sector];
+    *address = W25QXX_FTL_DATA_ADDRESS(physical);
+
+    return W25QXX_FTL_CHIP(physical);
+    }
+
+/** unwritten sectors read as erased flash */
+void W25QXX_FTL_Read(uint32_t sector, uint8_t *buffer)
+    {
+    uint32_t address;
+    W25QXX_Handle_t *chip = W25QXX_FTL_Locate(sector, &address);
+
+    if (!chip)
+	{
+	memset(buffer, 0xFF, W25QXX_SECTOR_SIZE);
+	return;
+	}
+
+    W25QXX_Read(chip, address, buffer, W25QXX_SECTOR_SIZE);
+    }
+
+/**
+ * start reading count sectors with dma and return, unmapped sectors are
+ * filled right away. runs that are also consecutive on one device are
+ * streamed with a single read command, every device streams its own runs
+ * so devices read concurrently
+ * W25QXX_FTL_Read_Range_Wait, then W25QXX_FTL_Read_Range_Next until it
+ * returns 0, buffer must stay valid until then
+ */
+void W25QXX_FTL_Read_Range_Start(uint32_t sector, uint32_t count, uint8_t *buffer)
+    {
+    uint32_t address;
+
+    W25QXX_FTL_Range_Sector = sector;
+    W25QXX_FTL_Range_Count = count;
+    W25QXX_FTL_Range_Buffer = buffer;
+
+    for (uint32_t i = 0; i < count; i++)
+	{
+	if (!W25QXX_FTL_Locate(sector + i, &address))
+	    {
+	    memset(buffer + i * W25QXX_SECTOR_SIZE, 0xFF, W25QXX_SECTOR_SIZE);
+	    }
+	}
+
+    for (uint8_t c = 0; c < W25QXX_FTL_CHIPS; c++)
+	{
+	W25QXX_FTL_Range_Next[c] = 0;
+	}
+
+    W25QXX_FTL_Read_Range_Next();
+    }
+
+/**
+ * start the next run on every device that finished its previous one,
+ * only the command phase touches the spi bus
+ * return 1 while some device still reads
+ */
+uint8_t W25QXX_FTL_Read_Range_Next(void)
+    {
+    uint8_t reading = 0;
+
+    for (uint8_t c = 0; c < W25QXX_FTL_CHIPS; c++)
+	{
+	W25QXX_Handle_t *chip = W25QXX_FTL_Chips[c];
+	uint32_t i = W25QXX_FTL_Range_Next[c];
+	uint32_t address;
+	uint32_t next;
+	uint32_t run = 1;
+
+	if (chip->dma_busy)
+	    {
+	    reading = 1;
+	    continue;
+	    }
+
+	while (i < W25QXX_FTL_Range_Count && W25QXX_FTL_Locate(W25QXX_FTL_Range_Sector + i, &address) != chip)
+	    {
+	    i++;
+	    }
+	if (i == W25QXX_FTL_Range_Count)
+	    {
+	    W25QXX_FTL_Range_Next[c] = i;
+	    continue;
+	    }
+
+	while (i + run < W25QXX_FTL_Range_Count
+		&& W25QXX_FTL_Locate(W25QXX_FTL_Range_Sector + i + run, &next) == chip
+		&& next == address + run * W25QXX_SECTOR_SIZE)
+	    {
+	    run++;
+	    }
+
+	W25QXX_Read_DMA(chip, address, W25QXX_FTL_Range_Buffer + i * W25QXX_SECTOR_SIZE, run * W25QXX_SECTOR_SIZE, NULL);
+	W25QXX_FTL_Range_Next[c] = i + run;
+	reading = 1;
+	}
+
+    return reading;
+    }
+
+/**
+ * wait until a device that may still have runs of the range finished its
+ * current one, or all devices are done, so W25QXX_FTL_Read_Range_Next
+ * restarts it while the other devices keep streaming
+ */
+void W25QXX_FTL_Read_Range_Wait(void)
+    {
+    while (1)
+	{
+	uint8_t busy = 0;
+
+	for (uint8_t c = 0; c < W25QXX_FTL_CHIPS; c++)
+	    {
+	    if (W25QXX_FTL_Chips[c]->dma_busy)
+		{
+		busy = 1;
+		}
+	    else if (W25QXX_FTL_Range_Next[c] < W25QXX_FTL_Range_Count)
+		{
+		return;
+		}
+	    }
+
+	if (!busy)
+	    {
+	    return;
+	    }
+	}
+    }
+
+void W25QXX_FTL_Write(uint32_t sector, uint8_t *buffer)
+    {
+    uint16_t physical;
+    uint16_t old;
+
+    if (sector >= W25QXX_FTL_Sector_Count)
+	{
+	return;
+	}
+
+    W25QXX_FTL_Stats.host_sectors++;
+
+    /** rewrite of a mapped sector, keep it in place when no bit has to be set */
+    old = W25QXX_FTL_Map[sector];
+    if (old != W25QXX_FTL_UNMAPPED)
+	{
+	uint16_t changed_pages;
+	W25QXX_Sector_Check_t check = W25QXX_Check_Sector(W25QXX_FTL_CHIP(old),
+		W25QXX_FTL_DATA_SECTOR(old), buffer, &changed_pages);
+
+	if (check == W25QXX_SECTOR_SAME)
+	    {
+	    W25QXX_FTL_Stats.writes_skipped++;
+	    return;
+	    }
+
+	if (check == W25QXX_SECTOR_PROGRAMMABLE)
+	    {
+	    W25QXX_Program_Pages(W25QXX_FTL_CHIP(old), W25QXX_FTL_DATA_SECTOR(old), buffer, changed_pages);
+	    W25QXX_FTL_Stats.erases_avoided++;
+	    return;
+	    }
+	}
+    else if (W25QXX_FTL_Is_Blank(buffer))
+	{
+	/** unmapped sectors already read back as 0xFF */
+	W25QXX_FTL_Stats.writes_skipped++;
+	return;
+	}
+
+    physical = W25QXX_FTL_Allocate();
+
+    W25QXX_FTL_Program(W25QXX_FTL_CHIP(physical), W25QXX_FTL_DATA_ADDRESS(physical), buffer, W25QXX_SECTOR_SIZE);
+
+    W25QXX_FTL_State[physical] = W25QXX_FTL_VALID;
+    W25QXX_FTL_Erased_Count--;
+
+    W25QXX_FTL_Map[sector] = physical;
+
+    if (old != W25QXX_FTL_UNMAPPED)
+	{
+	W25QXX_FTL_State[old] = W25QXX_FTL_STALE;
+	}
+
+    W25QXX_FTL_Journal_Append(sector, physical);
+    }
+
+/** drop the mapping, sector reads back as 0xFF and its flash copy is queued for erase */
+void W25QXX_FTL_Unmap(uint32_t sector)
+    {
+    uint16_t physical;
+
+    if (sector >= W25QXX_FTL_Sector_Count || W25QXX_FTL_Map[sector] == W25QXX_FTL_UNMAPPED)
+	{
+	return;
+	}
+
+    physical = W25QXX_FTL_Map[sector];
+
+    W25QXX_FTL_Map[sector] = W25QXX_FTL_UNMAPPED;
+    W25QXX_FTL_State[physical] = W25QXX_FTL_STALE;
+    W25QXX_FTL_Free[physical / 32] |= 1UL << (physical % 32);
+
+    W25QXX_FTL_Journal_Append(sector, W25QXX_FTL_UNMAPPED);
+
+    W25QXX_FTL_Stats.unmapped++;
+    }
+
+/** first sector of a device in free bitmap, -1 if there is none */
+static int32_t W25QXX_FTL_Find_Free(uint8_t chip)
+    {
+    for (uint32_t w = 0; w < sizeof(W25QXX_FTL_Free) / 4; w++)
+	{
+	uint32_t bits = W25QXX_FTL_Free[w];
+
+	while (bits)
+	    {
+	    uint32_t p = w * 32 + __builtin_ctz(bits);
+
+	    if (p % W25QXX_FTL_CHIPS == chip)
+		{
+		return p;
+		}
+	    bits &= bits - 1;
+	    }
+	}
+
+    return -1;
+    }
+
+/**
+ * widen the erase of a data sector to its 64K or 32K flash block when the
+ * block lies inside the data area and every sector of it is stale,
+ * erased sectors are left out so a torn block erase never hits a sector
+ * the journal already calls erased, physical is moved to the block start
+ * return number of sectors to erase
+ */
+static uint32_t W25QXX_FTL_Erase_Span(int32_t *physical)
+    {
+    static const uint32_t granules[] =
+	{
+	W25QXX_BLOCK_SECTORS, W25QXX_HALF_BLOCK_SECTORS
+	};
+    uint8_t chip = *physical % W25QXX_FTL_CHIPS;
+    uint32_t sector = W25QXX_FTL_DATA_SECTOR(*physical);
+
+    for (uint8_t g = 0; g < sizeof(granules) / sizeof(granules[0]); g++)
+	{
+	uint32_t first = sector - sector % granules[g];
+	uint32_t i = 0;
+
+	if (first < W25QXX_FTL_META_SECTORS
+		|| first + granules[g] > W25QXX_FTL_META_SECTORS + W25QXX_FTL_Data_Count / W25QXX_FTL_CHIPS)
+	    {
+	    continue;
+	    }
+
+	while (i < granules[g]
+		&& W25QXX_FTL_State[(first - W25QXX_FTL_META_SECTORS + i) * W25QXX_FTL_CHIPS + chip]
+			== W25QXX_FTL_STALE)
+	    {
+	    i++;
+	    }
+
+	if (i == granules[g])
+	    {
+	    *physical = (first - W25QXX_FTL_META_SECTORS) * W25QXX_FTL_CHIPS + chip;
+	    return granules[g];
+	    }
+	}
+
+    return 1;
+    }
+
+/**
+ * background garbage collection, on each device starts erasing one
+ * unmapped sector if any, else one stale sector while the erased pool
+ * is below W25QXX_FTL_ERASED_TARGET, widened to a block by
+ * W25QXX_FTL_Erase_Span. erases run asynchronously and concurrently on
+ * all devices, later calls poll them and record them once done
+ * also advances a checkpoint by one erase or page, device 0 starts no
+ * data erase while one runs
+ * return 1 while there is erase or checkpoint work in progress
+ */
+uint8_t W25QXX_FTL_Process(void)
+    {
+    uint8_t busy = 0;
+
+    if (W25QXX_FTL_Checkpoint_State == W25QXX_FTL_CHECKPOINT_IDLE
+	    && W25QXX_FTL_Journal_Next >= W25QXX_FTL_CHECKPOINT_RECORDS)
+	{
+	W25QXX_FTL_Checkpoint_Begin();
+	}
+
+    for (uint8_t c = 0; c < W25QXX_FTL_CHIPS; c++)
+	{
+	int32_t physical;
+
+	if (W25QXX_FTL_Erasing[c] >= 0)
+	    {
+	    if (!W25QXX_Erase_Busy(W25QXX_FTL_Chips[c]))
+		{
+		W25QXX_FTL_Erase_Finish(c);
+		}
+	    busy = 1;
+	    continue;
+	    }
+
+	if (c == 0 && W25QXX_FTL_Checkpoint_State != W25QXX_FTL_CHECKPOINT_IDLE)
+	    {
+	    continue;
+	    }
+
+	physical = W25QXX_FTL_Find_Free(c);
+
+	if (physical < 0)
+	    {
+	    if (W25QXX_FTL_Erased_Count >= W25QXX_FTL_ERASED_TARGET)
+		{
+		continue;
+		}
+
+	    physical = W25QXX_FTL_Find(W25QXX_FTL_STALE, c);
+
+	    if (physical < 0)
+		{
+		continue;
+		}
+	    }
+
+	W25QXX_FTL_Erasing_Count[c] = W25QXX_FTL_Erase_Span(&physical);
+	if (W25QXX_FTL_Erasing_Count[c] > 1)
+	    {
+	    W25QXX_FTL_Stats.block_erases++;
+	    }
+
+	W25QXX_Erase_Start(W25QXX_FTL_Chips[c], W25QXX_FTL_DATA_SECTOR(physical), W25QXX_FTL_Erasing_Count[c]);
+	W25QXX_FTL_Erasing[c] = physical;
+	busy = 1;
+	}
+
+    if (W25QXX_FTL_Checkpoint_Step(0))
+	{
+	busy = 1;
+	}
+
+    return busy;
+    }
+
+/** logical sectors exposed to host, valid after W25QXX_FTL_Init */
+uint32_t W25QXX_FTL_Get_Sector_Count(void)
+    {
+    return W25QXX_FTL_Sector_Count;
+    }
+
+const W25QXX_FTL_Stats_t *W25QXX_FTL_Get_Stats(void)
+    {
+    return &W25QXX_FTL_Stats;
+    }
@@ -0,0 +1,86 @@
+/*
+ * w25qxx_ftl.h
+ *
+ *  Created on: 17-Oct-2026
+ *      Author: gitz
+ */
+
+#ifndef W25QXX_FTL_H_
+#define W25QXX_FTL_H_
+
+#include "w25qxx.h"
+
+/**
+ * data sectors are striped over W25QXX_FTL_CHIPS devices, physical
+ * sector p lives on device p % W25QXX_FTL_CHIPS so consecutive
+ * allocations alternate devices and run concurrently
+ */
+#define W25QXX_FTL_CHIPS              1
+
+/**
+ * largest flash per device the ram tables and checkpoint slot are
+ * sized for, smaller parts use their probed size, bigger ones are
+ * used up to this size
+ */
+#define W25QXX_FTL_MAX_SIZE           W25QXX_TOTAL_SIZE
+#define W25QXX_FTL_CHIP_SECTORS       (W25QXX_FTL_MAX_SIZE/W25QXX_SECTOR_SIZE)
+
+/** data sectors hidden from host, keeps erased sectors available */
+#define W25QXX_FTL_SPARE_SECTORS      64
+
+/**
+ * checkpoint slot, first sector holds map and header, then wear table,
+ * then the part of the map that did not fit in front of the header
+ */
+#define W25QXX_FTL_WEAR_SECTORS       ((4*W25QXX_FTL_CHIPS*W25QXX_FTL_CHIP_SECTORS + W25QXX_SECTOR_SIZE - 1)/W25QXX_SECTOR_SIZE)
+#define W25QXX_FTL_MAP_BYTES          (2*(W25QXX_FTL_CHIPS*W25QXX_FTL_CHIP_SECTORS - W25QXX_FTL_SPARE_SECTORS))
+#define W25QXX_FTL_MAP_EXTRA_SECTORS  (W25QXX_FTL_MAP_BYTES > W25QXX_SECTOR_SIZE - 16 ? \
+	(W25QXX_FTL_MAP_BYTES - (W25QXX_SECTOR_SIZE - 16) + W25QXX_SECTOR_SIZE - 1)/W25QXX_SECTOR_SIZE : 0)
+
+/**
+ * flash layout of device 0 in 4K sectors, other devices leave the
+ * meta sectors unused so data sector numbers match on all devices
+ * 0..           checkpoint slot A, map + wear table
+ * ..            checkpoint slot B
+ * ..            journal, one 4 byte record per map change, two halves
+ *               used in turn by consecutive checkpoint sequences
+ * META..        data sectors
+ */
+#define W25QXX_FTL_SLOT_SECTORS       (1 + W25QXX_FTL_WEAR_SECTORS + W25QXX_FTL_MAP_EXTRA_SECTORS)
+#define W25QXX_FTL_JOURNAL_SECTORS    4
+#define W25QXX_FTL_META_SECTORS       (2*W25QXX_FTL_SLOT_SECTORS + W25QXX_FTL_JOURNAL_SECTORS)
+#define W25QXX_FTL_MAX_DATA_SECTORS   (W25QXX_FTL_CHIPS*(W25QXX_FTL_CHIP_SECTORS - W25QXX_FTL_META_SECTORS))
+
+/** most logical sectors exposed to host, see W25QXX_FTL_Get_Sector_Count */
+#define W25QXX_FTL_MAX_SECTOR_COUNT   (W25QXX_FTL_MAX_DATA_SECTORS - W25QXX_FTL_SPARE_SECTORS)
+
+/** background eraser keeps at least this many data sectors erased */
+#define W25QXX_FTL_ERASED_TARGET      16
+
+typedef struct
+    {
+    uint32_t host_sectors;      /* sectors written by host */
+    uint32_t programmed_bytes;  /* bytes programmed, data + journal + checkpoints */
+    uint32_t erases;            /* all sector erases */
+    uint32_t foreground_erases; /* erases the write path had to wait for */
+    uint32_t checkpoints;
+    uint32_t erases_avoided;    /* rewrites that only cleared bits, programmed in place */
+    uint32_t writes_skipped;    /* rewrites with unchanged data */
+    uint32_t unmapped;          /* sectors released by host unmap */
+    uint32_t block_erases;      /* 32K/64K background erases, their sectors also count in erases */
+    uint32_t torn_sectors;      /* erased sectors found programmed by a write cut off before its journal record */
+    } W25QXX_FTL_Stats_t;
+
+void W25QXX_FTL_Init(W25QXX_Handle_t **chips);
+uint32_t W25QXX_FTL_Get_Sector_Count(void);
+void W25QXX_FTL_Read(uint32_t sector, uint8_t *buffer);
+void W25QXX_FTL_Read_Range_Start(uint32_t sector, uint32_t count, uint8_t *buffer);
+uint8_t W25QXX_FTL_Read_Range_Next(void);
+void W25QXX_FTL_Read_Range_Wait(void);
+W25QXX_Handle_t *W25QXX_FTL_Locate(uint32_t sector, uint32_t *address);
+void W25QXX_FTL_Write(uint32_t sector, uint8_t *buffer);
+void W25QXX_FTL_Unmap(uint32_t sector);
+uint8_t W25QXX_FTL_Process(void);
+const W25QXX_FTL_Stats_t *W25QXX_FTL_Get_Stats(void);
+
+#endif /* W25QXX_FTL_H_ */